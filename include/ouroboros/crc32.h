@@ -32,4 +32,10 @@ void crc32(uint32_t *   crc,
            const void * buf,
            size_t       len);
 
+/* Copies len bytes from src to dst, updating the CRC in the same pass. */
+void crc32_copy(uint32_t *   crc,
+                void *       dst,
+                const void * src,
+                size_t       len);
+
 #endif /* OUROBOROS_CRC32_H */
@@ -28,6 +28,13 @@
 
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
+
+/* A message in a batch, on read len is the size of buf on entry. */
+struct flow_msg {
+        void * buf;
+        size_t len;
+};
 
 __BEGIN_DECLS
 
@@ -40,6 +47,16 @@ int     flow_alloc(const char *            dst_name,
 int     flow_accept(qosspec_t *             qs,
                     const struct timespec * timeo);
 
+/* As above, rb_size sets the rbuff slots, 0 derives them from qs. */
+int     flow_alloc_rb(const char *            dst_name,
+                      qosspec_t *             qs,
+                      size_t                  rb_size,
+                      const struct timespec * timeo);
+
+int     flow_accept_rb(qosspec_t *             qs,
+                       size_t                  rb_size,
+                       const struct timespec * timeo);
+
 /* Returns flow descriptor, qs updates to supplied QoS. */
 int     flow_join(const char *            bc,
                   qosspec_t *             qs,
@@ -55,6 +72,47 @@ ssize_t flow_read(int    fd,
                   void * buf,
                   size_t count);
 
+/* Gathers a packet from iovcnt buffers. */
+ssize_t flow_writev(int                  fd,
+                    const struct iovec * iov,
+                    int                  iovcnt);
+
+/* Scatters a packet over iovcnt buffers, as flow_read on partials. */
+ssize_t flow_readv(int                  fd,
+                   const struct iovec * iov,
+                   int                  iovcnt);
+
+/* Returns the number of messages written. */
+ssize_t flow_write_batch(int                     fd,
+                         const struct flow_msg * msgs,
+                         size_t                  n);
+
+/* Returns the number of messages read, len is set to their length. */
+ssize_t flow_read_batch(int               fd,
+                        struct flow_msg * msgs,
+                        size_t            n);
+
+/* Zero-copy, returns a loan id for a buffer of count bytes in buf. */
+ssize_t flow_write_loan(int     fd,
+                        size_t  count,
+                        void ** buf);
+
+/* Sends the first count bytes of the loan. */
+ssize_t flow_write_commit(int     fd,
+                          ssize_t id,
+                          size_t  count);
+
+int     flow_write_cancel(int     fd,
+                          ssize_t id);
+
+/* Zero-copy, returns a loan id for the next packet in buf and len. */
+ssize_t flow_read_loan(int           fd,
+                       const void ** buf,
+                       size_t *      len);
+
+int     flow_read_release(int     fd,
+                          ssize_t id);
+
 __END_DECLS
 
 #endif /* OUROBOROS_DEV_H */
@@ -25,6 +25,7 @@
 
 #include <ouroboros/cdefs.h>
 
+#include <stdint.h>
 #include <sys/time.h>
 
 /* Flow flags, same values as fcntl.h */
@@ -48,6 +49,12 @@
 /* FRCT flags */
 #define FRCTFRESCNTRL 00000001 /* Feedback from receiver */
 #define FRCTFRTX      00000002 /* Reliable flow          */
+#define FRCTFSACK     00000004 /* Selective ACKs         */
+
+/* FRCT congestion control */
+#define FRCTCCNONE    0        /* No congestion control */
+#define FRCTCCRENO    1        /* Loss-based, AIMD      */
+#define FRCTCCVEGAS   2        /* Delay-based           */
 
 /* Flow operations */
 #define FLOWSRCVTIMEO 00000001 /* Set read timeout       */
@@ -59,9 +66,25 @@
 #define FLOWGFLAGS    00000007 /* Get flags for flow     */
 #define FLOWGRXQLEN   00000010 /* Get queue length on rx */
 #define FLOWGTXQLEN   00000011 /* Get queue length on tx */
+#define FLOWSPOLL     00000012 /* Set busy-poll budget   */
+#define FLOWGPOLL     00000013 /* Get busy-poll budget   */
+#define FLOWGPOLLSTAT 00000014 /* Get busy-poll stats    */
+#define FLOWGRXQSIZE  00000015 /* Get queue size on rx   */
+
+/* Blocking waits that busy-poll for a budget (us) before sleeping. */
+struct flow_poll_stat {
+        uint64_t spin_ns;  /* Time spent spinning     */
+        uint64_t sleep_ns; /* Time spent sleeping     */
+        uint64_t hits;     /* Waits ended by spinning */
+        uint64_t sleeps;   /* Waits that went to sleep */
+};
 
 /* FRCT operations */
 #define FRCTGFLAGS    00001000 /* Get flags for FRCT     */
+#define FRCTSCC       00001001 /* Set congestion control */
+#define FRCTGCC       00001002 /* Get congestion control */
+#define FRCTGCWND     00001003 /* Get congestion window  */
+#define FRCTGSSTHRESH 00001004 /* Get slow start thresh. */
 
 __BEGIN_DECLS
 
@@ -26,7 +26,9 @@
 #include <ouroboros/cdefs.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
 
 enum fqtype {
         FLOW_PKT     = (1 << 0),
@@ -40,6 +42,8 @@ struct flow_set;
 
 struct fqueue;
 
+struct flow_poll_stat;
+
 typedef struct flow_set fset_t;
 typedef struct fqueue fqueue_t;
 
@@ -64,10 +68,20 @@ bool        fset_has(const fset_t * set,
 void        fset_del(fset_t * set,
                      int      fd);
 
+/* Readable while fevent has events, for poll/epoll loops. */
+int         fset_get_fd(fset_t * set);
+
 int         fqueue_next(fqueue_t * fq);
 
 enum fqtype fqueue_type(fqueue_t * fq);
 
+/* Busy-poll budget in us for fevent, 0 to sleep right away. */
+int         fqueue_set_poll(fqueue_t * fq,
+                            uint32_t   us);
+
+int         fqueue_get_poll_stat(fqueue_t *              fq,
+                                 struct flow_poll_stat * stat);
+
 ssize_t     fevent(fset_t *                set,
                    fqueue_t *              fq,
                    const struct timespec * timeo);
@@ -0,0 +1,50 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Futex based wait and wake for shared memory
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#ifndef OUROBOROS_FUTEX_H
+#define OUROBOROS_FUTEX_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A sequence word with the low bit set while someone sleeps on it,
+ * so a wake without sleepers is a fence and a load, no syscall.
+ *
+ * A waiter checks its condition, arms the futex with futex_prepare,
+ * checks again and then sleeps with futex_wait on the armed value.
+ */
+struct futex {
+        uint32_t seq;
+};
+
+void     futex_init(struct futex * f);
+
+uint32_t futex_prepare(struct futex * f);
+
+int      futex_wait(struct futex *          f,
+                    uint32_t                seq,
+                    const struct timespec * abstime);
+
+void     futex_wake(struct futex * f);
+
+#endif /* OUROBOROS_FUTEX_H */
@@ -26,6 +26,9 @@
 #ifndef OUROBOROS_IPCP_DEV_H
 #define OUROBOROS_IPCP_DEV_H
 
+/* Blocks reserved or released at once by the IPCP packet loops. */
+#define IPCP_SDB_BURST 32
+
 int  ipcp_create_r(int result);
 
 int  ipcp_flow_req_arr(const uint8_t * dst,
@@ -45,14 +48,35 @@ int  ipcp_flow_read(int                   fd,
 int  ipcp_flow_write(int                  fd,
                      struct shm_du_buff * sdb);
 
+/* Reads up to n packets, returns how many. */
+ssize_t ipcp_flow_read_n(int                   fd,
+                         struct shm_du_buff ** sdbs,
+                         size_t                n);
+
+/* Writes n packets with one wakeup, unsent ones are released. */
+ssize_t ipcp_flow_write_n(int                   fd,
+                          struct shm_du_buff ** sdbs,
+                          size_t                n);
+
 int  ipcp_flow_fini(int fd);
 
 int  ipcp_flow_get_qoscube(int         fd,
                            qoscube_t * cube);
 
+/* Packets waiting on the tx queue, to mark congestion. */
+size_t ipcp_flow_queued(int fd);
+
 int  ipcp_sdb_reserve(struct shm_du_buff ** sdb,
                       size_t                len);
 
 void ipcp_sdb_release(struct shm_du_buff * sdb);
 
+/* Reserves up to n blocks of len bytes, returns how many. */
+ssize_t ipcp_sdb_reserve_n(struct shm_du_buff ** sdbs,
+                           size_t                n,
+                           size_t                len);
+
+void ipcp_sdb_release_n(struct shm_du_buff ** sdbs,
+                        size_t                n);
+
 #endif /* OUROBOROS_IPCP_DEV_H */
@@ -30,13 +30,39 @@ struct shm_du_buff;
 
 size_t    shm_du_buff_get_idx(struct shm_du_buff * sdb);
 
+/* Large packets can span a chain of du_buffs, NULL after the last. */
+struct shm_du_buff * shm_du_buff_next(struct shm_du_buff * sdb);
+
+/* Length of the packet over the whole chain. */
+size_t    shm_du_buff_len(struct shm_du_buff * sdb);
+
+/* Copy len bytes at offset off out of the packet, returns bytes copied. */
+size_t    shm_du_buff_gather(struct shm_du_buff * sdb,
+                             size_t               off,
+                             void *               buf,
+                             size_t               len);
+
+/* Copy len bytes into the packet at offset off, returns bytes copied. */
+size_t    shm_du_buff_scatter(struct shm_du_buff * sdb,
+                              size_t               off,
+                              const void *         buf,
+                              size_t               len);
+
+/* Head and tail of this du_buff only, not of the whole chain. */
 uint8_t * shm_du_buff_head(struct shm_du_buff * sdb);
 
 uint8_t * shm_du_buff_tail(struct shm_du_buff * sdb);
 
+/* Copy len bytes from a position, ignores later head and tail moves. */
+size_t    shm_du_buff_extract(struct shm_du_buff * sdb,
+                              const uint8_t *      from,
+                              void *               buf,
+                              size_t               len);
+
 uint8_t * shm_du_buff_head_alloc(struct shm_du_buff * sdb,
                                  size_t               size);
 
+/* Tail alloc and release work on the end of a chain. */
 uint8_t * shm_du_buff_tail_alloc(struct shm_du_buff * sdb,
                                  size_t               size);
 
@@ -53,4 +79,10 @@ int       shm_du_buff_wait_ack(struct shm_du_buff * sdb);
 
 int       shm_du_buff_ack(struct shm_du_buff * sdb);
 
+/* Congestion mark set by the layer below, 0 if none. */
+uint8_t   shm_du_buff_get_ecn(struct shm_du_buff * sdb);
+
+void      shm_du_buff_set_ecn(struct shm_du_buff * sdb,
+                              uint8_t              ecn);
+
 #endif /* OUROBOROS_SHM_DU_BUFF_H */
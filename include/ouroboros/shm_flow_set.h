@@ -56,6 +56,22 @@ void                  shm_flow_set_notify(struct shm_flow_set * set,
                                           int                   flow_id,
                                           int                   event);
 
+void                  shm_flow_set_notify_n(struct shm_flow_set * set,
+                                            int                   flow_id,
+                                            int                   event,
+                                            size_t                n);
+
+/* Lockless peek for busy-polling, the answer may be stale. */
+bool                  shm_flow_set_ready(const struct shm_flow_set * set,
+                                         size_t                      idx);
+
+/* A datagram socket that is readable while fqueue idx has events. */
+int                   shm_flow_set_get_fd(struct shm_flow_set * set,
+                                          size_t                idx);
+
+void                  shm_flow_set_close_fd(struct shm_flow_set * set,
+                                            size_t                idx);
+
 ssize_t               shm_flow_set_wait(const struct shm_flow_set * shm_set,
                                         size_t                      idx,
                                         int *                       fqueue,
@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define ACL_RDWR     0000
@@ -34,8 +35,10 @@
 
 struct shm_rbuff;
 
-struct shm_rbuff * shm_rbuff_create(pid_t pid,
-                                    int   flow_id);
+/* Size in slots, rounded up to a power of 2, 0 for the default. */
+struct shm_rbuff * shm_rbuff_create(pid_t  pid,
+                                    int    flow_id,
+                                    size_t size);
 
 struct shm_rbuff * shm_rbuff_open(pid_t pid,
                                   int   flow_id);
@@ -49,6 +52,8 @@ void               shm_rbuff_set_acl(struct shm_rbuff * rb,
 
 uint32_t           shm_rbuff_get_acl(struct shm_rbuff * rb);
 
+size_t             shm_rbuff_size(struct shm_rbuff * rb);
+
 void               shm_rbuff_fini(struct shm_rbuff * rb);
 
 int                shm_rbuff_write(struct shm_rbuff * rb,
@@ -58,11 +63,22 @@ int                shm_rbuff_write_b(struct shm_rbuff *      rb,
                                      size_t                  idx,
                                      const struct timespec * abstime);
 
+ssize_t            shm_rbuff_write_n(struct shm_rbuff * rb,
+                                     const size_t *     idx,
+                                     size_t             n);
+
 ssize_t            shm_rbuff_read(struct shm_rbuff * rb);
 
 ssize_t            shm_rbuff_read_b(struct shm_rbuff *      rb,
                                     const struct timespec * abstime);
 
+ssize_t            shm_rbuff_read_n(struct shm_rbuff * rb,
+                                    ssize_t *          idx,
+                                    size_t             n);
+
 size_t             shm_rbuff_queued(struct shm_rbuff * rb);
 
+/* Lockless peek for busy-polling, the answer may be stale. */
+bool               shm_rbuff_ready(struct shm_rbuff * rb);
+
 #endif /* OUROBOROS_SHM_RBUFF_H */
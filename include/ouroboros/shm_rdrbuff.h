@@ -26,13 +26,24 @@
 #include <ouroboros/shm_du_buff.h>
 #include <ouroboros/time_utils.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <sys/types.h>
 
 struct shm_rdrbuff;
 
-struct shm_rdrbuff * shm_rdrbuff_create(void);
+/* Blocks handed out and released by threads running on a node. */
+struct rdrb_numa_stats {
+        size_t alloc_local;
+        size_t alloc_remote;
+        size_t free_local;
+        size_t free_remote;
+};
+
+/* Blocks must be a power of 2, falls back to normal pages. */
+struct shm_rdrbuff * shm_rdrbuff_create(size_t blocks,
+                                        bool   hugepages);
 
 struct shm_rdrbuff * shm_rdrbuff_open(void);
 
@@ -54,6 +65,14 @@ ssize_t              shm_rdrbuff_alloc_b(struct shm_rdrbuff *    rdrb,
                                          struct shm_du_buff **   sdb,
                                          const struct timespec * abstime);
 
+/* Blocks until at least one du_buff is free, returns the number. */
+ssize_t              shm_rdrbuff_alloc_n(struct shm_rdrbuff *    rdrb,
+                                         size_t                  count,
+                                         struct shm_du_buff **   sdbs,
+                                         size_t                  n,
+                                         const struct timespec * abstime);
+
+/* Reads the first block of a chain, returns its length. */
 ssize_t              shm_rdrbuff_read(uint8_t **           dst,
                                       struct shm_rdrbuff * rdrb,
                                       size_t               idx);
@@ -64,4 +83,23 @@ struct shm_du_buff * shm_rdrbuff_get(struct shm_rdrbuff * rdrb,
 int                  shm_rdrbuff_remove(struct shm_rdrbuff  * rdrb,
                                         size_t                idx);
 
+/* Removes n blocks under a single lock. */
+int                  shm_rdrbuff_remove_n(struct shm_rdrbuff * rdrb,
+                                          const size_t *       idx,
+                                          size_t               n);
+
+/* Release the blocks cached by a (dead) process. */
+void                 shm_rdrbuff_reclaim(struct shm_rdrbuff * rdrb,
+                                         pid_t                pid);
+
+/* Remove extension segments that stayed idle, call periodically. */
+void                 shm_rdrbuff_shrink(struct shm_rdrbuff * rdrb);
+
+/* NUMA nodes with a partition of their own, at least 1. */
+size_t               shm_rdrbuff_nodes(struct shm_rdrbuff * rdrb);
+
+void                 shm_rdrbuff_numa_stats(struct shm_rdrbuff *     rdrb,
+                                            size_t                   node,
+                                            struct rdrb_numa_stats * stats);
+
 #endif /* OUROBOROS_SHM_RDRBUFF_H */
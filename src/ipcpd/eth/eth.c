@@ -846,6 +846,40 @@ static void * eth_ipcp_mgmt_handler(void * o)
         return (void *) 0;
 }
 
+/* Blocks reserved or sent in a burst, released when cancelled. */
+struct sdb_burst {
+        struct shm_du_buff * sdbs[IPCP_SDB_BURST];
+        size_t               n;
+};
+
+static void cleanup_burst(void * o)
+{
+        struct sdb_burst * b = (struct sdb_burst *) o;
+
+        ipcp_sdb_release_n(b->sdbs, b->n);
+}
+
+#if !defined(HAVE_NETMAP)
+/* Takes a block from the burst, reserves the next burst if empty. */
+static int burst_get(struct sdb_burst *    b,
+                     struct shm_du_buff ** sdb,
+                     size_t                len)
+{
+        ssize_t n;
+
+        if (b->n == 0) {
+                n = ipcp_sdb_reserve_n(b->sdbs, IPCP_SDB_BURST, len);
+                if (n <= 0)
+                        return -1;
+                b->n = (size_t) n;
+        }
+
+        *sdb = b->sdbs[--b->n];
+
+        return 0;
+}
+#endif
+
 static void * eth_ipcp_packet_reader(void * o)
 {
         uint8_t              br_addr[MAC_SIZE];
@@ -862,6 +896,7 @@ static void * eth_ipcp_packet_reader(void * o)
         struct nm_pkthdr     hdr;
 #else
         struct shm_du_buff * sdb;
+        struct sdb_burst     rx;
         fd_set               fds;
         int                  frame_len;
 #endif
@@ -873,7 +908,11 @@ static void * eth_ipcp_packet_reader(void * o)
         ipcp_lock_to_core();
 
         memset(br_addr, 0xff, MAC_SIZE * sizeof(uint8_t));
+#if !defined(HAVE_NETMAP)
+        rx.n = 0;
 
+        pthread_cleanup_push(cleanup_burst, &rx);
+#endif
         while (true) {
 #if defined(HAVE_NETMAP)
                 if (poll(&eth_data.poll_in, 1, -1) < 0)
@@ -893,7 +932,7 @@ static void * eth_ipcp_packet_reader(void * o)
                 if (select(eth_data.bpf + 1, &fds, NULL, NULL, NULL))
                         continue;
                 assert(FD_ISSET(eth_data.bpf, &fds));
-                if (ipcp_sdb_reserve(&sdb, BPF_LEN))
+                if (burst_get(&rx, &sdb, BPF_LEN))
                         continue;
                 buf = shm_du_buff_head(sdb);
                 frame_len = read(eth_data.bpf, buf, BPF_BLEN);
@@ -902,7 +941,7 @@ static void * eth_ipcp_packet_reader(void * o)
                 if (select(eth_data.s_fd + 1, &fds, NULL, NULL, NULL) < 0)
                         continue;
                 assert(FD_ISSET(eth_data.s_fd, &fds));
-                if (ipcp_sdb_reserve(&sdb, ETH_MTU))
+                if (burst_get(&rx, &sdb, ETH_MTU))
                         continue;
                 buf = shm_du_buff_head_alloc(sdb, ETH_HEADER_TOT_SIZE);
                 if (buf == NULL) {
@@ -1022,7 +1061,9 @@ static void * eth_ipcp_packet_reader(void * o)
 #endif
                 }
         }
-
+#if !defined(HAVE_NETMAP)
+        pthread_cleanup_pop(true);
+#endif
         return (void *) 0;
 }
 
@@ -1035,6 +1076,7 @@ static void * eth_ipcp_packet_writer(void * o)
 {
         int                  fd;
         struct shm_du_buff * sdb;
+        struct sdb_burst     tx;
         size_t               len;
 #if defined(BUILD_ETH_DIX)
         uint16_t             deid;
@@ -1054,6 +1096,10 @@ static void * eth_ipcp_packet_writer(void * o)
 
         pthread_cleanup_push(cleanup_writer, fq);
 
+        tx.n = 0;
+
+        pthread_cleanup_push(cleanup_burst, &tx);
+
         ipcp_lock_to_core();
 
         while (true) {
@@ -1067,12 +1113,18 @@ static void * eth_ipcp_packet_writer(void * o)
                                 continue;
                         }
 
-                        len = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+                        len = shm_du_buff_len(sdb);
+                        if (len > (size_t) ETH_MAX_PACKET_SIZE) {
+                                log_dbg("Packet length exceeds MTU.");
+                                ipcp_sdb_release(sdb);
+                                continue;
+                        }
 
                         if (shm_du_buff_head_alloc(sdb, ETH_HEADER_TOT_SIZE)
                             == NULL) {
                                 log_dbg("Failed to allocate header.");
                                 ipcp_sdb_release(sdb);
+                                continue;
                         }
 
                         pthread_rwlock_rdlock(&eth_data.flows_lock);
@@ -1096,10 +1148,19 @@ static void * eth_ipcp_packet_writer(void * o)
 #endif
                                             shm_du_buff_head(sdb),
                                             len);
-                        ipcp_sdb_release(sdb);
+
+                        tx.sdbs[tx.n++] = sdb;
+                        if (tx.n == IPCP_SDB_BURST) {
+                                ipcp_sdb_release_n(tx.sdbs, tx.n);
+                                tx.n = 0;
+                        }
                 }
+
+                ipcp_sdb_release_n(tx.sdbs, tx.n);
+                tx.n = 0;
         }
 
+        pthread_cleanup_pop(true);
         pthread_cleanup_pop(true);
 
         return (void *) 1;
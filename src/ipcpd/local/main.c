@@ -117,8 +117,6 @@ static void * ipcp_local_packet_loop(void * o)
                         if (idx < 0)
                                 continue;
 
-                        assert(idx < (SHM_BUFFER_SIZE));
-
                         pthread_rwlock_rdlock(&local_data.lock);
 
                         fd = local_data.in_out[fd];
@@ -248,7 +248,7 @@ static int raptor_send_frame(struct shm_du_buff * sdb,
         size_t    len;
 
         payload = shm_du_buff_head(sdb);
-        len = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+        len = shm_du_buff_len(sdb);
 
         frame_len = RAPTOR_HEADER + len;
 
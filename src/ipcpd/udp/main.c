@@ -53,6 +53,7 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #define FLOW_REQ                 1
@@ -61,6 +62,8 @@
 #define THIS_TYPE                IPCP_UDP
 #define IPCP_UDP_MAX_PACKET_SIZE 8980
 #define OUR_HEADER_LEN           sizeof(uint32_t) /* adds eid */
+#define IPCP_UDP_RX_LEN          1500 /* larger packets skip the burst */
+#define IPCP_UDP_IOV             8    /* blocks in a chained packet */
 
 #define IPCP_UDP_BUF_SIZE        8980
 #define IPCP_UDP_MSG_SIZE        8980
@@ -458,19 +461,57 @@ static void * ipcp_udp_mgmt_handler(void * o)
         return (void *) 0;
 }
 
+/* Blocks reserved or sent in a burst, released when cancelled. */
+struct sdb_burst {
+        struct shm_du_buff * sdbs[IPCP_SDB_BURST];
+        size_t               n;
+};
+
+static void cleanup_burst(void * o)
+{
+        struct sdb_burst * b = (struct sdb_burst *) o;
+
+        ipcp_sdb_release_n(b->sdbs, b->n);
+}
+
+/* Takes a block from the burst, reserves the next burst if empty. */
+static int burst_get(struct sdb_burst *    b,
+                     struct shm_du_buff ** sdb,
+                     size_t                len)
+{
+        ssize_t n;
+
+        if (b->n == 0) {
+                n = ipcp_sdb_reserve_n(b->sdbs, IPCP_SDB_BURST, len);
+                if (n <= 0)
+                        return -1;
+                b->n = (size_t) n;
+        }
+
+        *sdb = b->sdbs[--b->n];
+
+        return 0;
+}
+
 static void * ipcp_udp_packet_reader(void * o)
 {
-        uint8_t    buf[IPCP_UDP_MAX_PACKET_SIZE];
-        uint8_t *  data;
-        ssize_t    n;
-        uint32_t   eid;
-        uint32_t * eid_p;
+        uint8_t              buf[IPCP_UDP_MAX_PACKET_SIZE];
+        uint8_t *            data;
+        ssize_t              n;
+        uint32_t             eid;
+        uint32_t *           eid_p;
+        struct shm_du_buff * sdb;
+        struct sdb_burst     rx;
 
         (void) o;
 
         data  = buf + sizeof(uint32_t);
         eid_p = (uint32_t *) buf;
 
+        rx.n = 0;
+
+        pthread_cleanup_push(cleanup_burst, &rx);
+
         while (true) {
                 struct mgmt_frame * frame;
                 struct sockaddr_in  r_saddr;
@@ -515,9 +556,22 @@ static void * ipcp_udp_packet_reader(void * o)
                         continue;
                 }
 
-                flow_write(eid, data, n - sizeof(eid));
+                n -= sizeof(eid);
+
+                if (n > IPCP_UDP_RX_LEN ||
+                    burst_get(&rx, &sdb, IPCP_UDP_RX_LEN)) {
+                        flow_write(eid, data, n);
+                        continue;
+                }
+
+                memcpy(shm_du_buff_head(sdb), data, n);
+                shm_du_buff_truncate(sdb, n);
+
+                ipcp_flow_write(eid, sdb);
         }
 
+        pthread_cleanup_pop(true);
+
         return 0;
 }
 
@@ -526,9 +580,30 @@ static void cleanup_writer(void * o)
         fqueue_destroy((fqueue_t *) o);
 }
 
+/* A large packet can span a chain of blocks, one iovec each. */
+static ssize_t sdb_write(int                  fd,
+                         struct shm_du_buff * sdb)
+{
+        struct iovec iov[IPCP_UDP_IOV];
+        int          n;
+
+        for (n = 0; sdb != NULL && n < IPCP_UDP_IOV; ++n) {
+                iov[n].iov_base = shm_du_buff_head(sdb);
+                iov[n].iov_len  = shm_du_buff_tail(sdb)
+                        - shm_du_buff_head(sdb);
+                sdb = shm_du_buff_next(sdb);
+        }
+
+        if (sdb != NULL)
+                return -1;
+
+        return writev(fd, iov, n);
+}
+
 static void * ipcp_udp_packet_writer(void * o)
 {
-        fqueue_t * fq;
+        fqueue_t *       fq;
+        struct sdb_burst tx;
 
         fq = fqueue_create();
         if (fq == NULL)
@@ -540,6 +615,10 @@ static void * ipcp_udp_packet_writer(void * o)
 
         pthread_cleanup_push(cleanup_writer, fq);
 
+        tx.n = 0;
+
+        pthread_cleanup_push(cleanup_burst, &tx);
+
         while (true) {
                 int fd;
                 int eid;
@@ -547,7 +626,7 @@ static void * ipcp_udp_packet_writer(void * o)
                 while ((fd = fqueue_next(fq)) >= 0) {
                         struct shm_du_buff * sdb;
                         uint8_t *            buf;
-                        uint16_t             len;
+                        size_t               len;
 
                         if (fqueue_type(fq) != FLOW_PKT)
                                 continue;
@@ -557,7 +636,7 @@ static void * ipcp_udp_packet_writer(void * o)
                                 continue;
                         }
 
-                        len = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+                        len = shm_du_buff_len(sdb);
                         if (len > IPCP_UDP_MAX_PACKET_SIZE) {
                                 log_dbg("Packet length exceeds MTU.");
                                 ipcp_sdb_release(sdb);
@@ -580,16 +659,22 @@ static void * ipcp_udp_packet_writer(void * o)
 
                         memcpy(buf, &eid, sizeof(eid));
 
-                        pthread_cleanup_push((void (*)(void *))
-                                             ipcp_sdb_release, (void *) sdb);
+                        tx.sdbs[tx.n++] = sdb;
 
-                        if (write(fd, buf, len + OUR_HEADER_LEN) < 0)
+                        if (sdb_write(fd, sdb) < 0)
                                 log_err("Failed to send packet.");
 
-                        pthread_cleanup_pop(true);
+                        if (tx.n == IPCP_SDB_BURST) {
+                                ipcp_sdb_release_n(tx.sdbs, tx.n);
+                                tx.n = 0;
+                        }
                 }
+
+                ipcp_sdb_release_n(tx.sdbs, tx.n);
+                tx.n = 0;
         }
 
+        pthread_cleanup_pop(true);
         pthread_cleanup_pop(true);
 
         return (void *) 1;
@@ -37,6 +37,7 @@
 #include <ouroboros/dev.h>
 #include <ouroboros/notifier.h>
 #include <ouroboros/rib.h>
+#include <ouroboros/utils.h>
 #ifdef IPCP_FLOW_STATS
 #include <ouroboros/fccntl.h>
 #endif
@@ -75,6 +76,9 @@ struct comp_info {
 #define QOS_LEN 1
 #define ECN_LEN 1
 
+/* Packets on the next hop's queue per ECN step, 16 marks. */
+#define ECN_Q_SHFT 4
+
 struct dt_pci {
         uint64_t  dst_addr;
         qoscube_t qc;
@@ -142,6 +146,22 @@ static void dt_pci_des(struct shm_du_buff * sdb,
         memcpy(&dt_pci->eid, head + dt_pci_info.eid_o, dt_pci_info.eid_size);
 }
 
+/* Marks congestion from the queue towards the next hop. */
+static void dt_pci_mark(struct shm_du_buff * sdb,
+                        int                  fd)
+{
+        uint8_t * ecn;
+        size_t    q;
+
+        assert(sdb);
+
+        ecn = shm_du_buff_head(sdb) + dt_pci_info.ecn_o;
+        q   = MIN(ipcp_flow_queued(fd) >> ECN_Q_SHFT, UINT8_MAX);
+
+        if (q > *ecn)
+                *ecn = (uint8_t) q;
+}
+
 static void dt_pci_shrink(struct shm_du_buff * sdb)
 {
         assert(sdb);
@@ -447,7 +467,7 @@ static void packet_handler(int                  fd,
 #endif
 
 #ifdef IPCP_FLOW_STATS
-        len = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+        len = shm_du_buff_len(sdb);
 #endif
         memset(&dt_pci, 0, sizeof(dt_pci));
         dt_pci_des(sdb, &dt_pci);
@@ -486,6 +506,8 @@ static void packet_handler(int                  fd,
                         return;
                 }
 
+                dt_pci_mark(sdb, ofd);
+
                 ret = ipcp_flow_write(ofd, sdb);
                 if (ret < 0) {
                         log_dbg("Failed to write packet to fd %d.", ofd);
@@ -525,6 +547,8 @@ static void packet_handler(int                  fd,
         } else {
                 dt_pci_shrink(sdb);
                 if (dt_pci.eid >= PROG_RES_FDS) {
+                        /* FRCT of the application echoes the mark. */
+                        shm_du_buff_set_ecn(sdb, dt_pci.ecn);
                         if (ipcp_flow_write(dt_pci.eid, sdb)) {
                                 ipcp_sdb_release(sdb);
 #ifdef IPCP_FLOW_STATS
@@ -835,7 +859,7 @@ int dt_write_packet(uint64_t             dst_addr,
         if (fd < 0) {
                 log_dbg("Could not get nhop for addr %" PRIu64 ".", dst_addr);
 #ifdef IPCP_FLOW_STATS
-                len = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+                len = shm_du_buff_len(sdb);
 
                 pthread_mutex_lock(&dt.stat[np1_fd].lock);
 
@@ -857,12 +881,14 @@ int dt_write_packet(uint64_t             dst_addr,
         if (dt_pci_ser(sdb, &dt_pci)) {
                 log_dbg("Failed to serialize PDU.");
 #ifdef IPCP_FLOW_STATS
-                len = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+                len = shm_du_buff_len(sdb);
 #endif
                 goto fail_write;
         }
+
+        dt_pci_mark(sdb, fd);
 #ifdef IPCP_FLOW_STATS
-        len = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+        len = shm_du_buff_len(sdb);
 #endif
         ret = ipcp_flow_write(fd, sdb);
         if (ret < 0) {
@@ -613,9 +613,9 @@ static int graph_routing_table_lfa(struct graph *     graph,
                                    struct list_head * table,
                                    int **             dist)
 {
-        int *              n_dist[PROG_MAX_FLOWS];
-        uint64_t           addrs[PROG_MAX_FLOWS];
-        int                n_index[PROG_MAX_FLOWS];
+        int **             n_dist;
+        uint64_t *         addrs;
+        int *              n_index;
         struct list_head * p;
         struct list_head * q;
         struct vertex *    v;
@@ -628,7 +628,20 @@ static int graph_routing_table_lfa(struct graph *     graph,
         if (graph_routing_table_simple(graph, s_addr, table, dist))
                 goto fail_table;
 
-        for (j = 0; j < PROG_MAX_FLOWS; j++) {
+        /* The source has at most one edge to every other vertex. */
+        n_dist = malloc(sizeof(*n_dist) * graph->nr_vertices);
+        if (n_dist == NULL)
+                goto fail_n_dist;
+
+        addrs = malloc(sizeof(*addrs) * graph->nr_vertices);
+        if (addrs == NULL)
+                goto fail_addrs;
+
+        n_index = malloc(sizeof(*n_index) * graph->nr_vertices);
+        if (n_index == NULL)
+                goto fail_n_index;
+
+        for (j = 0; j < (int) graph->nr_vertices; j++) {
                 n_dist[j] = NULL;
                 n_index[j] = -1;
                 addrs[j] = -1;
@@ -687,12 +700,22 @@ static int graph_routing_table_lfa(struct graph *     graph,
         for (j = 0; j < i; j++)
                 free(n_dist[j]);
 
+        free(n_index);
+        free(addrs);
+        free(n_dist);
+
         return 0;
 
  fail_add_lfa:
         for (k = j; k < i; k++)
                 free(n_dist[k]);
  fail_dijkstra:
+        free(n_index);
+ fail_n_index:
+        free(addrs);
+ fail_addrs:
+        free(n_dist);
+ fail_n_dist:
         free_routing_table(table);
  fail_table:
         return -1;
@@ -410,13 +410,19 @@ static void calculate_pff(struct routing_i * instance)
         struct list_head   table;
         struct list_head * p;
         struct list_head * q;
-        int                fds[PROG_MAX_FLOWS];
+        int *              fds;
 
         assert(instance);
 
+        fds = malloc(sizeof(*fds) * PROG_MAX_FLOWS);
+        if (fds == NULL)
+                return;
+
         if (graph_routing_table(ls.graph, ls.routing_algo,
-                                ipcpi.dt_addr, &table))
+                                ipcpi.dt_addr, &table)) {
+                free(fds);
                 return;
+        }
 
         pff_lock(instance->pff);
 
@@ -444,6 +450,8 @@ static void calculate_pff(struct routing_i * instance)
         pff_unlock(instance->pff);
 
         graph_free_routing_table(ls.graph, &table);
+
+        free(fds);
 }
 
 static void set_pff_modified(bool calc)
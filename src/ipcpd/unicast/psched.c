@@ -66,7 +66,9 @@ static void cleanup_reader(void * o)
 static void * packet_reader(void * o)
 {
         struct psched *       sched;
-        struct shm_du_buff *  sdb;
+        struct shm_du_buff *  sdbs[IPCP_SDB_BURST];
+        ssize_t               n;
+        ssize_t               i;
         int                   fd;
         fqueue_t *            fq;
         qoscube_t             qc;
@@ -101,10 +103,9 @@ static void * packet_reader(void * o)
                                 notifier_event(NOTIFY_DT_FLOW_UP, &fd);
                                 break;
                         case FLOW_PKT:
-                                if (ipcp_flow_read(fd, &sdb))
-                                        continue;
-
-                                sched->callback(fd, qc, sdb);
+                                n = ipcp_flow_read_n(fd, sdbs, IPCP_SDB_BURST);
+                                for (i = 0; i < n; ++i)
+                                        sched->callback(fd, qc, sdbs[i]);
                                 break;
                         default:
                                 break;
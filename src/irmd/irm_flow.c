@@ -34,12 +34,39 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 
+/* Conservative packet size to turn bytes in flight into slots. */
+#define RB_PKT_SIZE 128
+
+/*
+ * A queue that holds more than the bandwidth-delay product can only
+ * add latency, size the rbuff to that. Without a bandwidth or delay
+ * bound, the library default is used.
+ */
+static size_t rbuff_size(qosspec_t qs)
+{
+        uint64_t pps;
+
+        if (qs.bandwidth == 0 || qs.delay == UINT32_MAX)
+                return 0;
+
+        if (qs.delay == 0)
+                return 1;
+
+        pps = qs.bandwidth / 8 / RB_PKT_SIZE;
+        if (pps > (uint64_t) SIZE_MAX / qs.delay)
+                return SIZE_MAX;
+
+        return (size_t) (pps * qs.delay / 1000 + 1);
+}
+
 struct irm_flow * irm_flow_create(pid_t     n_pid,
                                   pid_t     n_1_pid,
                                   int       flow_id,
-                                  qosspec_t qs)
+                                  qosspec_t qs,
+                                  size_t    rb_size)
 {
         pthread_condattr_t cattr;
         struct irm_flow *  f = malloc(sizeof(*f));
@@ -65,13 +92,16 @@ struct irm_flow * irm_flow_create(pid_t     n_pid,
         f->data    = NULL;
         f->len     = 0;
 
-        f->n_rb = shm_rbuff_create(n_pid, flow_id);
+        if (rb_size == 0)
+                rb_size = rbuff_size(qs);
+
+        f->n_rb = shm_rbuff_create(n_pid, flow_id, rb_size);
         if (f->n_rb == NULL) {
                 log_err("Could not create ringbuffer for process %d.", n_pid);
                 goto fail_n_rbuff;
         }
 
-        f->n_1_rb = shm_rbuff_create(n_1_pid, flow_id);
+        f->n_1_rb = shm_rbuff_create(n_1_pid, flow_id, rb_size);
         if (f->n_1_rb == NULL) {
                 log_err("Could not create ringbuffer for process %d.", n_1_pid);
                 goto fail_n_1_rbuff;
@@ -64,7 +64,8 @@ struct irm_flow {
 struct irm_flow * irm_flow_create(pid_t     n_pid,
                                   pid_t     n_1_pid,
                                   int       flow_id,
-                                  qosspec_t qs);
+                                  qosspec_t qs,
+                                  size_t    rb_size);
 
 void              irm_flow_destroy(struct irm_flow * f);
 
@@ -1256,6 +1256,7 @@ static int proc_announce(pid_t  pid,
 }
 
 static int flow_accept(pid_t              pid,
+                       size_t             rb_size,
                        struct timespec *  timeo,
                        struct irm_flow ** fl,
                        const void *       data,
@@ -1280,6 +1281,8 @@ static int flow_accept(pid_t              pid,
                 return -EINVAL;
         }
 
+        e->rb_size = rb_size;
+
         log_dbg("New instance (%d) of %s added.", pid, e->prog);
         log_dbg("This process accepts flows for:");
 
@@ -1386,6 +1389,7 @@ static int flow_accept(pid_t              pid,
 static int flow_alloc(pid_t              pid,
                       const char *       dst,
                       qosspec_t          qs,
+                      size_t             rb_size,
                       struct timespec *  timeo,
                       struct irm_flow ** e,
                       bool               join,
@@ -1413,7 +1417,7 @@ static int flow_alloc(pid_t              pid,
                 return -EBADF;
         }
 
-        f = irm_flow_create(pid, ipcp->pid, flow_id, qs);
+        f = irm_flow_create(pid, ipcp->pid, flow_id, qs, rb_size);
         if (f == NULL) {
                 bmp_release(irmd.flow_ids, flow_id);
                 pthread_rwlock_unlock(&irmd.flows_lock);
@@ -1566,6 +1570,7 @@ static struct irm_flow * flow_req_arr(pid_t           pid,
         struct ipcp_entry * ipcp;
         pid_t               h_pid   = -1;
         int                 flow_id = -1;
+        size_t              rb_size = 0;
 
         struct timespec wt = {IRMD_REQ_ARR_TIMEOUT / 1000,
                               (IRMD_REQ_ARR_TIMEOUT % 1000) * MILLION};
@@ -1643,6 +1648,10 @@ static struct irm_flow * flow_req_arr(pid_t           pid,
                         return NULL;
                 }
 
+                e = proc_table_get(&irmd.proc_table, h_pid);
+                if (e != NULL)
+                        rb_size = e->rb_size;
+
                 break;
         default:
                 pthread_rwlock_unlock(&irmd.reg_lock);
@@ -1659,7 +1668,7 @@ static struct irm_flow * flow_req_arr(pid_t           pid,
                 return NULL;
         }
 
-        f = irm_flow_create(h_pid, pid, flow_id, qs);
+        f = irm_flow_create(h_pid, pid, flow_id, qs, rb_size);
         if (f == NULL) {
                 bmp_release(irmd.flow_ids, flow_id);
                 pthread_rwlock_unlock(&irmd.flows_lock);
@@ -1746,6 +1755,23 @@ static int flow_alloc_reply(int          flow_id,
         return 0;
 }
 
+/* Shows how well the packet buffer keeps blocks on their node. */
+static void rdrb_numa_report(void)
+{
+        struct rdrb_numa_stats stats;
+        size_t                 n;
+
+        for (n = 0; n < shm_rdrbuff_nodes(irmd.rdrb); ++n) {
+                shm_rdrbuff_numa_stats(irmd.rdrb, n, &stats);
+                log_info("Node %zu: %zu/%zu allocations local, "
+                         "%zu/%zu releases local.", n,
+                         stats.alloc_local,
+                         stats.alloc_local + stats.alloc_remote,
+                         stats.free_local,
+                         stats.free_local + stats.free_remote);
+        }
+}
+
 static void irm_fini(void)
 {
         struct list_head * p;
@@ -1815,8 +1841,11 @@ static void irm_fini(void)
         pthread_rwlock_unlock(&irmd.flows_lock);
 
 
-        if (irmd.rdrb != NULL)
+        if (irmd.rdrb != NULL) {
+                if (shm_rdrbuff_nodes(irmd.rdrb) > 1)
+                        rdrb_numa_report();
                 shm_rdrbuff_destroy(irmd.rdrb);
+        }
 
         if (irmd.lf != NULL)
                 lockfile_destroy(irmd.lf);
@@ -1870,10 +1899,13 @@ void * irm_sanitize(void * o)
                         if (kill(e->pid, 0) >= 0)
                                 continue;
                         log_dbg("Dead process removed: %d.", e->pid);
+                        shm_rdrbuff_reclaim(irmd.rdrb, e->pid);
                         list_del(&e->next);
                         proc_entry_destroy(e);
                 }
 
+                shm_rdrbuff_shrink(irmd.rdrb);
+
                 list_for_each_safe(p, h, &irmd.ipcps) {
                         struct ipcp_entry * e =
                                 list_entry(p, struct ipcp_entry, next);
@@ -2143,8 +2175,8 @@ static void * mainloop(void * o)
                 case IRM_MSG_CODE__IRM_FLOW_ACCEPT:
                         assert(msg->pk.len > 0 ? msg->pk.data != NULL
                                : msg->pk.data == NULL);
-                        result = flow_accept(msg->pid, timeo, &e,
-                                             msg->pk.data, msg->pk.len);
+                        result = flow_accept(msg->pid, msg->rb_size, timeo,
+                                             &e, msg->pk.data, msg->pk.len);
                         if (result == 0) {
                                 qosspec_msg_t qs_msg;
                                 ret_msg->has_flow_id = true;
@@ -2164,8 +2196,8 @@ static void * mainloop(void * o)
                                                : msg->pk.data == NULL);
                         result = flow_alloc(msg->pid, msg->dst,
                                             msg_to_spec(msg->qosspec),
-                                            timeo, &e, false, msg->pk.data,
-                                            msg->pk.len);
+                                            msg->rb_size, timeo, &e, false,
+                                            msg->pk.data, msg->pk.len);
                         if (result == 0) {
                                 ret_msg->has_flow_id = true;
                                 ret_msg->flow_id     = e->flow_id;
@@ -2181,7 +2213,8 @@ static void * mainloop(void * o)
                         assert(msg->pk.len == 0 && msg->pk.data == NULL);
                         result = flow_alloc(msg->pid, msg->dst,
                                             msg_to_spec(msg->qosspec),
-                                            timeo, &e, true, NULL, 0);
+                                            msg->rb_size, timeo, &e, true,
+                                            NULL, 0);
                         if (result == 0) {
                                 ret_msg->has_flow_id = true;
                                 ret_msg->flow_id     = e->flow_id;
@@ -2273,7 +2306,8 @@ static void * mainloop(void * o)
         return (void *) 0;
 }
 
-static int irm_init(void)
+static int irm_init(size_t rdrb_blocks,
+                    bool   hugepages)
 {
         struct stat        st;
         pthread_condattr_t cattr;
@@ -2373,7 +2407,8 @@ static int irm_init(void)
                 goto fail_sock_path;
         }
 
-        if ((irmd.rdrb = shm_rdrbuff_create()) == NULL) {
+        irmd.rdrb = shm_rdrbuff_create(rdrb_blocks, hugepages);
+        if (irmd.rdrb == NULL) {
                 log_err("Failed to create rdrbuff.");
                 goto fail_rdrbuff;
         }
@@ -2436,8 +2471,12 @@ static void usage(void)
 {
         printf("Usage: irmd \n"
                "         [--stdout  (Log to stdout instead of system log)]\n"
+               "         [--buffer-size <blocks> (Packet buffer blocks,"
+               " power of 2, default %d)]\n"
+               "         [--hugepages (Back the packet buffer with huge "
+               "pages)]\n"
                "         [--version (Print version number and exit)]\n"
-               "\n");
+               "\n", SHM_BUFFER_SIZE);
 }
 
 int main(int     argc,
@@ -2445,6 +2484,9 @@ int main(int     argc,
 {
         sigset_t  sigset;
         bool      use_stdout = false;
+        bool      hugepages  = false;
+        size_t    blocks     = SHM_BUFFER_SIZE;
+        char *    end;
         int       sig;
 
         sigemptyset(&sigset);
@@ -2453,6 +2495,7 @@ int main(int     argc,
         sigaddset(&sigset, SIGHUP);
         sigaddset(&sigset, SIGTERM);
         sigaddset(&sigset, SIGPIPE);
+        sigaddset(&sigset, SIGUSR1);
 
         argc--;
         argv++;
@@ -2461,6 +2504,19 @@ int main(int     argc,
                         use_stdout = true;
                         argc--;
                         argv++;
+                } else if (strcmp(*argv, "--buffer-size") == 0 && argc > 1) {
+                        blocks = strtoul(*(argv + 1), &end, 10);
+                        if (*end != '\0' || blocks < 4 ||
+                            (blocks & (blocks - 1))) {
+                                usage();
+                                exit(EXIT_FAILURE);
+                        }
+                        argc -= 2;
+                        argv += 2;
+                } else if (strcmp(*argv, "--hugepages") == 0) {
+                        hugepages = true;
+                        argc--;
+                        argv++;
                 } else if (strcmp(*argv, "--version") == 0) {
                         printf("Ouroboros version %d.%d.%d\n",
                                OUROBOROS_VERSION_MAJOR,
@@ -2480,7 +2536,7 @@ int main(int     argc,
 
         log_init(!use_stdout);
 
-        if (irm_init() < 0)
+        if (irm_init(blocks, hugepages) < 0)
                 goto fail_irm_init;
 
         irmd.tpm = tpm_create(IRMD_MIN_THREADS, IRMD_ADD_THREADS,
@@ -2524,6 +2580,9 @@ int main(int     argc,
                 case SIGPIPE:
                         log_dbg("Ignored SIGPIPE.");
                         break;
+                case SIGUSR1:
+                        rdrb_numa_report();
+                        break;
                 default:
                         break;
                 }
@@ -75,6 +75,7 @@ struct proc_entry * proc_entry_create(pid_t  pid,
         e->pid      = pid;
         e->prog     = prog;
         e->re       = NULL;
+        e->rb_size  = 0;
         e->state    = PROC_INIT;
 
         return e;
@@ -46,6 +46,7 @@ struct proc_entry {
         struct shm_flow_set * set;
 
         struct reg_entry *    re;    /* reg_entry for which a flow arrived */
+        size_t                rb_size; /* rbuff size asked at accept */
 
         /* The process will block on this */
         enum proc_state       state;
@@ -82,3 +82,22 @@ void crc32(uint32_t *   crc,
 
         *crc = *crc ^ 0xffffffff;
 }
+
+void crc32_copy(uint32_t *   crc,
+                void *       dst,
+                const void * src,
+                size_t       len)
+{
+        const uint8_t * s = src;
+        uint8_t *       d = dst;
+        size_t          n;
+
+        *crc = *crc ^ 0xffffffff;
+
+        for (n = 0; n < len; n++) {
+                d[n] = s[n];
+                *crc = crc32_table[(*crc ^ d[n]) & 0xff] ^ (*crc >> 8);
+        }
+
+        *crc = *crc ^ 0xffffffff;
+}
@@ -207,6 +207,7 @@ static int openssl_encrypt(struct flow *        f,
 {
         uint8_t * out;
         uint8_t * in;
+        uint8_t * lin = NULL;
         uint8_t * head;
         uint8_t   iv[IVSZ];
         int       in_sz;
@@ -215,7 +216,16 @@ static int openssl_encrypt(struct flow *        f,
         int       ret;
 
         in = shm_du_buff_head(sdb);
-        in_sz = shm_du_buff_tail(sdb) - in;
+        in_sz = shm_du_buff_len(sdb);
+
+        /* A chain is encrypted from a linear copy. */
+        if (shm_du_buff_next(sdb) != NULL) {
+                lin = malloc(in_sz);
+                if (lin == NULL)
+                        goto fail_lin;
+                shm_du_buff_gather(sdb, 0, lin, in_sz);
+                in = lin;
+        }
 
         if (random_buffer(iv, IVSZ) < 0)
                 goto fail_iv;
@@ -257,9 +267,10 @@ static int openssl_encrypt(struct flow *        f,
                 goto fail_tail_alloc;
 
         memcpy(head, iv, IVSZ);
-        memcpy(in, out, out_sz);
+        shm_du_buff_scatter(sdb, IVSZ, out, out_sz);
 
         free(out);
+        free(lin);
 
         return 0;
 
@@ -270,6 +281,8 @@ static int openssl_encrypt(struct flow *        f,
  fail_encrypt_init:
         free(out);
  fail_iv:
+        free(lin);
+ fail_lin:
         return -ECRYPT;
 }
 
@@ -278,6 +291,7 @@ static int openssl_decrypt(struct flow *        f,
 {
         uint8_t * in;
         uint8_t * out;
+        uint8_t * lin = NULL;
         uint8_t   iv[IVSZ];
         int       ret;
         int       out_sz;
@@ -290,11 +304,20 @@ static int openssl_decrypt(struct flow *        f,
 
         in = shm_du_buff_head(sdb);
 
-        in_sz = shm_du_buff_tail(sdb) - shm_du_buff_head(sdb);
+        in_sz = shm_du_buff_len(sdb);
+
+        /* A chain is decrypted from a linear copy. */
+        if (shm_du_buff_next(sdb) != NULL) {
+                lin = malloc(in_sz);
+                if (lin == NULL)
+                        goto fail_malloc;
+                shm_du_buff_gather(sdb, 0, lin, in_sz);
+                in = lin;
+        }
 
         out = malloc(in_sz);
         if (out == NULL)
-                goto fail_malloc;
+                goto fail_out;
 
         EVP_CIPHER_CTX_reset(f->ctx);
 
@@ -322,9 +345,10 @@ static int openssl_decrypt(struct flow *        f,
 
         shm_du_buff_tail_release(sdb, in_sz - out_sz);
 
-        memcpy(in, out, out_sz);
+        shm_du_buff_scatter(sdb, 0, out, out_sz);
 
         free(out);
+        free(lin);
 
         return 0;
 
@@ -332,6 +356,8 @@ static int openssl_decrypt(struct flow *        f,
         EVP_CIPHER_CTX_cleanup(f->ctx);
  fail_decrypt_init:
         free(out);
+ fail_out:
+        free(lin);
  fail_malloc:
         return -ECRYPT;
 
@@ -29,6 +29,7 @@
 #include "config.h"
 
 #include <ouroboros/hash.h>
+#include <ouroboros/crc32.h>
 #include <ouroboros/cacep.h>
 #include <ouroboros/errno.h>
 #include <ouroboros/dev.h>
@@ -43,18 +44,24 @@
 #include <ouroboros/shm_rbuff.h>
 #include <ouroboros/utils.h>
 #include <ouroboros/fqueue.h>
+#include <ouroboros/list.h>
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <sys/types.h>
 
 #ifndef CLOCK_REALTIME_COARSE
 #define CLOCK_REALTIME_COARSE CLOCK_REALTIME
 #endif
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /* Partial read information. */
 #define NO_PART   -1
 #define DONE_PART -2
@@ -63,15 +70,30 @@
 #define SECMEMSZ  16384
 #define SYMMKEYSZ 32
 #define MSGBUFSZ  2048
+#define BATCHSZ   64
+#define WND_POLL  (10 * MILLION) /* ns */
+#define FRCT_TICK (ACK_DELAY * 500)  /* ns, half the ACK delay */
+
+/* The flow and port tables grow in chunks, which never move. */
+#define TBL_CHUNK   256
+#define FLOW_CHUNKS ((PROG_MAX_FLOWS + TBL_CHUNK - 1) / TBL_CHUNK)
+#define PORT_CHUNKS ((SYS_MAX_FLOWS + TBL_CHUNK - 1) / TBL_CHUNK)
+
+#define flow_at(fd) (ai.flows[(fd) / TBL_CHUNK][(fd) % TBL_CHUNK])
+#define port_at(id) (ai.ports[(id) / TBL_CHUNK][(id) % TBL_CHUNK])
 
 struct flow_set {
         size_t idx;
 };
 
 struct fqueue {
-        int    fqueue[2 * SHM_BUFFER_SIZE]; /* Safe copy from shm. */
-        size_t fqsize;
-        size_t next;
+        int                   fqueue[2 * SHM_BUFFER_SIZE]; /* From shm. */
+        size_t                fqsize;
+        size_t                next;
+        size_t                burst; /* Yields left for a FLOW_PKT. */
+
+        uint32_t              poll_us;
+        struct flow_poll_stat pstat;
 };
 
 enum port_state {
@@ -94,6 +116,8 @@ struct port {
         ((struct flow *)((uint8_t *) frcti - offsetof(struct flow, frcti)))
 
 struct flow {
+        pthread_rwlock_t      lock;
+
         struct shm_rbuff *    rx_rb;
         struct shm_rbuff *    tx_rb;
         struct shm_flow_set * set;
@@ -112,7 +136,19 @@ struct flow {
         struct timespec       snd_timeo;
         struct timespec       rcv_timeo;
 
+        uint32_t              poll_us;
+        struct flow_poll_stat pstat;
+
         struct frcti *        frcti;
+        size_t                readers; /* Threads reading the rx_rb. */
+};
+
+/* The flow set of a peer process, shared by the flows to it. */
+struct peer_set {
+        struct list_head      next;
+        pid_t                 pid;
+        struct shm_flow_set * set;
+        size_t                refs;
 };
 
 struct {
@@ -127,14 +163,191 @@ struct {
         struct bmp *          fds;
         struct bmp *          fqueues;
 
-        struct flow *         flows;
-        struct port *         ports;
+        struct flow *         flows[FLOW_CHUNKS];
+        struct port *         ports[PORT_CHUNKS];
+        struct list_head      peers;
 
-        pthread_rwlock_t      lock;
+        struct list_head      frctis;   /* FRCT instances to tick. */
+        pthread_mutex_t       frct_mtx;
+        pthread_cond_t        frct_cond;
+        pthread_t             frct_tmr;
+        bool                  frct_on;
+
+        pthread_rwlock_t      lock; /* Flow and port table changes. */
 } ai;
 
+static void frct_tmr_due(struct frcti * frcti);
+
 #include "frct.c"
 
+/* Clears the flow, its lock lives as long as its chunk. */
+static void flow_reset(struct flow * flow)
+{
+        memset((uint8_t *) flow + offsetof(struct flow, rx_rb), 0,
+               sizeof(*flow) - offsetof(struct flow, rx_rb));
+
+        flow->flow_id  = -1;
+        flow->pid      = -1;
+}
+
+/*
+ * Chunks not in use point to a shared read-only chunk of unallocated
+ * entries, lookups need no bounds on what was allocated.
+ */
+static struct flow null_flows[TBL_CHUNK];
+static struct port null_ports[TBL_CHUNK];
+
+/* Call under the ai.lock wrlock. */
+static int flow_chunk_get(int fd)
+{
+        struct flow * chunk;
+        int           i;
+
+        if (ai.flows[fd / TBL_CHUNK] != null_flows)
+                return 0;
+
+        chunk = malloc(sizeof(*chunk) * TBL_CHUNK);
+        if (chunk == NULL)
+                goto fail_malloc;
+
+        for (i = 0; i < TBL_CHUNK; ++i) {
+                if (pthread_rwlock_init(&chunk[i].lock, NULL))
+                        goto fail_init;
+                flow_reset(chunk + i);
+        }
+
+        /* Lookups take no ai.lock, publish a complete chunk. */
+        __sync_synchronize();
+
+        ai.flows[fd / TBL_CHUNK] = chunk;
+
+        return 0;
+
+ fail_init:
+        while (i-- > 0)
+                pthread_rwlock_destroy(&chunk[i].lock);
+        free(chunk);
+ fail_malloc:
+        return -ENOMEM;
+}
+
+static void flow_chunk_destroy(struct flow * chunk)
+{
+        int i;
+
+        for (i = 0; i < TBL_CHUNK; ++i)
+                pthread_rwlock_destroy(&chunk[i].lock);
+
+        free(chunk);
+}
+
+/* Call under the ai.lock wrlock. */
+static int port_chunk_get(int flow_id)
+{
+        struct port * chunk;
+        int           i;
+
+        if (ai.ports[flow_id / TBL_CHUNK] != null_ports)
+                return 0;
+
+        chunk = malloc(sizeof(*chunk) * TBL_CHUNK);
+        if (chunk == NULL)
+                goto fail_malloc;
+
+        for (i = 0; i < TBL_CHUNK; ++i) {
+                chunk[i].fd    = -1;
+                chunk[i].state = PORT_INIT;
+                if (pthread_mutex_init(&chunk[i].state_lock, NULL))
+                        goto fail_init;
+                if (pthread_cond_init(&chunk[i].state_cond, NULL)) {
+                        pthread_mutex_destroy(&chunk[i].state_lock);
+                        goto fail_init;
+                }
+        }
+
+        __sync_synchronize();
+
+        ai.ports[flow_id / TBL_CHUNK] = chunk;
+
+        return 0;
+
+ fail_init:
+        while (i-- > 0) {
+                pthread_cond_destroy(&chunk[i].state_cond);
+                pthread_mutex_destroy(&chunk[i].state_lock);
+        }
+        free(chunk);
+ fail_malloc:
+        return -ENOMEM;
+}
+
+static void port_chunk_destroy(struct port * chunk)
+{
+        int i;
+
+        for (i = 0; i < TBL_CHUNK; ++i) {
+                pthread_cond_destroy(&chunk[i].state_cond);
+                pthread_mutex_destroy(&chunk[i].state_lock);
+        }
+
+        free(chunk);
+}
+
+/* Call under the ai.lock wrlock. */
+static struct shm_flow_set * peer_set_open(pid_t pid)
+{
+        struct list_head * p;
+        struct peer_set *  ps;
+
+        list_for_each(p, &ai.peers) {
+                ps = list_entry(p, struct peer_set, next);
+                if (ps->pid == pid) {
+                        ++ps->refs;
+                        return ps->set;
+                }
+        }
+
+        ps = malloc(sizeof(*ps));
+        if (ps == NULL)
+                goto fail_malloc;
+
+        ps->set = shm_flow_set_open(pid);
+        if (ps->set == NULL)
+                goto fail_set;
+
+        ps->pid  = pid;
+        ps->refs = 1;
+
+        list_add(&ps->next, &ai.peers);
+
+        return ps->set;
+
+ fail_set:
+        free(ps);
+ fail_malloc:
+        return NULL;
+}
+
+/* Call under the ai.lock wrlock. */
+static void peer_set_close(struct shm_flow_set * set)
+{
+        struct list_head * p;
+        struct list_head * h;
+        struct peer_set *  ps;
+
+        list_for_each_safe(p, h, &ai.peers) {
+                ps = list_entry(p, struct peer_set, next);
+                if (ps->set != set)
+                        continue;
+                if (--ps->refs == 0) {
+                        list_del(&ps->next);
+                        shm_flow_set_close(ps->set);
+                        free(ps);
+                }
+                return;
+        }
+}
+
 static void port_destroy(struct port * p)
 {
         pthread_mutex_lock(&p->state_lock);
@@ -181,7 +394,16 @@ static enum port_state port_wait_assign(int flow_id)
         enum port_state state;
         struct port *   p;
 
-        p = &ai.ports[flow_id];
+        pthread_rwlock_wrlock(&ai.lock);
+
+        if (port_chunk_get(flow_id) < 0) {
+                pthread_rwlock_unlock(&ai.lock);
+                return PORT_NULL;
+        }
+
+        p = &port_at(flow_id);
+
+        pthread_rwlock_unlock(&ai.lock);
 
         pthread_mutex_lock(&p->state_lock);
 
@@ -236,49 +458,216 @@ static int proc_announce(char * prog)
         return ret;
 }
 
-static void flow_clear(int fd)
+static void poll_stat_add(struct flow_poll_stat * stat,
+                          struct timespec *       t0,
+                          struct timespec *       t1,
+                          bool                    hit)
+{
+        struct timespec now;
+
+        if (hit) {
+                __sync_fetch_and_add(&stat->spin_ns, ts_diff_ns(t0, t1));
+                __sync_fetch_and_add(&stat->hits, 1);
+                return;
+        }
+
+        clock_gettime(PTHREAD_COND_CLOCK, &now);
+
+        __sync_fetch_and_add(&stat->spin_ns, ts_diff_ns(t0, t1));
+        __sync_fetch_and_add(&stat->sleep_ns, ts_diff_ns(t1, &now));
+        __sync_fetch_and_add(&stat->sleeps, 1);
+}
+
+/* Spin on the ring for the flow's budget before sleeping on it. */
+static ssize_t flow_read_b(struct flow *           flow,
+                           const struct timespec * abstime)
 {
-        memset(&ai.flows[fd], 0, sizeof(ai.flows[fd]));
+        struct timespec t0;
+        struct timespec t1;
+        uint32_t        us;
+        bool            hit;
+        ssize_t         idx;
+
+        us = flow->poll_us;
+        if (us == 0)
+                return shm_rbuff_read_b(flow->rx_rb, abstime);
+
+        idx = shm_rbuff_read(flow->rx_rb);
+        if (idx != -EAGAIN)
+                return idx;
+
+        clock_gettime(PTHREAD_COND_CLOCK, &t0);
+
+        do {
+                hit = shm_rbuff_ready(flow->rx_rb);
+                clock_gettime(PTHREAD_COND_CLOCK, &t1);
+        } while (!hit && ts_diff_us(&t0, &t1) < us);
+
+        idx = shm_rbuff_read_b(flow->rx_rb, abstime);
+
+        poll_stat_add(&flow->pstat, &t0, &t1, hit);
+
+        return idx;
+}
 
-        ai.flows[fd].flow_id  = -1;
-        ai.flows[fd].pid      = -1;
+static void flow_clear(int fd)
+{
+        flow_reset(&flow_at(fd));
 }
 
 #include "crypt.c"
 
+static void flow_tx_ctrl(struct flow * flow);
+
+/* Drops an idle instance, unless FRCT made it due again meanwhile. */
+static void frct_tmr_idle(struct frcti * frcti)
+{
+        __sync_bool_compare_and_swap(&frcti->due, true, false);
+
+        if (!frcti_idle(frcti) &&
+            __sync_bool_compare_and_swap(&frcti->due, false, true))
+                return;
+
+        list_del(&frcti->next);
+        list_head_init(&frcti->next);
+}
+
+/*
+ * Drives retransmission and sends standalone ACKs. Only flows that
+ * owe an ACK or have PDUs in flight are on the list.
+ */
+static void * frct_tmr(void * o)
+{
+        struct list_head * p;
+        struct list_head * h;
+        struct timespec    now;
+        struct timespec    abs;
+        struct timespec    intv = {0, FRCT_TICK};
+
+        (void) o;
+
+        pthread_mutex_lock(&ai.frct_mtx);
+
+        while (ai.frct_on) {
+                if (list_is_empty(&ai.frctis)) {
+                        pthread_cond_wait(&ai.frct_cond, &ai.frct_mtx);
+                        continue;
+                }
+
+                rxmwheel_move();
+
+                list_for_each_safe(p, h, &ai.frctis) {
+                        struct frcti * frcti;
+                        frcti = list_entry(p, struct frcti, next);
+                        if (frcti_ack_due(frcti))
+                                flow_tx_ctrl(&flow_at(frcti->fd));
+                        else
+                                frct_tmr_idle(frcti);
+                }
+
+                clock_gettime(PTHREAD_COND_CLOCK, &now);
+                ts_add(&now, &intv, &abs);
+
+                pthread_cond_timedwait(&ai.frct_cond, &ai.frct_mtx, &abs);
+        }
+
+        pthread_mutex_unlock(&ai.frct_mtx);
+
+        return (void *) 0;
+}
+
+static int frct_tmr_start(void)
+{
+        pthread_mutex_lock(&ai.frct_mtx);
+
+        if (!ai.frct_on) {
+                ai.frct_on = true;
+                if (pthread_create(&ai.frct_tmr, NULL, frct_tmr, NULL)) {
+                        ai.frct_on = false;
+                        pthread_mutex_unlock(&ai.frct_mtx);
+                        return -1;
+                }
+        }
+
+        pthread_mutex_unlock(&ai.frct_mtx);
+
+        return 0;
+}
+
+/*
+ * FRCT calls this when the instance may owe an ACK or put a PDU in
+ * the wheel. Call without holding the flow lock, the timer takes it.
+ */
+static void frct_tmr_due(struct frcti * frcti)
+{
+        if (!__sync_bool_compare_and_swap(&frcti->due, false, true))
+                return;
+
+        pthread_mutex_lock(&ai.frct_mtx);
+
+        list_add_tail(&frcti->next, &ai.frctis);
+
+        pthread_cond_signal(&ai.frct_cond);
+
+        pthread_mutex_unlock(&ai.frct_mtx);
+}
+
+/* The instance stays marked due, FRCT will not add it again. */
+static void frct_tmr_del(struct frcti * frcti)
+{
+        pthread_mutex_lock(&ai.frct_mtx);
+
+        frcti->due = true;
+
+        list_del(&frcti->next);
+        list_head_init(&frcti->next);
+
+        pthread_mutex_unlock(&ai.frct_mtx);
+}
+
+/* Call under the ai.lock wrlock. */
 static void flow_fini(int fd)
 {
-        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
+        assert(fd >= 0 && fd < PROG_MAX_FLOWS);
 
-        if (ai.flows[fd].flow_id != -1) {
-                port_destroy(&ai.ports[ai.flows[fd].flow_id]);
+        /* Not under the flow lock, the timer takes it. */
+        if (flow_at(fd).frcti != NULL)
+                frct_tmr_del(flow_at(fd).frcti);
+
+        pthread_rwlock_wrlock(&flow_at(fd).lock);
+
+        if (flow_at(fd).flow_id != -1) {
+                port_destroy(&port_at(flow_at(fd).flow_id));
                 bmp_release(ai.fds, fd);
         }
 
-        if (ai.flows[fd].rx_rb != NULL) {
-                shm_rbuff_set_acl(ai.flows[fd].rx_rb, ACL_FLOWDOWN);
-                shm_rbuff_close(ai.flows[fd].rx_rb);
+        /* Before the rbuffs close, the wheel may still retransmit. */
+        if (flow_at(fd).frcti != NULL)
+                frcti_destroy(flow_at(fd).frcti);
+
+        if (flow_at(fd).rx_rb != NULL) {
+                shm_rbuff_set_acl(flow_at(fd).rx_rb, ACL_FLOWDOWN);
+                shm_rbuff_close(flow_at(fd).rx_rb);
         }
 
-        if (ai.flows[fd].tx_rb != NULL) {
-                shm_rbuff_set_acl(ai.flows[fd].tx_rb, ACL_FLOWDOWN);
-                shm_rbuff_close(ai.flows[fd].tx_rb);
+        if (flow_at(fd).tx_rb != NULL) {
+                shm_rbuff_set_acl(flow_at(fd).tx_rb, ACL_FLOWDOWN);
+                shm_rbuff_close(flow_at(fd).tx_rb);
         }
 
-        if (ai.flows[fd].set != NULL) {
-                shm_flow_set_notify(ai.flows[fd].set,
-                                    ai.flows[fd].flow_id,
+        if (flow_at(fd).set != NULL) {
+                shm_flow_set_notify(flow_at(fd).set,
+                                    flow_at(fd).flow_id,
                                     FLOW_DEALLOC);
-                shm_flow_set_close(ai.flows[fd].set);
+                peer_set_close(flow_at(fd).set);
         }
 
-        if (ai.flows[fd].frcti != NULL)
-                frcti_destroy(ai.flows[fd].frcti);
-
-        if (ai.flows[fd].ctx != NULL)
-                crypt_fini(ai.flows[fd].ctx);
+        if (flow_at(fd).ctx != NULL)
+                crypt_fini(flow_at(fd).ctx);
 
         flow_clear(fd);
+
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 }
 
 static int flow_init(int       flow_id,
@@ -291,53 +680,66 @@ static int flow_init(int       flow_id,
 
         pthread_rwlock_wrlock(&ai.lock);
 
+        if (port_chunk_get(flow_id) < 0)
+                goto fail_fds;
+
         fd = bmp_allocate(ai.fds);
         if (!bmp_is_id_valid(ai.fds, fd)) {
                 err = -EBADF;
                 goto fail_fds;
         }
 
-        ai.flows[fd].rx_rb = shm_rbuff_open(ai.pid, flow_id);
-        if (ai.flows[fd].rx_rb == NULL)
+        if (flow_chunk_get(fd) < 0)
+                goto fail_chunk;
+
+        pthread_rwlock_wrlock(&flow_at(fd).lock);
+
+        flow_at(fd).rx_rb = shm_rbuff_open(ai.pid, flow_id);
+        if (flow_at(fd).rx_rb == NULL)
                 goto fail_rx_rb;
 
-        ai.flows[fd].tx_rb = shm_rbuff_open(pid, flow_id);
-        if (ai.flows[fd].tx_rb == NULL)
+        flow_at(fd).tx_rb = shm_rbuff_open(pid, flow_id);
+        if (flow_at(fd).tx_rb == NULL)
                 goto fail_tx_rb;
 
-        ai.flows[fd].set = shm_flow_set_open(pid);
-        if (ai.flows[fd].set == NULL)
+        flow_at(fd).set = peer_set_open(pid);
+        if (flow_at(fd).set == NULL)
                 goto fail_set;
 
-        ai.flows[fd].flow_id  = flow_id;
-        ai.flows[fd].oflags   = FLOWFDEFAULT;
-        ai.flows[fd].pid      = pid;
-        ai.flows[fd].part_idx = NO_PART;
-        ai.flows[fd].qs       = qs;
+        flow_at(fd).flow_id  = flow_id;
+        flow_at(fd).oflags   = FLOWFDEFAULT;
+        flow_at(fd).pid      = pid;
+        flow_at(fd).part_idx = NO_PART;
+        flow_at(fd).qs       = qs;
 
         if (qs.cypher_s > 0) {
                 assert(s != NULL);
-                if (crypt_init(&ai.flows[fd].ctx) < 0)
+                if (crypt_init(&flow_at(fd).ctx) < 0)
                         goto fail_ctx;
 
-                memcpy(ai.flows[fd].key, s, SYMMKEYSZ);
+                memcpy(flow_at(fd).key, s, SYMMKEYSZ);
         }
 
-        ai.ports[flow_id].fd = fd;
+        pthread_rwlock_unlock(&flow_at(fd).lock);
+
+        port_at(flow_id).fd = fd;
 
-        port_set_state(&ai.ports[flow_id], PORT_ID_ASSIGNED);
+        port_set_state(&port_at(flow_id), PORT_ID_ASSIGNED);
 
         pthread_rwlock_unlock(&ai.lock);
 
         return fd;
 
  fail_ctx:
-        shm_flow_set_close(ai.flows[fd].set);
+        peer_set_close(flow_at(fd).set);
  fail_set:
-        shm_rbuff_close(ai.flows[fd].tx_rb);
+        shm_rbuff_close(flow_at(fd).tx_rb);
  fail_tx_rb:
-        shm_rbuff_close(ai.flows[fd].rx_rb);
+        shm_rbuff_close(flow_at(fd).rx_rb);
  fail_rx_rb:
+        flow_clear(fd);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
+ fail_chunk:
         bmp_release(ai.fds, fd);
  fail_fds:
         pthread_rwlock_unlock(&ai.lock);
@@ -358,8 +760,9 @@ static void init(int     argc,
                  char ** argv,
                  char ** envp)
 {
-        const char * prog = argv[0];
-        int          i;
+        const char *       prog = argv[0];
+        int                i;
+        pthread_condattr_t cattr;
 
         (void) argc;
         (void) envp;
@@ -390,16 +793,21 @@ static void init(int     argc,
         if (ai.rdrb == NULL)
                 goto fail_rdrb;
 
-        ai.flows = malloc(sizeof(*ai.flows) * PROG_MAX_FLOWS);
-        if (ai.flows == NULL)
-                goto fail_flows;
+        for (i = 0; i < TBL_CHUNK; ++i) {
+                if (pthread_rwlock_init(&null_flows[i].lock, NULL))
+                        goto fail_null;
+                flow_reset(null_flows + i);
+                null_ports[i].fd    = -1;
+                null_ports[i].state = PORT_INIT;
+        }
+
+        for (i = 0; i < FLOW_CHUNKS; ++i)
+                ai.flows[i] = null_flows;
 
-        for (i = 0; i < PROG_MAX_FLOWS; ++i)
-                flow_clear(i);
+        for (i = 0; i < PORT_CHUNKS; ++i)
+                ai.ports[i] = null_ports;
 
-        ai.ports = malloc(sizeof(*ai.ports) * SYS_MAX_FLOWS);
-        if (ai.ports == NULL)
-                goto fail_ports;
+        list_head_init(&ai.peers);
 
         if (prog != NULL) {
                 ai.prog = strdup(path_strip((char *) prog));
@@ -410,46 +818,50 @@ static void init(int     argc,
                         goto fail_announce;
         }
 
-        for (i = 0; i < SYS_MAX_FLOWS; ++i) {
-                ai.ports[i].state = PORT_INIT;
-                if (pthread_mutex_init(&ai.ports[i].state_lock, NULL)) {
-                        int j;
-                        for (j = 0; j < i; ++j)
-                                pthread_mutex_destroy(&ai.ports[j].state_lock);
-                        goto fail_announce;
-                }
-                if (pthread_cond_init(&ai.ports[i].state_cond, NULL)) {
-                        int j;
-                        for (j = 0; j < i; ++j)
-                                pthread_cond_destroy(&ai.ports[j].state_cond);
-                        goto fail_state_cond;
-                }
-        }
-
         if (pthread_rwlock_init(&ai.lock, NULL))
-                goto fail_lock;
+                goto fail_announce;
 
         ai.fqset = shm_flow_set_open(getpid());
         if (ai.fqset == NULL)
                 goto fail_fqset;
 
+        list_head_init(&ai.frctis);
+
+        if (rxmwheel_init())
+                goto fail_rxmwheel;
+
+        if (pthread_mutex_init(&ai.frct_mtx, NULL))
+                goto fail_frct_mtx;
+
+        if (pthread_condattr_init(&cattr))
+                goto fail_cattr;
+#ifndef __APPLE__
+        pthread_condattr_setclock(&cattr, PTHREAD_COND_CLOCK);
+#endif
+        if (pthread_cond_init(&ai.frct_cond, &cattr))
+                goto fail_frct_cond;
+
+        pthread_condattr_destroy(&cattr);
+
         return;
 
+ fail_frct_cond:
+        pthread_condattr_destroy(&cattr);
+ fail_cattr:
+        pthread_mutex_destroy(&ai.frct_mtx);
+ fail_frct_mtx:
+        rxmwheel_fini();
+ fail_rxmwheel:
+        shm_flow_set_close(ai.fqset);
  fail_fqset:
         pthread_rwlock_destroy(&ai.lock);
- fail_lock:
-        for (i = 0; i < SYS_MAX_FLOWS; ++i)
-                pthread_cond_destroy(&ai.ports[i].state_cond);
- fail_state_cond:
-        for (i = 0; i < SYS_MAX_FLOWS; ++i)
-                pthread_mutex_destroy(&ai.ports[i].state_lock);
  fail_announce:
         free(ai.prog);
  fail_prog:
-        free(ai.ports);
- fail_ports:
-        free(ai.flows);
- fail_flows:
+        i = TBL_CHUNK;
+ fail_null:
+        while (i-- > 0)
+                pthread_rwlock_destroy(&null_flows[i].lock);
         shm_rdrbuff_close(ai.rdrb);
  fail_rdrb:
         bmp_destroy(ai.fqueues);
@@ -472,13 +884,27 @@ static void fini(void)
         if (ai.prog != NULL)
                 free(ai.prog);
 
+        pthread_mutex_lock(&ai.frct_mtx);
+        if (ai.frct_on) {
+                ai.frct_on = false;
+                pthread_cond_signal(&ai.frct_cond);
+                pthread_mutex_unlock(&ai.frct_mtx);
+                pthread_join(ai.frct_tmr, NULL);
+        } else {
+                pthread_mutex_unlock(&ai.frct_mtx);
+        }
+
         pthread_rwlock_wrlock(&ai.lock);
 
         for (i = 0; i < PROG_MAX_FLOWS; ++i) {
-                if (ai.flows[i].flow_id != -1) {
+                if (ai.flows[i / TBL_CHUNK] == null_flows) {
+                        i += TBL_CHUNK - 1;
+                        continue;
+                }
+                if (flow_at(i).flow_id != -1) {
                         ssize_t idx;
-                        shm_rbuff_set_acl(ai.flows[i].rx_rb, ACL_FLOWDOWN);
-                        while ((idx = shm_rbuff_read(ai.flows[i].rx_rb)) >= 0)
+                        shm_rbuff_set_acl(flow_at(i).rx_rb, ACL_FLOWDOWN);
+                        while ((idx = shm_rbuff_read(flow_at(i).rx_rb)) >= 0)
                                 shm_rdrbuff_remove(ai.rdrb, idx);
                         flow_fini(i);
                 }
@@ -486,21 +912,29 @@ static void fini(void)
 
         shm_flow_set_close(ai.fqset);
 
-        for (i = 0; i < SYS_MAX_FLOWS; ++i) {
-                pthread_mutex_destroy(&ai.ports[i].state_lock);
-                pthread_cond_destroy(&ai.ports[i].state_cond);
-        }
+        for (i = 0; i < PORT_CHUNKS; ++i)
+                if (ai.ports[i] != null_ports)
+                        port_chunk_destroy(ai.ports[i]);
 
-        shm_rdrbuff_close(ai.rdrb);
+        for (i = 0; i < FLOW_CHUNKS; ++i)
+                if (ai.flows[i] != null_flows)
+                        flow_chunk_destroy(ai.flows[i]);
 
-        free(ai.flows);
-        free(ai.ports);
+        for (i = 0; i < TBL_CHUNK; ++i)
+                pthread_rwlock_destroy(&null_flows[i].lock);
+
+        shm_rdrbuff_close(ai.rdrb);
 
         bmp_destroy(ai.fds);
         bmp_destroy(ai.fqueues);
 
         pthread_rwlock_unlock(&ai.lock);
 
+        rxmwheel_fini();
+
+        pthread_cond_destroy(&ai.frct_cond);
+        pthread_mutex_destroy(&ai.frct_mtx);
+
         pthread_rwlock_destroy(&ai.lock);
 }
 
@@ -515,8 +949,9 @@ static void fini(void)
 __attribute__((section(INIT_SECTION))) __typeof__(init) * __init = init;
 __attribute__((section(FINI_SECTION))) __typeof__(fini) * __fini = fini;
 
-int flow_accept(qosspec_t *             qs,
-                const struct timespec * timeo)
+int flow_accept_rb(qosspec_t *             qs,
+                   size_t                  rb_size,
+                   const struct timespec * timeo)
 {
         irm_msg_t   msg = IRM_MSG__INIT;
         irm_msg_t * recv_msg;
@@ -533,6 +968,11 @@ int flow_accept(qosspec_t *             qs,
         msg.has_pid = true;
         msg.pid     = ai.pid;
 
+        if (rb_size != 0) {
+                msg.has_rb_size = true;
+                msg.rb_size     = rb_size;
+        }
+
         if (timeo != NULL) {
                 msg.has_timeo_sec = true;
                 msg.has_timeo_nsec = true;
@@ -588,23 +1028,28 @@ int flow_accept(qosspec_t *             qs,
         if (fd < 0)
                 return fd;
 
-        pthread_rwlock_wrlock(&ai.lock);
+        pthread_rwlock_wrlock(&flow_at(fd).lock);
 
-        assert(ai.flows[fd].frcti == NULL);
+        assert(flow_at(fd).frcti == NULL);
 
-        if (ai.flows[fd].qs.in_order != 0) {
-                ai.flows[fd].frcti = frcti_create(fd);
-                if (ai.flows[fd].frcti == NULL) {
-                        pthread_rwlock_unlock(&ai.lock);
+        if (flow_at(fd).qs.in_order != 0) {
+                flow_at(fd).frcti = frcti_create(fd);
+                if (flow_at(fd).frcti == NULL) {
+                        pthread_rwlock_unlock(&flow_at(fd).lock);
                         flow_dealloc(fd);
                         return -ENOMEM;
                 }
         }
 
         if (qs != NULL)
-                *qs = ai.flows[fd].qs;
+                *qs = flow_at(fd).qs;
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
+
+        if (flow_at(fd).frcti != NULL && frct_tmr_start()) {
+                flow_dealloc(fd);
+                return -ENOMEM;
+        }
 
         return fd;
 
@@ -616,8 +1061,15 @@ int flow_accept(qosspec_t *             qs,
         return err;
 }
 
+int flow_accept(qosspec_t *             qs,
+                const struct timespec * timeo)
+{
+        return flow_accept_rb(qs, 0, timeo);
+}
+
 static int __flow_alloc(const char *            dst,
                         qosspec_t *             qs,
+                        size_t                  rb_size,
                         const struct timespec * timeo,
                         bool join)
 {
@@ -644,6 +1096,11 @@ static int __flow_alloc(const char *            dst,
         qs_msg      = spec_to_msg(qs);
         msg.qosspec = &qs_msg;
 
+        if (rb_size != 0) {
+                msg.has_rb_size = true;
+                msg.rb_size     = rb_size;
+        }
+
         if (timeo != NULL) {
                 msg.has_timeo_sec = true;
                 msg.has_timeo_nsec = true;
@@ -703,20 +1160,25 @@ static int __flow_alloc(const char *            dst,
         if (fd < 0)
                 return fd;
 
-        pthread_rwlock_wrlock(&ai.lock);
+        pthread_rwlock_wrlock(&flow_at(fd).lock);
 
-        assert(ai.flows[fd].frcti == NULL);
+        assert(flow_at(fd).frcti == NULL);
 
-        if (ai.flows[fd].qs.in_order != 0) {
-                ai.flows[fd].frcti = frcti_create(fd);
-                if (ai.flows[fd].frcti == NULL) {
-                        pthread_rwlock_unlock(&ai.lock);
+        if (flow_at(fd).qs.in_order != 0) {
+                flow_at(fd).frcti = frcti_create(fd);
+                if (flow_at(fd).frcti == NULL) {
+                        pthread_rwlock_unlock(&flow_at(fd).lock);
                         flow_dealloc(fd);
                         return -ENOMEM;
                 }
         }
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
+
+        if (flow_at(fd).frcti != NULL && frct_tmr_start()) {
+                flow_dealloc(fd);
+                return -ENOMEM;
+        }
 
         return fd;
 
@@ -732,7 +1194,15 @@ int flow_alloc(const char *            dst,
                qosspec_t *             qs,
                const struct timespec * timeo)
 {
-        return __flow_alloc(dst, qs, timeo, false);
+        return __flow_alloc(dst, qs, 0, timeo, false);
+}
+
+int flow_alloc_rb(const char *            dst,
+                  qosspec_t *             qs,
+                  size_t                  rb_size,
+                  const struct timespec * timeo)
+{
+        return __flow_alloc(dst, qs, rb_size, timeo, false);
 }
 
 int flow_join(const char *            dst,
@@ -742,7 +1212,7 @@ int flow_join(const char *            dst,
         if (qs != NULL && qs->cypher_s != 0)
                 return -ECRYPT;
 
-        return __flow_alloc(dst, qs, timeo, true);
+        return __flow_alloc(dst, qs, 0, timeo, true);
 }
 
 int flow_dealloc(int fd)
@@ -750,7 +1220,7 @@ int flow_dealloc(int fd)
         irm_msg_t   msg = IRM_MSG__INIT;
         irm_msg_t * recv_msg;
 
-        if (fd < 0 || fd >= SYS_MAX_FLOWS )
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
                 return -EINVAL;
 
         msg.code         = IRM_MSG_CODE__IRM_FLOW_DEALLOC;
@@ -758,16 +1228,16 @@ int flow_dealloc(int fd)
         msg.has_pid      = true;
         msg.pid          = ai.pid;
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        if (ai.flows[fd].flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+        if (flow_at(fd).flow_id < 0) {
+                pthread_rwlock_unlock(&flow_at(fd).lock);
                 return -ENOTALLOC;
         }
 
-        msg.flow_id = ai.flows[fd].flow_id;
+        msg.flow_id = flow_at(fd).flow_id;
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 
         recv_msg = send_recv_irm_msg(&msg);
         if (recv_msg == NULL)
@@ -793,27 +1263,31 @@ int fccntl(int fd,
            int cmd,
            ...)
 {
-        uint32_t *        fflags;
-        uint16_t *        cflags;
-        va_list           l;
-        struct timespec * timeo;
-        qosspec_t *       qs;
-        uint32_t          rx_acl;
-        uint32_t          tx_acl;
-        size_t *          qlen;
-        struct flow *     flow;
-
-        if (fd < 0 || fd >= SYS_MAX_FLOWS)
+        uint32_t *              fflags;
+        uint16_t *              cflags;
+        va_list                 l;
+        struct timespec *       timeo;
+        qosspec_t *             qs;
+        uint32_t                rx_acl;
+        uint32_t                tx_acl;
+        size_t *                qlen;
+        uint32_t *              poll;
+        struct flow_poll_stat * pstat;
+        struct frct_cc          cc;
+        int *                   algo;
+        struct flow *           flow;
+
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
                 return -EBADF;
 
-        flow = &ai.flows[fd];
+        flow = &flow_at(fd);
 
         va_start(l, cmd);
 
-        pthread_rwlock_wrlock(&ai.lock);
+        pthread_rwlock_wrlock(&flow->lock);
 
         if (flow->flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+                pthread_rwlock_unlock(&flow->lock);
                 va_end(l);
                 return -ENOTALLOC;
         }
@@ -867,6 +1341,25 @@ int fccntl(int fd,
                 qlen  = va_arg(l, size_t *);
                 *qlen = shm_rbuff_queued(flow->tx_rb);
                 break;
+        case FLOWGRXQSIZE:
+                qlen  = va_arg(l, size_t *);
+                *qlen = shm_rbuff_size(flow->rx_rb);
+                break;
+        case FLOWSPOLL:
+                flow->poll_us = va_arg(l, uint32_t);
+                break;
+        case FLOWGPOLL:
+                poll = va_arg(l, uint32_t *);
+                if (poll == NULL)
+                        goto einval;
+                *poll = flow->poll_us;
+                break;
+        case FLOWGPOLLSTAT:
+                pstat = va_arg(l, struct flow_poll_stat *);
+                if (pstat == NULL)
+                        goto einval;
+                *pstat = flow->pstat;
+                break;
         case FLOWSFLAGS:
                 flow->oflags = va_arg(l, uint32_t);
                 rx_acl = shm_rbuff_get_acl(flow->rx_rb);
@@ -912,249 +1405,1122 @@ int fccntl(int fd,
                         goto eperm;
                 *cflags = frcti_getconf(flow->frcti);
                 break;
+        case FRCTSCC:
+                if (flow->frcti == NULL)
+                        goto eperm;
+                switch (frcti_setcc(flow->frcti, va_arg(l, int))) {
+                case 0:
+                        break;
+                case -EPERM:
+                        goto eperm;
+                default:
+                        goto einval;
+                }
+                break;
+        case FRCTGCC:
+                algo = va_arg(l, int *);
+                if (algo == NULL)
+                        goto einval;
+                if (flow->frcti == NULL)
+                        goto eperm;
+                frcti_getcc(flow->frcti, &cc);
+                *algo = cc.algo;
+                break;
+        case FRCTGCWND:
+                qlen = va_arg(l, size_t *);
+                if (qlen == NULL)
+                        goto einval;
+                if (flow->frcti == NULL)
+                        goto eperm;
+                frcti_getcc(flow->frcti, &cc);
+                *qlen = cc.cwnd;
+                break;
+        case FRCTGSSTHRESH:
+                qlen = va_arg(l, size_t *);
+                if (qlen == NULL)
+                        goto einval;
+                if (flow->frcti == NULL)
+                        goto eperm;
+                frcti_getcc(flow->frcti, &cc);
+                *qlen = cc.ssthresh;
+                break;
         default:
-                pthread_rwlock_unlock(&ai.lock);
+                pthread_rwlock_unlock(&flow->lock);
                 va_end(l);
                 return -ENOTSUP;
 
         };
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow->lock);
 
         va_end(l);
 
         return 0;
 
  einval:
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow->lock);
         va_end(l);
         return -EINVAL;
  eperm:
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow->lock);
         va_end(l);
         return -EPERM;
 }
 
-static int chk_crc(struct shm_du_buff * sdb)
+/* CRC over all blocks of a chain. */
+static uint32_t sdb_crc(struct shm_du_buff * sdb)
 {
-        uint32_t crc;
-        uint8_t * head = shm_du_buff_head(sdb);
-        uint8_t * tail = shm_du_buff_tail_release(sdb, CRCLEN);
+        uint32_t crc = 0;
+        uint8_t * head;
 
-        mem_hash(HASH_CRC32, &crc, head, tail - head);
+        for (; sdb != NULL; sdb = shm_du_buff_next(sdb)) {
+                head = shm_du_buff_head(sdb);
+                crc32(&crc, head, shm_du_buff_tail(sdb) - head);
+        }
 
-        return !(crc == *((uint32_t *) tail));
+        return crc;
 }
 
-static int add_crc(struct shm_du_buff * sdb)
+static int chk_crc(struct shm_du_buff * sdb)
 {
-        uint8_t * head = shm_du_buff_head(sdb);
-        uint8_t * tail = shm_du_buff_tail_alloc(sdb, CRCLEN);
+        uint32_t crc;
+        size_t   len = shm_du_buff_len(sdb);
+
+        if (len < CRCLEN)
+                return -1;
+
+        /* The CRC can straddle two blocks of a chain. */
+        shm_du_buff_gather(sdb, len - CRCLEN, &crc, CRCLEN);
+        shm_du_buff_tail_release(sdb, CRCLEN);
+
+        return !(crc == sdb_crc(sdb));
+}
+
+static int add_crc(struct shm_du_buff * sdb)
+{
+        uint32_t  crc  = sdb_crc(sdb);
+        uint8_t * tail = shm_du_buff_tail_alloc(sdb, CRCLEN);
         if (tail == NULL)
                 return -1;
 
-        mem_hash(HASH_CRC32, tail, head, tail - head);
+        memcpy(tail, &crc, CRCLEN);
+
+        return 0;
+}
+
+/* Reads the send flags and timeout of an allocated flow. */
+static int flow_snd_opts(struct flow *      flow,
+                         int *              flags,
+                         struct timespec *  abs,
+                         struct timespec ** abstime)
+{
+        clock_gettime(PTHREAD_COND_CLOCK, abs);
+
+        *abstime = NULL;
+
+        pthread_rwlock_rdlock(&flow->lock);
+
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&flow->lock);
+                return -ENOTALLOC;
+        }
+
+        if (flow->snd_timesout) {
+                ts_add(abs, &flow->snd_timeo, abs);
+                *abstime = abs;
+        }
+
+        *flags = flow->oflags;
+
+        pthread_rwlock_unlock(&flow->lock);
+
+        if ((*flags & FLOWFACCMODE) == FLOWFRDONLY)
+                return -EPERM;
 
         return 0;
 }
 
+static ssize_t flow_tx_alloc(int                     flags,
+                             size_t                  count,
+                             struct shm_du_buff **   sdb,
+                             const struct timespec * abstime)
+{
+        /* TODO: partial writes. */
+        if (flags & FLOWFWNOBLOCK)
+                return shm_rdrbuff_alloc(ai.rdrb, count, NULL, sdb);
+
+        return shm_rdrbuff_alloc_b(ai.rdrb, count, NULL, sdb, abstime);
+}
+
+static ssize_t flow_tx_alloc_n(int                     flags,
+                               size_t                  count,
+                               struct shm_du_buff **   sdbs,
+                               size_t                  n,
+                               const struct timespec * abstime)
+{
+        ssize_t idx;
+        size_t  i;
+
+        if (!(flags & FLOWFWNOBLOCK))
+                return shm_rdrbuff_alloc_n(ai.rdrb, count, sdbs, n, abstime);
+
+        for (i = 0; i < n; ++i) {
+                idx = shm_rdrbuff_alloc(ai.rdrb, count, NULL, sdbs + i);
+                if (idx < 0)
+                        return i > 0 ? (ssize_t) i : idx;
+        }
+
+        return (ssize_t) i;
+}
+
+/* Sends a finished packet, the block is gone on error. */
+static int flow_tx_write(struct flow *           flow,
+                         int                     flags,
+                         ssize_t                 idx,
+                         const struct timespec * abstime)
+{
+        int ret;
+
+        pthread_rwlock_rdlock(&flow->lock);
+
+        if (flags & FLOWFWNOBLOCK)
+                ret = shm_rbuff_write(flow->tx_rb, idx);
+        else
+                ret = shm_rbuff_write_b(flow->tx_rb, idx, abstime);
+
+        if (ret < 0)
+                shm_rdrbuff_remove(ai.rdrb, idx);
+        else
+                shm_flow_set_notify(flow->set, flow->flow_id, FLOW_PKT);
+
+        pthread_rwlock_unlock(&flow->lock);
+
+        return ret;
+}
+
+/* Applies crypt and CRC, the block is gone on error. */
+static int flow_tx_seal(struct flow *        flow,
+                        ssize_t              idx,
+                        struct shm_du_buff * sdb)
+{
+        int ret;
+
+        if (flow->qs.cypher_s > 0) {
+                /* The cipher context is per flow, not per thread. */
+                pthread_rwlock_wrlock(&flow->lock);
+                ret = crypt_encrypt(flow, sdb);
+                pthread_rwlock_unlock(&flow->lock);
+                if (ret < 0) {
+                        shm_rdrbuff_remove(ai.rdrb, idx);
+                        return -ENOMEM;
+                }
+        }
+
+        if (flow->qs.ber == 0 && add_crc(sdb) != 0) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/* Applies crypt and CRC and sends, the block is gone on error. */
+static int flow_tx_pdu(struct flow *           flow,
+                       int                     flags,
+                       ssize_t                 idx,
+                       struct shm_du_buff *    sdb,
+                       const struct timespec * abstime)
+{
+        int ret;
+
+        ret = flow_tx_seal(flow, idx, sdb);
+        if (ret < 0)
+                return ret;
+
+        return flow_tx_write(flow, flags, idx, abstime);
+}
+
+/* Sends an FRCT PDU without data, carrying the ACK and window. */
+static void flow_tx_ctrl(struct flow * flow)
+{
+        struct shm_du_buff * sdb;
+        ssize_t              idx;
+
+        idx = shm_rdrbuff_alloc(ai.rdrb, 0, NULL, &sdb);
+        if (idx < 0)
+                return;
+
+        if (frcti_snd_ctrl(flow->frcti, sdb) < 0) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return;
+        }
+
+        flow_tx_pdu(flow, FLOWFWNOBLOCK, idx, sdb, NULL);
+}
+
+/* Sends a standalone ACK if one is due after reading. */
+static void flow_rx_ack(struct flow * flow)
+{
+        if (frcti_ack_due(flow->frcti))
+                flow_tx_ctrl(flow);
+}
+
+/* Checks the CRC and decrypts, the block is gone on error. */
+static int flow_rx_chk(struct flow *        flow,
+                       struct shm_du_buff * sdb)
+{
+        int ret;
+
+        if (flow->qs.ber == 0 && chk_crc(sdb) != 0) {
+                ipcp_sdb_release(sdb);
+                return -EAGAIN;
+        }
+
+        if (flow->qs.cypher_s > 0) {
+                pthread_rwlock_wrlock(&flow->lock);
+                ret = crypt_decrypt(flow, sdb);
+                pthread_rwlock_unlock(&flow->lock);
+                if (ret < 0) {
+                        ipcp_sdb_release(sdb);
+                        return -ENOMEM;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Takes one packet off the rx_rb for FRCT, data is held for the
+ * application. A reader blocked on the rx_rb meanwhile is not woken
+ * for a held packet, fqueue events do see it.
+ */
+static void flow_rx_hold(struct flow *           flow,
+                         const struct timespec * abstime)
+{
+        struct shm_du_buff * sdb;
+        ssize_t              idx;
+
+        __sync_fetch_and_add(&flow->readers, 1);
+
+        idx = shm_rbuff_read_b(flow->rx_rb, abstime);
+        if (idx >= 0) {
+                sdb = shm_rdrbuff_get(ai.rdrb, idx);
+                if (flow_rx_chk(flow, sdb) == 0)
+                        frcti_hold(flow->frcti, sdb);
+        }
+
+        __sync_fetch_and_sub(&flow->readers, 1);
+}
+
+/*
+ * Waits for the receiver to open the FRCT window. Window updates come
+ * in on the rx_rb, so a writer that does not read takes them itself.
+ */
+static int flow_wnd_wait(struct flow *           flow,
+                         int                     flags,
+                         const struct timespec * abstime)
+{
+        struct timespec abs;
+        struct timespec intv = {0, WND_POLL};
+
+        while (!frcti_snd_open(flow->frcti)) {
+                if (flags & FLOWFWNOBLOCK)
+                        return -EAGAIN;
+
+                clock_gettime(PTHREAD_COND_CLOCK, &abs);
+
+                if (abstime != NULL && ts_diff_ns(abstime, &abs) >= 0)
+                        return -ETIMEDOUT;
+
+                ts_add(&abs, &intv, &abs);
+
+                if (abstime != NULL && ts_diff_ns(abstime, &abs) > 0)
+                        abs = *abstime;
+
+                if (__sync_fetch_and_add(&flow->readers, 0) > 0)
+                        frcti_wnd_wait(flow->frcti, &abs);
+                else
+                        flow_rx_hold(flow, &abs);
+        }
+
+        return 0;
+}
+
+/*
+ * Adds the FRCT header. Other writers can take the window between
+ * flow_wnd_wait and here, a blocking writer then waits again.
+ */
+static int flow_snd_hdr(struct flow *           flow,
+                        int                     flags,
+                        struct shm_du_buff *    sdb,
+                        uint32_t *              seqno,
+                        const struct timespec * abstime)
+{
+        int ret;
+
+        while ((ret = frcti_snd_hdr(flow->frcti, sdb, seqno)) == -EAGAIN) {
+                ret = flow_wnd_wait(flow, flags, abstime);
+                if (ret < 0)
+                        break;
+        }
+
+        return ret;
+}
+
+/*
+ * Applies FRCT, crypt and CRC and sends, the block is gone on error.
+ * The wheel keeps the sealed PDU, so a retransmission carries the CRC.
+ */
+static int flow_tx(struct flow *           flow,
+                   int                     flags,
+                   ssize_t                 idx,
+                   struct shm_du_buff *    sdb,
+                   const struct timespec * abstime)
+{
+        uint32_t seqno = 0;
+        int      ret;
+
+        ret = flow_snd_hdr(flow, flags, sdb, &seqno, abstime);
+        if (ret < 0) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return ret;
+        }
+
+        ret = flow_tx_seal(flow, idx, sdb);
+        if (ret < 0)
+                return ret;
+
+        frcti_rxm(flow->frcti, seqno, sdb);
+
+        ret = flow_tx_write(flow, flags, idx, abstime);
+        if (ret < 0)
+                frcti_rxm_del(flow->frcti, seqno);
+
+        return ret;
+}
+
+/* Total length of an iovec array, -EINVAL if it is not valid. */
+static ssize_t iov_len(const struct iovec * iov,
+                       int                  iovcnt)
+{
+        size_t len = 0;
+        int    i;
+
+        if ((iov == NULL && iovcnt > 0) || iovcnt < 0 || iovcnt > IOV_MAX)
+                return -EINVAL;
+
+        for (i = 0; i < iovcnt; ++i) {
+                if (iov[i].iov_len > SSIZE_MAX - len)
+                        return -EINVAL;
+                len += iov[i].iov_len;
+        }
+
+        return (ssize_t) len;
+}
+
+/*
+ * Copies the iovecs into the packet after its first off bytes. With a
+ * crc, the CRC over the whole packet is computed in the same pass.
+ */
+static void sdb_writev(struct shm_du_buff * sdb,
+                       size_t               off,
+                       const struct iovec * iov,
+                       int                  iovcnt,
+                       uint32_t *           crc)
+{
+        const uint8_t * src  = NULL;
+        size_t          left = 0;
+        uint8_t *       dst;
+        size_t          room;
+        size_t          n;
+        int             i    = 0;
+
+        for (; sdb != NULL; sdb = shm_du_buff_next(sdb)) {
+                dst  = shm_du_buff_head(sdb);
+                room = shm_du_buff_tail(sdb) - dst;
+
+                n = MIN(off, room);
+                if (crc != NULL)
+                        crc32(crc, dst, n);
+
+                dst  += n;
+                room -= n;
+                off  -= n;
+
+                while (room > 0) {
+                        if (left == 0) {
+                                if (i == iovcnt)
+                                        return;
+                                src  = iov[i].iov_base;
+                                left = iov[i++].iov_len;
+                                continue;
+                        }
+
+                        n = MIN(room, left);
+                        if (crc != NULL)
+                                crc32_copy(crc, dst, src, n);
+                        else
+                                memcpy(dst, src, n);
+
+                        dst  += n;
+                        src  += n;
+                        room -= n;
+                        left -= n;
+                }
+        }
+}
+
+/*
+ * Without encryption the packet is final once FRCT added its header,
+ * so that goes first and the CRC is taken while copying the data.
+ * Retransmission is scheduled only once the data is in place.
+ */
+ssize_t flow_writev(int                  fd,
+                    const struct iovec * iov,
+                    int                  iovcnt)
+{
+        struct flow *        flow;
+        ssize_t              idx;
+        ssize_t              count;
+        int                  ret;
+        int                  flags;
+        struct timespec      abs;
+        struct timespec *    abstime;
+        struct shm_du_buff * sdb;
+        uint32_t             crc = 0;
+        uint32_t             seqno = 0;
+        uint8_t *            tail;
+
+        count = iov_len(iov, iovcnt);
+        if (count < 0)
+                return count;
+
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
+                return -EBADF;
+
+        flow = &flow_at(fd);
+
+        ret = flow_snd_opts(flow, &flags, &abs, &abstime);
+        if (ret < 0)
+                return ret;
+
+        ret = flow_wnd_wait(flow, flags, abstime);
+        if (ret < 0)
+                return ret;
+
+        idx = flow_tx_alloc(flags, count, &sdb, abstime);
+        if (idx < 0)
+                return idx;
+
+        if (flow->qs.cypher_s > 0 || flow->qs.ber != 0) {
+                sdb_writev(sdb, 0, iov, iovcnt, NULL);
+                ret = flow_tx(flow, flags, idx, sdb, abstime);
+                return ret < 0 ? (ssize_t) ret : count;
+        }
+
+        ret = flow_snd_hdr(flow, flags, sdb, &seqno, abstime);
+        if (ret < 0) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return ret;
+        }
+
+        sdb_writev(sdb, shm_du_buff_len(sdb) - count, iov, iovcnt, &crc);
+
+        tail = shm_du_buff_tail_alloc(sdb, CRCLEN);
+        if (tail == NULL) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return -ENOMEM;
+        }
+
+        memcpy(tail, &crc, CRCLEN);
+
+        frcti_rxm(flow->frcti, seqno, sdb);
+
+        ret = flow_tx_write(flow, flags, idx, abstime);
+        if (ret < 0)
+                frcti_rxm_del(flow->frcti, seqno);
+
+        return ret < 0 ? (ssize_t) ret : count;
+}
+
 ssize_t flow_write(int          fd,
                    const void * buf,
                    size_t       count)
+{
+        struct iovec iov;
+
+        if (buf == NULL)
+                return 0;
+
+        iov.iov_base = (void *) buf;
+        iov.iov_len  = count;
+
+        return flow_writev(fd, &iov, 1);
+}
+
+/*
+ * Takes the locks, the time and the blocks once for the batch and
+ * notifies the reader once. Sends the messages in order up to the
+ * first that fails.
+ */
+ssize_t flow_write_batch(int                     fd,
+                         const struct flow_msg * msgs,
+                         size_t                  n)
+{
+        struct flow *        flow;
+        struct shm_du_buff * sdbs[BATCHSZ];
+        size_t               idx[BATCHSZ];
+        uint32_t             seqno[BATCHSZ];
+        struct timespec      abs;
+        struct timespec *    abstime;
+        size_t               len = 0;
+        size_t               m;
+        size_t               k;
+        size_t               i;
+        ssize_t              ret;
+        ssize_t              done = 0;
+        int                  flags;
+
+        if (msgs == NULL)
+                return -EINVAL;
+
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
+                return -EBADF;
+
+        if (n == 0)
+                return 0;
+
+        if (n > BATCHSZ)
+                n = BATCHSZ;
+
+        flow = &flow_at(fd);
+
+        ret = flow_snd_opts(flow, &flags, &abs, &abstime);
+        if (ret < 0)
+                return ret;
+
+        ret = flow_wnd_wait(flow, flags, abstime);
+        if (ret < 0)
+                return ret;
+
+        for (i = 0; i < n; ++i)
+                len = MAX(len, msgs[i].len);
+
+        ret = flow_tx_alloc_n(flags, len, sdbs, n, abstime);
+        if (ret < 0)
+                return ret;
+
+        m = (size_t) ret;
+
+        for (i = 0; i < m; ++i) {
+                idx[i] = shm_du_buff_get_idx(sdbs[i]);
+                shm_du_buff_truncate(sdbs[i], msgs[i].len);
+                shm_du_buff_scatter(sdbs[i], 0, msgs[i].buf, msgs[i].len);
+        }
+
+        /* The first PDU waits, the batch stops where the window closes. */
+        for (k = 0; k < m; ++k) {
+                if (k == 0)
+                        ret = flow_snd_hdr(flow, flags, sdbs[k], seqno + k,
+                                           abstime);
+                else
+                        ret = frcti_snd_hdr(flow->frcti, sdbs[k], seqno + k);
+                if (ret < 0)
+                        break;
+        }
+
+        if (k == 0) {
+                shm_rdrbuff_remove_n(ai.rdrb, idx, m);
+                return ret;
+        }
+
+        if (flow->qs.cypher_s > 0) {
+                pthread_rwlock_wrlock(&flow->lock);
+                for (i = 0; i < k; ++i)
+                        if (crypt_encrypt(flow, sdbs[i]) < 0)
+                                break;
+                pthread_rwlock_unlock(&flow->lock);
+                k = i;
+        }
+
+        if (flow->qs.ber == 0) {
+                for (i = 0; i < k; ++i)
+                        if (add_crc(sdbs[i]) != 0)
+                                break;
+                k = i;
+        }
+
+        /* Only sealed PDUs, before the reader can release them. */
+        for (i = 0; i < k; ++i)
+                frcti_rxm(flow->frcti, seqno[i], sdbs[i]);
+
+        ret = -ENOMEM;
+
+        pthread_rwlock_rdlock(&flow->lock);
+
+        while (done < (ssize_t) k) {
+                ret = shm_rbuff_write_n(flow->tx_rb, idx + done, k - done);
+                if (ret == -EAGAIN && !(flags & FLOWFWNOBLOCK)) {
+                        ret = shm_rbuff_write_b(flow->tx_rb, idx[done],
+                                                abstime);
+                        if (ret == 0)
+                                ret = 1;
+                }
+                if (ret < 0)
+                        break;
+                done += ret;
+        }
+
+        if (done > 0)
+                shm_flow_set_notify_n(flow->set, flow->flow_id, FLOW_PKT,
+                                      done);
+
+        pthread_rwlock_unlock(&flow->lock);
+
+        if ((size_t) done < m)
+                shm_rdrbuff_remove_n(ai.rdrb, idx + done, m - done);
+
+        for (i = (size_t) done; i < k; ++i)
+                frcti_rxm_del(flow->frcti, seqno[i]);
+
+        return done > 0 ? done : ret;
+}
+
+ssize_t flow_write_loan(int     fd,
+                        size_t  count,
+                        void ** buf)
 {
         struct flow *        flow;
         ssize_t              idx;
         int                  ret;
         int                  flags;
         struct timespec      abs;
-        struct timespec *    abstime = NULL;
+        struct timespec *    abstime;
         struct shm_du_buff * sdb;
-        uint8_t *            ptr;
 
         if (buf == NULL)
-                return 0;
+                return -EINVAL;
 
-        if (fd < 0 || fd > PROG_MAX_FLOWS)
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
                 return -EBADF;
 
-        flow = &ai.flows[fd];
+        flow = &flow_at(fd);
+
+        ret = flow_snd_opts(flow, &flags, &abs, &abstime);
+        if (ret < 0)
+                return ret;
+
+        idx = flow_tx_alloc(flags, count, &sdb, abstime);
+        if (idx < 0)
+                return idx;
+
+        /* A loan is contiguous, chained packets need flow_write. */
+        if (shm_du_buff_next(sdb) != NULL) {
+                shm_rdrbuff_remove(ai.rdrb, idx);
+                return -EMSGSIZE;
+        }
+
+        *buf = shm_du_buff_head(sdb);
+
+        return idx;
+}
+
+ssize_t flow_write_commit(int     fd,
+                          ssize_t id,
+                          size_t  count)
+{
+        struct flow *        flow;
+        int                  ret;
+        int                  flags;
+        struct timespec      abs;
+        struct timespec *    abstime;
+        struct shm_du_buff * sdb;
+
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
+                return -EBADF;
+
+        if (id < 0)
+                return -EINVAL;
+
+        flow = &flow_at(fd);
+
+        sdb = shm_rdrbuff_get(ai.rdrb, id);
+        if (sdb == NULL)
+                return -EINVAL;
+
+        if (count > shm_du_buff_len(sdb))
+                return -EINVAL;
+
+        ret = flow_snd_opts(flow, &flags, &abs, &abstime);
+        if (ret < 0) {
+                shm_rdrbuff_remove(ai.rdrb, id);
+                return ret;
+        }
+
+        ret = flow_wnd_wait(flow, flags, abstime);
+        if (ret < 0) {
+                shm_rdrbuff_remove(ai.rdrb, id);
+                return ret;
+        }
+
+        shm_du_buff_truncate(sdb, count);
+
+        ret = flow_tx(flow, flags, id, sdb, abstime);
+
+        return ret < 0 ? (ssize_t) ret : (ssize_t) count;
+}
+
+int flow_write_cancel(int     fd,
+                      ssize_t id)
+{
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
+                return -EBADF;
+
+        if (id < 0)
+                return -EINVAL;
+
+        return shm_rdrbuff_remove(ai.rdrb, id);
+}
+
+/* Next packet of the flow, after CRC, crypt and FRCT. */
+static ssize_t flow_rx(struct flow *           flow,
+                       bool                    noblock,
+                       const struct timespec * abstime)
+{
+        struct shm_du_buff * sdb;
+        ssize_t              idx;
+        int                  ret;
+
+        idx = frcti_queued_pdu(flow->frcti);
+        if (idx >= 0) {
+                flow_rx_ack(flow);
+                return idx;
+        }
+
+        __sync_fetch_and_add(&flow->readers, 1);
+
+        do {
+                idx = noblock ? shm_rbuff_read(flow->rx_rb) :
+                        flow_read_b(flow, abstime);
+                if (idx < 0)
+                        break;
+
+                sdb = shm_rdrbuff_get(ai.rdrb, idx);
+                ret = flow_rx_chk(flow, sdb);
+                if (ret == 0) {
+                        ret = frcti_rcv(flow->frcti, sdb);
+                        flow_rx_ack(flow);
+                }
+        } while (ret == -EAGAIN);
+
+        __sync_fetch_and_sub(&flow->readers, 1);
+
+        if (idx < 0)
+                return idx;
+
+        return ret < 0 ? ret : idx;
+}
+
+/* Copies up to len bytes from the packet into the iovecs. */
+static void sdb_readv(struct shm_du_buff * sdb,
+                      const struct iovec * iov,
+                      int                  iovcnt,
+                      size_t               len)
+{
+        size_t off = 0;
+        size_t n;
+        int    i;
+
+        for (i = 0; i < iovcnt && off < len; ++i) {
+                n = MIN(iov[i].iov_len, len - off);
+                shm_du_buff_gather(sdb, off, iov[i].iov_base, n);
+                off += n;
+        }
+}
+
+ssize_t flow_readv(int                  fd,
+                   const struct iovec * iov,
+                   int                  iovcnt)
+{
+        ssize_t              idx;
+        ssize_t              n;
+        ssize_t              count;
+        struct shm_du_buff * sdb;
+        struct timespec      abs;
+        struct timespec *    abstime = NULL;
+        struct flow *        flow;
+        bool                 noblock;
+        bool                 partrd;
+
+        count = iov_len(iov, iovcnt);
+        if (count < 0)
+                return count;
+
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
+                return -EBADF;
+
+        flow = &flow_at(fd);
 
         clock_gettime(PTHREAD_COND_CLOCK, &abs);
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow->lock);
+
+        if (flow->part_idx == DONE_PART) {
+                pthread_rwlock_unlock(&flow->lock);
+                flow->part_idx = NO_PART;
+                return 0;
+        }
 
         if (flow->flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+                pthread_rwlock_unlock(&flow->lock);
                 return -ENOTALLOC;
         }
 
-        if (ai.flows[fd].snd_timesout) {
-                ts_add(&abs, &flow->snd_timeo, &abs);
+        noblock = flow->oflags & FLOWFRNOBLOCK;
+        partrd = !(flow->oflags & FLOWFRNOPART);
+
+        if (flow_at(fd).rcv_timesout) {
+                ts_add(&abs, &flow->rcv_timeo, &abs);
                 abstime = &abs;
         }
 
-        flags = flow->oflags;
+        pthread_rwlock_unlock(&flow->lock);
+
+        idx = flow->part_idx;
+        if (idx < 0) {
+                idx = flow_rx(flow, noblock, abstime);
+                if (idx < 0)
+                        return idx;
+        }
+
+        sdb = shm_rdrbuff_get(ai.rdrb, idx);
+        if (sdb == NULL)
+                return -ENOMEM;
+
+        n = shm_du_buff_len(sdb);
+
+        if (n <= count) {
+                sdb_readv(sdb, iov, iovcnt, n);
+                shm_rdrbuff_remove(ai.rdrb, idx);
+
+                pthread_rwlock_wrlock(&flow->lock);
+
+                flow->part_idx = (partrd && n == count) ?
+                        DONE_PART : NO_PART;
+
+                pthread_rwlock_unlock(&flow->lock);
+                return n;
+        } else {
+                if (partrd) {
+                        sdb_readv(sdb, iov, iovcnt, count);
+                        shm_du_buff_head_release(sdb, count);
+                        flow->part_idx = idx;
+                        return count;
+                } else {
+                        shm_rdrbuff_remove(ai.rdrb, idx);
+                        return -EMSGSIZE;
+                }
+        }
+}
+
+ssize_t flow_read(int    fd,
+                  void * buf,
+                  size_t count)
+{
+        struct iovec iov;
+
+        iov.iov_base = buf;
+        iov.iov_len  = count;
+
+        return flow_readv(fd, &iov, 1);
+}
+
+/*
+ * Waits for the first message as flow_read does, then takes what is
+ * queued. A message that does not fit its buffer is truncated, its
+ * len is set to the full length.
+ */
+ssize_t flow_read_batch(int               fd,
+                        struct flow_msg * msgs,
+                        size_t            n)
+{
+        ssize_t              idx[BATCHSZ];
+        size_t               rm[BATCHSZ];
+        struct shm_du_buff * sdb;
+        struct timespec      abs;
+        struct timespec *    abstime = NULL;
+        struct flow *        flow;
+        bool                 noblock;
+        ssize_t              ret;
+        size_t               m;
+        size_t               i;
+        size_t               j;
+        size_t               len;
+
+        if (msgs == NULL)
+                return -EINVAL;
+
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
+                return -EBADF;
+
+        if (n == 0)
+                return 0;
+
+        if (n > BATCHSZ)
+                n = BATCHSZ;
+
+        flow = &flow_at(fd);
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+
+        pthread_rwlock_rdlock(&flow->lock);
+
+        if (flow->flow_id < 0) {
+                pthread_rwlock_unlock(&flow->lock);
+                return -ENOTALLOC;
+        }
+
+        /* Finish a partial read first. */
+        if (flow->part_idx != NO_PART) {
+                pthread_rwlock_unlock(&flow->lock);
+                ret = flow_read(fd, msgs[0].buf, msgs[0].len);
+                if (ret < 0)
+                        return ret;
+                msgs[0].len = ret;
+                return 1;
+        }
 
-        pthread_rwlock_unlock(&ai.lock);
+        noblock = flow->oflags & FLOWFRNOBLOCK;
 
-        if ((flags & FLOWFACCMODE) == FLOWFRDONLY)
-                return -EPERM;
+        if (flow->rcv_timesout) {
+                ts_add(&abs, &flow->rcv_timeo, &abs);
+                abstime = &abs;
+        }
 
-        /* TODO: partial writes. */
-        if (flags & FLOWFWNOBLOCK)
-                idx = shm_rdrbuff_alloc(ai.rdrb,
-                                        count,
-                                        &ptr,
-                                        &sdb);
-        else  /* Blocking. */
-                idx = shm_rdrbuff_alloc_b(ai.rdrb,
-                                          count,
-                                          &ptr,
-                                          &sdb,
-                                          abstime);
-        if (idx < 0)
-                return idx;
+        pthread_rwlock_unlock(&flow->lock);
 
-        memcpy(ptr, buf, count);
+        idx[0] = flow_rx(flow, noblock, abstime);
+        if (idx[0] < 0)
+                return idx[0];
 
-        if (frcti_snd(flow->frcti, sdb) < 0) {
-                shm_rdrbuff_remove(ai.rdrb, idx);
-                return -ENOMEM;
-        }
+        m = 1;
 
-        pthread_rwlock_wrlock(&ai.lock);
-        if (flow->qs.cypher_s > 0)
-                if (crypt_encrypt(flow, sdb) < 0) {
-                        pthread_rwlock_unlock(&ai.lock);
-                        shm_rdrbuff_remove(ai.rdrb, idx);
-                        return -ENOMEM;
+        /* FRCT may queue PDUs, so take those one at a time. */
+        if (flow->frcti != NULL) {
+                while (m < n && (idx[m] = flow_rx(flow, true, NULL)) >= 0)
+                        ++m;
+        } else if (n > 1) {
+                ret = shm_rbuff_read_n(flow->rx_rb, idx + 1, n - 1);
+                for (j = 1; ret > 0 && j <= (size_t) ret; ++j) {
+                        sdb = shm_rdrbuff_get(ai.rdrb, idx[j]);
+                        if (flow->qs.ber == 0 && chk_crc(sdb) != 0) {
+                                shm_rdrbuff_remove(ai.rdrb, idx[j]);
+                                continue;
+                        }
+                        idx[m++] = idx[j];
                 }
-        pthread_rwlock_unlock(&ai.lock);
 
-        if (flow->qs.ber == 0 && add_crc(sdb) != 0) {
-                shm_rdrbuff_remove(ai.rdrb, idx);
-                return -ENOMEM;
+                if (flow->qs.cypher_s > 0) {
+                        pthread_rwlock_wrlock(&flow->lock);
+                        for (i = j = 1; j < m; ++j) {
+                                sdb = shm_rdrbuff_get(ai.rdrb, idx[j]);
+                                if (crypt_decrypt(flow, sdb) < 0) {
+                                        shm_rdrbuff_remove(ai.rdrb, idx[j]);
+                                        continue;
+                                }
+                                idx[i++] = idx[j];
+                        }
+                        m = i;
+                        pthread_rwlock_unlock(&flow->lock);
+                }
         }
 
-        pthread_rwlock_rdlock(&ai.lock);
-
-        if (flags & FLOWFWNOBLOCK)
-                ret = shm_rbuff_write(flow->tx_rb, idx);
-        else
-                ret = shm_rbuff_write_b(flow->tx_rb, idx, abstime);
-
-        if (ret < 0)
-                shm_rdrbuff_remove(ai.rdrb, idx);
-        else
-                shm_flow_set_notify(flow->set, flow->flow_id, FLOW_PKT);
+        for (i = 0; i < m; ++i) {
+                sdb = shm_rdrbuff_get(ai.rdrb, idx[i]);
+                len = shm_du_buff_len(sdb);
+                shm_du_buff_gather(sdb, 0, msgs[i].buf, MIN(len, msgs[i].len));
+                msgs[i].len = len;
+                rm[i] = idx[i];
+        }
 
-        pthread_rwlock_unlock(&ai.lock);
+        shm_rdrbuff_remove_n(ai.rdrb, rm, m);
 
-        return ret < 0 ? (ssize_t) ret : (ssize_t) count;
+        return (ssize_t) m;
 }
 
-ssize_t flow_read(int    fd,
-                  void * buf,
-                  size_t count)
+ssize_t flow_read_loan(int           fd,
+                       const void ** buf,
+                       size_t *      len)
 {
         ssize_t              idx;
-        ssize_t              n;
-        uint8_t *            packet;
-        struct shm_rbuff *   rb;
         struct shm_du_buff * sdb;
         struct timespec      abs;
         struct timespec *    abstime = NULL;
         struct flow *        flow;
         bool                 noblock;
-        bool                 partrd;
 
-        if (fd < 0 || fd > PROG_MAX_FLOWS)
+        if (buf == NULL || len == NULL)
+                return -EINVAL;
+
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
                 return -EBADF;
 
-        flow = &ai.flows[fd];
+        flow = &flow_at(fd);
 
         clock_gettime(PTHREAD_COND_CLOCK, &abs);
 
-        pthread_rwlock_rdlock(&ai.lock);
-
-        if (flow->part_idx == DONE_PART) {
-                pthread_rwlock_unlock(&ai.lock);
-                flow->part_idx = NO_PART;
-                return 0;
-        }
+        pthread_rwlock_wrlock(&flow->lock);
 
         if (flow->flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+                pthread_rwlock_unlock(&flow->lock);
                 return -ENOTALLOC;
         }
 
-        rb   = flow->rx_rb;
         noblock = flow->oflags & FLOWFRNOBLOCK;
-        partrd = !(flow->oflags & FLOWFRNOPART);
 
-        if (ai.flows[fd].rcv_timesout) {
+        if (flow->rcv_timesout) {
                 ts_add(&abs, &flow->rcv_timeo, &abs);
                 abstime = &abs;
         }
 
-        pthread_rwlock_unlock(&ai.lock);
-
+        /* Loans the rest of a partially read packet first. */
         idx = flow->part_idx;
-        if (idx < 0) {
-                idx = frcti_queued_pdu(flow->frcti);
-                if (idx < 0) {
-                        do {
-                                idx = noblock ? shm_rbuff_read(rb) :
-                                        shm_rbuff_read_b(rb, abstime);
-                                if (idx < 0)
-                                        return idx;
-
-                                sdb = shm_rdrbuff_get(ai.rdrb, idx);
-                                if (flow->qs.ber == 0 && chk_crc(sdb) != 0) {
-                                        shm_rdrbuff_remove(ai.rdrb, idx);
-                                        continue;
-                                }
+        flow->part_idx = NO_PART;
 
-                                pthread_rwlock_wrlock(&ai.lock);
-                                if (flow->qs.cypher_s > 0)
-                                        if (crypt_decrypt(flow, sdb) < 0) {
-                                                pthread_rwlock_unlock(&ai.lock);
-                                                shm_rdrbuff_remove(ai.rdrb,
-                                                                   idx);
-                                                return -ENOMEM;
-                                        }
-                                pthread_rwlock_unlock(&ai.lock);
-                        } while (frcti_rcv(flow->frcti, sdb) != 0);
-                }
+        pthread_rwlock_unlock(&flow->lock);
+
+        if (idx < 0) {
+                idx = flow_rx(flow, noblock, abstime);
+                if (idx < 0)
+                        return idx;
         }
 
-        n = shm_rdrbuff_read(&packet, ai.rdrb, idx);
+        sdb = shm_rdrbuff_get(ai.rdrb, idx);
+        if (sdb == NULL)
+                return -ENOMEM;
 
-        assert(n >= 0);
+        /* Leave a chained packet for flow_read. */
+        if (shm_du_buff_next(sdb) != NULL) {
+                flow->part_idx = idx;
+                return -EMSGSIZE;
+        }
 
-        if (n <= (ssize_t) count) {
-                memcpy(buf, packet, n);
-                shm_rdrbuff_remove(ai.rdrb, idx);
+        *buf = shm_du_buff_head(sdb);
+        *len = shm_du_buff_len(sdb);
 
-                pthread_rwlock_wrlock(&ai.lock);
+        return idx;
+}
 
-                flow->part_idx = (partrd && n == (ssize_t) count) ?
-                        DONE_PART : NO_PART;
+int flow_read_release(int     fd,
+                      ssize_t id)
+{
+        if (fd < 0 || fd >= PROG_MAX_FLOWS)
+                return -EBADF;
 
-                pthread_rwlock_unlock(&ai.lock);
-                return n;
-        } else {
-                if (partrd) {
-                        memcpy(buf, packet, count);
-                        sdb = shm_rdrbuff_get(ai.rdrb, idx);
-                        shm_du_buff_head_release(sdb, n);
-                        flow->part_idx = idx;
-                        return count;
-                } else {
-                        shm_rdrbuff_remove(ai.rdrb, idx);
-                        return -EMSGSIZE;
-                }
-        }
+        if (id < 0)
+                return -EINVAL;
+
+        return shm_rdrbuff_remove(ai.rdrb, id);
 }
 
 /* fqueue functions. */
@@ -1190,6 +2556,8 @@ void fset_destroy(struct flow_set * set)
 
         pthread_rwlock_wrlock(&ai.lock);
 
+        shm_flow_set_close_fd(ai.fqset, set->idx);
+
         bmp_release(ai.fqueues, set->idx);
 
         pthread_rwlock_unlock(&ai.lock);
@@ -1197,6 +2565,22 @@ void fset_destroy(struct flow_set * set)
         free(set);
 }
 
+int fset_get_fd(struct flow_set * set)
+{
+        int fd;
+
+        if (set == NULL)
+                return -EINVAL;
+
+        pthread_rwlock_wrlock(&ai.lock);
+
+        fd = shm_flow_set_get_fd(ai.fqset, set->idx);
+
+        pthread_rwlock_unlock(&ai.lock);
+
+        return fd;
+}
+
 struct fqueue * fqueue_create()
 {
         struct fqueue * fq = malloc(sizeof(*fq));
@@ -1204,8 +2588,11 @@ struct fqueue * fqueue_create()
                 return NULL;
 
         memset(fq->fqueue, -1, (SHM_BUFFER_SIZE) * sizeof(*fq->fqueue));
-        fq->fqsize = 0;
-        fq->next   = 0;
+        memset(&fq->pstat, 0, sizeof(fq->pstat));
+        fq->fqsize  = 0;
+        fq->next    = 0;
+        fq->burst   = 0;
+        fq->poll_us = 0;
 
         return fq;
 }
@@ -1215,6 +2602,28 @@ void fqueue_destroy(struct fqueue * fq)
         free(fq);
 }
 
+int fqueue_set_poll(struct fqueue * fq,
+                    uint32_t        us)
+{
+        if (fq == NULL)
+                return -EINVAL;
+
+        fq->poll_us = us;
+
+        return 0;
+}
+
+int fqueue_get_poll_stat(struct fqueue *         fq,
+                         struct flow_poll_stat * stat)
+{
+        if (fq == NULL || stat == NULL)
+                return -EINVAL;
+
+        *stat = fq->pstat;
+
+        return 0;
+}
+
 void fset_zero(struct flow_set * set)
 {
         if (set == NULL)
@@ -1226,27 +2635,24 @@ void fset_zero(struct flow_set * set)
 int fset_add(struct flow_set * set,
              int               fd)
 {
-        int    ret;
-        size_t packets;
-        size_t i;
+        int ret;
 
-        if (set == NULL || fd < 0 || fd > SYS_MAX_FLOWS)
+        if (set == NULL || fd < 0 || fd >= PROG_MAX_FLOWS)
                 return -EINVAL;
 
-        pthread_rwlock_wrlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        if (ai.flows[fd].flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+        if (flow_at(fd).flow_id < 0) {
+                pthread_rwlock_unlock(&flow_at(fd).lock);
                 return -EINVAL;
         }
 
-        ret = shm_flow_set_add(ai.fqset, set->idx, ai.flows[fd].flow_id);
+        ret = shm_flow_set_add(ai.fqset, set->idx, flow_at(fd).flow_id);
 
-        packets = shm_rbuff_queued(ai.flows[fd].rx_rb);
-        for (i = 0; i < packets; i++)
-                shm_flow_set_notify(ai.fqset, ai.flows[fd].flow_id, FLOW_PKT);
+        if (shm_rbuff_queued(flow_at(fd).rx_rb) > 0)
+                shm_flow_set_notify(ai.fqset, flow_at(fd).flow_id, FLOW_PKT);
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 
         return ret;
 }
@@ -1254,15 +2660,15 @@ int fset_add(struct flow_set * set,
 void fset_del(struct flow_set * set,
               int               fd)
 {
-        if (set == NULL || fd < 0 || fd > SYS_MAX_FLOWS)
+        if (set == NULL || fd < 0 || fd >= PROG_MAX_FLOWS)
                 return;
 
-        pthread_rwlock_wrlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        if (ai.flows[fd].flow_id >= 0)
-                shm_flow_set_del(ai.fqset, set->idx, ai.flows[fd].flow_id);
+        if (flow_at(fd).flow_id >= 0)
+                shm_flow_set_del(ai.fqset, set->idx, flow_at(fd).flow_id);
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 }
 
 bool fset_has(const struct flow_set * set,
@@ -1270,42 +2676,107 @@ bool fset_has(const struct flow_set * set,
 {
         bool ret = false;
 
-        if (set == NULL || fd < 0 || fd > SYS_MAX_FLOWS)
+        if (set == NULL || fd < 0 || fd >= PROG_MAX_FLOWS)
                 return false;
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        if (ai.flows[fd].flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+        if (flow_at(fd).flow_id < 0) {
+                pthread_rwlock_unlock(&flow_at(fd).lock);
                 return false;
         }
 
-        ret = (shm_flow_set_has(ai.fqset, set->idx, ai.flows[fd].flow_id) == 1);
+        ret = (shm_flow_set_has(ai.fqset, set->idx, flow_at(fd).flow_id) == 1);
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 
         return ret;
 }
 
-int fqueue_next(struct fqueue * fq)
+/* Packets left for the application. */
+static size_t flow_rx_pending(int fd)
+{
+        struct flow * flow = &flow_at(fd);
+        size_t        n    = 0;
+
+        pthread_rwlock_rdlock(&flow->lock);
+
+        if (flow->rx_rb == NULL)
+                goto out;
+
+        n = shm_rbuff_queued(flow->rx_rb);
+        if (n == 0 && frcti_pdu_ready(flow->frcti))
+                n = 1;
+ out:
+        pthread_rwlock_unlock(&flow->lock);
+
+        return n;
+}
+
+/*
+ * FLOW_PKT is only queued when a flow goes from empty to non-empty.
+ * The last FLOW_PKT fd is handed out again while it has packets that
+ * were queued when it came in, anything left after that is rearmed
+ * for the next fevent.
+ */
+static int fqueue_last_pkt(struct fqueue * fq)
 {
+        int flow_id;
         int fd;
 
+        if (fq->next == 0 || fq->fqueue[fq->next - 1] != FLOW_PKT)
+                return -1;
+
+        flow_id = fq->fqueue[fq->next - 2];
+        fd      = port_at(flow_id).fd;
+        if (fd < 0 || flow_rx_pending(fd) == 0)
+                return -1;
+
+        if (fq->burst > 0) {
+                --fq->burst;
+                return fd;
+        }
+
+        shm_flow_set_notify(ai.fqset, flow_id, FLOW_PKT);
+
+        return -1;
+}
+
+int fqueue_next(struct fqueue * fq)
+{
+        int    fd;
+        int    type;
+        size_t n;
+
         if (fq == NULL)
                 return -EINVAL;
 
-        if (fq->fqsize == 0 || fq->next == fq->fqsize)
+        if (fq->fqsize == 0)
                 return -EPERM;
 
-        pthread_rwlock_rdlock(&ai.lock);
+        fd = fqueue_last_pkt(fq);
+        if (fd >= 0)
+                return fd;
 
-        fd = ai.ports[fq->fqueue[fq->next]].fd;
+        /* Ports are read without ai.lock, a stale fd has no packets. */
+        while (fq->next < fq->fqsize) {
+                fd   = port_at(fq->fqueue[fq->next]).fd;
+                type = fq->fqueue[fq->next + 1];
 
-        fq->next += 2;
+                fq->next += 2;
 
-        pthread_rwlock_unlock(&ai.lock);
+                if (type != FLOW_PKT)
+                        return fd;
 
-        return fd;
+                /* Skip flows drained through an earlier event. */
+                n = fd < 0 ? 0 : flow_rx_pending(fd);
+                if (n > 0) {
+                        fq->burst = n - 1;
+                        return fd;
+                }
+        }
+
+        return -EPERM;
 }
 
 enum fqtype fqueue_type(struct fqueue * fq)
@@ -1326,6 +2797,10 @@ ssize_t fevent(struct flow_set *       set,
         ssize_t           ret;
         struct timespec   abstime;
         struct timespec * t = NULL;
+        struct timespec   t0;
+        struct timespec   t1;
+        bool              spun = false;
+        bool              hit  = false;
 
         if (set == NULL || fq == NULL)
                 return -EINVAL;
@@ -1333,13 +2808,30 @@ ssize_t fevent(struct flow_set *       set,
         if (fq->fqsize > 0 && fq->next != fq->fqsize)
                 return fq->fqsize;
 
+        /* Rearm a flow that was not drained. */
+        fq->burst = 0;
+        fqueue_last_pkt(fq);
+
         if (timeo != NULL) {
                 clock_gettime(PTHREAD_COND_CLOCK, &abstime);
                 ts_add(&abstime, timeo, &abstime);
                 t = &abstime;
         }
 
+        if (fq->poll_us > 0 && !shm_flow_set_ready(ai.fqset, set->idx)) {
+                spun = true;
+                clock_gettime(PTHREAD_COND_CLOCK, &t0);
+                do {
+                        hit = shm_flow_set_ready(ai.fqset, set->idx);
+                        clock_gettime(PTHREAD_COND_CLOCK, &t1);
+                } while (!hit && ts_diff_us(&t0, &t1) < fq->poll_us);
+        }
+
         ret = shm_flow_set_wait(ai.fqset, set->idx, fq->fqueue, t);
+
+        if (spun)
+                poll_stat_add(&fq->pstat, &t0, &t1, hit);
+
         if (ret == -ETIMEDOUT) {
                 fq->fqsize = 0;
                 return -ETIMEDOUT;
@@ -1369,7 +2861,7 @@ int np1_flow_dealloc(int flow_id)
 
         pthread_rwlock_rdlock(&ai.lock);
 
-        fd = ai.ports[flow_id].fd;
+        fd = port_at(flow_id).fd;
 
         pthread_rwlock_unlock(&ai.lock);
 
@@ -1385,7 +2877,7 @@ int np1_flow_resp(int flow_id)
 
         pthread_rwlock_rdlock(&ai.lock);
 
-        fd = ai.ports[flow_id].fd;
+        fd = port_at(flow_id).fd;
 
         pthread_rwlock_unlock(&ai.lock);
 
@@ -1475,7 +2967,7 @@ int ipcp_flow_alloc_reply(int          fd,
         irm_msg_t * recv_msg;
         int         ret;
 
-        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
+        assert(fd >= 0 && fd < PROG_MAX_FLOWS);
 
         msg.code         = IRM_MSG_CODE__IPCP_FLOW_ALLOC_REPLY;
         msg.has_flow_id  = true;
@@ -1483,11 +2975,11 @@ int ipcp_flow_alloc_reply(int          fd,
         msg.pk.data      = (uint8_t *) data;
         msg.pk.len       = (uint32_t) len;
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        msg.flow_id = ai.flows[fd].flow_id;
+        msg.flow_id = flow_at(fd).flow_id;
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 
         msg.has_response = true;
         msg.response     = response;
@@ -1508,96 +3000,166 @@ int ipcp_flow_alloc_reply(int          fd,
         return ret;
 }
 
-int ipcp_flow_read(int                   fd,
-                   struct shm_du_buff ** sdb)
+ssize_t ipcp_flow_read_n(int                   fd,
+                         struct shm_du_buff ** sdbs,
+                         size_t                n)
 {
-        struct flow *      flow;
-        struct shm_rbuff * rb;
-        ssize_t            idx;
+        struct flow *        flow;
+        struct shm_rbuff *   rb;
+        struct shm_du_buff * sdb;
+        ssize_t              idx[IPCP_SDB_BURST];
+        ssize_t              ret;
+        size_t               i = 0;
+        ssize_t              j;
 
-        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
-        assert(sdb);
+        assert(fd >= 0 && fd < PROG_MAX_FLOWS);
+        assert(sdbs);
+        assert(n > 0);
 
-        flow = &ai.flows[fd];
+        if (n > IPCP_SDB_BURST)
+                n = IPCP_SDB_BURST;
 
-        pthread_rwlock_rdlock(&ai.lock);
+        flow = &flow_at(fd);
+
+        pthread_rwlock_rdlock(&flow->lock);
 
         assert(flow->flow_id >= 0);
 
         rb = flow->rx_rb;
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow->lock);
 
-        if (flow->frcti != NULL) {
-                idx = frcti_queued_pdu(flow->frcti);
-                if (idx >= 0) {
-                        *sdb = shm_rdrbuff_get(ai.rdrb, idx);
-                        return 0;
+        while (i < n) {
+                while (i < n && (idx[0] = frcti_queued_pdu(flow->frcti)) >= 0)
+                        sdbs[i++] = shm_rdrbuff_get(ai.rdrb, idx[0]);
+
+                if (i == n)
+                        break;
+
+                /* FRCT may queue PDUs, so take those one at a time. */
+                ret = shm_rbuff_read_n(rb, idx, flow->frcti ? 1 : n - i);
+                if (ret < 0) {
+                        flow_rx_ack(flow);
+                        return i > 0 ? (ssize_t) i : ret;
+                }
+
+                for (j = 0; j < ret; ++j) {
+                        sdb = shm_rdrbuff_get(ai.rdrb, idx[j]);
+                        if (flow->qs.ber == 0 && chk_crc(sdb) != 0) {
+                                shm_rdrbuff_remove(ai.rdrb, idx[j]);
+                                continue;
+                        }
+                        if (frcti_rcv(flow->frcti, sdb) != 0)
+                                continue;
+                        sdbs[i++] = sdb;
                 }
         }
 
-        do {
-                idx = shm_rbuff_read(rb);
-                if (idx < 0)
-                        return idx;
-                *sdb = shm_rdrbuff_get(ai.rdrb, idx);
-                if (flow->qs.ber == 0 && chk_crc(*sdb) != 0)
-                        continue;
-        } while (frcti_rcv(flow->frcti, *sdb) != 0);
+        flow_rx_ack(flow);
 
-        return 0;
+        return (ssize_t) i;
 }
 
-int ipcp_flow_write(int                  fd,
-                    struct shm_du_buff * sdb)
+int ipcp_flow_read(int                   fd,
+                   struct shm_du_buff ** sdb)
 {
-        struct flow * flow;
-        int           ret;
-        ssize_t       idx;
+        ssize_t ret;
 
-        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
         assert(sdb);
 
-        flow = &ai.flows[fd];
+        ret = ipcp_flow_read_n(fd, sdb, 1);
 
-        pthread_rwlock_rdlock(&ai.lock);
+        return ret < 0 ? ret : 0;
+}
+
+ssize_t ipcp_flow_write_n(int                   fd,
+                          struct shm_du_buff ** sdbs,
+                          size_t                n)
+{
+        struct flow * flow;
+        size_t        idx[IPCP_SDB_BURST];
+        uint32_t      seqno[IPCP_SDB_BURST];
+        size_t        m = 0;
+        size_t        i;
+        ssize_t       ret = 0;
+        ssize_t       done = 0;
+
+        assert(fd >= 0 && fd < PROG_MAX_FLOWS);
+        assert(sdbs);
+        assert(n > 0 && n <= IPCP_SDB_BURST);
+
+        flow = &flow_at(fd);
+
+        pthread_rwlock_rdlock(&flow->lock);
 
         if (flow->flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+                pthread_rwlock_unlock(&flow->lock);
                 return -ENOTALLOC;
         }
 
         if ((flow->oflags & FLOWFACCMODE) == FLOWFRDONLY) {
-                pthread_rwlock_unlock(&ai.lock);
+                pthread_rwlock_unlock(&flow->lock);
                 return -EPERM;
         }
 
         assert(flow->tx_rb);
 
-        idx = shm_du_buff_get_idx(sdb);
+        pthread_rwlock_unlock(&flow->lock);
 
-        if (frcti_snd(flow->frcti, sdb) < 0) {
-                pthread_rwlock_unlock(&ai.lock);
-                return -ENOMEM;
+        /* FRCT can put the flow on the timer, which takes the lock. */
+        for (i = 0; i < n; ++i) {
+                idx[m] = shm_du_buff_get_idx(sdbs[i]);
+                if (frcti_snd_hdr(flow->frcti, sdbs[i], seqno + m) < 0
+                    || (flow->qs.ber == 0 && add_crc(sdbs[i]) != 0)) {
+                        shm_rdrbuff_remove(ai.rdrb, idx[m]);
+                        continue;
+                }
+                frcti_rxm(flow->frcti, seqno[m], sdbs[i]);
+                ++m;
         }
 
-        if (flow->qs.ber == 0 && add_crc(sdb) != 0) {
-                pthread_rwlock_unlock(&ai.lock);
-                shm_rdrbuff_remove(ai.rdrb, idx);
-                return -ENOMEM;
+        pthread_rwlock_rdlock(&flow->lock);
+
+        /* Fill what fits, block only when the ring is full. */
+        while (done < (ssize_t) m) {
+                ret = shm_rbuff_write_n(flow->tx_rb, idx + done, m - done);
+                if (ret == -EAGAIN) {
+                        ret = shm_rbuff_write_b(flow->tx_rb, idx[done], NULL);
+                        if (ret == 0)
+                                ret = 1;
+                }
+                if (ret < 0)
+                        break;
+                done += ret;
         }
 
-        ret = shm_rbuff_write_b(flow->tx_rb, idx, NULL);
-        if (ret == 0)
-                shm_flow_set_notify(flow->set, flow->flow_id, FLOW_PKT);
-        else
-                shm_rdrbuff_remove(ai.rdrb, idx);
+        if (done > 0)
+                shm_flow_set_notify_n(flow->set, flow->flow_id, FLOW_PKT,
+                                      done);
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow->lock);
 
-        assert(ret <= 0);
+        for (i = (size_t) done; i < m; ++i) {
+                shm_rdrbuff_remove(ai.rdrb, idx[i]);
+                frcti_rxm_del(flow->frcti, seqno[i]);
+        }
 
-        return ret;
+        if (done == (ssize_t) n)
+                return done;
+
+        return ret < 0 ? ret : -ENOMEM;
+}
+
+int ipcp_flow_write(int                  fd,
+                    struct shm_du_buff * sdb)
+{
+        ssize_t ret;
+
+        assert(sdb);
+
+        ret = ipcp_flow_write_n(fd, &sdb, 1);
+
+        return ret < 0 ? ret : 0;
 }
 
 int ipcp_sdb_reserve(struct shm_du_buff ** sdb,
@@ -1611,29 +3173,51 @@ void ipcp_sdb_release(struct shm_du_buff * sdb)
         shm_rdrbuff_remove(ai.rdrb, shm_du_buff_get_idx(sdb));
 }
 
+ssize_t ipcp_sdb_reserve_n(struct shm_du_buff ** sdbs,
+                           size_t                n,
+                           size_t                len)
+{
+        return shm_rdrbuff_alloc_n(ai.rdrb, len, sdbs, n, NULL);
+}
+
+void ipcp_sdb_release_n(struct shm_du_buff ** sdbs,
+                        size_t                n)
+{
+        size_t idx[IPCP_SDB_BURST];
+        size_t i;
+
+        while (n > 0) {
+                for (i = 0; i < n && i < IPCP_SDB_BURST; ++i)
+                        idx[i] = shm_du_buff_get_idx(sdbs[i]);
+                shm_rdrbuff_remove_n(ai.rdrb, idx, i);
+                sdbs += i;
+                n    -= i;
+        }
+}
+
 int ipcp_flow_fini(int fd)
 {
         struct shm_rbuff * rx_rb;
 
-        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
+        assert(fd >= 0 && fd < PROG_MAX_FLOWS);
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        if (ai.flows[fd].flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+        if (flow_at(fd).flow_id < 0) {
+                pthread_rwlock_unlock(&flow_at(fd).lock);
                 return -1;
         }
 
-        shm_rbuff_set_acl(ai.flows[fd].rx_rb, ACL_FLOWDOWN);
-        shm_rbuff_set_acl(ai.flows[fd].tx_rb, ACL_FLOWDOWN);
+        shm_rbuff_set_acl(flow_at(fd).rx_rb, ACL_FLOWDOWN);
+        shm_rbuff_set_acl(flow_at(fd).tx_rb, ACL_FLOWDOWN);
 
-        shm_flow_set_notify(ai.flows[fd].set,
-                            ai.flows[fd].flow_id,
+        shm_flow_set_notify(flow_at(fd).set,
+                            flow_at(fd).flow_id,
                             FLOW_DEALLOC);
 
-        rx_rb = ai.flows[fd].rx_rb;
+        rx_rb = flow_at(fd).rx_rb;
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 
         if (rx_rb != NULL)
                 shm_rbuff_fini(rx_rb);
@@ -1644,31 +3228,47 @@ int ipcp_flow_fini(int fd)
 int ipcp_flow_get_qoscube(int         fd,
                           qoscube_t * cube)
 {
-        assert(fd >= 0 && fd < SYS_MAX_FLOWS);
+        assert(fd >= 0 && fd < PROG_MAX_FLOWS);
         assert(cube);
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        assert(ai.flows[fd].flow_id >= 0);
+        assert(flow_at(fd).flow_id >= 0);
 
-        *cube = qos_spec_to_cube(ai.flows[fd].qs);
+        *cube = qos_spec_to_cube(flow_at(fd).qs);
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 
         return 0;
 }
 
+size_t ipcp_flow_queued(int fd)
+{
+        size_t q = 0;
+
+        assert(fd >= 0 && fd < PROG_MAX_FLOWS);
+
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
+
+        if (flow_at(fd).tx_rb != NULL)
+                q = shm_rbuff_queued(flow_at(fd).tx_rb);
+
+        pthread_rwlock_unlock(&flow_at(fd).lock);
+
+        return q;
+}
+
 ssize_t local_flow_read(int fd)
 {
         ssize_t ret;
 
         assert(fd >= 0);
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow_at(fd).lock);
 
-        ret = shm_rbuff_read(ai.flows[fd].rx_rb);
+        ret = shm_rbuff_read(flow_at(fd).rx_rb);
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow_at(fd).lock);
 
         return ret;
 }
@@ -1681,12 +3281,12 @@ int local_flow_write(int    fd,
 
         assert(fd >= 0);
 
-        flow = &ai.flows[fd];
+        flow = &flow_at(fd);
 
-        pthread_rwlock_rdlock(&ai.lock);
+        pthread_rwlock_rdlock(&flow->lock);
 
         if (flow->flow_id < 0) {
-                pthread_rwlock_unlock(&ai.lock);
+                pthread_rwlock_unlock(&flow->lock);
                 return -ENOTALLOC;
         }
         ret = shm_rbuff_write_b(flow->tx_rb, idx, NULL);
@@ -1695,7 +3295,7 @@ int local_flow_write(int    fd,
         else
                 shm_rdrbuff_remove(ai.rdrb, idx);
 
-        pthread_rwlock_unlock(&ai.lock);
+        pthread_rwlock_unlock(&flow->lock);
 
         return ret;
 }
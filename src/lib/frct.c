@@ -26,12 +26,21 @@
 #define DELT_R         (20 * MILLION) /* us */
 
 #define RQ_SIZE        1024
+#define CTRL_SHARE     8              /* 1/8th of the rbuff for ctrl */
+#define ACK_PKTS       8              /* PDUs per standalone ACK */
+#define SACK_WORDS     4
+#define SACK_BITS      (SACK_WORDS * 32)
+#define SACK_DUPTHRESH 3              /* PDUs SACKed past a loss */
 
 #define FRCT_PCILEN    (sizeof(struct frct_pci))
+#define FRCT_SACKLEN   (sizeof(struct frct_sack))
+
+#include <frct_cc.c>
 
 struct frct_cr {
         uint32_t lwe;
         uint32_t rwe;
+        uint32_t wnd;     /* Credit, initial window for the sender. */
 
         uint8_t  cflags;
         uint32_t seqno;
@@ -41,6 +50,8 @@ struct frct_cr {
 };
 
 struct frcti {
+        struct list_head  next;        /* In the FRCT timer      */
+        bool              due;         /* The timer has it       */
         int               fd;
 
         time_t            mpl;
@@ -57,10 +68,23 @@ struct frcti {
         struct frct_cr    snd_cr;
         struct frct_cr    rcv_cr;
 
-        struct rxmwheel * rw;
+        uint32_t          ackno;       /* Last ACK sent          */
+        struct timespec   t_ack;       /* Time of the last ACK   */
+        size_t            ooo;         /* Queued since last SACK */
+        bool              ece;         /* Echo congestion mark   */
+
+        uint32_t          sack_base;   /* ackno of the SACK map  */
+        uint32_t          sack[SACK_WORDS];
+
+        struct frct_cc    cc;          /* congestion control     */
+
+        struct list_head  rxms;        /* Unacked, in the wheel  */
 
         ssize_t           rq[RQ_SIZE];
         pthread_rwlock_t  lock;
+
+        pthread_mutex_t   mtx;         /* Waits for the window   */
+        pthread_cond_t    cond;
 };
 
 enum frct_flags {
@@ -71,6 +95,8 @@ enum frct_flags {
         FRCT_RDVZ = 0x10, /* Rendez-vous      */
         FRCT_FFGM = 0x20, /* First Fragment   */
         FRCT_MFGM = 0x40, /* More fragments   */
+        FRCT_SACK = 0x80, /* SACK map follows */
+        FRCT_ECE  = 0x100 /* Congestion mark  */
 };
 
 struct frct_pci {
@@ -82,14 +108,55 @@ struct frct_pci {
         uint32_t ackno;
 } __attribute__((packed));
 
+/* Bit i is set if the receiver holds PDU ackno + i. */
+struct frct_sack {
+        uint32_t map[SACK_WORDS];
+} __attribute__((packed));
+
+/* True if the receiver holds seqno, call under the lock. */
+static bool frcti_sacked(struct frcti * frcti,
+                         uint32_t       seqno)
+{
+        uint32_t i = seqno - frcti->sack_base;
+
+        if (i >= SACK_BITS)
+                return false;
+
+        return (frcti->sack[i >> 5] & ((uint32_t) 1 << (i & 31))) != 0;
+}
+
+/* Reacts once per window to congestion, call under the wrlock. */
+static void frcti_cong(struct frcti * frcti,
+                       uint32_t       seqno,
+                       bool           rto)
+{
+        if ((int32_t)(seqno - frcti->cc.recover) < 0)
+                return;
+
+        frcti->cc.recover = frcti->snd_cr.seqno;
+        frcti->cc.ops->cong(&frcti->cc, rto);
+}
+
 #include <rxmwheel.c>
 
+/*
+ * An rbuff of n slots holds n - 1 PDUs. Control PDUs from the peer
+ * take slots too, without counting against the window.
+ */
+static uint32_t frcti_rbuff_wnd(struct shm_rbuff * rb)
+{
+        size_t n = shm_rbuff_size(rb);
+
+        return MIN(RQ_SIZE, n - 1 - n / CTRL_SHARE);
+}
+
 static struct frcti * frcti_create(int fd)
 {
-        struct frcti *  frcti;
-        time_t          delta_t;
-        ssize_t         idx;
-        struct timespec now;
+        struct frcti *     frcti;
+        time_t             delta_t;
+        ssize_t            idx;
+        struct timespec    now;
+        pthread_condattr_t cattr;
 
         frcti = malloc(sizeof(*frcti));
         if (frcti == NULL)
@@ -97,9 +164,23 @@ static struct frcti * frcti_create(int fd)
 
         memset(frcti, 0, sizeof(*frcti));
 
+        list_head_init(&frcti->next);
+        list_head_init(&frcti->rxms);
+
         if (pthread_rwlock_init(&frcti->lock, NULL))
                 goto fail_lock;
 
+        if (pthread_mutex_init(&frcti->mtx, NULL))
+                goto fail_mtx;
+
+        if (pthread_condattr_init(&cattr))
+                goto fail_cattr;
+#ifndef __APPLE__
+        pthread_condattr_setclock(&cattr, PTHREAD_COND_CLOCK);
+#endif
+        if (pthread_cond_init(&frcti->cond, &cattr))
+                goto fail_cond;
+
         for (idx = 0; idx < RQ_SIZE; ++idx)
                 frcti->rq[idx] = -1;
 
@@ -121,23 +202,33 @@ static struct frcti * frcti_create(int fd)
         frcti->srtt_us      = 0;      /* updated on first ACK */
         frcti->mdev_us      = 10000;  /* initial rxm will be after 20 ms */
         frcti->rto          = 20000;  /* initial rxm will be after 20 ms */
-        frcti->rw           = NULL;
-
-        if (ai.flows[fd].qs.loss == 0) {
-                frcti->snd_cr.cflags |= FRCTFRTX;
-                frcti->rcv_cr.cflags |= FRCTFRTX;
-                frcti->rw = rxmwheel_create();
-                if (frcti->rw == NULL)
-                        goto fail_rw;
+
+        frct_cc_init(&frcti->cc, FRCT_CC);
+
+        if (flow_at(fd).qs.loss == 0) {
+                frcti->snd_cr.cflags |= FRCTFRTX | FRCTFRESCNTRL | FRCTFSACK;
+                frcti->rcv_cr.cflags |= FRCTFRTX | FRCTFRESCNTRL | FRCTFSACK;
         }
 
+        /*
+         * The sender may not have more PDUs outstanding than the
+         * receiver's rbuff and reorder queue hold.
+         */
+        frcti->snd_cr.wnd = frcti_rbuff_wnd(flow_at(fd).tx_rb);
+        frcti->rcv_cr.wnd = frcti_rbuff_wnd(flow_at(fd).rx_rb);
+
         frcti->rcv_cr.inact = 2 * delta_t /  MILLION; /* s */
         frcti->rcv_cr.act   = now.tv_sec - (frcti->rcv_cr.inact + 1);
 
+        pthread_condattr_destroy(&cattr);
 
         return frcti;
 
- fail_rw:
+ fail_cond:
+        pthread_condattr_destroy(&cattr);
+ fail_cattr:
+        pthread_mutex_destroy(&frcti->mtx);
+ fail_mtx:
         pthread_rwlock_destroy(&frcti->lock);
  fail_lock:
         free(frcti);
@@ -152,9 +243,10 @@ static void frcti_destroy(struct frcti * frcti)
          * make sure everything we sent is acked.
          */
 
-        if (frcti->rw != NULL)
-                rxmwheel_destroy(frcti->rw);
+        rxmwheel_clear(frcti);
 
+        pthread_cond_destroy(&frcti->cond);
+        pthread_mutex_destroy(&frcti->mtx);
         pthread_rwlock_destroy(&frcti->lock);
 
         free(frcti);
@@ -178,11 +270,29 @@ static uint16_t frcti_getconf(struct frcti * frcti)
 #define frcti_queued_pdu(frcti) \
         (frcti == NULL ? -1 : __frcti_queued_pdu(frcti))
 
-#define frcti_snd(frcti, sdb) \
-        (frcti == NULL ? 0 : __frcti_snd(frcti, sdb))
+#define frcti_pdu_ready(frcti) \
+        (frcti == NULL ? false : __frcti_pdu_ready(frcti))
+
+#define frcti_snd_open(frcti) \
+        (frcti == NULL ? true : __frcti_snd_open(frcti))
+
+#define frcti_ack_due(frcti) \
+        (frcti == NULL ? false : __frcti_ack_due(frcti))
+
+#define frcti_snd_hdr(frcti, sdb, seqno) \
+        (frcti == NULL ? 0 : __frcti_snd_hdr(frcti, sdb, seqno))
+
+#define frcti_rxm(frcti, seqno, sdb) \
+        (frcti == NULL ? (void) 0 : __frcti_rxm(frcti, seqno, sdb))
+
+#define frcti_rxm_del(frcti, seqno) \
+        (frcti == NULL ? (void) 0 : __frcti_rxm_del(frcti, seqno))
 
 #define frcti_rcv(frcti, sdb) \
-        (frcti == NULL ? 0 : __frcti_rcv(frcti, sdb))
+        (frcti == NULL ? 0 : __frcti_rcv(frcti, sdb, false))
+
+#define frcti_hold(frcti, sdb) \
+        (frcti == NULL ? 0 : __frcti_rcv(frcti, sdb, true))
 
 static ssize_t __frcti_queued_pdu(struct frcti * frcti)
 {
@@ -206,6 +316,21 @@ static ssize_t __frcti_queued_pdu(struct frcti * frcti)
         return idx;
 }
 
+static bool __frcti_pdu_ready(struct frcti * frcti)
+{
+        bool ready;
+
+        assert(frcti);
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        ready = frcti->rq[frcti->rcv_cr.lwe & (RQ_SIZE - 1)] != -1;
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return ready;
+}
+
 static struct frct_pci * frcti_alloc_head(struct shm_du_buff * sdb)
 {
         struct frct_pci * pci;
@@ -229,26 +354,285 @@ static bool after(uint32_t seq1,
         return (int32_t)(seq2 - seq1) < 0;
 }
 
-static int __frcti_snd(struct frcti *       frcti,
-                       struct shm_du_buff * sdb)
+/* True if the next PDU fits both windows, call under the lock. */
+static bool frcti_in_wnd(struct frcti * frcti)
+{
+        struct frct_cr * snd_cr = &frcti->snd_cr;
+
+        if ((snd_cr->cflags & FRCTFRESCNTRL) &&
+            !before(snd_cr->seqno, snd_cr->rwe))
+                return false;
+
+        if ((snd_cr->cflags & FRCTFRTX) &&
+            snd_cr->seqno - snd_cr->lwe >= frcti->cc.cwnd)
+                return false;
+
+        return true;
+}
+
+/* True if the receiver and the network have room for the next PDU. */
+static bool __frcti_snd_open(struct frcti * frcti)
+{
+        struct frct_cr * snd_cr = &frcti->snd_cr;
+        struct timespec  now;
+        bool             open;
+
+        if (!(snd_cr->cflags & (FRCTFRESCNTRL | FRCTFRTX)))
+                return true;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        /* An inactive sender starts a new run with fresh windows. */
+        open = now.tv_sec - snd_cr->act > snd_cr->inact ||
+                frcti_in_wnd(frcti);
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return open;
+}
+
+/* Waits until a reader processes a window update or abstime. */
+static void frcti_wnd_wait(struct frcti *          frcti,
+                           const struct timespec * abstime)
+{
+        pthread_mutex_lock(&frcti->mtx);
+
+        pthread_cleanup_push((void (*) (void *)) pthread_mutex_unlock,
+                             (void *) &frcti->mtx);
+
+        if (!__frcti_snd_open(frcti))
+                pthread_cond_timedwait(&frcti->cond, &frcti->mtx, abstime);
+
+        pthread_cleanup_pop(true);
+}
+
+static void frcti_wnd_signal(struct frcti * frcti)
+{
+        pthread_mutex_lock(&frcti->mtx);
+        pthread_cond_broadcast(&frcti->cond);
+        pthread_mutex_unlock(&frcti->mtx);
+}
+
+static int frcti_setcc(struct frcti * frcti,
+                       int            algo)
+{
+        int ret;
+
+        assert(frcti);
+
+        if (!(frcti->snd_cr.cflags & FRCTFRTX))
+                return -EPERM;
+
+        pthread_rwlock_wrlock(&frcti->lock);
+
+        ret = frct_cc_init(&frcti->cc, algo);
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        if (ret == 0)
+                frcti_wnd_signal(frcti);
+
+        return ret;
+}
+
+static void frcti_getcc(struct frcti *   frcti,
+                        struct frct_cc * cc)
+{
+        assert(frcti);
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        *cc = frcti->cc;
+
+        pthread_rwlock_unlock(&frcti->lock);
+}
+
+/*
+ * A standalone ACK is due ACK_PKTS PDUs or ACK_DELAY after the last
+ * one, when the reader consumed half of the announced window, or at
+ * once when PDUs arrived out of order, so the sender learns the SACKs.
+ */
+static bool __frcti_ack_due(struct frcti * frcti)
+{
+        struct frct_cr * rcv_cr = &frcti->rcv_cr;
+        struct timespec  now;
+        uint32_t         unacked;
+        bool             due;
+
+        if (!(rcv_cr->cflags & FRCTFRTX))
+                return false;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        unacked = rcv_cr->lwe - frcti->ackno;
+
+        if (now.tv_sec - rcv_cr->act > rcv_cr->inact)
+                due = false;
+        else if (unacked >= ACK_PKTS || frcti->ooo > 0 || frcti->ece)
+                due = true;
+        else if (unacked > 0 && ts_diff_us(&frcti->t_ack, &now) >= ACK_DELAY)
+                due = true;
+        else
+                due = (rcv_cr->cflags & FRCTFRESCNTRL) &&
+                        rcv_cr->lwe + rcv_cr->wnd - rcv_cr->rwe
+                        >= rcv_cr->wnd / 2;
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        return due;
+}
+
+/* No ACK owed and nothing to retransmit, the timer can let go. */
+static bool frcti_idle(struct frcti * frcti)
+{
+        struct frct_cr * rcv_cr = &frcti->rcv_cr;
+        struct timespec  now;
+        bool             idle;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        pthread_rwlock_rdlock(&frcti->lock);
+
+        idle = !(rcv_cr->cflags & FRCTFRTX)
+                || now.tv_sec - rcv_cr->act > rcv_cr->inact
+                || (rcv_cr->lwe == frcti->ackno && frcti->ooo == 0
+                    && !frcti->ece);
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        if (!idle)
+                return false;
+
+        pthread_mutex_lock(&rw.lock);
+
+        idle = list_is_empty(&frcti->rxms);
+
+        pthread_mutex_unlock(&rw.lock);
+
+        return idle;
+}
+
+/* Puts our ACK and window in the PCI, call under the wrlock. */
+static void frcti_put_ack(struct frcti *          frcti,
+                          struct frct_pci *       pci,
+                          const struct timespec * now)
+{
+        struct frct_cr * rcv_cr = &frcti->rcv_cr;
+
+        pci->flags |= FRCT_ACK;
+        pci->ackno  = hton32(rcv_cr->lwe);
+
+        frcti->ackno = rcv_cr->lwe;
+        frcti->t_ack = *now;
+
+        if (frcti->ece) {
+                pci->flags |= FRCT_ECE;
+                frcti->ece  = false;
+        }
+
+        if (!(rcv_cr->cflags & FRCTFRESCNTRL))
+                return;
+
+        pci->flags  |= FRCT_FC;
+        pci->window  = hton16(rcv_cr->wnd);
+        rcv_cr->rwe  = rcv_cr->lwe + rcv_cr->wnd;
+}
+
+/* Maps the reorder queue from lwe, call under the wrlock. */
+static bool frcti_put_sack(struct frcti *     frcti,
+                           struct frct_sack * sack)
+{
+        struct frct_cr * rcv_cr = &frcti->rcv_cr;
+        uint32_t         map;
+        bool             any = false;
+        size_t           i;
+        size_t           j;
+
+        frcti->ooo = 0;
+
+        if (!(rcv_cr->cflags & FRCTFSACK))
+                return false;
+
+        for (i = 0; i < SACK_WORDS; ++i) {
+                map = 0;
+                for (j = 0; j < 32; ++j) {
+                        size_t pos = (rcv_cr->lwe + i * 32 + j)
+                                & (RQ_SIZE - 1);
+                        if (frcti->rq[pos] != -1)
+                                map |= (uint32_t) 1 << j;
+                }
+                sack->map[i] = hton32(map);
+                any = any || map != 0;
+        }
+
+        return any;
+}
+
+/*
+ * A PDU without data, carrying only the ACK and window. Only these
+ * carry a SACK map: a retransmitted copy gets a new ackno, which would
+ * shift the map.
+ */
+static int frcti_snd_ctrl(struct frcti *       frcti,
+                          struct shm_du_buff * sdb)
+{
+        struct frct_pci  pci;
+        struct frct_sack sack;
+        struct timespec  now;
+        uint8_t *        head;
+        size_t           len = FRCT_PCILEN;
+
+        memset(&pci, 0, sizeof(pci));
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        pthread_rwlock_wrlock(&frcti->lock);
+
+        frcti_put_ack(frcti, &pci, &now);
+
+        if (frcti_put_sack(frcti, &sack)) {
+                pci.flags |= FRCT_SACK;
+                len       += FRCT_SACKLEN;
+        }
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        head = shm_du_buff_head_alloc(sdb, len);
+        if (head == NULL)
+                return -1;
+
+        memcpy(head, &pci, FRCT_PCILEN);
+        if (pci.flags & FRCT_SACK)
+                memcpy(head + FRCT_PCILEN, &sack, FRCT_SACKLEN);
+
+        return 0;
+}
+
+/*
+ * Adds the FRCT header and returns its seqno, frcti_rxm schedules the
+ * retransmission once the PDU is sealed.
+ */
+static int __frcti_snd_hdr(struct frcti *       frcti,
+                           struct shm_du_buff * sdb,
+                           uint32_t *           seqno)
 {
         struct frct_pci * pci;
         struct timespec   now;
         struct frct_cr *  snd_cr;
         struct frct_cr *  rcv_cr;
-        uint32_t          seqno;
 
         assert(frcti);
 
         snd_cr = &frcti->snd_cr;
         rcv_cr = &frcti->rcv_cr;
 
-        if (frcti->rw != NULL)
-                rxmwheel_move(frcti->rw);
-
         pci = frcti_alloc_head(sdb);
         if (pci == NULL)
-                return -1;
+                return -ENOMEM;
 
         clock_gettime(CLOCK_REALTIME, &now);
 
@@ -266,10 +650,21 @@ static int __frcti_snd(struct frcti *       frcti,
                 assert(snd_cr->seqno == snd_cr->lwe);
                 random_buffer(&snd_cr->seqno, sizeof(snd_cr->seqno));
                 frcti->snd_cr.lwe = snd_cr->seqno - 1;
+                snd_cr->rwe = snd_cr->seqno + snd_cr->wnd;
+                memset(frcti->sack, 0, sizeof(frcti->sack));
+                frcti->cc.ops->init(&frcti->cc);
+                frcti->cc.recover = snd_cr->seqno;
+        }
+
+        /* No room in the receiver or network, see frcti_snd_open. */
+        if (!frcti_in_wnd(frcti)) {
+                pthread_rwlock_unlock(&frcti->lock);
+                shm_du_buff_head_release(sdb, FRCT_PCILEN);
+                return -EAGAIN;
         }
 
-        seqno = snd_cr->seqno;
-        pci->seqno = hton32(seqno);
+        *seqno = snd_cr->seqno;
+        pci->seqno = hton32(*seqno);
 
         if (!(snd_cr->cflags & FRCTFRTX)) {
                 snd_cr->lwe++;
@@ -280,10 +675,8 @@ static int __frcti_snd(struct frcti *       frcti,
                         frcti->probe   = true;
                 }
 
-                if (now.tv_sec - rcv_cr->act <= rcv_cr->inact) {
-                        pci->flags |= FRCT_ACK;
-                        pci->ackno = hton32(rcv_cr->lwe);
-                }
+                if (now.tv_sec - rcv_cr->act <= rcv_cr->inact)
+                        frcti_put_ack(frcti, pci, &now);
         }
 
         snd_cr->seqno++;
@@ -291,12 +684,34 @@ static int __frcti_snd(struct frcti *       frcti,
 
         pthread_rwlock_unlock(&frcti->lock);
 
-        if (frcti->rw != NULL)
-                rxmwheel_add(frcti->rw, frcti, seqno, sdb);
-
         return 0;
 }
 
+/*
+ * Call once the PDU is sealed, before it is written: the reader can
+ * release it as soon as it is. The wheel may resend it at once.
+ */
+static void __frcti_rxm(struct frcti *       frcti,
+                        uint32_t             seqno,
+                        struct shm_du_buff * sdb)
+{
+        if (!(frcti->snd_cr.cflags & FRCTFRTX))
+                return;
+
+        if (rxmwheel_add(frcti, seqno, sdb) == 0)
+                frct_tmr_due(frcti);
+}
+
+/* Unschedules a PDU that could not be written after all. */
+static void __frcti_rxm_del(struct frcti * frcti,
+                            uint32_t       seqno)
+{
+        if (!(frcti->snd_cr.cflags & FRCTFRTX))
+                return;
+
+        rxmwheel_del(frcti, seqno);
+}
+
 static void rtt_estimator(struct frcti * frcti,
                           time_t         mrtt_us)
 {
@@ -319,25 +734,120 @@ static void rtt_estimator(struct frcti * frcti,
         frcti->rto         = MAX(RTO_MIN, srtt + (rttvar >> 2));
 }
 
-/* Returns 0 when idx contains a packet for the application. */
+/*
+ * Takes the ACK and window from the PCI and feeds congestion control,
+ * call under the wrlock. Returns true if the send window opened.
+ */
+static bool frcti_get_ack(struct frcti *          frcti,
+                          const struct frct_pci * pci,
+                          struct timespec *       now)
+{
+        struct frct_cr * snd_cr = &frcti->snd_cr;
+        uint32_t         ackno;
+        uint32_t         acked = 0;
+        uint32_t         rwe;
+        time_t           mrtt_us = 0;
+
+        if (!(frcti->rcv_cr.cflags & FRCTFRTX) || !(pci->flags & FRCT_ACK))
+                return false;
+
+        ackno = ntoh32(pci->ackno);
+        /* Check for duplicate (old) acks. */
+        if ((int32_t)(ackno - snd_cr->lwe) > 0) {
+                acked       = ackno - snd_cr->lwe;
+                snd_cr->lwe = ackno;
+        }
+
+        if (frcti->probe && after(ackno, frcti->rttseq)) {
+                mrtt_us = ts_diff_us(&frcti->t_probe, now);
+                rtt_estimator(frcti, mrtt_us);
+                frcti->probe = false;
+        }
+
+        if (pci->flags & FRCT_ECE)
+                frcti_cong(frcti, ackno, false);
+        else if (acked > 0 || mrtt_us > 0)
+                frcti->cc.ops->ack(&frcti->cc, acked, mrtt_us);
+
+        if (!(snd_cr->cflags & FRCTFRESCNTRL) || !(pci->flags & FRCT_FC))
+                return acked > 0;
+
+        rwe = ackno + ntoh16(pci->window);
+        if (!after(rwe, snd_cr->rwe))
+                return acked > 0;
+
+        snd_cr->rwe = rwe;
+
+        return true;
+}
+
+/* Keeps the latest SACK map, call under the wrlock after the ACK. */
+static void frcti_get_sack(struct frcti *           frcti,
+                           const struct frct_pci *  pci,
+                           const struct frct_sack * sack)
+{
+        uint32_t map;
+        size_t   n = 0;
+        size_t   i;
+
+        if (!(frcti->snd_cr.cflags & FRCTFSACK))
+                return;
+
+        /* A map from a stale ACK is shifted from lwe, drop it. */
+        if (ntoh32(pci->ackno) != frcti->snd_cr.lwe)
+                return;
+
+        frcti->sack_base = frcti->snd_cr.lwe;
+
+        for (i = 0; i < SACK_WORDS; ++i) {
+                frcti->sack[i] = ntoh32(sack->map[i]);
+                for (map = frcti->sack[i]; map != 0; map &= map - 1)
+                        ++n;
+        }
+
+        /* The map starts at the hole, reordering rarely gets this far. */
+        if (n >= SACK_DUPTHRESH)
+                frcti_cong(frcti, frcti->sack_base, false);
+}
+
+/* Stops retransmitting what the ACK covered and wakes the writers. */
+static void frcti_opened(struct frcti * frcti,
+                         uint32_t       lwe)
+{
+        rxmwheel_ack(frcti, lwe);
+        frcti_wnd_signal(frcti);
+}
+
+/*
+ * Returns 0 when idx contains a packet for the application. A held
+ * packet goes to the reorder queue, even when it is in order.
+ */
 static int __frcti_rcv(struct frcti *       frcti,
-                       struct shm_du_buff * sdb)
+                       struct shm_du_buff * sdb,
+                       bool                 hold)
 {
-        ssize_t           idx;
-        struct frct_pci * pci;
-        struct timespec   now;
-        struct frct_cr *  snd_cr;
-        struct frct_cr *  rcv_cr;
-        uint32_t          seqno;
-        int               ret = 0;
+        ssize_t            idx;
+        struct frct_pci *  pci;
+        struct frct_sack * sack = NULL;
+        struct timespec    now;
+        struct frct_cr *   rcv_cr;
+        uint32_t           seqno;
+        uint32_t           snd_lwe;
+        bool               opened = false;
+        bool               due = false;
+        int                ret = 0;
 
         assert(frcti);
 
         rcv_cr = &frcti->rcv_cr;
-        snd_cr = &frcti->snd_cr;
 
         pci = (struct frct_pci *) shm_du_buff_head_release(sdb, FRCT_PCILEN);
 
+        if ((pci->flags & FRCT_SACK) && !(pci->flags & FRCT_DATA) &&
+            shm_du_buff_len(sdb) >= FRCT_SACKLEN)
+                sack = (struct frct_sack *)
+                        shm_du_buff_head_release(sdb, FRCT_SACKLEN);
+
         clock_gettime(CLOCK_REALTIME, &now);
 
         pthread_rwlock_wrlock(&frcti->lock);
@@ -346,20 +856,39 @@ static int __frcti_rcv(struct frcti *       frcti,
 
         seqno = ntoh32(pci->seqno);
 
+        if (!(pci->flags & FRCT_DATA)) {
+                opened = frcti_get_ack(frcti, pci, &now);
+                if (sack != NULL)
+                        frcti_get_sack(frcti, pci, sack);
+                goto drop_packet;
+        }
+
+        /* Data, even a duplicate, can make an ACK due. */
+        due = rcv_cr->cflags & FRCTFRTX;
+
+        /* Marked by the layer below, echo it in the next ACK. */
+        if (shm_du_buff_get_ecn(sdb) > 0 && (rcv_cr->cflags & FRCTFRTX))
+                frcti->ece = true;
+
         /* Check if receiver inactivity is true. */
         if (now.tv_sec - rcv_cr->act > rcv_cr->inact) {
                 /* Inactive receiver, check for DRF. */
-                if (pci->flags & FRCT_DRF) /* New run. */
+                if (pci->flags & FRCT_DRF) { /* New run. */
                         rcv_cr->lwe = seqno;
-                else
+                        rcv_cr->rwe = seqno; /* Nothing announced. */
+                } else {
                         goto drop_packet;
+                }
         }
 
-        if (seqno == rcv_cr->lwe) {
+        if (seqno == rcv_cr->lwe && !hold) {
                 ++rcv_cr->lwe;
-        } else { /* Out of order. */
-                if (before(seqno, rcv_cr->lwe) )
+        } else { /* Out of order or held. */
+                if (before(seqno, rcv_cr->lwe)) {
+                        /* A retransmission, the ACK got lost. */
+                        rcv_cr->rwe = rcv_cr->lwe;
                         goto drop_packet;
+                }
 
                 if (rcv_cr->cflags & FRCTFRTX) {
                         size_t pos = seqno & (RQ_SIZE - 1);
@@ -371,38 +900,37 @@ static int __frcti_rcv(struct frcti *       frcti,
 
                         /* Queue. */
                         frcti->rq[pos] = idx;
+                        if (seqno != rcv_cr->lwe)
+                                ++frcti->ooo;
                         ret = -EAGAIN;
                 } else {
                         rcv_cr->lwe = seqno + 1;
                 }
         }
 
-        if (rcv_cr->cflags & FRCTFRTX && pci->flags & FRCT_ACK) {
-                uint32_t ackno = ntoh32(pci->ackno);
-                /* Check for duplicate (old) acks. */
-                if ((int32_t)(ackno - snd_cr->lwe) > 0)
-                        snd_cr->lwe = ackno;
-
-                if (frcti->probe && after(ackno, frcti->rttseq)) {
-                        rtt_estimator(frcti, ts_diff_us(&frcti->t_probe, &now));
-                        frcti->probe = false;
-                }
-        }
+        opened = frcti_get_ack(frcti, pci, &now);
 
         rcv_cr->act = now.tv_sec;
 
+        snd_lwe = frcti->snd_cr.lwe;
+
         pthread_rwlock_unlock(&frcti->lock);
 
-        if (ret == 0 && !(pci->flags & FRCT_DATA))
-                shm_rdrbuff_remove(ai.rdrb, idx);
+        if (opened)
+                frcti_opened(frcti, snd_lwe);
 
-        if (frcti->rw != NULL)
-                rxmwheel_move(frcti->rw);
+        if (due)
+                frct_tmr_due(frcti);
 
         return ret;
 
  drop_packet:
+        snd_lwe = frcti->snd_cr.lwe;
         pthread_rwlock_unlock(&frcti->lock);
         shm_rdrbuff_remove(ai.rdrb, idx);
+        if (opened)
+                frcti_opened(frcti, snd_lwe);
+        if (due)
+                frct_tmr_due(frcti);
         return -EAGAIN;
 }
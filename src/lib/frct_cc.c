@@ -0,0 +1,198 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Congestion control for FRCT
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define CC_INIT_WND  10             /* PDUs */
+#define CC_MIN_WND   2              /* PDUs */
+#define CC_MAX_WND   RQ_SIZE        /* PDUs */
+
+#define VEGAS_ALPHA  2              /* PDUs queued, grow below */
+#define VEGAS_BETA   4              /* PDUs queued, shrink above */
+#define VEGAS_GAMMA  1              /* PDUs queued, leave slow start */
+
+struct frct_cc_ops;
+
+struct frct_cc {
+        const struct frct_cc_ops * ops;
+        int                        algo;
+
+        uint32_t                   cwnd;     /* PDUs                   */
+        uint32_t                   ssthresh; /* PDUs                   */
+        uint32_t                   cnt;      /* ACKed since last grow  */
+        time_t                     rtt_min;  /* us, base rtt           */
+        uint32_t                   recover;  /* No new signal before   */
+};
+
+struct frct_cc_ops {
+        void (* init)(struct frct_cc * cc);
+
+        /* n PDUs were newly ACKed, rtt_us is a new sample or 0. */
+        void (* ack)(struct frct_cc * cc,
+                     uint32_t         n,
+                     time_t           rtt_us);
+
+        /* A loss or ECN mark, or a retransmission timeout. */
+        void (* cong)(struct frct_cc * cc,
+                      bool             rto);
+};
+
+static void none_init(struct frct_cc * cc)
+{
+        cc->cwnd     = CC_MAX_WND;
+        cc->ssthresh = CC_MAX_WND;
+}
+
+static void none_ack(struct frct_cc * cc,
+                     uint32_t         n,
+                     time_t           rtt_us)
+{
+        (void) cc;
+        (void) n;
+        (void) rtt_us;
+}
+
+static void none_cong(struct frct_cc * cc,
+                      bool             rto)
+{
+        (void) cc;
+        (void) rto;
+}
+
+static void reno_init(struct frct_cc * cc)
+{
+        cc->cwnd     = CC_INIT_WND;
+        cc->ssthresh = CC_MAX_WND;
+        cc->cnt      = 0;
+}
+
+/* Slow start below ssthresh, then one PDU per window. */
+static void reno_ack(struct frct_cc * cc,
+                     uint32_t         n,
+                     time_t           rtt_us)
+{
+        (void) rtt_us;
+
+        if (cc->cwnd < cc->ssthresh) {
+                cc->cwnd = MIN(cc->cwnd + n, cc->ssthresh);
+                return;
+        }
+
+        cc->cnt += n;
+        while (cc->cnt >= cc->cwnd) {
+                cc->cnt -= cc->cwnd;
+                ++cc->cwnd;
+        }
+
+        cc->cwnd = MIN(cc->cwnd, CC_MAX_WND);
+}
+
+static void reno_cong(struct frct_cc * cc,
+                      bool             rto)
+{
+        cc->ssthresh = MAX(cc->cwnd / 2, CC_MIN_WND);
+        cc->cwnd     = rto ? 1 : cc->ssthresh;
+        cc->cnt      = 0;
+}
+
+static void vegas_init(struct frct_cc * cc)
+{
+        reno_init(cc);
+
+        cc->rtt_min = 0;
+}
+
+/*
+ * Once per rtt sample, estimates the PDUs queued in the network from
+ * the rtt above the base rtt, and keeps them between alpha and beta.
+ */
+static void vegas_ack(struct frct_cc * cc,
+                      uint32_t         n,
+                      time_t           rtt_us)
+{
+        uint32_t diff;
+
+        (void) n;
+
+        if (rtt_us <= 0)
+                return;
+
+        if (cc->rtt_min == 0 || rtt_us < cc->rtt_min)
+                cc->rtt_min = rtt_us;
+
+        diff = cc->cwnd * (rtt_us - cc->rtt_min) / rtt_us;
+
+        if (cc->cwnd < cc->ssthresh) {
+                if (diff > VEGAS_GAMMA)
+                        cc->ssthresh = cc->cwnd;
+                else
+                        cc->cwnd = MIN(2 * cc->cwnd, CC_MAX_WND);
+                return;
+        }
+
+        if (diff < VEGAS_ALPHA)
+                cc->cwnd = MIN(cc->cwnd + 1, CC_MAX_WND);
+        else if (diff > VEGAS_BETA)
+                cc->cwnd = MAX(cc->cwnd - 1, CC_MIN_WND);
+
+        /* Do not slow start again after shrinking. */
+        cc->ssthresh = MIN(cc->ssthresh, cc->cwnd);
+}
+
+static const struct frct_cc_ops none_ops = {
+        none_init,
+        none_ack,
+        none_cong
+};
+
+static const struct frct_cc_ops reno_ops = {
+        reno_init,
+        reno_ack,
+        reno_cong
+};
+
+static const struct frct_cc_ops vegas_ops = {
+        vegas_init,
+        vegas_ack,
+        reno_cong
+};
+
+/* Indexed by the FRCTCC values in fccntl.h. */
+static const struct frct_cc_ops * cc_ops[] = {
+        &none_ops,
+        &reno_ops,
+        &vegas_ops
+};
+
+#define CC_ALGOS ((int) (sizeof(cc_ops) / sizeof(cc_ops[0])))
+
+static int frct_cc_init(struct frct_cc * cc,
+                        int              algo)
+{
+        if (algo < 0 || algo >= CC_ALGOS)
+                return -EINVAL;
+
+        cc->ops  = cc_ops[algo];
+        cc->algo = algo;
+
+        cc->ops->init(cc);
+
+        return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Futex based wait and wake for shared memory
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "config.h"
+
+#include <ouroboros/futex.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+void futex_init(struct futex * f)
+{
+        assert(f);
+
+        f->seq = 0;
+}
+
+uint32_t futex_prepare(struct futex * f)
+{
+        assert(f);
+
+        return __sync_fetch_and_or(&f->seq, 1) | 1;
+}
+
+int futex_wait(struct futex *          f,
+               uint32_t                seq,
+               const struct timespec * abstime)
+{
+        int op = FUTEX_WAIT_BITSET;
+        int old;
+        int ret;
+
+        assert(f);
+
+        if (PTHREAD_COND_CLOCK == CLOCK_REALTIME)
+                op |= FUTEX_CLOCK_REALTIME;
+
+        /* The syscall is not a cancellation point by itself. */
+        pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &old);
+
+        ret = syscall(SYS_futex, &f->seq, op, seq, abstime, NULL,
+                      FUTEX_BITSET_MATCH_ANY);
+
+        pthread_setcanceltype(old, NULL);
+
+        if (ret < 0 && errno == ETIMEDOUT)
+                return -ETIMEDOUT;
+
+        return 0;
+}
+
+void futex_wake(struct futex * f)
+{
+        uint32_t seq;
+
+        assert(f);
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        seq = __atomic_load_n(&f->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1))
+                return;
+
+        /* Clear the sleeper bit and move on, one waker does the call. */
+        if (__sync_bool_compare_and_swap(&f->seq, seq, seq + 1))
+                syscall(SYS_futex, &f->seq, FUTEX_WAKE, INT_MAX,
+                        NULL, NULL, 0);
+}
@@ -1,7 +1,7 @@
 /*
  * Ouroboros - Copyright (C) 2016 - 2020
  *
- * Timerwheel
+ * Timerwheel for FRCT retransmission, shared by all flows
  *
  *    Dimitri Staessens <dimitri.staessens@ugent.be>
  *    Sander Vrijders   <sander.vrijders@ugent.be>
@@ -22,77 +22,157 @@
 
 #include <ouroboros/list.h>
 
-#define RXMQ_S     16                 /* defines #slots           */
-#define RXMQ_M     24                 /* defines max delay  (us)  */
-#define RXMQ_R     (RXMQ_M - RXMQ_S)  /* defines resolution (us)  */
-#define RXMQ_SLOTS (1 << RXMQ_S)
-#define RXMQ_MAX   (1 << RXMQ_M)      /* us                       */
+#define RXMQ_BITS  8                       /* defines #slots per level */
+#define RXMQ_LVLS  3                       /* defines #levels          */
+#define RXMQ_R     8                       /* defines resolution (us)  */
+#define RXMQ_SLOTS (1 << RXMQ_BITS)
+#define RXMQ_SPAN  ((uint64_t) 1 << (RXMQ_BITS * RXMQ_LVLS)) /* ticks  */
+#define RXM_CHUNK  256                     /* records per allocation   */
 
 /* Small inacurracy to avoid slow division by MILLION. */
 #define ts_to_us(ts) (ts.tv_sec * MILLION + (ts.tv_nsec >> 10))
-#define ts_to_slot(ts) ((ts_to_us(ts) >> RXMQ_R) & (RXMQ_SLOTS - 1))
+#define ts_to_tick(ts) ((uint64_t) ts_to_us(ts) >> RXMQ_R)
 
 struct rxm {
-        struct list_head     next;
+        struct list_head     next;   /* In a slot or in the pool.        */
+        struct list_head     fnext;  /* In the frcti, in seqno order.    */
+        uint64_t             expiry; /* tick                             */
         uint32_t             seqno;
         struct shm_du_buff * sdb;
         uint8_t *            head;
-        uint8_t *            tail;
-        time_t               t0;    /* Time when original was sent (us). */
-        size_t               mul;   /* RTO multiplier.                   */
+        size_t               len;    /* Length when sent, can be chained. */
+        time_t               t0;     /* Time when original was sent (us). */
         struct frcti *       frcti;
 };
 
-struct rxmwheel {
-        struct list_head wheel[RXMQ_SLOTS];
+struct rxm_chunk {
+        struct list_head next;
+        struct rxm       rxms[RXM_CHUNK];
+};
+
+/*
+ * One hierarchical wheel per process. Level l has slots of
+ * 2^(RXMQ_BITS * l) ticks, its slots move down a level when the
+ * level below wraps.
+ */
+static struct {
+        struct list_head wheel[RXMQ_LVLS][RXMQ_SLOTS];
+        uint64_t         tick;   /* Next tick to process. */
+        size_t           count;  /* Records in use.       */
+
+        struct list_head pool;   /* Free records.         */
+        struct list_head chunks;
 
-        size_t           prv; /* Last processed slot. */
         pthread_mutex_t  lock;
-};
+} rw;
 
-static void rxmwheel_destroy(struct rxmwheel * rw)
+static int rxmwheel_init(void)
+{
+        size_t i;
+        size_t j;
+
+        if (pthread_mutex_init(&rw.lock, NULL))
+                return -1;
+
+        for (i = 0; i < RXMQ_LVLS; ++i)
+                for (j = 0; j < RXMQ_SLOTS; ++j)
+                        list_head_init(&rw.wheel[i][j]);
+
+        list_head_init(&rw.pool);
+        list_head_init(&rw.chunks);
+
+        rw.tick  = 0;
+        rw.count = 0;
+
+        return 0;
+}
+
+/* Call after all flows are gone. */
+static void rxmwheel_fini(void)
 {
-        size_t             i;
         struct list_head * p;
         struct list_head * h;
 
-        pthread_mutex_destroy(&rw->lock);
+        assert(rw.count == 0);
 
-        for (i = 0; i < RXMQ_SLOTS; ++i) {
-                list_for_each_safe(p, h, &rw->wheel[i]) {
-                        struct rxm * rxm = list_entry(p, struct rxm, next);
-                        list_del(&rxm->next);
-                        shm_du_buff_ack(rxm->sdb);
-                        ipcp_sdb_release(rxm->sdb);
-                        free(rxm);
-                }
+        list_for_each_safe(p, h, &rw.chunks) {
+                struct rxm_chunk * c = list_entry(p, struct rxm_chunk, next);
+                list_del(&c->next);
+                free(c);
         }
+
+        pthread_mutex_destroy(&rw.lock);
 }
 
-static struct rxmwheel * rxmwheel_create(void)
+/* Records come from chunks, which are kept until rxmwheel_fini. */
+static struct rxm * rxm_alloc(void)
 {
-        struct rxmwheel * rw;
-        struct timespec   now;
-        size_t            i;
+        struct rxm_chunk * c;
+        struct rxm *       r;
+        size_t             i;
 
-        rw = malloc(sizeof(*rw));
-        if (rw == NULL)
-                return NULL;
+        if (list_is_empty(&rw.pool)) {
+                c = malloc(sizeof(*c));
+                if (c == NULL)
+                        return NULL;
 
-        if (pthread_mutex_init(&rw->lock, NULL)) {
-                free(rw);
-                return NULL;
+                list_add(&c->next, &rw.chunks);
+
+                for (i = 0; i < RXM_CHUNK; ++i)
+                        list_add_tail(&c->rxms[i].next, &rw.pool);
         }
 
-        clock_gettime(PTHREAD_COND_CLOCK, &now);
+        r = list_first_entry(&rw.pool, struct rxm, next);
+        list_del(&r->next);
 
-        /* Mark the previous timeslot as the last one processed. */
-        rw->prv = (ts_to_slot(now) - 1) & (RXMQ_SLOTS - 1);
+        ++rw.count;
 
-        for (i = 0; i < RXMQ_SLOTS; ++i)
-                list_head_init(&rw->wheel[i]);
+        return r;
+}
 
-        return rw;
+/* Releases a record that is in no slot, and its PDU. */
+static void rxm_free(struct rxm * r)
+{
+        list_del(&r->fnext);
+
+        ipcp_sdb_release(r->sdb);
+
+        list_add(&r->next, &rw.pool);
+
+        --rw.count;
+}
+
+static void rxm_schedule(struct rxm * r,
+                         uint64_t     expiry)
+{
+        uint64_t delta;
+        size_t   lvl = 0;
+        size_t   slot;
+
+        if (expiry < rw.tick)
+                expiry = rw.tick;
+
+        if (expiry - rw.tick >= RXMQ_SPAN)
+                expiry = rw.tick + RXMQ_SPAN - 1;
+
+        delta = expiry - rw.tick;
+
+        while (lvl < RXMQ_LVLS - 1 && (delta >> (RXMQ_BITS * (lvl + 1))))
+                ++lvl;
+
+        slot = (expiry >> (RXMQ_BITS * lvl)) & (RXMQ_SLOTS - 1);
+
+        r->expiry = expiry;
+
+        list_add_tail(&r->next, &rw.wheel[lvl][slot]);
+}
+
+/* Cancels a scheduled record and releases its PDU. */
+static void rxm_cancel(struct rxm * r)
+{
+        list_del(&r->next);
+        shm_du_buff_ack(r->sdb);
+        rxm_free(r);
 }
 
 static void check_probe(struct frcti * frcti,
@@ -111,167 +191,290 @@ static void check_probe(struct frcti * frcti,
         pthread_rwlock_unlock(&frcti->lock);
 }
 
-static void rxmwheel_move(struct rxmwheel * rw)
+/* The receiver moves head and tail, copy what was sent. */
+static int rxm_copy(struct rxm *         r,
+                    struct shm_du_buff * sdb)
 {
-        struct timespec    now;
-        struct list_head * p;
-        struct list_head * h;
-        size_t             slot;
-        size_t             i;
+        uint8_t * buf;
 
-        pthread_mutex_lock(&rw->lock);
+        if (shm_du_buff_next(sdb) == NULL) {
+                shm_du_buff_extract(r->sdb, r->head, shm_du_buff_head(sdb),
+                                    r->len);
+                return 0;
+        }
 
-        pthread_cleanup_push((void (*) (void *)) pthread_mutex_unlock,
-                             (void *) &rw->lock);
+        buf = malloc(r->len);
+        if (buf == NULL)
+                return -ENOMEM;
 
-        clock_gettime(PTHREAD_COND_CLOCK, &now);
+        shm_du_buff_extract(r->sdb, r->head, buf, r->len);
+        shm_du_buff_scatter(sdb, 0, buf, r->len);
 
-        slot = ts_to_slot(now);
+        free(buf);
+
+        return 0;
+}
+
+/* Retransmits an expired record or reschedules it. */
+static void rxm_fire(struct rxm * r,
+                     time_t       now_us)
+{
+        struct frcti *       frcti = r->frcti;
+        struct flow *        f     = &flow_at(frcti->fd);
+        struct shm_du_buff * sdb;
+        uint8_t *            head;
+        ssize_t              idx;
+        uint32_t             snd_lwe;
+        uint32_t             rcv_lwe;
+        time_t               rto;
+        uint64_t             next;
+        bool                 sacked;
+        int                  ret;
 
-        i = rw->prv;
+        shm_du_buff_ack(r->sdb);
 
-        if (slot < i)
-                slot += RXMQ_SLOTS;
+        pthread_rwlock_rdlock(&frcti->lock);
 
-        while (i++ < slot) {
-                list_for_each_safe(p, h, &rw->wheel[i & (RXMQ_SLOTS - 1)]) {
-                        struct rxm *         r;
-                        struct frct_cr *     snd_cr;
-                        struct frct_cr *     rcv_cr;
-                        size_t               rslot;
-                        ssize_t              idx;
-                        struct shm_du_buff * sdb;
-                        uint8_t *            head;
-                        struct flow *        f;
-                        int                  fd;
-                        uint32_t             snd_lwe;
-                        uint32_t             rcv_lwe;
-                        time_t               rto;
+        snd_lwe = frcti->snd_cr.lwe;
+        rcv_lwe = frcti->rcv_cr.lwe;
+        rto     = frcti->rto;
+        sacked  = frcti_sacked(frcti, r->seqno);
 
-                        r = list_entry(p, struct rxm, next);
+        pthread_rwlock_unlock(&frcti->lock);
 
-                        list_del(&r->next);
+        /* The wheel may be catching up, schedule from now. */
+        next = ((uint64_t) now_us >> RXMQ_R) + MAX(rto >> RXMQ_R, 1);
 
-                        snd_cr = &r->frcti->snd_cr;
-                        rcv_cr = &r->frcti->rcv_cr;
-                        fd     = r->frcti->fd;
-                        f      = &ai.flows[fd];
+        /* Has been ack'd, remove. */
+        if ((int) (r->seqno - snd_lwe) < 0) {
+                rxm_free(r);
+                return;
+        }
 
-                        shm_du_buff_ack(r->sdb);
+        /* The receiver holds it, wait for the ACK. */
+        if (sacked) {
+                shm_du_buff_wait_ack(r->sdb);
+                rxm_schedule(r, next);
+                return;
+        }
 
-                        pthread_rwlock_rdlock(&r->frcti->lock);
+        /* Check for r-timer expiry. */
+        if (now_us - r->t0 > frcti->r)
+                goto flow_down;
+
+        /* Copy the payload, safe rtx in other layers. */
+        idx = shm_rdrbuff_alloc(ai.rdrb, r->len, NULL, &sdb);
+        if (idx == -EAGAIN) {
+                /* Do not wait for blocks with the wheel locked. */
+                shm_du_buff_wait_ack(r->sdb);
+                rxm_schedule(r, ((uint64_t) now_us >> RXMQ_R) + 1);
+                return;
+        }
 
-                        snd_lwe = snd_cr->lwe;
-                        rcv_lwe = rcv_cr->lwe;
-                        rto     = r->frcti->rto;
+        if (idx < 0)
+                goto flow_down;
 
-                        pthread_rwlock_unlock(&r->frcti->lock);
+        head = shm_du_buff_head(sdb);
+        if (rxm_copy(r, sdb)) {
+                ipcp_sdb_release(sdb);
+                goto flow_down;
+        }
 
-                        /* Has been ack'd, remove. */
-                        if ((int) (r->seqno - snd_lwe) < 0) {
-                                ipcp_sdb_release(r->sdb);
-                                free(r);
-                                continue;
-                        }
+        /* A sealed PDU keeps its ackno, the peer ignores an old one. */
+        if (f->qs.cypher_s == 0 && f->qs.ber != 0)
+                ((struct frct_pci *) head)->ackno = ntoh32(rcv_lwe);
+
+        /* Retransmit the copy, retry when the rb is full. */
+        ret = shm_rbuff_write(f->tx_rb, idx);
+        if (ret == -EAGAIN) {
+                ipcp_sdb_release(sdb);
+                shm_du_buff_wait_ack(r->sdb);
+                rxm_schedule(r, ((uint64_t) now_us >> RXMQ_R) + 1);
+                return;
+        }
 
-                        /* Check for r-timer expiry. */
-                        if (ts_to_us(now) - r->t0 > r->frcti->r) {
-                                ipcp_sdb_release(r->sdb);
-                                free(r);
-                                shm_rbuff_set_acl(ai.flows[fd].rx_rb,
-                                                  ACL_FLOWDOWN);
-                                shm_rbuff_set_acl(ai.flows[fd].tx_rb,
-                                                  ACL_FLOWDOWN);
-                                continue;
-                        }
+        if (ret < 0) {
+                ipcp_sdb_release(sdb);
+                goto flow_down;
+        }
 
-                        /* Copy the payload, safe rtx in other layers. */
-                        if (ipcp_sdb_reserve(&sdb, r->tail - r->head)) {
-                                ipcp_sdb_release(r->sdb);
-                                free(r);
-                                shm_rbuff_set_acl(f->rx_rb, ACL_FLOWDOWN);
-                                shm_rbuff_set_acl(f->tx_rb, ACL_FLOWDOWN);
-                                continue;
-                        }
+        ipcp_sdb_release(r->sdb);
 
-                        idx = shm_du_buff_get_idx(sdb);
+        check_probe(frcti, r->seqno);
 
-                        head = shm_du_buff_head(sdb);
-                        memcpy(head, r->head, r->tail - r->head);
+        pthread_rwlock_wrlock(&frcti->lock);
+        frcti_cong(frcti, r->seqno, true);
+        pthread_rwlock_unlock(&frcti->lock);
 
-                        ipcp_sdb_release(r->sdb);
+        /* Reschedule. */
+        shm_du_buff_wait_ack(sdb);
 
-                        check_probe(r->frcti, r->seqno);
+        shm_flow_set_notify(f->set, f->flow_id, FLOW_PKT);
 
-                        ((struct frct_pci *) head)->ackno = ntoh32(rcv_lwe);
+        r->head = head;
+        r->sdb  = sdb;
 
-                        /* Retransmit the copy. */
-                        if (shm_rbuff_write_b(f->tx_rb, idx, NULL)) {
-                                ipcp_sdb_release(sdb);
-                                free(r);
-                                shm_rbuff_set_acl(f->rx_rb, ACL_FLOWDOWN);
-                                shm_rbuff_set_acl(f->tx_rb, ACL_FLOWDOWN);
-                                continue;
-                        }
+        rxm_schedule(r, next);
 
-                        /* Reschedule. */
-                        shm_du_buff_wait_ack(sdb);
+        return;
 
-                        shm_flow_set_notify(f->set, f->flow_id, FLOW_PKT);
+ flow_down:
+        rxm_free(r);
+        shm_rbuff_set_acl(f->rx_rb, ACL_FLOWDOWN);
+        shm_rbuff_set_acl(f->tx_rb, ACL_FLOWDOWN);
+}
 
-                        r->head = head;
-                        r->tail = shm_du_buff_tail(sdb);
-                        r->sdb  = sdb;
+/* Processes rw.tick, moving down the slots of the upper levels first. */
+static void rxmwheel_tick(time_t now_us)
+{
+        struct list_head * h;
+        struct rxm *       r;
+        size_t             lvl;
 
-                        /* Schedule at least in the next time slot */
-                        rslot = (slot + MAX(rto >> RXMQ_R, 1))
-                                & (RXMQ_SLOTS - 1);
+        for (lvl = RXMQ_LVLS - 1; lvl > 0; --lvl) {
+                if (rw.tick & (((uint64_t) 1 << (RXMQ_BITS * lvl)) - 1))
+                        continue;
 
-                        list_add_tail(&r->next, &rw->wheel[rslot]);
+                h = &rw.wheel[lvl][(rw.tick >> (RXMQ_BITS * lvl))
+                                   & (RXMQ_SLOTS - 1)];
+                while (!list_is_empty(h)) {
+                        r = list_first_entry(h, struct rxm, next);
+                        list_del(&r->next);
+                        rxm_schedule(r, r->expiry);
                 }
         }
 
-        rw->prv = slot & (RXMQ_SLOTS - 1);
+        h = &rw.wheel[0][rw.tick & (RXMQ_SLOTS - 1)];
+        while (!list_is_empty(h)) {
+                r = list_first_entry(h, struct rxm, next);
+                list_del(&r->next);
+                rxm_fire(r, now_us);
+        }
+}
+
+static void rxmwheel_move(void)
+{
+        struct timespec now;
+        uint64_t        tick;
+
+        pthread_mutex_lock(&rw.lock);
+
+        pthread_cleanup_push((void (*) (void *)) pthread_mutex_unlock,
+                             (void *) &rw.lock);
+
+        clock_gettime(PTHREAD_COND_CLOCK, &now);
+
+        tick = ts_to_tick(now);
+
+        while (rw.count > 0 && rw.tick <= tick) {
+                rxmwheel_tick(ts_to_us(now));
+                ++rw.tick;
+        }
+
+        /* Nothing scheduled, skip the empty ticks. */
+        if (rw.count == 0)
+                rw.tick = tick + 1;
 
         pthread_cleanup_pop(true);
 }
 
-static int rxmwheel_add(struct rxmwheel *    rw,
-                        struct frcti *       frcti,
+static int rxmwheel_add(struct frcti *       frcti,
                         uint32_t             seqno,
                         struct shm_du_buff * sdb)
 {
-        struct timespec now;
-        struct rxm *    r;
-        size_t          slot;
+        struct timespec    now;
+        struct rxm *       r;
+        struct list_head * p;
+        time_t             rto;
+
+        clock_gettime(PTHREAD_COND_CLOCK, &now);
+
+        pthread_rwlock_rdlock(&frcti->lock);
 
-        r = malloc(sizeof(*r));
-        if (r == NULL)
+        rto = frcti->rto;
+
+        pthread_rwlock_unlock(&frcti->lock);
+
+        pthread_mutex_lock(&rw.lock);
+
+        r = rxm_alloc();
+        if (r == NULL) {
+                pthread_mutex_unlock(&rw.lock);
                 return -ENOMEM;
+        }
 
-        clock_gettime(PTHREAD_COND_CLOCK, &now);
+        /* The timer skipped ticks while the wheel was empty. */
+        if (rw.count == 1)
+                rw.tick = ts_to_tick(now);
 
         r->t0    = ts_to_us(now);
-        r->mul   = 0;
         r->seqno = seqno;
         r->sdb   = sdb;
         r->head  = shm_du_buff_head(sdb);
-        r->tail  = shm_du_buff_tail(sdb);
+        r->len   = shm_du_buff_len(sdb);
         r->frcti = frcti;
 
-        pthread_rwlock_rdlock(&r->frcti->lock);
-
-        slot = (((r->t0 + frcti->rto) >> RXMQ_R) + 1) & (RXMQ_SLOTS - 1);
-
-        pthread_rwlock_unlock(&r->frcti->lock);
+        /* Concurrent writers can add out of order. */
+        p = frcti->rxms.prv;
+        while (p != &frcti->rxms &&
+               (int32_t) (list_entry(p, struct rxm, fnext)->seqno - seqno) > 0)
+                p = p->prv;
 
-        pthread_mutex_lock(&rw->lock);
+        list_add(&r->fnext, p);
 
-        list_add_tail(&r->next, &rw->wheel[slot]);
+        rxm_schedule(r, ((r->t0 + rto) >> RXMQ_R) + 1);
 
         shm_du_buff_wait_ack(sdb);
 
-        pthread_mutex_unlock(&rw->lock);
+        pthread_mutex_unlock(&rw.lock);
 
         return 0;
 }
+
+/* Cancels the record of a PDU that was not written. */
+static void rxmwheel_del(struct frcti * frcti,
+                         uint32_t       seqno)
+{
+        struct list_head * p;
+        struct rxm *       r;
+
+        pthread_mutex_lock(&rw.lock);
+
+        list_for_each(p, &frcti->rxms) {
+                r = list_entry(p, struct rxm, fnext);
+                if (r->seqno == seqno) {
+                        rxm_cancel(r);
+                        break;
+                }
+        }
+
+        pthread_mutex_unlock(&rw.lock);
+}
+
+/* Cancels the records of the PDUs before lwe, oldest first. */
+static void rxmwheel_ack(struct frcti * frcti,
+                         uint32_t       lwe)
+{
+        struct rxm * r;
+
+        pthread_mutex_lock(&rw.lock);
+
+        while (!list_is_empty(&frcti->rxms)) {
+                r = list_first_entry(&frcti->rxms, struct rxm, fnext);
+                if ((int32_t) (r->seqno - lwe) >= 0)
+                        break;
+                rxm_cancel(r);
+        }
+
+        pthread_mutex_unlock(&rw.lock);
+}
+
+static void rxmwheel_clear(struct frcti * frcti)
+{
+        pthread_mutex_lock(&rw.lock);
+
+        while (!list_is_empty(&frcti->rxms))
+                rxm_cancel(list_first_entry(&frcti->rxms, struct rxm, fnext));
+
+        pthread_mutex_unlock(&rw.lock);
+}
@@ -28,6 +28,8 @@
 #include <ouroboros/time_utils.h>
 #include <ouroboros/shm_flow_set.h>
 #include <ouroboros/errno.h>
+#include <ouroboros/futex.h>
+#include <ouroboros/sockets.h>
 
 #include <pthread.h>
 #include <sys/mman.h>
@@ -37,7 +39,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
 /*
@@ -53,38 +58,99 @@
 
 #define FN_MAX_CHARS 255
 
-#define QUEUESIZE ((SHM_BUFFER_SIZE) * sizeof(struct portevent))
+#define FQ_SOCK_PATH SOCK_PATH "fqueue.%d.%zu" SOCK_PATH_SUFFIX
 
-#define SHM_FLOW_SET_FILE_SIZE (SYS_MAX_FLOWS * sizeof(ssize_t)             \
-                                + PROG_MAX_FQUEUES * sizeof(size_t)         \
-                                + PROG_MAX_FQUEUES * sizeof(pthread_cond_t) \
-                                + PROG_MAX_FQUEUES * QUEUESIZE              \
-                                + sizeof(pthread_mutex_t))
+#define FS_LINE  (64 / sizeof(size_t))
+#define FS_SLOTS (SHM_BUFFER_SIZE)          /* the events a wait returns */
+#define FS_MASK  (FS_SLOTS - 1)
+#define fq_lap(pos) ((pos) & ~(size_t) FS_MASK)
 
-#define fqueue_ptr(fs, idx) (fs->fqueues + (SHM_BUFFER_SIZE) * idx)
+#define FS_IDX_BITS 16
+#define FS_IDX_MASK ((1 << FS_IDX_BITS) - 1)
 
-struct portevent {
-        int flow_id;
-        int event;
+#define FS_EV_BITS  8                   /* fqueue events are flags  */
+#define FS_EVENTS   5                   /* FLOW_PKT to FLOW_DEALLOC */
+
+#if PROG_MAX_FQUEUES > (1 << FS_IDX_BITS)
+#error PROG_MAX_FQUEUES does not fit the flow set member table
+#endif
+
+#ifdef HAVE_FUTEX
+#define FS_CONDS 0
+#else
+#define FS_CONDS PROG_MAX_FQUEUES
+#endif
+
+#define SHM_FLOW_SET_FILE_SIZE (SYS_MAX_FLOWS * sizeof(uint64_t)            \
+                                + PROG_MAX_FQUEUES * sizeof(struct fq_ring) \
+                                + PROG_MAX_FQUEUES * FS_SLOTS               \
+                                * sizeof(struct fq_slot)                    \
+                                + sizeof(pthread_mutex_t)                   \
+                                + FS_CONDS * sizeof(pthread_cond_t)         \
+                                + 2 * SYS_MAX_FLOWS * sizeof(uint64_t)      \
+                                + 2 * SYS_MAX_FLOWS * sizeof(int32_t))
+
+#define fq_slot_ptr(fs, idx, pos)                                       \
+        (fs->slots + FS_SLOTS * (idx) + ((pos) & FS_MASK))
+
+/*
+ * Each fqueue is a bounded multi-producer ring of events, the events
+ * that do not fit stay with the flows. A slot's seq tells whose turn
+ * it is: the lap of pos when free for the producer that claims pos,
+ * that lap + 1 once filled for the consumer at pos. Counting in laps
+ * instead of positions, a zeroed ring is empty without setup.
+ */
+struct fq_slot {
+        size_t seq;
+        int    flow_id;
+        int    event;
+};
+
+struct fq_ring {
+        size_t       head;               /* consumers claim here */
+        size_t       pad0[FS_LINE - 1];
+        size_t       tail;               /* producers claim here */
+        size_t       pad1[FS_LINE - 1];
+        struct futex wake;               /* consumer sleeps here */
+        uint32_t     armed;              /* signal the pollable fd */
+        uint32_t     lost;               /* events left with flows */
+        int32_t      first;              /* member list, -1 if none */
+        uint64_t     gen;                /* membership, 0 if unused */
+        size_t       pad2[FS_LINE - 1];
 };
 
+/*
+ * A flow is in fqueue idx if its mtable entry is gen << FS_IDX_BITS |
+ * idx for the current gen of that ring. Bumping the gen empties the
+ * fqueue in O(1), zeroed entries and rings are not in use. The members
+ * are also on a list through next and prev, for the rescan.
+ */
 struct shm_flow_set {
-        ssize_t *          mtable;
-        size_t *           heads;
-        pthread_cond_t *   conds;
-        struct portevent * fqueues;
-        pthread_mutex_t *  lock;
+        uint64_t *        mtable;
+        struct fq_ring *  rings;
+        struct fq_slot *  slots;
+        pthread_mutex_t * lock;     /* membership changes */
+        pthread_cond_t *  conds;    /* no futexes, sleep here */
+        uint64_t *        pending;  /* FLOW_PKT queued for member */
+        uint64_t *        lost;     /* member, events the ring lost */
+        int32_t *         next;     /* next member of the fqueue */
+        int32_t *         prev;     /* previous member */
+        int               fds[PROG_MAX_FQUEUES]; /* pollable, local */
 
         pid_t pid;
 };
 
+/* Unbound, for signalling the pollable fds of other processes. */
+static int fs_sock = -1;
+
 static struct shm_flow_set * flow_set_create(pid_t pid,
                                              int   flags)
 {
         struct shm_flow_set * set;
-        ssize_t *             shm_base;
+        uint64_t *            shm_base;
         char                  fn[FN_MAX_CHARS];
         int                   shm_fd;
+        int                   i;
 
         sprintf(fn, SHM_FLOW_SET_PREFIX "%d", pid);
 
@@ -96,6 +162,12 @@ static struct shm_flow_set * flow_set_create(pid_t pid,
         if (shm_fd == -1)
                 goto fail_shm_open;
 
+        /* A new set starts zeroed, its pages are touched on use. */
+        if ((flags & O_CREAT) && ftruncate(shm_fd, 0) < 0) {
+                close(shm_fd);
+                goto fail_shm_open;
+        }
+
         if (ftruncate(shm_fd, SHM_FLOW_SET_FILE_SIZE - 1) < 0) {
                 close(shm_fd);
                 goto fail_shm_open;
@@ -114,11 +186,19 @@ static struct shm_flow_set * flow_set_create(pid_t pid,
                 goto fail_mmap;
 
         set->mtable  = shm_base;
-        set->heads   = (size_t *) (set->mtable + SYS_MAX_FLOWS);
-        set->conds   = (pthread_cond_t *)(set->heads + PROG_MAX_FQUEUES);
-        set->fqueues = (struct portevent *) (set->conds + PROG_MAX_FQUEUES);
+        set->rings   = (struct fq_ring *) (set->mtable + SYS_MAX_FLOWS);
+        set->slots   = (struct fq_slot *) (set->rings + PROG_MAX_FQUEUES);
         set->lock    = (pthread_mutex_t *)
-                (set->fqueues + PROG_MAX_FQUEUES * (SHM_BUFFER_SIZE));
+                (set->slots + PROG_MAX_FQUEUES * FS_SLOTS);
+        set->conds   = (pthread_cond_t *) (set->lock + 1);
+        set->pending = (uint64_t *) (set->conds + FS_CONDS);
+        set->lost    = set->pending + SYS_MAX_FLOWS;
+        set->next    = (int32_t *) (set->lost + SYS_MAX_FLOWS);
+        set->prev    = set->next + SYS_MAX_FLOWS;
+        set->pid     = pid;
+
+        for (i = 0; i < PROG_MAX_FQUEUES; ++i)
+                set->fds[i] = -1;
 
         return set;
 
@@ -131,13 +211,31 @@ static struct shm_flow_set * flow_set_create(pid_t pid,
         return NULL;
 }
 
+/* On first use, an unused ring's zeroed slots read as empty. */
+static void fq_ring_init(struct shm_flow_set * set,
+                         size_t                idx)
+{
+        struct fq_ring * r = set->rings + idx;
+
+        r->head     = 0;
+        r->tail     = 0;
+        r->wake.seq = 0;
+        r->armed    = 0;
+        r->lost     = 0;
+        r->first    = -1;
+
+        __atomic_store_n(&r->gen, 1, __ATOMIC_RELEASE);
+}
+
 struct shm_flow_set * shm_flow_set_create(pid_t pid)
 {
         struct shm_flow_set * set;
         pthread_mutexattr_t   mattr;
+#ifndef HAVE_FUTEX
         pthread_condattr_t    cattr;
-        mode_t                mask;
         int                   i;
+#endif
+        mode_t                mask;
 
         mask = umask(0);
 
@@ -148,8 +246,6 @@ struct shm_flow_set * shm_flow_set_create(pid_t pid)
         if (set == NULL)
                 goto fail_set;
 
-        set->pid = pid;
-
         if (pthread_mutexattr_init(&mattr))
                 goto fail_mutexattr_init;
 
@@ -162,7 +258,7 @@ struct shm_flow_set * shm_flow_set_create(pid_t pid)
 
         if (pthread_mutex_init(set->lock, &mattr))
                 goto fail_mattr_set;
-
+#ifndef HAVE_FUTEX
         if (pthread_condattr_init(&cattr))
                 goto fail_condattr_init;
 
@@ -174,16 +270,13 @@ struct shm_flow_set * shm_flow_set_create(pid_t pid)
                 goto fail_condattr_set;
 #endif
         for (i = 0; i < PROG_MAX_FQUEUES; ++i) {
-                set->heads[i] = 0;
                 if (pthread_cond_init(&set->conds[i], &cattr))
                         goto fail_init;
         }
-
-        for (i = 0; i < SYS_MAX_FLOWS; ++i)
-                set->mtable[i] = -1;
-
+#endif
         return set;
 
+#ifndef HAVE_FUTEX
  fail_init:
         while (i-- > 0)
                 pthread_cond_destroy(&set->conds[i]);
@@ -191,6 +284,7 @@ struct shm_flow_set * shm_flow_set_create(pid_t pid)
         pthread_condattr_destroy(&cattr);
  fail_condattr_init:
         pthread_mutex_destroy(set->lock);
+#endif
  fail_mattr_set:
         pthread_mutexattr_destroy(&mattr);
  fail_mutexattr_init:
@@ -219,32 +313,104 @@ void shm_flow_set_destroy(struct shm_flow_set * set)
 
 void shm_flow_set_close(struct shm_flow_set * set)
 {
+        size_t i;
+
         assert(set);
 
+        for (i = 0; i < PROG_MAX_FQUEUES; ++i)
+                shm_flow_set_close_fd(set, i);
+
         munmap(set->mtable, SHM_FLOW_SET_FILE_SIZE);
         free(set);
 }
 
+static uint64_t fs_member(const struct shm_flow_set * set,
+                          size_t                      idx)
+{
+        return __atomic_load_n(&set->rings[idx].gen, __ATOMIC_ACQUIRE)
+                << FS_IDX_BITS | idx;
+}
+
+/* The fqueue the flow is in, -1 if none. */
+static ssize_t flow_set_queue(const struct shm_flow_set * set,
+                              int                         flow_id)
+{
+        uint64_t m;
+        size_t   idx;
+
+        m = __atomic_load_n(set->mtable + flow_id, __ATOMIC_ACQUIRE);
+        if (m == 0)
+                return -1;
+
+        idx = m & FS_IDX_MASK;
+        if (idx >= PROG_MAX_FQUEUES || fs_member(set, idx) != m)
+                return -1;
+
+        return idx;
+}
+
+/*
+ * Membership changes take the lock, producers read the mtable without
+ * it. Events still queued for a flow that left are dropped on pop.
+ * A pending FLOW_PKT holds the membership it was queued for, so one
+ * set by a producer that raced with a move does not count for the new
+ * fqueue.
+ */
+static void flow_set_join(struct shm_flow_set * set,
+                          size_t                idx,
+                          int                   flow_id)
+{
+        struct fq_ring * r = set->rings + idx;
+
+        set->prev[flow_id] = -1;
+        set->next[flow_id] = r->first;
+        if (r->first >= 0)
+                set->prev[r->first] = flow_id;
+        r->first = flow_id;
+
+        __atomic_store_n(set->mtable + flow_id, fs_member(set, idx),
+                         __ATOMIC_RELEASE);
+}
+
+static void flow_set_leave(struct shm_flow_set * set,
+                           size_t                idx,
+                           int                   flow_id)
+{
+        int32_t prev = set->prev[flow_id];
+        int32_t next = set->next[flow_id];
+
+        __atomic_store_n(set->mtable + flow_id, 0, __ATOMIC_RELEASE);
+
+        if (prev >= 0)
+                set->next[prev] = next;
+        else
+                set->rings[idx].first = next;
+
+        if (next >= 0)
+                set->prev[next] = prev;
+}
+
 void shm_flow_set_zero(struct shm_flow_set * set,
                        size_t                idx)
 {
-        ssize_t i = 0;
+        struct fq_ring * r;
 
         assert(set);
         assert(idx < PROG_MAX_FQUEUES);
 
-        pthread_mutex_lock(set->lock);
+        r = set->rings + idx;
 
-        for (i = 0; i < SYS_MAX_FLOWS; ++i)
-                if (set->mtable[i] == (ssize_t) idx)
-                        set->mtable[i] = -1;
+        pthread_mutex_lock(set->lock);
 
-        set->heads[idx] = 0;
+        /* The links of the old members are stale, not followed. */
+        if (r->gen != 0) {
+                __atomic_store_n(&r->gen, r->gen + 1, __ATOMIC_RELEASE);
+                r->first = -1;
+        }
 
         pthread_mutex_unlock(set->lock);
 }
 
-
 int shm_flow_set_add(struct shm_flow_set * set,
                      size_t                idx,
                      int                   flow_id)
@@ -255,12 +421,15 @@ int shm_flow_set_add(struct shm_flow_set * set,
 
         pthread_mutex_lock(set->lock);
 
-        if (set->mtable[flow_id] != -1) {
+        if (flow_set_queue(set, flow_id) >= 0) {
                 pthread_mutex_unlock(set->lock);
                 return -EPERM;
         }
 
-        set->mtable[flow_id] = idx;
+        if (set->rings[idx].gen == 0)
+                fq_ring_init(set, idx);
+
+        flow_set_join(set, idx, flow_id);
 
         pthread_mutex_unlock(set->lock);
 
@@ -277,8 +446,8 @@ void shm_flow_set_del(struct shm_flow_set * set,
 
         pthread_mutex_lock(set->lock);
 
-        if (set->mtable[flow_id] == (ssize_t) idx)
-                set->mtable[flow_id] = -1;
+        if (set->mtable[flow_id] == fs_member(set, idx))
+                flow_set_leave(set, idx, flow_id);
 
         pthread_mutex_unlock(set->lock);
 }
@@ -287,57 +456,41 @@ int shm_flow_set_has(struct shm_flow_set * set,
                      size_t                idx,
                      int                   flow_id)
 {
-        int ret = 0;
-
         assert(set);
         assert(!(flow_id < 0) && flow_id < SYS_MAX_FLOWS);
         assert(idx < PROG_MAX_FQUEUES);
 
-        pthread_mutex_lock(set->lock);
-
-        if (set->mtable[flow_id] == (ssize_t) idx)
-                ret = 1;
+        return flow_set_queue(set, flow_id) == (ssize_t) idx;
+}
 
-        pthread_mutex_unlock(set->lock);
+#ifdef HAVE_FUTEX
+#define fs_prepare(set, idx) futex_prepare(&set->rings[idx].wake)
 
-        return ret;
+static int fs_wait(const struct shm_flow_set * set,
+                   size_t                      idx,
+                   uint32_t                    seq,
+                   const struct timespec *     abstime)
+{
+        return futex_wait(&set->rings[idx].wake, seq, abstime);
 }
 
-void shm_flow_set_notify(struct shm_flow_set * set,
-                         int                   flow_id,
-                         int                   event)
+#define fs_wake(set, idx) futex_wake(&set->rings[idx].wake)
+#else
+/* Same protocol as the futexes, sleeping on a condition variable. */
+static uint32_t fs_prepare(const struct shm_flow_set * set,
+                           size_t                      idx)
 {
-        assert(set);
-        assert(!(flow_id < 0) && flow_id < SYS_MAX_FLOWS);
-
-        pthread_mutex_lock(set->lock);
-
-        if (set->mtable[flow_id] == -1) {
-                pthread_mutex_unlock(set->lock);
-                return;
-        }
-
-        (fqueue_ptr(set, set->mtable[flow_id]) +
-         (set->heads[set->mtable[flow_id]]))->flow_id = flow_id;
-        (fqueue_ptr(set, set->mtable[flow_id]) +
-         (set->heads[set->mtable[flow_id]])++)->event = event;
-
-        pthread_cond_signal(&set->conds[set->mtable[flow_id]]);
-
-        pthread_mutex_unlock(set->lock);
+        return __atomic_or_fetch(&set->rings[idx].wake.seq, 1,
+                                 __ATOMIC_SEQ_CST);
 }
 
-
-ssize_t shm_flow_set_wait(const struct shm_flow_set * set,
-                          size_t                      idx,
-                          int *                       fqueue,
-                          const struct timespec *     abstime)
+static int fs_wait(const struct shm_flow_set * set,
+                   size_t                      idx,
+                   uint32_t                    seq,
+                   const struct timespec *     abstime)
 {
-        ssize_t ret = 0;
-
-        assert(set);
-        assert(idx < PROG_MAX_FQUEUES);
-        assert(fqueue);
+        struct futex * f   = &set->rings[idx].wake;
+        int            ret = 0;
 
 #ifndef HAVE_ROBUST_MUTEX
         pthread_mutex_lock(set->lock);
@@ -345,11 +498,10 @@ ssize_t shm_flow_set_wait(const struct shm_flow_set * set,
         if (pthread_mutex_lock(set->lock) == EOWNERDEAD)
                 pthread_mutex_consistent(set->lock);
 #endif
-
         pthread_cleanup_push((void(*)(void *))pthread_mutex_unlock,
                              (void *) set->lock);
 
-        while (set->heads[idx] == 0 && ret != -ETIMEDOUT) {
+        if (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq) {
                 if (abstime != NULL) {
                         ret = -pthread_cond_timedwait(set->conds + idx,
                                                       set->lock,
@@ -368,17 +520,460 @@ ssize_t shm_flow_set_wait(const struct shm_flow_set * set,
 #endif
         }
 
-        if (ret != -ETIMEDOUT) {
-                memcpy(fqueue,
-                       fqueue_ptr(set, idx),
-                       set->heads[idx] * sizeof(struct portevent));
-                ret = set->heads[idx];
-                set->heads[idx] = 0;
+        pthread_cleanup_pop(true);
+
+        return ret == -ETIMEDOUT ? -ETIMEDOUT : 0;
+}
+
+static void fs_wake(const struct shm_flow_set * set,
+                    size_t                      idx)
+{
+        struct futex * f = &set->rings[idx].wake;
+        uint32_t       seq;
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        seq = __atomic_load_n(&f->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1))
+                return;
+
+        if (!__atomic_compare_exchange_n(&f->seq, &seq, seq + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                return;
+
+#ifndef HAVE_ROBUST_MUTEX
+        pthread_mutex_lock(set->lock);
+#else
+        if (pthread_mutex_lock(set->lock) == EOWNERDEAD)
+                pthread_mutex_consistent(set->lock);
+#endif
+        pthread_cond_broadcast(set->conds + idx);
+
+        pthread_mutex_unlock(set->lock);
+}
+#endif
+
+static void fs_addr(struct sockaddr_un * addr,
+                    pid_t                pid,
+                    size_t               idx)
+{
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        sprintf(addr->sun_path, FQ_SOCK_PATH, pid, idx);
+}
+
+/* Makes the pollable fd readable, it holds at most a few bytes. */
+static void fs_signal(const struct shm_flow_set * set,
+                      size_t                      idx)
+{
+        struct sockaddr_un addr;
+        int                sock;
+        int                nil = -1;
+        char               c   = 0;
+
+        sock = __atomic_load_n(&fs_sock, __ATOMIC_ACQUIRE);
+        if (sock < 0) {
+                sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+                if (sock < 0)
+                        return;
+                if (!__atomic_compare_exchange_n(&fs_sock, &nil, sock, false,
+                                                 __ATOMIC_ACQ_REL,
+                                                 __ATOMIC_ACQUIRE)) {
+                        close(sock);
+                        sock = nil;
+                }
         }
 
-        pthread_cleanup_pop(true);
+        fs_addr(&addr, set->pid, idx);
+
+        sendto(sock, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL,
+               (struct sockaddr *) &addr, sizeof(addr));
+}
+
+static int fq_push(struct shm_flow_set * set,
+                   size_t                idx,
+                   int                   flow_id,
+                   int                   event)
+{
+        struct fq_ring * r = set->rings + idx;
+        struct fq_slot * sl;
+        size_t           pos;
+        size_t           seq;
+
+        pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        while (true) {
+                sl  = fq_slot_ptr(set, idx, pos);
+                seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+                if (seq == fq_lap(pos)) {
+                        if (__atomic_compare_exchange_n(&r->tail, &pos,
+                                                        pos + 1, true,
+                                                        __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED))
+                                break;
+                } else if ((ssize_t) (seq - fq_lap(pos)) < 0) {
+                        return -EAGAIN; /* full */
+                } else {
+                        pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+                }
+        }
+
+        sl->flow_id = flow_id;
+        sl->event   = event;
+
+        __atomic_store_n(&sl->seq, fq_lap(pos) + 1, __ATOMIC_RELEASE);
 
-        assert(ret);
+        return 0;
+}
+
+static int fq_pop(const struct shm_flow_set * set,
+                  size_t                      idx,
+                  int *                       flow_id,
+                  int *                       event)
+{
+        struct fq_ring * r = set->rings + idx;
+        struct fq_slot * sl;
+        size_t           pos;
+        size_t           seq;
+
+        pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        while (true) {
+                sl  = fq_slot_ptr(set, idx, pos);
+                seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+                if (seq == fq_lap(pos) + 1) {
+                        if (__atomic_compare_exchange_n(&r->head, &pos,
+                                                        pos + 1, true,
+                                                        __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED))
+                                break;
+                } else if ((ssize_t) (seq - (fq_lap(pos) + 1)) < 0) {
+                        return -EAGAIN; /* empty */
+                } else {
+                        pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+                }
+        }
+
+        *flow_id = sl->flow_id;
+        *event   = sl->event;
+
+        __atomic_store_n(&sl->seq, fq_lap(pos) + FS_SLOTS, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+/* Tags the event flags in a lost entry with the membership. */
+#define fs_lost_tag(m) ((m) << FS_EV_BITS)
+
+/*
+ * The ring is full, leave the event with the flow and have the
+ * consumer rescan. A FLOW_PKT stays pending, other events are kept
+ * as flags for the membership.
+ */
+static void flow_set_lost(struct shm_flow_set * set,
+                          size_t                idx,
+                          int                   flow_id,
+                          uint64_t              m,
+                          int                   event)
+{
+        uint64_t * l = set->lost + flow_id;
+        uint64_t   old;
+        uint64_t   new;
+
+        if (event != FLOW_PKT) {
+                old = __atomic_load_n(l, __ATOMIC_RELAXED);
+                do {
+                        new = (old >> FS_EV_BITS) ==
+                                (fs_lost_tag(m) >> FS_EV_BITS) ?
+                                old : fs_lost_tag(m);
+                        new |= event;
+                } while (!__atomic_compare_exchange_n(l, &old, new, true,
+                                                      __ATOMIC_RELEASE,
+                                                      __ATOMIC_RELAXED));
+        }
+
+        __atomic_store_n(&set->rings[idx].lost, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * A flow has at most one FLOW_PKT event queued, the reader drains the
+ * flow when it gets it. This bounds the queue by the number of flows,
+ * other events are rare. Events that do not fit are not dropped, see
+ * flow_set_lost.
+ */
+static void flow_set_push(struct shm_flow_set * set,
+                          int                   flow_id,
+                          int                   event)
+{
+        uint64_t m;
+        ssize_t  q;
+
+        q = flow_set_queue(set, flow_id);
+        if (q < 0)
+                return;
+
+        m = fs_member(set, q);
+
+        if (event == FLOW_PKT &&
+            __atomic_exchange_n(set->pending + flow_id, m,
+                                __ATOMIC_ACQ_REL) == m)
+                return;
+
+        if (fq_push(set, q, flow_id, event) < 0)
+                flow_set_lost(set, q, flow_id, m, event);
+
+        fs_wake(set, q);
+
+        if (__atomic_load_n(&set->rings[q].armed, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&set->rings[q].armed, 0, __ATOMIC_ACQ_REL))
+                fs_signal(set, q);
+}
+
+void shm_flow_set_notify(struct shm_flow_set * set,
+                         int                   flow_id,
+                         int                   event)
+{
+        assert(set);
+        assert(!(flow_id < 0) && flow_id < SYS_MAX_FLOWS);
+
+        flow_set_push(set, flow_id, event);
+}
+
+void shm_flow_set_notify_n(struct shm_flow_set * set,
+                           int                   flow_id,
+                           int                   event,
+                           size_t                n)
+{
+        size_t i;
+
+        assert(set);
+        assert(!(flow_id < 0) && flow_id < SYS_MAX_FLOWS);
+
+        for (i = 0; i < n; ++i) {
+                flow_set_push(set, flow_id, event);
+                if (event == FLOW_PKT)
+                        break;
+        }
+}
+
+/*
+ * The ring was found empty, drain the pollable fd and arm it for the
+ * next producer. Events that raced in keep it readable.
+ */
+static void fs_rearm(const struct shm_flow_set * set,
+                     size_t                      idx)
+{
+        uint32_t * armed = &set->rings[idx].armed;
+        char       buf[64];
+
+        if (set->fds[idx] < 0)
+                return;
+
+        while (recv(set->fds[idx], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+                ;
+
+        __atomic_store_n(armed, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (shm_flow_set_ready(set, idx) &&
+            __atomic_exchange_n(armed, 0, __ATOMIC_ACQ_REL))
+                fs_signal(set, idx);
+}
+
+/*
+ * After the ring ran full, reports the events left with the members
+ * of fqueue idx, in flag order. Restarts when fqueue fills up, flows
+ * that were reported are cleared. Walks the member list under the
+ * lock, this is rare.
+ */
+static ssize_t flow_set_rescan(const struct shm_flow_set * set,
+                               size_t                      idx,
+                               int *                       fqueue,
+                               ssize_t                     n)
+{
+        uint64_t m;
+        uint64_t l;
+        uint64_t p;
+        int      flow_id;
+        int      ev;
+
+        pthread_mutex_lock(set->lock);
+
+        m = fs_member(set, idx);
+
+        for (flow_id = set->rings[idx].first; flow_id >= 0;
+             flow_id = set->next[flow_id]) {
+                if (n > (SHM_BUFFER_SIZE) - FS_EVENTS) {
+                        __atomic_store_n(&set->rings[idx].lost, 1,
+                                         __ATOMIC_RELEASE);
+                        break;
+                }
+
+                l = __atomic_load_n(set->lost + flow_id, __ATOMIC_ACQUIRE);
+                while ((l >> FS_EV_BITS) == (fs_lost_tag(m) >> FS_EV_BITS)) {
+                        if (!__atomic_compare_exchange_n(set->lost + flow_id,
+                                                         &l, 0, true,
+                                                         __ATOMIC_ACQ_REL,
+                                                         __ATOMIC_ACQUIRE))
+                                continue;
+                        for (ev = FLOW_DOWN; ev < (1 << FS_EV_BITS); ev <<= 1)
+                                if (l & ev) {
+                                        fqueue[2 * n]     = flow_id;
+                                        fqueue[2 * n + 1] = ev;
+                                        ++n;
+                                }
+                        break;
+                }
+
+                p = m;
+                if (__atomic_compare_exchange_n(set->pending + flow_id, &p, 0,
+                                                false, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_RELAXED)) {
+                        fqueue[2 * n]     = flow_id;
+                        fqueue[2 * n + 1] = FLOW_PKT;
+                        ++n;
+                }
+        }
+
+        pthread_mutex_unlock(set->lock);
+
+        return n;
+}
+
+/* Pops what is queued, rearms FLOW_PKT for the flows it pops. */
+static ssize_t flow_set_pop(const struct shm_flow_set * set,
+                            size_t                      idx,
+                            int *                       fqueue)
+{
+        ssize_t  n = 0;
+        uint64_t m;
+        int      flow_id;
+        int      event;
+
+        while (true) {
+                if (n == (SHM_BUFFER_SIZE))
+                        return n;
+                if (fq_pop(set, idx, &flow_id, &event) < 0)
+                        break;
+                m = fs_member(set, idx);
+                if (event == FLOW_PKT)
+                        __atomic_compare_exchange_n(set->pending + flow_id,
+                                                    &m, 0, false,
+                                                    __ATOMIC_ACQ_REL,
+                                                    __ATOMIC_RELAXED);
+
+                if (flow_set_queue(set, flow_id) != (ssize_t) idx)
+                        continue;
+
+                fqueue[2 * n]     = flow_id;
+                fqueue[2 * n + 1] = event;
+                ++n;
+        }
+
+        if (__atomic_load_n(&set->rings[idx].lost, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&set->rings[idx].lost, 0, __ATOMIC_ACQ_REL))
+                n = flow_set_rescan(set, idx, fqueue, n);
+
+        fs_rearm(set, idx);
+
+        return n;
+}
+
+int shm_flow_set_get_fd(struct shm_flow_set * set,
+                        size_t                idx)
+{
+        struct sockaddr_un addr;
+        int                fd;
+
+        assert(set);
+        assert(idx < PROG_MAX_FQUEUES);
+
+        if (set->fds[idx] >= 0)
+                return set->fds[idx];
+
+        fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (fd < 0)
+                return -errno;
+
+        fs_addr(&addr, set->pid, idx);
+        unlink(addr.sun_path);
+
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+                close(fd);
+                return -errno;
+        }
+
+        set->fds[idx] = fd;
+
+        fs_rearm(set, idx);
+
+        return fd;
+}
+
+void shm_flow_set_close_fd(struct shm_flow_set * set,
+                           size_t                idx)
+{
+        struct sockaddr_un addr;
+
+        assert(set);
+        assert(idx < PROG_MAX_FQUEUES);
+
+        if (set->fds[idx] < 0)
+                return;
+
+        __atomic_store_n(&set->rings[idx].armed, 0, __ATOMIC_RELEASE);
+
+        close(set->fds[idx]);
+        set->fds[idx] = -1;
+
+        fs_addr(&addr, set->pid, idx);
+        unlink(addr.sun_path);
+}
+
+bool shm_flow_set_ready(const struct shm_flow_set * set,
+                        size_t                      idx)
+{
+        struct fq_ring * r;
+        size_t           pos;
+
+        assert(set);
+        assert(idx < PROG_MAX_FQUEUES);
+
+        r   = set->rings + idx;
+        pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+        if (__atomic_load_n(&r->lost, __ATOMIC_RELAXED))
+                return true;
+
+        return __atomic_load_n(&fq_slot_ptr(set, idx, pos)->seq,
+                               __ATOMIC_RELAXED) == fq_lap(pos) + 1;
+}
+
+ssize_t shm_flow_set_wait(const struct shm_flow_set * set,
+                          size_t                      idx,
+                          int *                       fqueue,
+                          const struct timespec *     abstime)
+{
+        ssize_t  ret;
+        uint32_t seq;
+
+        assert(set);
+        assert(idx < PROG_MAX_FQUEUES);
+        assert(fqueue);
+
+        /* Only arm the wakeup and sleep if there are no events. */
+        while (true) {
+                ret = flow_set_pop(set, idx, fqueue);
+                if (ret > 0)
+                        break;
+
+                seq = fs_prepare(set, idx);
+
+                ret = flow_set_pop(set, idx, fqueue);
+                if (ret > 0)
+                        break;
+
+                if (fs_wait(set, idx, seq, abstime) == -ETIMEDOUT)
+                        return -ETIMEDOUT;
+        }
 
         return ret;
 }
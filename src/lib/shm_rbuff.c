@@ -29,8 +29,10 @@
 #include <ouroboros/time_utils.h>
 #include <ouroboros/errno.h>
 #include <ouroboros/fccntl.h>
+#include <ouroboros/futex.h>
 
 #include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -45,14 +47,23 @@
 
 #define FN_MAX_CHARS 255
 
-#define SHM_RB_FILE_SIZE ((SHM_RBUFF_SIZE) * sizeof(ssize_t)            \
-                          + 3 * sizeof(size_t)                          \
-                          + sizeof(pthread_mutex_t)                     \
-                          + 2 * sizeof (pthread_cond_t))
+/*
+ * The writer side and the reader side each get their own lines, with
+ * the mutex that serializes its threads. The acl gets a line.
+ */
+#define SHM_RB_LINE 64
+#define SHM_RB_SIDE ((2 * sizeof(size_t) + sizeof(pthread_mutex_t)      \
+                      + SHM_RB_LINE - 1) / SHM_RB_LINE * SHM_RB_LINE)
+
+#define SHM_RB_HDR_SIZE (2 * SHM_RB_SIDE + SHM_RB_LINE                  \
+                         + sizeof(pthread_mutex_t)                      \
+                         + 2 * sizeof (pthread_cond_t)                  \
+                         + 2 * sizeof(struct futex))
+
+#define SHM_RB_FILE_SIZE(n) ((n) * sizeof(ssize_t) + SHM_RB_HDR_SIZE)
 
-#define shm_rbuff_used(rb) ((*rb->head + (SHM_RBUFF_SIZE) - *rb->tail)   \
-                            & ((SHM_RBUFF_SIZE) - 1))
-#define shm_rbuff_free(rb) (shm_rbuff_used(rb) + 1 < (SHM_RBUFF_SIZE))
+#define shm_rbuff_used(rb) ((*rb->head - *rb->tail) & rb->mask)
+#define shm_rbuff_free(rb) (shm_rbuff_used(rb) < rb->mask)
 #define shm_rbuff_empty(rb) (*rb->head == *rb->tail)
 #define head_el_ptr(rb) (rb->shm_base + *rb->head)
 #define tail_el_ptr(rb) (rb->shm_base + *rb->tail)
@@ -60,11 +71,18 @@
 struct shm_rbuff {
         ssize_t *         shm_base; /* start of entry                */
         size_t *          head;     /* start of ringbuffer head      */
+        size_t *          ctail;    /* tail as last seen by a writer */
+        pthread_mutex_t * wlock;    /* serializes writers            */
         size_t *          tail;     /* start of ringbuffer tail      */
+        size_t *          chead;    /* head as last seen by a reader */
+        pthread_mutex_t * rlock;    /* serializes readers            */
         size_t *          acl;      /* access control                */
         pthread_mutex_t * lock;     /* lock all free space in shm    */
         pthread_cond_t *  add;      /* packet arrived                */
         pthread_cond_t *  del;      /* packet removed                */
+        struct futex *    fadd;     /* packet arrived, lockless      */
+        struct futex *    fdel;     /* packet removed, lockless      */
+        size_t            mask;     /* number of slots - 1           */
         pid_t             pid;      /* pid of the owner              */
         int               flow_id;  /* flow_id of the flow           */
 };
@@ -73,20 +91,36 @@ void shm_rbuff_close(struct shm_rbuff * rb)
 {
         assert(rb);
 
-        munmap(rb->shm_base, SHM_RB_FILE_SIZE);
+        munmap(rb->shm_base, SHM_RB_FILE_SIZE(rb->mask + 1));
 
         free(rb);
 }
 
 #define MM_FLAGS (PROT_READ | PROT_WRITE)
 
-struct shm_rbuff * rbuff_create(pid_t pid,
-                                int   flow_id,
-                                int   flags)
+/* Round up to a power of 2 within the configured bounds. */
+static size_t rbuff_slots(size_t size)
+{
+        size_t n = SHM_RBUFF_MIN;
+
+        if (size == 0)
+                return SHM_RBUFF_SIZE;
+
+        while (n < size && n < SHM_RBUFF_MAX)
+                n <<= 1;
+
+        return n;
+}
+
+static struct shm_rbuff * rbuff_create(pid_t  pid,
+                                       int    flow_id,
+                                       size_t size,
+                                       int    flags)
 {
         struct shm_rbuff * rb;
         int                fd;
         ssize_t *          shm_base;
+        struct stat        st;
         char               fn[FN_MAX_CHARS];
 
         sprintf(fn, SHM_RBUFF_PREFIX "%d.%d", pid, flow_id);
@@ -99,22 +133,39 @@ struct shm_rbuff * rbuff_create(pid_t pid,
         if (fd == -1)
                 goto fail_open;
 
-        if ((flags & O_CREAT) && ftruncate(fd, SHM_RB_FILE_SIZE - 1) < 0)
-                goto fail_truncate;
-
-        shm_base = mmap(NULL, SHM_RB_FILE_SIZE, MM_FLAGS, MAP_SHARED, fd, 0);
+        if (flags & O_CREAT) {
+                if (ftruncate(fd, SHM_RB_FILE_SIZE(size)) < 0)
+                        goto fail_truncate;
+        } else {
+                /* The creator picked the size, the file has it. */
+                if (fstat(fd, &st) < 0)
+                        goto fail_truncate;
+                if ((size_t) st.st_size < SHM_RB_HDR_SIZE)
+                        goto fail_truncate;
+                size = (st.st_size - SHM_RB_HDR_SIZE) / sizeof(ssize_t);
+        }
+
+        shm_base = mmap(NULL, SHM_RB_FILE_SIZE(size), MM_FLAGS, MAP_SHARED,
+                        fd, 0);
         if (shm_base == MAP_FAILED)
                 goto fail_truncate;
 
         close(fd);
 
         rb->shm_base = shm_base;
-        rb->head     = (size_t *) (rb->shm_base + (SHM_RBUFF_SIZE));
-        rb->tail     = rb->head + 1;
-        rb->acl      = rb->tail + 1;
-        rb->lock     = (pthread_mutex_t *) (rb->acl + 1);
+        rb->head     = (size_t *) (rb->shm_base + size);
+        rb->ctail    = rb->head + 1;
+        rb->wlock    = (pthread_mutex_t *) (rb->head + 2);
+        rb->tail     = (size_t *) ((uint8_t *) rb->head + SHM_RB_SIDE);
+        rb->chead    = rb->tail + 1;
+        rb->rlock    = (pthread_mutex_t *) (rb->tail + 2);
+        rb->acl      = (size_t *) ((uint8_t *) rb->tail + SHM_RB_SIDE);
+        rb->lock     = (pthread_mutex_t *) ((uint8_t *) rb->acl + SHM_RB_LINE);
         rb->add      = (pthread_cond_t *) (rb->lock + 1);
         rb->del      = rb->add + 1;
+        rb->fadd     = (struct futex *) (rb->del + 1);
+        rb->fdel     = rb->fadd + 1;
+        rb->mask     = size - 1;
         rb->pid      = pid;
         rb->flow_id  = flow_id;
 
@@ -130,8 +181,9 @@ struct shm_rbuff * rbuff_create(pid_t pid,
         return NULL;
 }
 
-struct shm_rbuff * shm_rbuff_create(pid_t pid,
-                                    int   flow_id)
+struct shm_rbuff * shm_rbuff_create(pid_t  pid,
+                                    int    flow_id,
+                                    size_t size)
 {
         struct shm_rbuff *  rb;
         pthread_mutexattr_t mattr;
@@ -140,7 +192,8 @@ struct shm_rbuff * shm_rbuff_create(pid_t pid,
 
         mask = umask(0);
 
-        rb = rbuff_create(pid, flow_id, O_CREAT | O_EXCL | O_RDWR);
+        rb = rbuff_create(pid, flow_id, rbuff_slots(size),
+                          O_CREAT | O_EXCL | O_RDWR);
 
         umask(mask);
 
@@ -157,6 +210,12 @@ struct shm_rbuff * shm_rbuff_create(pid_t pid,
         if (pthread_mutex_init(rb->lock, &mattr))
                 goto fail_mutex;
 
+        if (pthread_mutex_init(rb->wlock, &mattr))
+                goto fail_wlock;
+
+        if (pthread_mutex_init(rb->rlock, &mattr))
+                goto fail_rlock;
+
         if (pthread_condattr_init(&cattr))
                 goto fail_cattr;
 
@@ -170,9 +229,14 @@ struct shm_rbuff * shm_rbuff_create(pid_t pid,
         if (pthread_cond_init(rb->del, &cattr))
                 goto fail_del;
 
-        *rb->acl  = ACL_RDWR;
-        *rb->head = 0;
-        *rb->tail = 0;
+        rb->fadd->seq = 0;
+        rb->fdel->seq = 0;
+
+        *rb->acl   = ACL_RDWR;
+        *rb->head  = 0;
+        *rb->ctail = 0;
+        *rb->tail  = 0;
+        *rb->chead = 0;
 
         rb->pid = pid;
         rb->flow_id = flow_id;
@@ -187,6 +251,10 @@ struct shm_rbuff * shm_rbuff_create(pid_t pid,
  fail_add:
         pthread_condattr_destroy(&cattr);
  fail_cattr:
+        pthread_mutex_destroy(rb->rlock);
+ fail_rlock:
+        pthread_mutex_destroy(rb->wlock);
+ fail_wlock:
         pthread_mutex_destroy(rb->lock);
  fail_mutex:
         pthread_mutexattr_destroy(&mattr);
@@ -199,7 +267,21 @@ struct shm_rbuff * shm_rbuff_create(pid_t pid,
 struct shm_rbuff * shm_rbuff_open(pid_t pid,
                                   int   flow_id)
 {
-        return rbuff_create(pid, flow_id, O_RDWR);
+        return rbuff_create(pid, flow_id, 0, O_RDWR);
+}
+
+size_t shm_rbuff_size(struct shm_rbuff * rb)
+{
+        assert(rb);
+
+        return rb->mask + 1;
+}
+
+bool shm_rbuff_ready(struct shm_rbuff * rb)
+{
+        assert(rb);
+
+        return *(volatile size_t *) rb->head != *(volatile size_t *) rb->tail;
 }
 
 #if (defined(SHM_RBUFF_LOCKLESS) &&                            \
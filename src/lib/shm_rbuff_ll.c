@@ -20,70 +20,131 @@
  * Foundation, Inc., http://www.fsf.org/about/contact/.
  */
 
-#define RB_HEAD __sync_fetch_and_add(rb->head, 0)
-#define RB_TAIL __sync_fetch_and_add(rb->tail, 0)
 
-void shm_rbuff_destroy(struct shm_rbuff * rb)
-{
-        char fn[FN_MAX_CHARS];
+/*
+ * Single producer, single consumer ring. The writer owns head and
+ * its copy of tail, the reader owns tail and its copy of head, each
+ * on a cache line of its own. Concurrent writers (or readers) take
+ * turns through a robust mutex on their own line, which is
+ * uncontended in the common case of one thread per side.
+ */
 
-        assert(rb);
+#define RB_MASK (rb->mask)
 
-        sprintf(fn, SHM_RBUFF_PREFIX "%d.%d", rb->pid, rb->flow_id);
+#define RB_LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define RB_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
 
-        shm_rbuff_close(rb);
+/*
+ * Head (tail) moves in a single store after the slots are written, a
+ * process that dies holding the lock leaves the ring as it was.
+ */
+static void rb_lock(pthread_mutex_t * l)
+{
+#ifndef HAVE_ROBUST_MUTEX
+        pthread_mutex_lock(l);
+#else
+        if (pthread_mutex_lock(l) == EOWNERDEAD)
+                pthread_mutex_consistent(l);
+#endif
+}
 
-        shm_unlink(fn);
+static void rb_unlock(pthread_mutex_t * l)
+{
+        pthread_mutex_unlock(l);
 }
 
-int shm_rbuff_write(struct shm_rbuff * rb,
-                    size_t             idx)
+/* Called with the writer lock held. */
+static size_t rb_push(struct shm_rbuff * rb,
+                      const size_t *     idx,
+                      size_t             n)
 {
-        size_t ohead;
-        size_t nhead;
-        bool   was_empty = false;
+        size_t head;
+        size_t room;
+        size_t i;
+
+        head = __atomic_load_n(rb->head, __ATOMIC_RELAXED);
+        room = (*rb->ctail + RB_MASK - head) & RB_MASK;
+        if (room < n) {
+                *rb->ctail = RB_LOAD(rb->tail);
+                room = (*rb->ctail + RB_MASK - head) & RB_MASK;
+        }
 
-        assert(rb);
-        assert(idx < SHM_BUFFER_SIZE);
+        if (n > room)
+                n = room;
 
-        if (__sync_fetch_and_add(rb->acl, 0) != ACL_RDWR) {
-                if (__sync_fetch_and_add(rb->acl, 0) & ACL_FLOWDOWN)
-                        return -EFLOWDOWN;
-                else if (__sync_fetch_and_add(rb->acl, 0) & ACL_RDONLY)
-                        return -ENOTALLOC;
+        for (i = 0; i < n; ++i)
+                *(rb->shm_base + ((head + i) & RB_MASK)) = (ssize_t) idx[i];
+
+        RB_STORE(rb->head, (head + n) & RB_MASK);
+
+        return n;
+}
+
+/* Called with the reader lock held. */
+static size_t rb_pop(struct shm_rbuff * rb,
+                     ssize_t *          idx,
+                     size_t             n)
+{
+        size_t tail;
+        size_t used;
+        size_t i;
+
+        tail = __atomic_load_n(rb->tail, __ATOMIC_RELAXED);
+        used = (*rb->chead - tail) & RB_MASK;
+        if (used < n) {
+                *rb->chead = RB_LOAD(rb->head);
+                used = (*rb->chead - tail) & RB_MASK;
         }
 
-        if (!shm_rbuff_free(rb))
-                return -EAGAIN;
+        if (n > used)
+                n = used;
 
-        if (shm_rbuff_empty(rb))
-                was_empty = true;
+        for (i = 0; i < n; ++i)
+                idx[i] = *(rb->shm_base + ((tail + i) & RB_MASK));
 
-        nhead = RB_HEAD;
+        RB_STORE(rb->tail, (tail + n) & RB_MASK);
 
-        *(rb->shm_base + nhead) = (ssize_t) idx;
+        return n;
+}
 
-        do {
-                ohead = nhead;
-                nhead = (ohead + 1) & ((SHM_RBUFF_SIZE) - 1);
-                nhead = __sync_val_compare_and_swap(rb->head, ohead, nhead);
-        } while (nhead != ohead);
+#ifdef HAVE_FUTEX
+#define rb_prepare(f) futex_prepare(f)
 
-        if (was_empty)
-                pthread_cond_broadcast(rb->add);
+static int rb_wait(struct shm_rbuff *      rb,
+                   struct futex *          f,
+                   pthread_cond_t *        cond,
+                   uint32_t                seq,
+                   const struct timespec * abstime)
+{
+        (void) rb;
+        (void) cond;
 
-        return 0;
+        return futex_wait(f, seq, abstime);
 }
 
-/* FIXME: this is a copy of the pthr implementation */
-int shm_rbuff_write_b(struct shm_rbuff *      rb,
-                      size_t                  idx,
-                      const struct timespec * abstime)
+static void rb_wake(struct shm_rbuff * rb,
+                    struct futex *     f,
+                    pthread_cond_t *   cond)
 {
-        int ret = 0;
+        (void) rb;
+        (void) cond;
 
-        assert(rb);
-        assert(idx < SHM_BUFFER_SIZE);
+        futex_wake(f);
+}
+#else
+/* Same protocol as the futexes, sleeping on a condition variable. */
+static uint32_t rb_prepare(struct futex * f)
+{
+        return __atomic_or_fetch(&f->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static int rb_wait(struct shm_rbuff *      rb,
+                   struct futex *          f,
+                   pthread_cond_t *        cond,
+                   uint32_t                seq,
+                   const struct timespec * abstime)
+{
+        int ret = 0;
 
 #ifndef HAVE_ROBUST_MUTEX
         pthread_mutex_lock(rb->lock);
@@ -91,113 +152,191 @@ int shm_rbuff_write_b(struct shm_rbuff *      rb,
         if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
                 pthread_mutex_consistent(rb->lock);
 #endif
-
-        if (*rb->acl != ACL_RDWR) {
-                if (*rb->acl & ACL_FLOWDOWN)
-                        ret = -EFLOWDOWN;
-                else if (*rb->acl & ACL_RDONLY)
-                        ret = -ENOTALLOC;
-                goto err;
-        }
-
         pthread_cleanup_push((void(*)(void *))pthread_mutex_unlock,
                              (void *) rb->lock);
 
-        while (!shm_rbuff_free(rb) && ret != -ETIMEDOUT) {
+        if (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq) {
                 if (abstime != NULL)
-                        ret = -pthread_cond_timedwait(rb->add,
-                                                      rb->lock,
-                                                      abstime);
+                        ret = -pthread_cond_timedwait(cond, rb->lock, abstime);
                 else
-                        ret = -pthread_cond_wait(rb->add, rb->lock);
+                        ret = -pthread_cond_wait(cond, rb->lock);
 #ifdef HAVE_ROBUST_MUTEX
                 if (ret == -EOWNERDEAD)
                         pthread_mutex_consistent(rb->lock);
 #endif
         }
 
-        if (shm_rbuff_empty(rb))
-                pthread_cond_broadcast(rb->add);
+        pthread_cleanup_pop(true);
 
-        if (ret != -ETIMEDOUT) {
-                *head_el_ptr(rb) = (ssize_t) idx;
-                *rb->head = (*rb->head + 1) & ((SHM_RBUFF_SIZE) -1);
-        }
+        return ret == -ETIMEDOUT ? -ETIMEDOUT : 0;
+}
 
-        pthread_cleanup_pop(true);
+static void rb_wake(struct shm_rbuff * rb,
+                    struct futex *     f,
+                    pthread_cond_t *   cond)
+{
+        uint32_t seq;
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        seq = __atomic_load_n(&f->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1))
+                return;
+
+        if (!__atomic_compare_exchange_n(&f->seq, &seq, seq + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                return;
+
+#ifndef HAVE_ROBUST_MUTEX
+        pthread_mutex_lock(rb->lock);
+#else
+        if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
+                pthread_mutex_consistent(rb->lock);
+#endif
+        pthread_cond_broadcast(cond);
 
-        return ret;
- err:
         pthread_mutex_unlock(rb->lock);
+}
+#endif
+
+static int rb_check_acl(struct shm_rbuff * rb)
+{
+        size_t acl = __atomic_load_n(rb->acl, __ATOMIC_RELAXED);
+
+        if (acl == ACL_RDWR)
+                return 0;
+
+        if (acl & ACL_FLOWDOWN)
+                return -EFLOWDOWN;
+
+        if (acl & ACL_RDONLY)
+                return -ENOTALLOC;
+
+        return 0;
+}
+
+void shm_rbuff_destroy(struct shm_rbuff * rb)
+{
+        char fn[FN_MAX_CHARS];
+
+        assert(rb);
+
+        sprintf(fn, SHM_RBUFF_PREFIX "%d.%d", rb->pid, rb->flow_id);
+
+        shm_rbuff_close(rb);
+
+        shm_unlink(fn);
+}
+
+ssize_t shm_rbuff_write_n(struct shm_rbuff * rb,
+                          const size_t *     idx,
+                          size_t             n)
+{
+        ssize_t ret;
+
+        assert(rb);
+        assert(idx);
+
+        ret = rb_check_acl(rb);
+        if (ret < 0)
+                return ret;
+
+        rb_lock(rb->wlock);
+
+        ret = (ssize_t) rb_push(rb, idx, n);
+
+        rb_unlock(rb->wlock);
+
+        if (ret == 0)
+                return -EAGAIN;
+
+        rb_wake(rb, rb->fadd, rb->add);
+
         return ret;
 }
 
-ssize_t shm_rbuff_read(struct shm_rbuff * rb)
+int shm_rbuff_write(struct shm_rbuff * rb,
+                    size_t             idx)
 {
-        size_t otail;
-        size_t ntail;
+        ssize_t ret;
+
+        ret = shm_rbuff_write_n(rb, &idx, 1);
+
+        return ret < 0 ? (int) ret : 0;
+}
+
+int shm_rbuff_write_b(struct shm_rbuff *      rb,
+                      size_t                  idx,
+                      const struct timespec * abstime)
+{
+        uint32_t seq;
+        int      ret;
+
+        assert(rb);
+
+        ret = shm_rbuff_write(rb, idx);
+        while (ret == -EAGAIN) {
+                seq = rb_prepare(rb->fdel);
+                ret = shm_rbuff_write(rb, idx);
+                if (ret == -EAGAIN
+                    && rb_wait(rb, rb->fdel, rb->del, seq, abstime))
+                        ret = -ETIMEDOUT;
+        }
+
+        return ret;
+}
+
+ssize_t shm_rbuff_read_n(struct shm_rbuff * rb,
+                         ssize_t *          idx,
+                         size_t             n)
+{
+        ssize_t ret;
 
         assert(rb);
+        assert(idx);
+
+        rb_lock(rb->rlock);
 
-        if (shm_rbuff_empty(rb))
-                return __sync_fetch_and_add(rb->acl, 0) & ACL_FLOWDOWN ?
-                        -EFLOWDOWN : -EAGAIN;
+        ret = (ssize_t) rb_pop(rb, idx, n);
 
-        ntail = RB_TAIL;
+        rb_unlock(rb->rlock);
+
+        if (ret == 0)
+                return __atomic_load_n(rb->acl, __ATOMIC_RELAXED)
+                        & ACL_FLOWDOWN ? -EFLOWDOWN : -EAGAIN;
+
+        rb_wake(rb, rb->fdel, rb->del);
+
+        return ret;
+}
 
-        do {
-                otail = ntail;
-                ntail = (otail + 1) & ((SHM_RBUFF_SIZE) - 1);
-                ntail = __sync_val_compare_and_swap(rb->tail, otail, ntail);
-        } while (ntail != otail);
+ssize_t shm_rbuff_read(struct shm_rbuff * rb)
+{
+        ssize_t idx;
+        ssize_t ret;
 
-        pthread_cond_broadcast(rb->del);
+        ret = shm_rbuff_read_n(rb, &idx, 1);
 
-        return *(rb->shm_base + ntail);
+        return ret < 0 ? ret : idx;
 }
 
 ssize_t shm_rbuff_read_b(struct shm_rbuff *      rb,
                          const struct timespec * abstime)
 {
-        ssize_t idx = -1;
+        uint32_t seq;
+        ssize_t  idx;
 
         assert(rb);
 
-        /* try a non-blocking read first */
         idx = shm_rbuff_read(rb);
-        if (idx != -EAGAIN)
-                return idx;
-
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rb->lock);
-#else
-        if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
-                pthread_mutex_consistent(rb->lock);
-#endif
-        pthread_cleanup_push((void(*)(void *))pthread_mutex_unlock,
-                             (void *) rb->lock);
-
-        while (shm_rbuff_empty(rb) && (idx != -ETIMEDOUT)) {
-                if (abstime != NULL)
-                        idx = -pthread_cond_timedwait(rb->add,
-                                                      rb->lock,
-                                                      abstime);
-                else
-                        idx = -pthread_cond_wait(rb->add, rb->lock);
-#ifdef HAVE_ROBUST_MUTEX
-                if (idx == -EOWNERDEAD)
-                        pthread_mutex_consistent(rb->lock);
-#endif
-        }
-
-        if (idx != -ETIMEDOUT) {
-                /* do a nonblocking read */
+        while (idx == -EAGAIN) {
+                seq = rb_prepare(rb->fadd);
                 idx = shm_rbuff_read(rb);
-                assert(idx >= 0);
+                if (idx == -EAGAIN
+                    && rb_wait(rb, rb->fadd, rb->add, seq, abstime))
+                        idx = -ETIMEDOUT;
         }
 
-        pthread_cleanup_pop(true);
-
         return idx;
 }
 
@@ -206,46 +345,36 @@ void shm_rbuff_set_acl(struct shm_rbuff * rb,
 {
         assert(rb);
 
-        __sync_bool_compare_and_swap(rb->acl, *rb->acl, flags);
+        __atomic_store_n(rb->acl, (size_t) flags, __ATOMIC_RELEASE);
+
+        rb_wake(rb, rb->fadd, rb->add);
+        rb_wake(rb, rb->fdel, rb->del);
 }
 
 uint32_t shm_rbuff_get_acl(struct shm_rbuff * rb)
 {
         assert(rb);
 
-        return __sync_fetch_and_add(rb->acl, 0);
+        return (uint32_t) __atomic_load_n(rb->acl, __ATOMIC_ACQUIRE);
 }
 
 void shm_rbuff_fini(struct shm_rbuff * rb)
 {
-        assert(rb);
-
-        if (shm_rbuff_empty(rb))
-                return;
-
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rb->lock);
-#else
-        if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
-                pthread_mutex_consistent(rb->lock);
-#endif
+        uint32_t seq;
 
-        pthread_cleanup_push((void(*)(void *))pthread_mutex_unlock,
-                             (void *) rb->lock);
+        assert(rb);
 
-        while (!shm_rbuff_empty(rb))
-#ifndef HAVE_ROBUST_MUTEX
-                pthread_cond_wait(rb->del, rb->lock);
-#else
-                if (pthread_cond_wait(rb->del, rb->lock) == EOWNERDEAD)
-                        pthread_mutex_consistent(rb->lock);
-#endif
-        pthread_cleanup_pop(true);
+        while (RB_LOAD(rb->head) != RB_LOAD(rb->tail)) {
+                seq = rb_prepare(rb->fdel);
+                if (RB_LOAD(rb->head) == RB_LOAD(rb->tail))
+                        break;
+                rb_wait(rb, rb->fdel, rb->del, seq, NULL);
+        }
 }
 
 size_t shm_rbuff_queued(struct shm_rbuff * rb)
 {
         assert(rb);
 
-        return shm_rbuff_used(rb);
+        return (RB_LOAD(rb->head) - RB_LOAD(rb->tail)) & RB_MASK;
 }
@@ -46,7 +46,6 @@ int shm_rbuff_write(struct shm_rbuff * rb,
         int ret = 0;
 
         assert(rb);
-        assert(idx < SHM_BUFFER_SIZE);
 
 #ifndef HAVE_ROBUST_MUTEX
         pthread_mutex_lock(rb->lock);
@@ -72,7 +71,7 @@ int shm_rbuff_write(struct shm_rbuff * rb,
                 pthread_cond_broadcast(rb->add);
 
         *head_el_ptr(rb) = (ssize_t) idx;
-        *rb->head = (*rb->head + 1) & ((SHM_RBUFF_SIZE) - 1);
+        *rb->head = (*rb->head + 1) & rb->mask;
 
         pthread_mutex_unlock(rb->lock);
 
@@ -89,7 +88,6 @@ int shm_rbuff_write_b(struct shm_rbuff *      rb,
         int ret = 0;
 
         assert(rb);
-        assert(idx < SHM_BUFFER_SIZE);
 
 #ifndef HAVE_ROBUST_MUTEX
         pthread_mutex_lock(rb->lock);
@@ -128,7 +126,7 @@ int shm_rbuff_write_b(struct shm_rbuff *      rb,
                 if (shm_rbuff_empty(rb))
                         pthread_cond_broadcast(rb->add);
                 *head_el_ptr(rb) = (ssize_t) idx;
-                *rb->head = (*rb->head + 1) & ((SHM_RBUFF_SIZE) - 1);
+                *rb->head = (*rb->head + 1) & rb->mask;
         }
 
         pthread_cleanup_pop(true);
@@ -139,6 +137,52 @@ int shm_rbuff_write_b(struct shm_rbuff *      rb,
         return ret;
 }
 
+ssize_t shm_rbuff_write_n(struct shm_rbuff * rb,
+                          const size_t *     idx,
+                          size_t             n)
+{
+        ssize_t ret = 0;
+        size_t  i;
+
+        assert(rb);
+        assert(idx);
+
+#ifndef HAVE_ROBUST_MUTEX
+        pthread_mutex_lock(rb->lock);
+#else
+        if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
+                pthread_mutex_consistent(rb->lock);
+#endif
+
+        if (*rb->acl != ACL_RDWR) {
+                if (*rb->acl & ACL_FLOWDOWN)
+                        ret = -EFLOWDOWN;
+                else if (*rb->acl & ACL_RDONLY)
+                        ret = -ENOTALLOC;
+                goto err;
+        }
+
+        if (!shm_rbuff_free(rb)) {
+                ret = -EAGAIN;
+                goto err;
+        }
+
+        if (shm_rbuff_empty(rb))
+                pthread_cond_broadcast(rb->add);
+
+        for (i = 0; i < n && shm_rbuff_free(rb); ++i) {
+                *head_el_ptr(rb) = (ssize_t) idx[i];
+                *rb->head = (*rb->head + 1) & rb->mask;
+        }
+
+        pthread_mutex_unlock(rb->lock);
+
+        return (ssize_t) i;
+ err:
+        pthread_mutex_unlock(rb->lock);
+        return ret;
+}
+
 ssize_t shm_rbuff_read(struct shm_rbuff * rb)
 {
         ssize_t ret = 0;
@@ -159,7 +203,7 @@ ssize_t shm_rbuff_read(struct shm_rbuff * rb)
         }
 
         ret = *tail_el_ptr(rb);
-        *rb->tail = (*rb->tail + 1) & ((SHM_RBUFF_SIZE) - 1);
+        *rb->tail = (*rb->tail + 1) & rb->mask;
         pthread_cond_broadcast(rb->del);
 
         pthread_mutex_unlock(rb->lock);
@@ -206,7 +250,7 @@ ssize_t shm_rbuff_read_b(struct shm_rbuff *      rb,
 
         if (idx != -ETIMEDOUT) {
                 idx = *tail_el_ptr(rb);
-                *rb->tail = (*rb->tail + 1) & ((SHM_RBUFF_SIZE) - 1);
+                *rb->tail = (*rb->tail + 1) & rb->mask;
                 pthread_cond_broadcast(rb->del);
         }
 
@@ -215,6 +259,41 @@ ssize_t shm_rbuff_read_b(struct shm_rbuff *      rb,
         return idx;
 }
 
+ssize_t shm_rbuff_read_n(struct shm_rbuff * rb,
+                         ssize_t *          idx,
+                         size_t             n)
+{
+        ssize_t ret = 0;
+        size_t  i;
+
+        assert(rb);
+        assert(idx);
+
+#ifndef HAVE_ROBUST_MUTEX
+        pthread_mutex_lock(rb->lock);
+#else
+        if (pthread_mutex_lock(rb->lock) == EOWNERDEAD)
+                pthread_mutex_consistent(rb->lock);
+#endif
+
+        if (shm_rbuff_empty(rb)) {
+                ret = *rb->acl & ACL_FLOWDOWN ? -EFLOWDOWN : -EAGAIN;
+                pthread_mutex_unlock(rb->lock);
+                return ret;
+        }
+
+        for (i = 0; i < n && !shm_rbuff_empty(rb); ++i) {
+                idx[i] = *tail_el_ptr(rb);
+                *rb->tail = (*rb->tail + 1) & rb->mask;
+        }
+
+        pthread_cond_broadcast(rb->del);
+
+        pthread_mutex_unlock(rb->lock);
+
+        return (ssize_t) i;
+}
+
 void shm_rbuff_set_acl(struct shm_rbuff * rb,
                        uint32_t           flags)
 {
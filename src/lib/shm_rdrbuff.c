@@ -20,14 +20,20 @@
  * Foundation, Inc., http://www.fsf.org/about/contact/.
  */
 
+#if defined(__linux__) || defined(__CYGWIN__)
+#define _DEFAULT_SOURCE
+#else
 #define _POSIX_C_SOURCE 200809L
+#endif
 
 #include "config.h"
 
 #include <ouroboros/errno.h>
+#include <ouroboros/list.h>
 #include <ouroboros/shm_rdrbuff.h>
 #include <ouroboros/shm_du_buff.h>
 #include <ouroboros/time_utils.h>
+#include <ouroboros/utils.h>
 
 #include <pthread.h>
 #include <sys/mman.h>
@@ -39,186 +45,1406 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <assert.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#endif
 
-#define SHM_BLOCKS_SIZE ((SHM_BUFFER_SIZE) * SHM_RDRB_BLOCK_SIZE)
-#define SHM_FILE_SIZE (SHM_BLOCKS_SIZE + 2 * sizeof(size_t)                    \
-                       + sizeof(pthread_mutex_t) + 2 * sizeof(pthread_cond_t)  \
-                       + sizeof(pid_t))
+/*
+ * The buffer is split into size classes, each with its own slots.
+ * Small and MTU sized slots are kept on free lists, larger packets
+ * get a power of 2 run of blocks from a buddy allocated jumbo pool.
+ * When no run is free, or without multi-block support, a packet is
+ * spread over a chain of MTU blocks from the same segment, each
+ * keeping the offset to the next one.
+ * The geometry is set by the irmd and stored in the segment header.
+ *
+ * The first segments are partitions, one per NUMA node, with their
+ * memory bound to that node. Allocations take from the partition of
+ * the node the caller runs on. When all partitions run dry, extension
+ * segments with the same layout are added, up to SHM_RDRB_SEGMENTS.
+ * The segment is kept in the high bits of a block index.
+ */
 #define DU_BUFF_OVERHEAD (DU_BUFF_HEADSPACE + DU_BUFF_TAILSPACE)
+#define RDRB_HUGEPAGE    ((size_t) 1 << 21)
+#define HUGETLBFS_MAGIC  0x958458f6UL
+/* Calls to shrink that find a segment idle before it is removed. */
+#define RDRB_IDLE_ROUNDS 4
+/* Node lookups served from the thread cache before asking again. */
+#define RDRB_NODE_TICKS  1024
+#define RDRB_NODES_FILE  "/sys/devices/system/node/online"
+#define MPOL_PREFERRED   1
+
+/* End of a free list. */
+#define RDRB_NIL         ((size_t) -1)
+/* Maximum number of buddy orders in the jumbo pool. */
+#define RDRB_ORDERS      (sizeof(size_t) * CHAR_BIT)
+
+/* refs of a block parked in a cache, low bits identify the cache. */
+#define RDRB_CACHED ((size_t) 1 << (sizeof(size_t) * CHAR_BIT - 1))
+
+#define IDX_SEG(rdrb, idx) ((idx) >> (rdrb)->shift)
+
+enum rdrb_class {
+        RDRB_SMALL = 0,
+        RDRB_MTU,
+        RDRB_JUMBO,
+        RDRB_CLASSES
+};
 
-#define get_head_ptr(rdrb)                                                     \
-        idx_to_du_buff_ptr(rdrb, *rdrb->head)
-
-#define get_tail_ptr(rdrb)                                                     \
-        idx_to_du_buff_ptr(rdrb, *rdrb->tail)
-
-#define idx_to_du_buff_ptr(rdrb, idx)                                          \
-        ((struct shm_du_buff *) (rdrb->shm_base + idx * SHM_RDRB_BLOCK_SIZE))
+#define RDRB_POOLS RDRB_JUMBO
 
-#define shm_rdrb_used(rdrb)                                                    \
-        (((*rdrb->head + (SHM_BUFFER_SIZE) - *rdrb->tail) + 1)                 \
-         & ((SHM_BUFFER_SIZE) - 1))
+struct shm_du_buff {
+        size_t  size;
+#ifdef SHM_RDRB_MULTI_BLOCK
+        size_t  blocks;
+        size_t  prev;    /* previous run on a jumbo free list */
+#endif
+        size_t  du_head;
+        size_t  du_tail;
+        size_t  refs;
+        size_t  idx;
+        size_t  next;    /* next block on a free list */
+        pid_t   pid;     /* process caching this block */
+        uint8_t ecn;     /* congestion mark from the layer below */
+        long    chain;   /* offset to the next block of a chain, or 0 */
+};
 
-#define shm_rdrb_free(rdrb, i)                                                 \
-        (shm_rdrb_used(rdrb) + i < (SHM_BUFFER_SIZE))
+struct rdrb_pool {
+        size_t free;     /* head of the free list */
+        size_t count;    /* blocks on the free list */
+        size_t fresh;    /* slots that were never used start here */
+        size_t released; /* blocks released without taking the lock */
+};
 
-#define shm_rdrb_empty(rdrb)                                                   \
-        (*rdrb->tail == *rdrb->head)
+/* Locality counters of a node, on a cache line of its own. */
+struct rdrb_numa {
+        struct rdrb_numa_stats stats;
+        size_t                 pad[4];
+};
 
-struct shm_du_buff {
-        size_t size;
+/*
+ * Start of each segment, followed by the jumbo order map. The lock,
+ * the segment table and the NUMA counters of the primary segment
+ * cover all segments.
+ */
+struct rdrb_hdr {
+        size_t           size;     /* size of the segment */
+        size_t           blocks;   /* number of packet indices */
+        size_t           block;    /* size of a block */
+        size_t           offset;   /* start of the blocks */
+        size_t           huge;     /* backed by hugetlbfs */
+        struct rdrb_pool pools[RDRB_POOLS];
 #ifdef SHM_RDRB_MULTI_BLOCK
-        size_t blocks;
+        size_t           runs[RDRB_ORDERS]; /* free jumbo runs per order */
 #endif
-        size_t du_head;
-        size_t du_tail;
-        size_t refs;
-        size_t idx;
+        size_t           parts;    /* number of NUMA partitions */
+        struct rdrb_numa numa[SHM_RDRB_SEGMENTS];
+        size_t           gens;     /* last issued segment generation */
+        size_t           gen[SHM_RDRB_SEGMENTS];  /* 0 if not in use */
+        size_t           idle[SHM_RDRB_SEGMENTS]; /* idle shrink rounds */
+        size_t           waiters;  /* allocators waiting for space */
+        size_t           tags;     /* last issued cache tag */
+        pthread_mutex_t  lock;     /* lock all free space in shm */
+        pthread_cond_t   healthy;  /* flag when packet is read */
+        pid_t            pid;      /* pid of the irmd owner */
+};
+
+/* A segment as mapped in this process. */
+struct rdrb_seg {
+        struct rdrb_hdr * hdr;      /* start of the segment */
+        uint8_t *         base;     /* start of blocks */
+        uint8_t *         order;    /* 1 + order of free jumbo runs */
+        size_t            first;    /* first block index */
+        size_t            gen;      /* generation that is mapped */
+};
+
+#if SHM_RDRB_CACHE_SIZE > 0
+/* Blocks reserved by a thread, handed out without taking the lock. */
+struct rdrb_cache {
+        struct list_head     link;
+        struct shm_rdrbuff * rdrb;
+        size_t               tag;
+        size_t               node;
+        size_t               ticks;
+        size_t               next[RDRB_POOLS];
+        size_t               len[RDRB_POOLS];
+        size_t               idx[RDRB_POOLS][SHM_RDRB_CACHE_SIZE];
 };
+#endif
 
 struct shm_rdrbuff {
-        uint8_t *         shm_base; /* start of blocks */
-        size_t *          head;     /* start of ringbuffer head */
-        size_t *          tail;     /* start of ringbuffer tail */
-        pthread_mutex_t * lock;     /* lock all free space in shm */
-        pthread_cond_t *  healthy;  /* flag when packet is read */
-        pid_t *           pid;      /* pid of the irmd owner */
+        struct rdrb_hdr * hdr;      /* primary segment */
+        struct rdrb_seg   segs[SHM_RDRB_SEGMENTS];
+        pthread_mutex_t   mtx;      /* lock for mapping segments */
+        size_t            parts;    /* number of NUMA partitions */
+        size_t            blocks;   /* packet indices per segment */
+        size_t            shift;    /* log2 of blocks */
+        size_t            block;    /* size of a block */
+        size_t            orders;   /* number of jumbo orders */
+        size_t            base[RDRB_CLASSES];  /* first index */
+        size_t            slots[RDRB_CLASSES]; /* number of indices */
+#if SHM_RDRB_CACHE_SIZE > 0
+        pthread_key_t     cache;    /* per-thread block cache */
+        struct list_head  caches;   /* of all threads, under mtx */
+#endif
 };
 
-static void garbage_collect(struct shm_rdrbuff * rdrb)
+/* A quarter of the indices is small, a quarter jumbo, the rest MTU. */
+static void rdrb_geometry(struct shm_rdrbuff * rdrb,
+                          size_t               blocks,
+                          size_t               block)
 {
+        rdrb->blocks              = blocks;
+        rdrb->block               = block;
+        rdrb->slots[RDRB_SMALL]   = blocks >> 2;
 #ifdef SHM_RDRB_MULTI_BLOCK
-        struct shm_du_buff * sdb;
-        while (!shm_rdrb_empty(rdrb) &&
-               (sdb = get_tail_ptr(rdrb))->refs == 0)
-                *rdrb->tail = (*rdrb->tail + sdb->blocks)
-                        & ((SHM_BUFFER_SIZE) - 1);
+        rdrb->slots[RDRB_JUMBO]   = blocks >> 2;
 #else
-        while (!shm_rdrb_empty(rdrb) && get_tail_ptr(rdrb)->refs == 0)
-                *rdrb->tail = (*rdrb->tail + 1) & ((SHM_BUFFER_SIZE) - 1);
+        rdrb->slots[RDRB_JUMBO]   = 0;
 #endif
-        pthread_cond_broadcast(rdrb->healthy);
+        rdrb->slots[RDRB_MTU]     = blocks - rdrb->slots[RDRB_SMALL]
+                - rdrb->slots[RDRB_JUMBO];
+        rdrb->base[RDRB_SMALL]    = 0;
+        rdrb->base[RDRB_MTU]      = rdrb->slots[RDRB_SMALL];
+        rdrb->base[RDRB_JUMBO]    = rdrb->base[RDRB_MTU]
+                + rdrb->slots[RDRB_MTU];
+
+        rdrb->shift = 0;
+        while (((size_t) 1 << rdrb->shift) < blocks)
+                ++rdrb->shift;
+
+        rdrb->orders = 1;
+        while (((size_t) 1 << (rdrb->orders - 1)) < rdrb->slots[RDRB_JUMBO])
+                ++rdrb->orders;
 }
 
-static void sanitize(struct shm_rdrbuff * rdrb)
+/* Offset of the first block, the header is padded to a block. */
+static size_t rdrb_offset(const struct shm_rdrbuff * rdrb)
+{
+        size_t size = sizeof(struct rdrb_hdr) + rdrb->slots[RDRB_JUMBO];
+
+        return (size + rdrb->block - 1) / rdrb->block * rdrb->block;
+}
+
+static size_t rdrb_size(const struct shm_rdrbuff * rdrb,
+                        bool                       huge)
 {
-        --get_head_ptr(rdrb)->refs;
-        garbage_collect(rdrb);
-        pthread_mutex_consistent(rdrb->lock);
+        size_t size;
+
+        size = rdrb_offset(rdrb)
+                + rdrb->slots[RDRB_SMALL] * (rdrb->block >> 2)
+                + (rdrb->slots[RDRB_MTU] + rdrb->slots[RDRB_JUMBO])
+                * rdrb->block;
+
+        if (huge)
+                size = (size + RDRB_HUGEPAGE - 1) & ~(RDRB_HUGEPAGE - 1);
+
+        return size;
 }
 
-static char * rdrb_filename(void)
+static struct shm_du_buff * seg_sdb(const struct shm_rdrbuff * rdrb,
+                                    const struct rdrb_seg *    seg,
+                                    size_t                     idx)
+{
+        size_t    mtu = rdrb->base[RDRB_MTU];
+        uint8_t * ptr = seg->base;
+
+        idx -= seg->first;
+
+        if (idx < mtu)
+                return (struct shm_du_buff *) (ptr + idx * (rdrb->block >> 2));
+
+        ptr += mtu * (rdrb->block >> 2);
+
+        return (struct shm_du_buff *) (ptr + (idx - mtu) * rdrb->block);
+}
+
+static char * rdrb_filename(size_t s,
+                            bool   huge)
 {
         char * str;
 
-        str = malloc(strlen(SHM_RDRB_NAME) + 1);
+        str = malloc(strlen(SHM_RDRB_HUGE_DIR) + strlen(SHM_RDRB_NAME) + 24);
         if (str == NULL)
                 return NULL;
 
-        sprintf(str, "%s", SHM_RDRB_NAME);
+        sprintf(str, "%s%s", huge ? SHM_RDRB_HUGE_DIR : "", SHM_RDRB_NAME);
+        if (s > 0)
+                sprintf(str + strlen(str), ".%lu", (unsigned long) s);
 
         return str;
 }
 
-void shm_rdrbuff_close(struct shm_rdrbuff * rdrb)
+/* Opens a file on hugetlbfs, fails if it is not mounted. */
+static int rdrb_open_huge(const char * path,
+                          int          flags)
 {
-        assert(rdrb);
+#ifdef __linux__
+        struct statfs fs;
 
-        munmap(rdrb->shm_base, SHM_FILE_SIZE);
-        free(rdrb);
+        if (statfs(SHM_RDRB_HUGE_DIR, &fs) < 0)
+                return -1;
+
+        if ((unsigned long) fs.f_type != HUGETLBFS_MAGIC)
+                return -1;
+
+        return open(path, flags, 0666);
+#else
+        (void) path;
+        (void) flags;
+
+        return -1;
+#endif
 }
 
-void shm_rdrbuff_destroy(struct shm_rdrbuff * rdrb)
+static void rdrb_unlink(size_t s,
+                        bool   huge)
 {
-        char * shm_rdrb_fn;
-
-        assert(rdrb);
+        char * fn;
 
-        if (getpid() != *rdrb->pid && kill(*rdrb->pid, 0) == 0) {
-                free(rdrb);
+        fn = rdrb_filename(s, huge);
+        if (fn == NULL)
                 return;
-        }
 
-        shm_rdrbuff_close(rdrb);
+        if (huge)
+                unlink(fn);
+        else
+                shm_unlink(fn);
 
-        shm_rdrb_fn = rdrb_filename();
-        if (shm_rdrb_fn == NULL)
-                return;
+        free(fn);
+}
 
-        shm_unlink(shm_rdrb_fn);
-        free(shm_rdrb_fn);
+static int seg_open(size_t s,
+                    bool   huge,
+                    int    flags)
+{
+        char * fn;
+        int    fd;
+
+        fn = rdrb_filename(s, huge);
+        if (fn == NULL)
+                return -1;
+
+        if (huge)
+                fd = rdrb_open_huge(fn, flags);
+        else
+                fd = shm_open(fn, flags, 0666);
+
+        free(fn);
+
+        return fd;
 }
 
 #define MM_FLAGS (PROT_READ | PROT_WRITE)
 
-static struct shm_rdrbuff * rdrb_create(int flags)
+static int seg_map(struct shm_rdrbuff * rdrb,
+                   size_t               s,
+                   int                  fd,
+                   size_t               size)
 {
-        struct shm_rdrbuff * rdrb;
-        int                  fd;
-        uint8_t *            shm_base;
-        char *               shm_rdrb_fn;
+        struct rdrb_seg * seg = &rdrb->segs[s];
+        uint8_t *         shm_base;
 
-        shm_rdrb_fn = rdrb_filename();
-        if (shm_rdrb_fn == NULL)
-                goto fail_fn;
+        shm_base = mmap(NULL, size, MM_FLAGS, MAP_SHARED, fd, 0);
+        if (shm_base == MAP_FAILED)
+                return -1;
 
-        rdrb = malloc(sizeof *rdrb);
-        if (rdrb == NULL)
-                goto fail_rdrb;
+        seg->hdr   = (struct rdrb_hdr *) shm_base;
+        seg->order = (uint8_t *) (seg->hdr + 1);
+        seg->first = s << rdrb->shift;
+
+        return 0;
+}
+
+static void seg_unmap(struct rdrb_seg * seg)
+{
+        if (seg->hdr == NULL)
+                return;
 
-        fd = shm_open(shm_rdrb_fn, flags, 0666);
+        munmap(seg->hdr, seg->hdr->size);
+
+        seg->hdr = NULL;
+        seg->gen = 0;
+}
+
+/* Prefer the memory of a node, the policy is shared by all users. */
+static void seg_bind(struct rdrb_seg * seg,
+                     size_t            size,
+                     int               node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+        unsigned long mask;
+
+        if (node < 0 || (size_t) node >= sizeof(mask) * CHAR_BIT)
+                return;
+
+        mask = 1UL << node;
+
+        syscall(SYS_mbind, seg->hdr, size, MPOL_PREFERRED, &mask,
+                sizeof(mask) * CHAR_BIT + 1, 0);
+#else
+        (void) seg;
+        (void) size;
+        (void) node;
+#endif
+}
+
+/*
+ * Creates and maps the file for a segment, the layout is set later.
+ * A segment for a NUMA partition is bound to its node (-1 for none).
+ */
+static int seg_create(struct shm_rdrbuff * rdrb,
+                      size_t               s,
+                      bool                 huge,
+                      int                  node)
+{
+        size_t size = rdrb_size(rdrb, huge);
+        int    fd;
+
+        if (s > 0) /* Left behind by a crashed irmd. */
+                rdrb_unlink(s, huge);
+
+        fd = seg_open(s, huge, O_CREAT | O_EXCL | O_RDWR);
         if (fd == -1)
                 goto fail_open;
 
-        if ((flags & O_CREAT) && ftruncate(fd, SHM_FILE_SIZE - 1) < 0)
+        if (fchmod(fd, 0666) < 0 || ftruncate(fd, size) < 0)
                 goto fail_truncate;
 
-        shm_base = mmap(NULL, SHM_FILE_SIZE, MM_FLAGS, MAP_SHARED, fd, 0);
-        if (shm_base == MAP_FAILED)
+        if (seg_map(rdrb, s, fd, size) < 0)
                 goto fail_truncate;
 
         close(fd);
 
-        rdrb->shm_base = shm_base;
-        rdrb->head = (size_t *) ((uint8_t *) rdrb->shm_base + SHM_BLOCKS_SIZE);
-        rdrb->tail = rdrb->head + 1;
-        rdrb->lock = (pthread_mutex_t *) (rdrb->tail + 1);
-        rdrb->healthy = (pthread_cond_t *) (rdrb->lock + 1);
-        rdrb->pid = (pid_t *) (rdrb->healthy + 1);
+        seg_bind(&rdrb->segs[s], size, node);
 
-        free(shm_rdrb_fn);
+        rdrb->segs[s].hdr->size = size;
+        rdrb->segs[s].hdr->huge = huge;
 
-        return rdrb;
+        return 0;
 
  fail_truncate:
         close(fd);
-        if (flags & O_CREAT)
-                shm_unlink(shm_rdrb_fn);
+        rdrb_unlink(s, huge);
  fail_open:
+        return -1;
+}
+
+static int seg_attach(struct shm_rdrbuff * rdrb,
+                      size_t               s,
+                      bool                 huge)
+{
+        struct stat st;
+        int         fd;
+
+        fd = seg_open(s, huge, O_RDWR);
+        if (fd == -1)
+                return -1;
+
+        if (fstat(fd, &st) < 0 || seg_map(rdrb, s, fd, st.st_size) < 0) {
+                close(fd);
+                return -1;
+        }
+
+        close(fd);
+
+        return 0;
+}
+
+/* Returns a mapped segment, (re)maps a segment added by others. */
+static struct rdrb_seg * rdrb_seg(struct shm_rdrbuff * rdrb,
+                                  size_t               s)
+{
+        struct rdrb_seg * seg = &rdrb->segs[s];
+        size_t            gen;
+
+        if (s == 0)
+                return seg;
+
+        gen = __sync_fetch_and_add(&rdrb->hdr->gen[s], 0);
+        if (gen == 0)
+                return NULL;
+
+        if (__sync_fetch_and_add(&seg->gen, 0) == gen)
+                return seg;
+
+        pthread_mutex_lock(&rdrb->mtx);
+
+        if (seg->gen != gen) {
+                seg_unmap(seg);
+                if (seg_attach(rdrb, s, rdrb->hdr->huge) == 0) {
+                        seg->base = (uint8_t *) seg->hdr + seg->hdr->offset;
+                        __sync_synchronize();
+                        seg->gen = gen;
+                }
+        }
+
+        pthread_mutex_unlock(&rdrb->mtx);
+
+        return seg->gen == gen ? seg : NULL;
+}
+
+static struct shm_du_buff * idx_to_sdb(struct shm_rdrbuff * rdrb,
+                                       size_t               idx)
+{
+        struct rdrb_seg * seg;
+
+        seg = rdrb_seg(rdrb, IDX_SEG(rdrb, idx));
+        if (seg == NULL)
+                return NULL;
+
+        return seg_sdb(rdrb, seg, idx);
+}
+
+static enum rdrb_class idx_class(struct shm_rdrbuff * rdrb,
+                                 size_t               idx)
+{
+        idx &= rdrb->blocks - 1;
+
+        if (idx < rdrb->base[RDRB_MTU])
+                return RDRB_SMALL;
+
+        if (idx < rdrb->base[RDRB_JUMBO])
+                return RDRB_MTU;
+
+        return RDRB_JUMBO;
+}
+
+/* Smallest class that holds a packet of len bytes. */
+static enum rdrb_class len_class(struct shm_rdrbuff * rdrb,
+                                 size_t               len)
+{
+        size_t size = DU_BUFF_OVERHEAD + len + sizeof(struct shm_du_buff);
+
+        if (size <= rdrb->block >> 2)
+                return RDRB_SMALL;
+
+        if (size <= rdrb->block)
+                return RDRB_MTU;
+
+        return RDRB_JUMBO;
+}
+
+/* Move the blocks that were released without the lock to the free list. */
+static void pool_collect(struct shm_rdrbuff * rdrb,
+                         struct rdrb_seg *    seg,
+                         enum rdrb_class      cls)
+{
+        struct rdrb_pool *   pool = &seg->hdr->pools[cls];
+        struct shm_du_buff * sdb;
+        size_t               idx;
+
+        do {
+                idx = __sync_fetch_and_add(&pool->released, 0);
+        } while (!__sync_bool_compare_and_swap(&pool->released, idx,
+                                               RDRB_NIL));
+
+        while (idx != RDRB_NIL) {
+                sdb        = seg_sdb(rdrb, seg, idx);
+                idx        = sdb->next;
+                sdb->next  = pool->free;
+                pool->free = sdb->idx;
+                ++pool->count;
+        }
+}
+
+/* Call with the lock held. */
+static struct shm_du_buff * pool_pop(struct shm_rdrbuff * rdrb,
+                                     struct rdrb_seg *    seg,
+                                     enum rdrb_class      cls)
+{
+        struct rdrb_pool *   pool = &seg->hdr->pools[cls];
+        struct shm_du_buff * sdb;
+        size_t               idx;
+
+        if (pool->free == RDRB_NIL)
+                pool_collect(rdrb, seg, cls);
+
+        if (pool->free == RDRB_NIL) {
+                if (pool->fresh == rdrb->slots[cls])
+                        return NULL;
+                idx      = seg->first + rdrb->base[cls] + pool->fresh++;
+                sdb      = seg_sdb(rdrb, seg, idx);
+                sdb->idx = idx;
+                return sdb;
+        }
+
+        sdb        = seg_sdb(rdrb, seg, pool->free);
+        pool->free = sdb->next;
+        --pool->count;
+
+        return sdb;
+}
+
+/* Blocks can be released in any order, without taking the lock. */
+static void pool_release(struct shm_rdrbuff * rdrb,
+                         struct rdrb_seg *    seg,
+                         struct shm_du_buff * sdb)
+{
+        struct rdrb_pool * pool;
+        size_t             head;
+
+        pool = &seg->hdr->pools[idx_class(rdrb, sdb->idx)];
+
+        do {
+                head      = __sync_fetch_and_add(&pool->released, 0);
+                sdb->next = head;
+        } while (!__sync_bool_compare_and_swap(&pool->released, head,
+                                               sdb->idx));
+}
+
+/* Call with the lock held, takes back blocks parked in caches. */
+static bool pool_steal(struct shm_rdrbuff * rdrb,
+                       struct rdrb_seg *    seg,
+                       enum rdrb_class      cls,
+                       pid_t                pid)
+{
+        struct rdrb_pool *   pool = &seg->hdr->pools[cls];
+        struct shm_du_buff * sdb;
+        size_t               refs;
+        size_t               i;
+        bool                 ret = false;
+
+        for (i = 0; i < pool->fresh; ++i) {
+                sdb  = seg_sdb(rdrb, seg, seg->first + rdrb->base[cls] + i);
+                refs = __sync_fetch_and_add(&sdb->refs, 0);
+                if (!(refs & RDRB_CACHED) || (pid != 0 && sdb->pid != pid))
+                        continue;
+                if (!__sync_bool_compare_and_swap(&sdb->refs, refs, 0))
+                        continue;
+                sdb->next  = pool->free;
+                pool->free = sdb->idx;
+                ++pool->count;
+                ret = true;
+        }
+
+        return ret;
+}
+
+#ifdef SHM_RDRB_MULTI_BLOCK
+/* Order of the run of blocks that holds a packet of len bytes. */
+static size_t jumbo_order(struct shm_rdrbuff * rdrb,
+                          size_t               len)
+{
+        size_t size  = DU_BUFF_OVERHEAD + len + sizeof(struct shm_du_buff);
+        size_t order = 0;
+
+        while ((rdrb->block << order) < size && order < rdrb->orders)
+                ++order;
+
+        return order;
+}
+
+static void jumbo_link(struct shm_rdrbuff * rdrb,
+                       struct rdrb_seg *    seg,
+                       size_t               blk,
+                       size_t               order)
+{
+        struct rdrb_hdr *    hdr = seg->hdr;
+        struct shm_du_buff * sdb;
+        size_t               idx;
+
+        idx         = seg->first + rdrb->base[RDRB_JUMBO] + blk;
+        sdb         = seg_sdb(rdrb, seg, idx);
+        sdb->idx    = idx;
+        sdb->blocks = (size_t) 1 << order;
+        sdb->refs   = 0;
+        sdb->prev   = RDRB_NIL;
+        sdb->next   = hdr->runs[order];
+
+        if (sdb->next != RDRB_NIL)
+                seg_sdb(rdrb, seg, sdb->next)->prev = sdb->idx;
+
+        hdr->runs[order] = sdb->idx;
+        seg->order[blk]  = (uint8_t) (order + 1);
+}
+
+static void jumbo_unlink(struct shm_rdrbuff * rdrb,
+                         struct rdrb_seg *    seg,
+                         struct shm_du_buff * sdb,
+                         size_t               order)
+{
+        struct rdrb_hdr * hdr = seg->hdr;
+        size_t            blk;
+
+        if (sdb->prev != RDRB_NIL)
+                seg_sdb(rdrb, seg, sdb->prev)->next = sdb->next;
+        else
+                hdr->runs[order] = sdb->next;
+
+        if (sdb->next != RDRB_NIL)
+                seg_sdb(rdrb, seg, sdb->next)->prev = sdb->prev;
+
+        blk = sdb->idx - seg->first - rdrb->base[RDRB_JUMBO];
+
+        seg->order[blk] = 0;
+}
+
+/* Call with the lock held, splits the smallest free run that fits. */
+static struct shm_du_buff * jumbo_alloc(struct shm_rdrbuff * rdrb,
+                                        struct rdrb_seg *    seg,
+                                        size_t               order)
+{
+        struct rdrb_hdr *    hdr = seg->hdr;
+        struct shm_du_buff * sdb;
+        size_t               o;
+        size_t               blk;
+
+        for (o = order; o < rdrb->orders && hdr->runs[o] == RDRB_NIL; ++o)
+                ;
+
+        if (o >= rdrb->orders)
+                return NULL;
+
+        sdb = seg_sdb(rdrb, seg, hdr->runs[o]);
+        jumbo_unlink(rdrb, seg, sdb, o);
+
+        blk = sdb->idx - seg->first - rdrb->base[RDRB_JUMBO];
+        while (o > order) {
+                --o;
+                jumbo_link(rdrb, seg, blk + ((size_t) 1 << o), o);
+        }
+
+        sdb->blocks = (size_t) 1 << order;
+
+        return sdb;
+}
+
+/* Call with the lock held, merges the run with its free buddies. */
+static void jumbo_free(struct shm_rdrbuff * rdrb,
+                       struct rdrb_seg *    seg,
+                       struct shm_du_buff * sdb)
+{
+        size_t base  = seg->first + rdrb->base[RDRB_JUMBO];
+        size_t blk   = sdb->idx - base;
+        size_t order = 0;
+        size_t buddy;
+
+        while (((size_t) 1 << order) < sdb->blocks)
+                ++order;
+
+        while (order + 1 < rdrb->orders) {
+                buddy = blk ^ ((size_t) 1 << order);
+                if (seg->order[buddy] != order + 1)
+                        break;
+                jumbo_unlink(rdrb, seg, seg_sdb(rdrb, seg, base + buddy),
+                             order);
+                blk &= ~((size_t) 1 << order);
+                ++order;
+        }
+
+        jumbo_link(rdrb, seg, blk, order);
+}
+#endif
+
+/* Sets up the free lists of a new segment. */
+static void seg_init(struct shm_rdrbuff * rdrb,
+                     struct rdrb_seg *    seg)
+{
+        struct rdrb_hdr * hdr = seg->hdr;
+        size_t            i;
+
+        hdr->blocks = rdrb->blocks;
+        hdr->block  = rdrb->block;
+        hdr->offset = rdrb_offset(rdrb);
+
+        seg->base = (uint8_t *) hdr + hdr->offset;
+
+        for (i = 0; i < RDRB_POOLS; ++i) {
+                hdr->pools[i].free     = RDRB_NIL;
+                hdr->pools[i].count    = 0;
+                hdr->pools[i].fresh    = 0;
+                hdr->pools[i].released = RDRB_NIL;
+        }
+#ifdef SHM_RDRB_MULTI_BLOCK
+        for (i = 0; i < RDRB_ORDERS; ++i)
+                hdr->runs[i] = RDRB_NIL;
+
+        memset(seg->order, 0, rdrb->slots[RDRB_JUMBO]);
+
+        jumbo_link(rdrb, seg, 0, rdrb->orders - 1);
+#endif
+}
+
+/* Call with the lock held, true if no block in the segment is used. */
+static bool seg_idle(struct shm_rdrbuff * rdrb,
+                     struct rdrb_seg *    seg)
+{
+        struct rdrb_pool * pool;
+        int                c;
+
+        for (c = 0; c < RDRB_POOLS; ++c) {
+                pool_collect(rdrb, seg, (enum rdrb_class) c);
+                pool = &seg->hdr->pools[c];
+                if (pool->count + rdrb->slots[c] - pool->fresh
+                    != rdrb->slots[c])
+                        return false;
+        }
+#ifdef SHM_RDRB_MULTI_BLOCK
+        return seg->hdr->runs[rdrb->orders - 1] != RDRB_NIL;
+#else
+        return true;
+#endif
+}
+
+/* Call with the lock held, adds an extension segment. */
+static struct rdrb_seg * rdrb_grow(struct shm_rdrbuff * rdrb)
+{
+        struct rdrb_seg * seg;
+        size_t            s;
+
+        for (s = rdrb->parts; s < SHM_RDRB_SEGMENTS; ++s)
+                if (rdrb->hdr->gen[s] == 0)
+                        break;
+
+        if (s == SHM_RDRB_SEGMENTS)
+                return NULL;
+
+        seg = &rdrb->segs[s];
+
+        pthread_mutex_lock(&rdrb->mtx);
+
+        seg_unmap(seg);
+
+        if (seg_create(rdrb, s, rdrb->hdr->huge, -1) < 0) {
+                pthread_mutex_unlock(&rdrb->mtx);
+                return NULL;
+        }
+
+        seg_init(rdrb, seg);
+
+        rdrb->hdr->idle[s] = 0;
+        seg->gen = ++rdrb->hdr->gens;
+        __sync_synchronize();
+        rdrb->hdr->gen[s] = seg->gen;
+
+        pthread_mutex_unlock(&rdrb->mtx);
+
+        return seg;
+}
+
+/*
+ * Call with the lock held after its owner died. The pool free lists
+ * change with single stores, so a dead owner can only leak the blocks
+ * it was moving. The counts it left behind and the doubly linked jumbo
+ * runs can be off, they are rebuilt from the blocks.
+ */
+static void seg_repair(struct shm_rdrbuff * rdrb,
+                       struct rdrb_seg *    seg)
+{
+        struct rdrb_pool *   pool;
+        struct shm_du_buff * sdb;
+        size_t *             p;
+        size_t               first;
+        size_t               n;
+        int                  c;
+#ifdef SHM_RDRB_MULTI_BLOCK
+        size_t               blk;
+#endif
+        for (c = 0; c < RDRB_POOLS; ++c) {
+                pool  = &seg->hdr->pools[c];
+                first = seg->first + rdrb->base[c];
+                for (n = 0, p = &pool->free; *p != RDRB_NIL; ++n) {
+                        if (n == pool->fresh || *p < first ||
+                            *p >= first + pool->fresh) {
+                                *p = RDRB_NIL;
+                                break;
+                        }
+                        sdb = seg_sdb(rdrb, seg, *p);
+                        p   = &sdb->next;
+                }
+                pool->count = n;
+        }
+#ifdef SHM_RDRB_MULTI_BLOCK
+        for (n = 0; n < RDRB_ORDERS; ++n)
+                seg->hdr->runs[n] = RDRB_NIL;
+
+        for (blk = 0; blk < rdrb->slots[RDRB_JUMBO]; ++blk)
+                if (seg->order[blk] != 0)
+                        jumbo_link(rdrb, seg, blk, seg->order[blk] - 1);
+#endif
+}
+
+static void sanitize(struct shm_rdrbuff * rdrb)
+{
+        struct rdrb_seg * seg;
+        size_t            s;
+
+        for (s = 0; s < SHM_RDRB_SEGMENTS; ++s) {
+                seg = rdrb_seg(rdrb, s);
+                if (seg != NULL)
+                        seg_repair(rdrb, seg);
+        }
+
+        pthread_mutex_consistent(&rdrb->hdr->lock);
+}
+
+static void rdrb_lock(struct shm_rdrbuff * rdrb)
+{
+#ifndef HAVE_ROBUST_MUTEX
+        pthread_mutex_lock(&rdrb->hdr->lock);
+#else
+        if (pthread_mutex_lock(&rdrb->hdr->lock) == EOWNERDEAD)
+                sanitize(rdrb);
+#endif
+}
+
+static void rdrb_unwait(void * o)
+{
+        struct shm_rdrbuff * rdrb = (struct shm_rdrbuff *) o;
+
+        __sync_sub_and_fetch(&rdrb->hdr->waiters, 1);
+        pthread_mutex_unlock(&rdrb->hdr->lock);
+}
+
+/* Wake up allocators after blocks were released without the lock. */
+static void rdrb_wake(struct shm_rdrbuff * rdrb)
+{
+        if (__sync_fetch_and_add(&rdrb->hdr->waiters, 0) == 0)
+                return;
+
+        rdrb_lock(rdrb);
+
+        pthread_cond_broadcast(&rdrb->hdr->healthy);
+
+        pthread_mutex_unlock(&rdrb->hdr->lock);
+}
+
+/* MTU blocks in a chain that holds a packet of len bytes. */
+static size_t chain_blocks(struct shm_rdrbuff * rdrb,
+                           size_t               len)
+{
+        size_t cap = rdrb->block - sizeof(struct shm_du_buff);
+
+        return (DU_BUFF_OVERHEAD + len + cap - 1) / cap;
+}
+
+/*
+ * Call with the lock held. The head and tail space go in front of
+ * the first and after the last byte of the packet, a block in the
+ * middle is full.
+ */
+static struct shm_du_buff * seg_chain(struct shm_rdrbuff * rdrb,
+                                      struct rdrb_seg *    seg,
+                                      size_t               len)
+{
+        struct rdrb_pool *   pool = &seg->hdr->pools[RDRB_MTU];
+        struct shm_du_buff * head = NULL;
+        struct shm_du_buff * prev = NULL;
+        struct shm_du_buff * sdb;
+        size_t               cap  = rdrb->block - sizeof(*sdb);
+        size_t               end  = DU_BUFF_HEADSPACE + len;
+        size_t               off;
+        size_t               n;
+
+        n = chain_blocks(rdrb, len);
+
+        pool_collect(rdrb, seg, RDRB_MTU);
+        if (pool->count + rdrb->slots[RDRB_MTU] - pool->fresh < n)
+                return NULL;
+
+        for (off = 0; off < n * cap; off += cap) {
+                sdb          = pool_pop(rdrb, seg, RDRB_MTU);
+                sdb->size    = cap;
+                sdb->du_head = off == 0 ? DU_BUFF_HEADSPACE : 0;
+                sdb->du_tail = end < off ? 0 : MIN(end - off, cap);
+                sdb->refs    = 1;
+                sdb->chain   = 0;
+                if (prev != NULL)
+                        prev->chain = (uint8_t *) sdb - (uint8_t *) prev;
+                else
+                        head = sdb;
+                prev = sdb;
+        }
+
+        return head;
+}
+
+/*
+ * Call with the lock held, falls back to the larger classes and
+ * then to a chain of MTU blocks.
+ */
+static struct shm_du_buff * seg_get(struct shm_rdrbuff * rdrb,
+                                    struct rdrb_seg *    seg,
+                                    size_t               len)
+{
+        struct shm_du_buff * sdb = NULL;
+        int                  cls = len_class(rdrb, len);
+        int                  c;
+
+        for (c = cls; sdb == NULL && c < RDRB_JUMBO; ++c)
+                sdb = pool_pop(rdrb, seg, (enum rdrb_class) c);
+#ifdef SHM_RDRB_MULTI_BLOCK
+        if (sdb == NULL && jumbo_order(rdrb, len) < rdrb->orders)
+                sdb = jumbo_alloc(rdrb, seg, jumbo_order(rdrb, len));
+#endif
+        if (sdb == NULL && cls == RDRB_JUMBO)
+                sdb = seg_chain(rdrb, seg, len);
+
+        return sdb;
+}
+
+/*
+ * Call with the lock held. Tries the partition of the node first,
+ * blocks parked in caches are taken back before a new segment is
+ * added.
+ */
+static struct shm_du_buff * rdrb_get(struct shm_rdrbuff * rdrb,
+                                     size_t               len,
+                                     size_t               node)
+{
+        struct shm_du_buff * sdb;
+        struct rdrb_seg *    seg;
+        int                  cls = len_class(rdrb, len);
+        size_t               s;
+        size_t               p;
+        int                  c;
+
+        seg = rdrb_seg(rdrb, node);
+        sdb = seg == NULL ? NULL : seg_get(rdrb, seg, len);
+
+        for (s = 0; sdb == NULL && s < SHM_RDRB_SEGMENTS; ++s) {
+                seg = rdrb_seg(rdrb, s);
+                if (s != node && seg != NULL)
+                        sdb = seg_get(rdrb, seg, len);
+        }
+
+        for (s = 0; sdb == NULL && s < rdrb->parts; ++s) {
+                p   = (node + s) % rdrb->parts;
+                seg = rdrb_seg(rdrb, p);
+                for (c = MIN(cls, RDRB_MTU);
+                     seg != NULL && sdb == NULL && c < RDRB_JUMBO; ++c)
+                        if (pool_steal(rdrb, seg, (enum rdrb_class) c, 0))
+                                sdb = seg_get(rdrb, seg, len);
+        }
+
+        if (sdb == NULL) {
+                seg = rdrb_grow(rdrb);
+                if (seg != NULL)
+                        sdb = seg_get(rdrb, seg, len);
+        }
+
+        if (sdb != NULL)
+                sdb->refs = 1;
+
+        return sdb;
+}
+
+/* Call with the lock held, waits for blocks until abstime. */
+static struct shm_du_buff * rdrb_get_b(struct shm_rdrbuff *    rdrb,
+                                       size_t                  len,
+                                       size_t                  node,
+                                       const struct timespec * abstime)
+{
+        struct shm_du_buff * sdb;
+        pthread_mutex_t *    lock    = &rdrb->hdr->lock;
+        pthread_cond_t *     healthy = &rdrb->hdr->healthy;
+        int                  ret     = 0;
+
+        sdb = rdrb_get(rdrb, len, node);
+        if (sdb != NULL)
+                return sdb;
+
+        /* Releasing threads check for waiters after freeing. */
+        __sync_add_and_fetch(&rdrb->hdr->waiters, 1);
+
+        pthread_cleanup_push(rdrb_unwait, (void *) rdrb);
+
+        while ((sdb = rdrb_get(rdrb, len, node)) == NULL &&
+               ret != ETIMEDOUT) {
+                if (abstime != NULL)
+                        ret = pthread_cond_timedwait(healthy, lock, abstime);
+                else
+                        ret = pthread_cond_wait(healthy, lock);
+        }
+
+        pthread_cleanup_pop(false);
+
+        __sync_sub_and_fetch(&rdrb->hdr->waiters, 1);
+
+        return sdb;
+}
+
+#if SHM_RDRB_CACHE_SIZE > 0
+static void cache_flush(struct rdrb_cache * cache)
+{
+        struct shm_rdrbuff * rdrb = cache->rdrb;
+        struct shm_du_buff * sdb;
+        struct rdrb_seg *    seg;
+        size_t               idx;
+        int                  c;
+
+        for (c = 0; c < RDRB_POOLS; ++c) {
+                while (cache->next[c] < cache->len[c]) {
+                        idx = cache->idx[c][cache->next[c]++];
+                        seg = rdrb_seg(rdrb, IDX_SEG(rdrb, idx));
+                        if (seg == NULL)
+                                continue;
+                        sdb = seg_sdb(rdrb, seg, idx);
+                        if (__sync_bool_compare_and_swap(&sdb->refs,
+                                                         cache->tag, 0))
+                                pool_release(rdrb, seg, sdb);
+                }
+
+                cache->next[c] = 0;
+                cache->len[c]  = 0;
+        }
+
+        rdrb_wake(rdrb);
+}
+
+static void cache_destroy(void * o)
+{
+        struct rdrb_cache * cache = (struct rdrb_cache *) o;
+
+        pthread_mutex_lock(&cache->rdrb->mtx);
+        list_del(&cache->link);
+        pthread_mutex_unlock(&cache->rdrb->mtx);
+
+        cache_flush(cache);
+        free(cache);
+}
+
+/* Flushes the caches of all threads, call once the key is deleted. */
+static void cache_fini(struct shm_rdrbuff * rdrb)
+{
+        struct rdrb_cache * cache;
+
+        pthread_mutex_lock(&rdrb->mtx);
+
+        while (!list_is_empty(&rdrb->caches)) {
+                cache = list_first_entry(&rdrb->caches, struct rdrb_cache,
+                                         link);
+                list_del(&cache->link);
+                /* Mapping a segment in the flush takes the mtx. */
+                pthread_mutex_unlock(&rdrb->mtx);
+                cache_flush(cache);
+                free(cache);
+                pthread_mutex_lock(&rdrb->mtx);
+        }
+
+        pthread_mutex_unlock(&rdrb->mtx);
+}
+
+static struct rdrb_cache * cache_get(struct shm_rdrbuff * rdrb)
+{
+        struct rdrb_cache * cache;
+
+        cache = pthread_getspecific(rdrb->cache);
+        if (cache != NULL)
+                return cache;
+
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+                return NULL;
+
+        cache->rdrb = rdrb;
+        cache->tag  = __sync_add_and_fetch(&rdrb->hdr->tags, 1) | RDRB_CACHED;
+
+        if (pthread_setspecific(rdrb->cache, cache)) {
+                free(cache);
+                return NULL;
+        }
+
+        pthread_mutex_lock(&rdrb->mtx);
+        list_add(&cache->link, &rdrb->caches);
+        pthread_mutex_unlock(&rdrb->mtx);
+
+        return cache;
+}
+
+/* Take a block from the cache, fails if the cache was stolen from. */
+static struct shm_du_buff * cache_alloc(struct shm_rdrbuff * rdrb,
+                                        enum rdrb_class      cls)
+{
+        struct rdrb_cache *  cache;
+        struct shm_du_buff * sdb;
+        size_t               idx;
+
+        cache = cache_get(rdrb);
+        if (cache == NULL)
+                return NULL;
+
+        while (cache->next[cls] < cache->len[cls]) {
+                idx = cache->idx[cls][cache->next[cls]++];
+                sdb = idx_to_sdb(rdrb, idx);
+                if (__sync_bool_compare_and_swap(&sdb->refs, cache->tag, 1))
+                        return sdb;
+        }
+
+        return NULL;
+}
+
+/*
+ * Call with the lock held, refills an empty cache from the partition
+ * of the node in one go as long as half of the slots of the class
+ * remain free for others.
+ */
+static void cache_fill(struct shm_rdrbuff * rdrb,
+                       enum rdrb_class      cls,
+                       size_t               node)
+{
+        struct rdrb_cache *  cache;
+        struct rdrb_seg *    seg  = rdrb_seg(rdrb, node);
+        struct rdrb_pool *   pool;
+        struct shm_du_buff * sdb;
+        size_t               reserve = rdrb->slots[cls] >> 1;
+
+        cache = pthread_getspecific(rdrb->cache);
+        if (cache == NULL || cache->next[cls] < cache->len[cls])
+                return;
+
+        if (seg == NULL)
+                return;
+
+        pool = &seg->hdr->pools[cls];
+
+        cache->next[cls] = 0;
+        cache->len[cls]  = 0;
+
+        pool_collect(rdrb, seg, cls);
+
+        while (cache->len[cls] < SHM_RDRB_CACHE_SIZE &&
+               pool->count + rdrb->slots[cls] - pool->fresh > reserve) {
+                sdb = pool_pop(rdrb, seg, cls);
+                sdb->refs = cache->tag;
+                sdb->pid  = getpid();
+                cache->idx[cls][cache->len[cls]++] = sdb->idx;
+        }
+}
+#endif
+
+/* NUMA partition of the node the calling thread runs on. */
+static size_t rdrb_node(struct shm_rdrbuff * rdrb)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+        unsigned cpu;
+        unsigned node;
+
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+                return 0;
+
+        return node % rdrb->parts;
+#else
+        (void) rdrb;
+
+        return 0;
+#endif
+}
+
+/* Looking up the node is a system call, the thread cache keeps it. */
+static size_t rdrb_local(struct shm_rdrbuff * rdrb)
+{
+#if SHM_RDRB_CACHE_SIZE > 0
+        struct rdrb_cache * cache;
+#endif
+        if (rdrb->parts == 1)
+                return 0;
+#if SHM_RDRB_CACHE_SIZE > 0
+        cache = cache_get(rdrb);
+        if (cache == NULL)
+                return rdrb_node(rdrb);
+
+        if (cache->ticks++ % RDRB_NODE_TICKS == 0)
+                cache->node = rdrb_node(rdrb);
+
+        return cache->node;
+#else
+        return rdrb_node(rdrb);
+#endif
+}
+
+static void rdrb_count(struct shm_rdrbuff * rdrb,
+                       size_t               node,
+                       size_t               idx,
+                       bool                 alloc)
+{
+        struct rdrb_numa_stats * stats;
+        bool                     local;
+
+        if (rdrb->parts == 1)
+                return;
+
+        stats = &rdrb->hdr->numa[node].stats;
+        local = IDX_SEG(rdrb, idx) == node;
+
+        if (alloc)
+                __sync_fetch_and_add(local ? &stats->alloc_local
+                                     : &stats->alloc_remote, 1);
+        else
+                __sync_fetch_and_add(local ? &stats->free_local
+                                     : &stats->free_remote, 1);
+}
+
+/* Number of NUMA nodes that are online, 1 if unknown. */
+static size_t rdrb_numa_nodes(void)
+{
+        FILE * f;
+        char   buf[128];
+        char * last = NULL;
+        char * p;
+
+        f = fopen(RDRB_NODES_FILE, "r");
+        if (f == NULL)
+                return 1;
+
+        if (fgets(buf, sizeof(buf), f) == NULL) {
+                fclose(f);
+                return 1;
+        }
+
+        fclose(f);
+
+        /* A list of ranges, such as 0-1,3, the last one is highest. */
+        for (p = buf; *p != '\0'; ++p)
+                if (*p >= '0' && *p <= '9' && (p == buf || *(p - 1) < '0'
+                                                || *(p - 1) > '9'))
+                        last = p;
+
+        if (last == NULL)
+                return 1;
+
+        return strtoul(last, NULL, 10) + 1;
+}
+
+void shm_rdrbuff_close(struct shm_rdrbuff * rdrb)
+{
+        size_t s;
+
+        assert(rdrb);
+
+#if SHM_RDRB_CACHE_SIZE > 0
+        /* No destructors run after this, other threads keep caches. */
+        pthread_key_delete(rdrb->cache);
+        cache_fini(rdrb);
+#endif
+        for (s = SHM_RDRB_SEGMENTS; s-- > 0;)
+                seg_unmap(&rdrb->segs[s]);
+
+        pthread_mutex_destroy(&rdrb->mtx);
+        free(rdrb);
+}
+
+void shm_rdrbuff_destroy(struct shm_rdrbuff * rdrb)
+{
+        bool   huge;
+        bool   used[SHM_RDRB_SEGMENTS];
+        size_t s;
+
+        assert(rdrb);
+
+        if (getpid() != rdrb->hdr->pid && kill(rdrb->hdr->pid, 0) == 0) {
+                shm_rdrbuff_close(rdrb);
+                return;
+        }
+
+        huge = rdrb->hdr->huge;
+        for (s = 0; s < SHM_RDRB_SEGMENTS; ++s)
+                used[s] = s == 0 || rdrb->hdr->gen[s] != 0;
+
+        shm_rdrbuff_close(rdrb);
+
+        for (s = 0; s < SHM_RDRB_SEGMENTS; ++s)
+                if (used[s])
+                        rdrb_unlink(s, huge);
+}
+
+static struct shm_rdrbuff * rdrb_alloc(void)
+{
+        struct shm_rdrbuff * rdrb;
+
+        rdrb = calloc(1, sizeof(*rdrb));
+        if (rdrb == NULL)
+                goto fail_rdrb;
+
+        if (pthread_mutex_init(&rdrb->mtx, NULL))
+                goto fail_mtx;
+#if SHM_RDRB_CACHE_SIZE > 0
+        if (pthread_key_create(&rdrb->cache, cache_destroy))
+                goto fail_key;
+
+        list_head_init(&rdrb->caches);
+#endif
+        return rdrb;
+#if SHM_RDRB_CACHE_SIZE > 0
+ fail_key:
+        pthread_mutex_destroy(&rdrb->mtx);
+#endif
+ fail_mtx:
         free(rdrb);
  fail_rdrb:
-        free(shm_rdrb_fn);
- fail_fn:
         return NULL;
 }
 
-struct shm_rdrbuff * shm_rdrbuff_create()
-{
-        struct shm_rdrbuff * rdrb;
-        mode_t               mask;
-        pthread_mutexattr_t  mattr;
-        pthread_condattr_t   cattr;
+static void rdrb_free(struct shm_rdrbuff * rdrb)
+{
+#if SHM_RDRB_CACHE_SIZE > 0
+        pthread_key_delete(rdrb->cache);
+#endif
+        pthread_mutex_destroy(&rdrb->mtx);
+        free(rdrb);
+}
+
+struct shm_rdrbuff * shm_rdrbuff_create(size_t blocks,
+                                        bool   hugepages)
+{
+        struct shm_rdrbuff * rdrb;
+        pthread_mutexattr_t  mattr;
+        pthread_condattr_t   cattr;
+        size_t               s;
+
+        if (blocks < 4 || (blocks & (blocks - 1)))
+                goto fail_rdrb;
+
+        rdrb = rdrb_alloc();
+        if (rdrb == NULL)
+                goto fail_rdrb;
+
+        rdrb_geometry(rdrb, blocks, SHM_RDRB_BLOCK_SIZE);
 
-        mask = umask(0);
+        rdrb->parts = rdrb_numa_nodes();
+        if (rdrb->parts > SHM_RDRB_SEGMENTS)
+                rdrb->parts = SHM_RDRB_SEGMENTS;
 
-        rdrb = rdrb_create(O_CREAT | O_EXCL | O_RDWR);
+        if (!hugepages || seg_create(rdrb, 0, true, 0) < 0) {
+                if (seg_create(rdrb, 0, false, 0) < 0) {
+                        rdrb_free(rdrb);
+                        goto fail_rdrb;
+                }
+        }
 
-        umask(mask);
+        rdrb->hdr = rdrb->segs[0].hdr;
+        rdrb->hdr->pid = getpid();
+        rdrb->hdr->gens = 0;
 
-        if (rdrb == NULL)
-                goto fail_rdrb;
+        for (s = 0; s < SHM_RDRB_SEGMENTS; ++s) {
+                rdrb->hdr->gen[s]  = 0;
+                rdrb->hdr->idle[s] = 0;
+        }
+
+        memset(rdrb->hdr->numa, 0, sizeof(rdrb->hdr->numa));
+
+        seg_init(rdrb, &rdrb->segs[0]);
 
+        /* One partition per node, bound to the memory of that node. */
+        for (s = 1; s < rdrb->parts; ++s) {
+                if (seg_create(rdrb, s, rdrb->hdr->huge, (int) s) < 0) {
+                        rdrb->parts = s;
+                        break;
+                }
+                seg_init(rdrb, &rdrb->segs[s]);
+                rdrb->segs[s].gen = ++rdrb->hdr->gens;
+                rdrb->hdr->gen[s] = rdrb->segs[s].gen;
+        }
+
+        rdrb->hdr->parts = rdrb->parts;
+#ifdef MADV_HUGEPAGE
+        for (s = 0; hugepages && !rdrb->hdr->huge && s < rdrb->parts; ++s)
+                madvise(rdrb->segs[s].hdr, rdrb->hdr->size, MADV_HUGEPAGE);
+#endif
         if (pthread_mutexattr_init(&mattr))
                 goto fail_mattr;
 
@@ -226,7 +1452,7 @@ struct shm_rdrbuff * shm_rdrbuff_create()
 #ifdef HAVE_ROBUST_MUTEX
         pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
 #endif
-        if (pthread_mutex_init(rdrb->lock, &mattr))
+        if (pthread_mutex_init(&rdrb->hdr->lock, &mattr))
                 goto fail_mutex;
 
         if (pthread_condattr_init(&cattr))
@@ -236,13 +1462,11 @@ struct shm_rdrbuff * shm_rdrbuff_create()
 #ifndef __APPLE__
         pthread_condattr_setclock(&cattr, PTHREAD_COND_CLOCK);
 #endif
-        if (pthread_cond_init(rdrb->healthy, &cattr))
+        if (pthread_cond_init(&rdrb->hdr->healthy, &cattr))
                 goto fail_healthy;
 
-        *rdrb->head = 0;
-        *rdrb->tail = 0;
-
-        *rdrb->pid = getpid();
+        rdrb->hdr->waiters = 0;
+        rdrb->hdr->tags    = 0;
 
         pthread_mutexattr_destroy(&mattr);
         pthread_condattr_destroy(&cattr);
@@ -252,7 +1476,7 @@ struct shm_rdrbuff * shm_rdrbuff_create()
  fail_healthy:
         pthread_condattr_destroy(&cattr);
  fail_cattr:
-        pthread_mutex_destroy(rdrb->lock);
+        pthread_mutex_destroy(&rdrb->hdr->lock);
  fail_mutex:
         pthread_mutexattr_destroy(&mattr);
  fail_mattr:
@@ -263,19 +1487,75 @@ struct shm_rdrbuff * shm_rdrbuff_create()
 
 struct shm_rdrbuff * shm_rdrbuff_open()
 {
-        return rdrb_create(O_RDWR);
+        struct shm_rdrbuff * rdrb;
+        struct rdrb_hdr *    hdr;
+
+        rdrb = rdrb_alloc();
+        if (rdrb == NULL)
+                return NULL;
+
+        if (seg_attach(rdrb, 0, false) < 0 && seg_attach(rdrb, 0, true) < 0) {
+                rdrb_free(rdrb);
+                return NULL;
+        }
+
+        hdr = rdrb->segs[0].hdr;
+
+        rdrb_geometry(rdrb, hdr->blocks, hdr->block);
+
+        rdrb->hdr          = hdr;
+        rdrb->parts        = hdr->parts;
+        rdrb->segs[0].base = (uint8_t *) hdr + hdr->offset;
+
+        return rdrb;
 }
 
 void shm_rdrbuff_purge(void)
 {
-        char * shm_rdrb_fn;
+        size_t s;
 
-        shm_rdrb_fn = rdrb_filename();
-        if (shm_rdrb_fn == NULL)
-                return;
+        for (s = 0; s < SHM_RDRB_SEGMENTS; ++s) {
+                rdrb_unlink(s, false);
+                rdrb_unlink(s, true);
+        }
+}
 
-        shm_unlink(shm_rdrb_fn);
-        free(shm_rdrb_fn);
+/* A chain takes at most half of the MTU blocks. */
+static bool rdrb_fits(struct shm_rdrbuff * rdrb,
+                      size_t               len)
+{
+#ifdef SHM_RDRB_MULTI_BLOCK
+        if (jumbo_order(rdrb, len) < rdrb->orders)
+                return true;
+#else
+        if (len_class(rdrb, len) != RDRB_JUMBO)
+                return true;
+#endif
+        return chain_blocks(rdrb, len) <= rdrb->slots[RDRB_MTU] >> 1;
+}
+
+/* A chain is laid out when it is allocated. */
+static ssize_t rdrb_init_sdb(struct shm_rdrbuff *  rdrb,
+                             struct shm_du_buff *  sdb,
+                             size_t                len,
+                             uint8_t **            ptr,
+                             struct shm_du_buff ** psdb)
+{
+        if (len_class(rdrb, len) != RDRB_JUMBO
+            || idx_class(rdrb, sdb->idx) == RDRB_JUMBO) {
+                sdb->size    = DU_BUFF_OVERHEAD + len;
+                sdb->du_head = DU_BUFF_HEADSPACE;
+                sdb->du_tail = sdb->du_head + len;
+                sdb->chain   = 0;
+        }
+
+        sdb->ecn = 0;
+
+        *psdb = sdb;
+        if (ptr != NULL)
+                *ptr = (uint8_t *) (sdb + 1) + sdb->du_head;
+
+        return sdb->idx;
 }
 
 ssize_t shm_rdrbuff_alloc(struct shm_rdrbuff *  rdrb,
@@ -284,77 +1564,44 @@ ssize_t shm_rdrbuff_alloc(struct shm_rdrbuff *  rdrb,
                           struct shm_du_buff ** psdb)
 {
         struct shm_du_buff * sdb;
-        size_t               size = DU_BUFF_OVERHEAD + len;
-#ifdef SHM_RDRB_MULTI_BLOCK
-        size_t               blocks = 0;
-        size_t               padblocks = 0;
+        size_t               node;
+#if SHM_RDRB_CACHE_SIZE > 0
+        enum rdrb_class      cls;
 #endif
-        ssize_t              sz = size + sizeof(*sdb);
-
         assert(rdrb);
         assert(psdb);
 
-#ifndef SHM_RDRB_MULTI_BLOCK
-        if (sz > SHM_RDRB_BLOCK_SIZE)
+        if (!rdrb_fits(rdrb, len))
                 return -EMSGSIZE;
-#else
-        while (sz > 0) {
-                sz -= SHM_RDRB_BLOCK_SIZE;
-                ++blocks;
-        }
-#endif
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rdrb->lock);
-#else
-        if (pthread_mutex_lock(rdrb->lock) == EOWNERDEAD)
-                sanitize(rdrb);
-#endif
-#ifdef SHM_RDRB_MULTI_BLOCK
-        if (blocks + *rdrb->head > (SHM_BUFFER_SIZE))
-                padblocks = (SHM_BUFFER_SIZE) - *rdrb->head;
-
-        if (!shm_rdrb_free(rdrb, blocks + padblocks)) {
-#else
-        if (!shm_rdrb_free(rdrb, 1)) {
-#endif
-                pthread_mutex_unlock(rdrb->lock);
-                return -EAGAIN;
-        }
 
-#ifdef SHM_RDRB_MULTI_BLOCK
-        if (padblocks) {
-                sdb = get_head_ptr(rdrb);
-                sdb->size    = 0;
-                sdb->blocks  = padblocks;
-                sdb->refs    = 0;
-                sdb->du_head = 0;
-                sdb->du_tail = 0;
-                sdb->idx     = *rdrb->head;
+        node = rdrb_local(rdrb);
 
-                *rdrb->head = 0;
+#if SHM_RDRB_CACHE_SIZE > 0
+        cls = len_class(rdrb, len);
+        if (cls != RDRB_JUMBO) {
+                sdb = cache_alloc(rdrb, cls);
+                if (sdb != NULL) {
+                        rdrb_count(rdrb, node, sdb->idx, true);
+                        return rdrb_init_sdb(rdrb, sdb, len, ptr, psdb);
+                }
         }
 #endif
-        sdb        = get_head_ptr(rdrb);
-        sdb->refs  = 1;
-        sdb->idx   = *rdrb->head;
-#ifdef SHM_RDRB_MULTI_BLOCK
-        sdb->blocks  = blocks;
+        rdrb_lock(rdrb);
 
-        *rdrb->head = (*rdrb->head + blocks) & ((SHM_BUFFER_SIZE) - 1);
-#else
-        *rdrb->head = (*rdrb->head + 1) & ((SHM_BUFFER_SIZE) - 1);
+        sdb = rdrb_get(rdrb, len, node);
+        if (sdb == NULL) {
+                pthread_mutex_unlock(&rdrb->hdr->lock);
+                return -EAGAIN;
+        }
+#if SHM_RDRB_CACHE_SIZE > 0
+        if (cls != RDRB_JUMBO)
+                cache_fill(rdrb, cls, node);
 #endif
-        pthread_mutex_unlock(rdrb->lock);
+        pthread_mutex_unlock(&rdrb->hdr->lock);
 
-        sdb->size    = size;
-        sdb->du_head = DU_BUFF_HEADSPACE;
-        sdb->du_tail = sdb->du_head + len;
-
-        *psdb = sdb;
-        if (ptr != NULL)
-                *ptr = (uint8_t *) (sdb + 1) + sdb->du_head;
+        rdrb_count(rdrb, node, sdb->idx, true);
 
-        return sdb->idx;
+        return rdrb_init_sdb(rdrb, sdb, len, ptr, psdb);
 }
 
 ssize_t shm_rdrbuff_alloc_b(struct shm_rdrbuff *    rdrb,
@@ -364,96 +1611,87 @@ ssize_t shm_rdrbuff_alloc_b(struct shm_rdrbuff *    rdrb,
                             const struct timespec * abstime)
 {
         struct shm_du_buff * sdb;
-        size_t               size      = DU_BUFF_OVERHEAD + len;
-#ifdef SHM_RDRB_MULTI_BLOCK
-        size_t               blocks    = 0;
-        size_t               padblocks = 0;
+        size_t               node;
+#if SHM_RDRB_CACHE_SIZE > 0
+        enum rdrb_class      cls;
 #endif
-        ssize_t              sz        = size + sizeof(*sdb);
-        int                  ret       = 0;
-
         assert(rdrb);
         assert(psdb);
 
-#ifndef SHM_RDRB_MULTI_BLOCK
-        if (sz > SHM_RDRB_BLOCK_SIZE)
+        if (!rdrb_fits(rdrb, len))
                 return -EMSGSIZE;
-#else
-        while (sz > 0) {
-                sz -= SHM_RDRB_BLOCK_SIZE;
-                ++blocks;
+
+        node = rdrb_local(rdrb);
+
+#if SHM_RDRB_CACHE_SIZE > 0
+        cls = len_class(rdrb, len);
+        if (cls != RDRB_JUMBO) {
+                sdb = cache_alloc(rdrb, cls);
+                if (sdb != NULL) {
+                        rdrb_count(rdrb, node, sdb->idx, true);
+                        return rdrb_init_sdb(rdrb, sdb, len, ptr, psdb);
+                }
         }
 #endif
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rdrb->lock);
-#else
-        if (pthread_mutex_lock(rdrb->lock) == EOWNERDEAD)
-                sanitize(rdrb);
+        rdrb_lock(rdrb);
+
+        sdb = rdrb_get_b(rdrb, len, node, abstime);
+        if (sdb == NULL) {
+                pthread_mutex_unlock(&rdrb->hdr->lock);
+                return -ETIMEDOUT;
+        }
+#if SHM_RDRB_CACHE_SIZE > 0
+        if (cls != RDRB_JUMBO)
+                cache_fill(rdrb, cls, node);
 #endif
-        pthread_cleanup_push((void (*) (void *)) pthread_mutex_unlock,
-                             (void *) rdrb->lock);
+        pthread_mutex_unlock(&rdrb->hdr->lock);
 
-#ifdef SHM_RDRB_MULTI_BLOCK
-        if (blocks + *rdrb->head > (SHM_BUFFER_SIZE))
-                padblocks = (SHM_BUFFER_SIZE) - *rdrb->head;
+        rdrb_count(rdrb, node, sdb->idx, true);
 
-        while (!shm_rdrb_free(rdrb, blocks + padblocks) && ret != ETIMEDOUT) {
-#else
-        while (!shm_rdrb_free(rdrb, 1) && ret != ETIMEDOUT) {
-#endif
-                if (abstime != NULL)
-                        ret = pthread_cond_timedwait(rdrb->healthy,
-                                                     rdrb->lock,
-                                                     abstime);
-                else
-                        ret = pthread_cond_wait(rdrb->healthy, rdrb->lock);
+        return rdrb_init_sdb(rdrb, sdb, len, ptr, psdb);
+}
 
-#ifdef SHM_RDRB_MULTI_BLOCK
-                if (blocks + *rdrb->head > (SHM_BUFFER_SIZE))
-                        padblocks = (SHM_BUFFER_SIZE) - *rdrb->head;
-#endif
-        }
+ssize_t shm_rdrbuff_alloc_n(struct shm_rdrbuff *    rdrb,
+                            size_t                  len,
+                            struct shm_du_buff **   sdbs,
+                            size_t                  n,
+                            const struct timespec * abstime)
+{
+        struct shm_du_buff * sdb;
+        struct rdrb_seg *    seg;
+        size_t               node;
+        size_t               i;
 
-        if (ret != ETIMEDOUT) {
-#ifdef SHM_RDRB_MULTI_BLOCK
-                if (padblocks) {
-                        sdb = get_head_ptr(rdrb);
-                        sdb->size    = 0;
-                        sdb->blocks  = padblocks;
-                        sdb->refs    = 0;
-                        sdb->du_head = 0;
-                        sdb->du_tail = 0;
-                        sdb->idx     = *rdrb->head;
-
-                        *rdrb->head = 0;
-                }
-#endif
-                sdb        = get_head_ptr(rdrb);
-                sdb->refs  = 1;
-                sdb->idx   = *rdrb->head;
-#ifdef SHM_RDRB_MULTI_BLOCK
-                sdb->blocks  = blocks;
+        assert(rdrb);
+        assert(sdbs);
+        assert(n > 0);
 
-                *rdrb->head = (*rdrb->head + blocks) & ((SHM_BUFFER_SIZE) - 1);
-#else
-                *rdrb->head = (*rdrb->head + 1) & ((SHM_BUFFER_SIZE) - 1);
-#endif
-        }
+        if (!rdrb_fits(rdrb, len))
+                return -EMSGSIZE;
 
-        pthread_cleanup_pop(true);
+        node = rdrb_local(rdrb);
 
-        if (ret == ETIMEDOUT)
+        rdrb_lock(rdrb);
+
+        sdb = rdrb_get_b(rdrb, len, node, abstime);
+        if (sdb == NULL) {
+                pthread_mutex_unlock(&rdrb->hdr->lock);
                 return -ETIMEDOUT;
+        }
 
-        sdb->size    = size;
-        sdb->du_head = DU_BUFF_HEADSPACE;
-        sdb->du_tail = sdb->du_head + len;
+        seg = rdrb_seg(rdrb, IDX_SEG(rdrb, sdb->idx));
 
-        *psdb = sdb;
-        if (ptr != NULL)
-                *ptr = (uint8_t *) (sdb + 1) + sdb->du_head;
+        /* The rest of the burst comes from the same segment, if free. */
+        for (i = 0; sdb != NULL; ++i) {
+                sdb->refs = 1;
+                rdrb_count(rdrb, node, sdb->idx, true);
+                rdrb_init_sdb(rdrb, sdb, len, NULL, &sdbs[i]);
+                sdb = i + 1 < n ? seg_get(rdrb, seg, len) : NULL;
+        }
 
-        return sdb->idx;
+        pthread_mutex_unlock(&rdrb->hdr->lock);
+
+        return (ssize_t) i;
 }
 
 ssize_t shm_rdrbuff_read(uint8_t **           dst,
@@ -464,9 +1702,12 @@ ssize_t shm_rdrbuff_read(uint8_t **           dst,
 
         assert(dst);
         assert(rdrb);
-        assert(idx < (SHM_BUFFER_SIZE));
+        assert(IDX_SEG(rdrb, idx) < SHM_RDRB_SEGMENTS);
+
+        sdb = idx_to_sdb(rdrb, idx);
+        if (sdb == NULL)
+                return -ENOMEM;
 
-        sdb = idx_to_du_buff_ptr(rdrb, idx);
         *dst = ((uint8_t *) (sdb + 1)) + sdb->du_head;
 
         return (ssize_t) (sdb->du_tail - sdb->du_head);
@@ -476,40 +1717,187 @@ struct shm_du_buff * shm_rdrbuff_get(struct shm_rdrbuff * rdrb,
                                      size_t               idx)
 {
         assert(rdrb);
-        assert(idx < (SHM_BUFFER_SIZE));
+        assert(IDX_SEG(rdrb, idx) < SHM_RDRB_SEGMENTS);
 
-        return idx_to_du_buff_ptr(rdrb, idx);
+        return idx_to_sdb(rdrb, idx);
 }
 
 int shm_rdrbuff_remove(struct shm_rdrbuff * rdrb,
                        size_t               idx)
 {
         struct shm_du_buff * sdb;
+        struct shm_du_buff * next;
+        struct rdrb_seg *    seg;
 
         assert(rdrb);
-        assert(idx < (SHM_BUFFER_SIZE));
+        assert(IDX_SEG(rdrb, idx) < SHM_RDRB_SEGMENTS);
 
-#ifndef HAVE_ROBUST_MUTEX
-        pthread_mutex_lock(rdrb->lock);
-#else
-        if (pthread_mutex_lock(rdrb->lock) == EOWNERDEAD)
-                sanitize(rdrb);
+        seg = rdrb_seg(rdrb, IDX_SEG(rdrb, idx));
+        if (seg == NULL)
+                return -ENOMEM;
+
+        sdb = seg_sdb(rdrb, seg, idx);
+
+        /* Only the stack needs it, can be removed. */
+        if (!__sync_bool_compare_and_swap(&sdb->refs, 1, 0))
+                return 0;
+
+        rdrb_count(rdrb, rdrb_local(rdrb), idx, false);
+#ifdef SHM_RDRB_MULTI_BLOCK
+        if (idx_class(rdrb, idx) == RDRB_JUMBO) {
+                rdrb_lock(rdrb);
+                jumbo_free(rdrb, seg, sdb);
+                pthread_cond_broadcast(&rdrb->hdr->healthy);
+                pthread_mutex_unlock(&rdrb->hdr->lock);
+                return 0;
+        }
 #endif
-        assert(!shm_rdrb_empty(rdrb));
+        do {
+                next = shm_du_buff_next(sdb);
+                pool_release(rdrb, seg, sdb);
+                sdb = next;
+        } while (sdb != NULL);
+
+        rdrb_wake(rdrb);
+
+        return 0;
+}
+
+int shm_rdrbuff_remove_n(struct shm_rdrbuff * rdrb,
+                         const size_t *       idx,
+                         size_t               n)
+{
+        struct shm_du_buff * sdb;
+        struct rdrb_seg *    seg;
+        struct rdrb_pool *   pool;
+        size_t               node;
+        size_t               i;
+        bool                 freed = false;
+
+        assert(rdrb);
+        assert(idx);
+
+        node = rdrb_local(rdrb);
 
-        sdb = idx_to_du_buff_ptr(rdrb, idx);
+        rdrb_lock(rdrb);
 
-        if (sdb->refs == 1) { /* only stack needs it, can be removed */
-                sdb->refs = 0;
-                if (idx == *rdrb->tail)
-                        garbage_collect(rdrb);
+        /* Holding the lock, blocks go straight to the free lists. */
+        for (i = 0; i < n; ++i) {
+                assert(IDX_SEG(rdrb, idx[i]) < SHM_RDRB_SEGMENTS);
+
+                seg = rdrb_seg(rdrb, IDX_SEG(rdrb, idx[i]));
+                if (seg == NULL)
+                        continue;
+
+                sdb = seg_sdb(rdrb, seg, idx[i]);
+                if (!__sync_bool_compare_and_swap(&sdb->refs, 1, 0))
+                        continue;
+
+                rdrb_count(rdrb, node, idx[i], false);
+                freed = true;
+#ifdef SHM_RDRB_MULTI_BLOCK
+                if (idx_class(rdrb, idx[i]) == RDRB_JUMBO) {
+                        jumbo_free(rdrb, seg, sdb);
+                        continue;
+                }
+#endif
+                pool = &seg->hdr->pools[idx_class(rdrb, idx[i])];
+                for (; sdb != NULL; sdb = shm_du_buff_next(sdb)) {
+                        sdb->next  = pool->free;
+                        pool->free = sdb->idx;
+                        ++pool->count;
+                }
         }
 
-        pthread_mutex_unlock(rdrb->lock);
+        if (freed)
+                pthread_cond_broadcast(&rdrb->hdr->healthy);
+
+        pthread_mutex_unlock(&rdrb->hdr->lock);
 
         return 0;
 }
 
+void shm_rdrbuff_reclaim(struct shm_rdrbuff * rdrb,
+                         pid_t                pid)
+{
+        struct rdrb_seg * seg;
+        size_t            s;
+        int               c;
+
+        assert(rdrb);
+
+        rdrb_lock(rdrb);
+
+        for (s = 0; s < rdrb->parts; ++s) {
+                seg = rdrb_seg(rdrb, s);
+                for (c = 0; seg != NULL && c < RDRB_POOLS; ++c)
+                        pool_steal(rdrb, seg, (enum rdrb_class) c, pid);
+        }
+
+        pthread_cond_broadcast(&rdrb->hdr->healthy);
+
+        pthread_mutex_unlock(&rdrb->hdr->lock);
+}
+
+void shm_rdrbuff_shrink(struct shm_rdrbuff * rdrb)
+{
+        struct rdrb_seg * seg;
+        size_t            s;
+
+        assert(rdrb);
+
+        rdrb_lock(rdrb);
+
+        for (s = SHM_RDRB_SEGMENTS; s-- > rdrb->parts;) {
+                seg = rdrb_seg(rdrb, s);
+                if (seg == NULL)
+                        continue;
+
+                if (!seg_idle(rdrb, seg)) {
+                        rdrb->hdr->idle[s] = 0;
+                        continue;
+                }
+
+                if (++rdrb->hdr->idle[s] < RDRB_IDLE_ROUNDS)
+                        continue;
+
+                rdrb->hdr->gen[s] = 0;
+
+                pthread_mutex_lock(&rdrb->mtx);
+                seg_unmap(seg);
+                pthread_mutex_unlock(&rdrb->mtx);
+
+                rdrb_unlink(s, rdrb->hdr->huge);
+        }
+
+        pthread_mutex_unlock(&rdrb->hdr->lock);
+}
+
+size_t shm_rdrbuff_nodes(struct shm_rdrbuff * rdrb)
+{
+        assert(rdrb);
+
+        return rdrb->parts;
+}
+
+void shm_rdrbuff_numa_stats(struct shm_rdrbuff *     rdrb,
+                            size_t                   node,
+                            struct rdrb_numa_stats * stats)
+{
+        struct rdrb_numa_stats * s;
+
+        assert(rdrb);
+        assert(stats);
+        assert(node < rdrb->parts);
+
+        s = &rdrb->hdr->numa[node].stats;
+
+        stats->alloc_local  = __sync_fetch_and_add(&s->alloc_local, 0);
+        stats->alloc_remote = __sync_fetch_and_add(&s->alloc_remote, 0);
+        stats->free_local   = __sync_fetch_and_add(&s->free_local, 0);
+        stats->free_remote  = __sync_fetch_and_add(&s->free_remote, 0);
+}
+
 size_t shm_du_buff_get_idx(struct shm_du_buff * sdb)
 {
         assert(sdb);
@@ -531,6 +1919,138 @@ uint8_t * shm_du_buff_tail(struct shm_du_buff * sdb)
         return (uint8_t *) (sdb + 1) + sdb->du_tail;
 }
 
+struct shm_du_buff * shm_du_buff_next(struct shm_du_buff * sdb)
+{
+        assert(sdb);
+
+        if (sdb->chain == 0)
+                return NULL;
+
+        return (struct shm_du_buff *) ((uint8_t *) sdb + sdb->chain);
+}
+
+size_t shm_du_buff_len(struct shm_du_buff * sdb)
+{
+        size_t len = 0;
+
+        for (; sdb != NULL; sdb = shm_du_buff_next(sdb))
+                len += sdb->du_tail - sdb->du_head;
+
+        return len;
+}
+
+static struct shm_du_buff * du_buff_last(struct shm_du_buff * sdb)
+{
+        while (sdb->chain != 0)
+                sdb = shm_du_buff_next(sdb);
+
+        return sdb;
+}
+
+/* Cuts the packet at len bytes, returns the block it ends in. */
+static struct shm_du_buff * du_buff_cut(struct shm_du_buff * sdb,
+                                        size_t               len)
+{
+        struct shm_du_buff * end;
+        size_t               n;
+
+        while (sdb->chain != 0 && (n = sdb->du_tail - sdb->du_head) < len) {
+                len -= n;
+                sdb  = shm_du_buff_next(sdb);
+        }
+
+        assert(len <= sdb->size);
+
+        sdb->du_tail = sdb->du_head + len;
+
+        for (end = sdb; (sdb = shm_du_buff_next(sdb)) != NULL;)
+                sdb->du_tail = sdb->du_head;
+
+        return end;
+}
+
+size_t shm_du_buff_gather(struct shm_du_buff * sdb,
+                          size_t               off,
+                          void *               buf,
+                          size_t               len)
+{
+        uint8_t * dst = (uint8_t *) buf;
+        size_t    n;
+
+        assert(sdb);
+
+        for (; sdb != NULL && len > 0; sdb = shm_du_buff_next(sdb)) {
+                n = sdb->du_tail - sdb->du_head;
+                if (off >= n) {
+                        off -= n;
+                        continue;
+                }
+                n = MIN(n - off, len);
+                memcpy(dst, (uint8_t *) (sdb + 1) + sdb->du_head + off, n);
+                dst += n;
+                len -= n;
+                off  = 0;
+        }
+
+        return dst - (uint8_t *) buf;
+}
+
+size_t shm_du_buff_scatter(struct shm_du_buff * sdb,
+                           size_t               off,
+                           const void *         buf,
+                           size_t               len)
+{
+        const uint8_t * src = (const uint8_t *) buf;
+        size_t          n;
+
+        assert(sdb);
+
+        for (; sdb != NULL && len > 0; sdb = shm_du_buff_next(sdb)) {
+                n = sdb->du_tail - sdb->du_head;
+                if (off >= n) {
+                        off -= n;
+                        continue;
+                }
+                n = MIN(n - off, len);
+                memcpy((uint8_t *) (sdb + 1) + sdb->du_head + off, src, n);
+                src += n;
+                len -= n;
+                off  = 0;
+        }
+
+        return src - (const uint8_t *) buf;
+}
+
+size_t shm_du_buff_extract(struct shm_du_buff * sdb,
+                           const uint8_t *      from,
+                           void *               buf,
+                           size_t               len)
+{
+        uint8_t * dst = (uint8_t *) buf;
+        uint8_t * end;
+        size_t    n;
+
+        assert(sdb);
+
+        while (sdb != NULL && (from < (uint8_t *) (sdb + 1)
+                               || from >= (uint8_t *) (sdb + 1) + sdb->size))
+                sdb = shm_du_buff_next(sdb);
+
+        /* Blocks before the last one of a chain are full. */
+        for (; sdb != NULL && len > 0; sdb = shm_du_buff_next(sdb)) {
+                if (from == NULL)
+                        from = (uint8_t *) (sdb + 1);
+                end = (uint8_t *) (sdb + 1) + sdb->size;
+                n   = MIN((size_t) (end - from), len);
+                memcpy(dst, from, n);
+                dst += n;
+                len -= n;
+                from = NULL;
+        }
+
+        return dst - (uint8_t *) buf;
+}
+
 uint8_t * shm_du_buff_head_alloc(struct shm_du_buff * sdb,
                                  size_t               size)
 {
@@ -551,6 +2071,8 @@ uint8_t * shm_du_buff_tail_alloc(struct shm_du_buff * sdb,
 
         assert(sdb);
 
+        sdb = du_buff_last(sdb);
+
         if (sdb->du_tail + size >= sdb->size)
                 return NULL;
 
@@ -565,12 +2087,21 @@ uint8_t * shm_du_buff_head_release(struct shm_du_buff * sdb,
                                    size_t               size)
 {
         uint8_t * buf;
+        size_t    n;
 
         assert(sdb);
-        assert(!(size > sdb->du_tail - sdb->du_head));
 
         buf = (uint8_t *) (sdb + 1) + sdb->du_head;
 
+        /* On a chain, this can empty the first blocks. */
+        while (sdb->chain != 0 && (n = sdb->du_tail - sdb->du_head) < size) {
+                sdb->du_head = sdb->du_tail;
+                size        -= n;
+                sdb          = shm_du_buff_next(sdb);
+        }
+
+        assert(!(size > sdb->du_tail - sdb->du_head));
+
         sdb->du_head += size;
 
         return buf;
@@ -580,6 +2111,13 @@ uint8_t * shm_du_buff_tail_release(struct shm_du_buff * sdb,
                               size_t               size)
 {
         assert(sdb);
+
+        if (sdb->chain != 0) {
+                assert(!(size > shm_du_buff_len(sdb)));
+                sdb = du_buff_cut(sdb, shm_du_buff_len(sdb) - size);
+                return (uint8_t *) (sdb + 1) + sdb->du_tail;
+        }
+
         assert(!(size > sdb->du_tail - sdb->du_head));
 
         sdb->du_tail -= size;
@@ -591,9 +2129,8 @@ void shm_du_buff_truncate(struct shm_du_buff * sdb,
                           size_t               len)
 {
         assert(sdb);
-        assert(len <= sdb->size);
 
-        sdb->du_tail = sdb->du_head + len;
+        du_buff_cut(sdb, len);
 }
 
 int shm_du_buff_wait_ack(struct shm_du_buff * sdb)
@@ -608,3 +2145,18 @@ int shm_du_buff_ack(struct shm_du_buff * sdb)
         __sync_sub_and_fetch(&sdb->refs, 1);
         return 0;
 }
+
+uint8_t shm_du_buff_get_ecn(struct shm_du_buff * sdb)
+{
+        assert(sdb);
+
+        return sdb->ecn;
+}
+
+void shm_du_buff_set_ecn(struct shm_du_buff * sdb,
+                         uint8_t              ecn)
+{
+        assert(sdb);
+
+        sdb->ecn = ecn;
+}
@@ -38,6 +38,7 @@ int crc32_test(int     argc,
 {
         uint32_t crc = 0;
         int i = 0;
+        char buf[9];
 
         (void) argc;
         (void) argv;
@@ -68,5 +69,12 @@ int crc32_test(int     argc,
         if (crc != 0xD202EF8D)
                 return -1;
 
+        crc = 0;
+
+        crc32_copy(&crc, buf, "1234", 4);
+        crc32_copy(&crc, buf + 4, "56789", 5);
+        if (crc != 0xCBF43926 || memcmp(buf, "123456789", 9))
+                return -1;
+
         return 0;
 }
@@ -0,0 +1,288 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Benchmark of the FRCT retransmission state
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "config.h"
+
+#include <ouroboros/endian.h>
+#include <ouroboros/errno.h>
+#include <ouroboros/fccntl.h>
+#include <ouroboros/list.h>
+#include <ouroboros/qos.h>
+#include <ouroboros/random.h>
+#include <ouroboros/shm_rbuff.h>
+#include <ouroboros/shm_rdrbuff.h>
+#include <ouroboros/time_utils.h>
+#include <ouroboros/utils.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define WINDOW 8   /* PDUs in flight per flow, below the cwnd */
+#define ROUNDS 64
+
+/* Just what frct.c needs from dev.c. */
+struct flow {
+        struct shm_rbuff *    rx_rb;
+        struct shm_rbuff *    tx_rb;
+        qosspec_t             qs;
+        int                   flow_id;
+        struct shm_flow_set * set;
+};
+
+static struct {
+        struct shm_rdrbuff * rdrb;
+        struct flow *        flows;
+} ai;
+
+#define flow_at(fd) (ai.flows[fd])
+
+static int ipcp_sdb_reserve(struct shm_du_buff ** sdb,
+                            size_t                len)
+{
+        if (shm_rdrbuff_alloc(ai.rdrb, len, NULL, sdb) < 0)
+                return -1;
+
+        return 0;
+}
+
+static void ipcp_sdb_release(struct shm_du_buff * sdb)
+{
+        shm_rdrbuff_remove(ai.rdrb, shm_du_buff_get_idx(sdb));
+}
+
+#define shm_flow_set_notify(set, flow_id, event) ((void) 0)
+#define frct_tmr_due(frcti) ((void) 0)
+
+#include "frct.c"
+
+static struct frcti ** snd;
+static struct frcti ** rcv;
+static size_t          flows = 1024;
+
+static long rss_kb(void)
+{
+        struct rusage r;
+
+        if (getrusage(RUSAGE_SELF, &r))
+                return 0;
+
+        return r.ru_maxrss;
+}
+
+static long cpu_us(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+        return now.tv_sec * MILLION + now.tv_nsec / 1000;
+}
+
+/* Puts n PDUs in flight on flow i, the receiver takes them all. */
+static int send_pdus(size_t i,
+                     size_t n)
+{
+        struct shm_du_buff * sdb;
+        uint32_t             seqno;
+        size_t               j;
+
+        for (j = 0; j < n; ++j) {
+                if (ipcp_sdb_reserve(&sdb, 8))
+                        return -1;
+
+                if (__frcti_snd_hdr(snd[i], sdb, &seqno) < 0)
+                        return -1;
+
+                __frcti_rxm(snd[i], seqno, sdb);
+
+                /* The wheel keeps a reference until the ACK. */
+                if (__frcti_rcv(rcv[i], sdb, false) == 0)
+                        ipcp_sdb_release(sdb);
+        }
+
+        return 0;
+}
+
+static int ack_pdus(size_t i)
+{
+        struct shm_du_buff * sdb;
+
+        if (ipcp_sdb_reserve(&sdb, 0))
+                return -1;
+
+        if (frcti_snd_ctrl(rcv[i], sdb))
+                return -1;
+
+        __frcti_rcv(snd[i], sdb, false);
+
+        return 0;
+}
+
+int main(int     argc,
+         char ** argv)
+{
+        struct shm_rbuff * rb[2];
+        size_t             i;
+        size_t             r;
+        long               rss;
+        long               t0;
+        long               us;
+        ssize_t            idx;
+
+        if (argc > 1)
+                flows = strtoul(argv[1], NULL, 10);
+
+        printf("Retransmission wheel of %d levels, %d slots, %d us.\n",
+               RXMQ_LVLS, RXMQ_SLOTS, 1 << RXMQ_R);
+
+        if (rxmwheel_init())
+                goto fail_rxmwheel;
+
+        ai.rdrb = shm_rdrbuff_create(SHM_BUFFER_SIZE, false);
+        if (ai.rdrb == NULL)
+                goto fail_rdrb;
+
+        rb[0] = shm_rbuff_create(getpid(), 1, 0);
+        if (rb[0] == NULL)
+                goto fail_rb0;
+
+        rb[1] = shm_rbuff_create(getpid(), 2, 0);
+        if (rb[1] == NULL)
+                goto fail_rb1;
+
+        ai.flows = calloc(2 * flows, sizeof(*ai.flows));
+        snd      = calloc(flows, sizeof(*snd));
+        rcv      = calloc(flows, sizeof(*rcv));
+        if (ai.flows == NULL || snd == NULL || rcv == NULL)
+                goto fail_flows;
+
+        for (i = 0; i < flows; ++i) {
+                flow_at(2 * i).tx_rb     = rb[0];
+                flow_at(2 * i).rx_rb     = rb[1];
+                flow_at(2 * i + 1).tx_rb = rb[1];
+                flow_at(2 * i + 1).rx_rb = rb[0];
+        }
+
+        rss = rss_kb();
+
+        for (i = 0; i < flows; ++i) {
+                snd[i] = frcti_create(2 * i);
+                rcv[i] = frcti_create(2 * i + 1);
+                if (snd[i] == NULL || rcv[i] == NULL)
+                        goto fail_frcti;
+        }
+
+        /* One PDU in flight on every flow. */
+        for (i = 0; i < flows; ++i)
+                if (send_pdus(i, 1))
+                        goto fail_frcti;
+
+        rss = rss_kb() - rss;
+
+        printf("%zu flows in %ld KiB, %.2f KiB per flow.\n",
+               2 * flows, rss, (double) rss / (2 * flows));
+
+        for (i = 0; i < flows; ++i)
+                if (ack_pdus(i))
+                        goto fail_frcti;
+
+        t0 = cpu_us();
+
+        for (r = 0; r < ROUNDS; ++r) {
+                for (i = 0; i < flows; ++i)
+                        if (send_pdus(i, WINDOW) || ack_pdus(i))
+                                goto fail_frcti;
+                rxmwheel_move();
+        }
+
+        us = cpu_us() - t0;
+
+        printf("%zu PDUs sent and ACKed in %ld us, %.0f ns per PDU.\n",
+               ROUNDS * WINDOW * flows, us,
+               1000.0 * us / (ROUNDS * WINDOW * flows));
+
+        /* The timer, with a PDU in flight on every flow. */
+        for (i = 0; i < flows; ++i) {
+                snd[i]->rto = MILLION;
+                if (send_pdus(i, 1))
+                        goto fail_frcti;
+        }
+
+        t0 = cpu_us();
+
+        for (r = 0; r < ROUNDS; ++r) {
+                usleep(1 << RXMQ_R);
+                rxmwheel_move();
+        }
+
+        us = cpu_us() - t0;
+
+        printf("%d timer runs in %ld us, %.2f us per run.\n",
+               ROUNDS, us, (double) us / ROUNDS);
+
+        for (i = 0; i < flows; ++i) {
+                frcti_destroy(snd[i]);
+                frcti_destroy(rcv[i]);
+        }
+
+        while ((idx = shm_rbuff_read(rb[0])) >= 0)
+                shm_rdrbuff_remove(ai.rdrb, idx);
+
+        free(rcv);
+        free(snd);
+        free(ai.flows);
+        shm_rbuff_destroy(rb[1]);
+        shm_rbuff_destroy(rb[0]);
+        shm_rdrbuff_destroy(ai.rdrb);
+        rxmwheel_fini();
+
+        return 0;
+
+ fail_frcti:
+        for (i = 0; i < flows; ++i) {
+                if (snd[i] != NULL)
+                        frcti_destroy(snd[i]);
+                if (rcv[i] != NULL)
+                        frcti_destroy(rcv[i]);
+        }
+ fail_flows:
+        free(rcv);
+        free(snd);
+        free(ai.flows);
+        shm_rbuff_destroy(rb[1]);
+ fail_rb1:
+        shm_rbuff_destroy(rb[0]);
+ fail_rb0:
+        shm_rdrbuff_destroy(ai.rdrb);
+ fail_rdrb:
+        rxmwheel_fini();
+ fail_rxmwheel:
+        printf("Benchmark failed.\n");
+        return -1;
+}
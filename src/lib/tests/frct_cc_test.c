@@ -0,0 +1,257 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Test of the FRCT congestion control
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "config.h"
+
+#include <ouroboros/endian.h>
+#include <ouroboros/errno.h>
+#include <ouroboros/fccntl.h>
+#include <ouroboros/list.h>
+#include <ouroboros/qos.h>
+#include <ouroboros/random.h>
+#include <ouroboros/shm_rbuff.h>
+#include <ouroboros/shm_rdrbuff.h>
+#include <ouroboros/time_utils.h>
+#include <ouroboros/utils.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SSTHRESH 32  /* PDUs */
+#define RTT      1000 /* us */
+
+/* Just what frct.c needs from dev.c. */
+struct flow {
+        struct shm_rbuff *    rx_rb;
+        struct shm_rbuff *    tx_rb;
+        qosspec_t             qs;
+        int                   flow_id;
+        struct shm_flow_set * set;
+};
+
+static struct {
+        struct shm_rdrbuff * rdrb;
+        struct flow *        flows;
+} ai;
+
+#define flow_at(fd) (ai.flows[fd])
+
+static void ipcp_sdb_release(struct shm_du_buff * sdb)
+{
+        shm_rdrbuff_remove(ai.rdrb, shm_du_buff_get_idx(sdb));
+}
+
+#define shm_flow_set_notify(set, flow_id, event) ((void) 0)
+#define frct_tmr_due(frcti) ((void) 0)
+
+#include "frct.c"
+
+/* ACKs n PDUs one by one. */
+static void ack_n(struct frct_cc * cc,
+                  uint32_t         n)
+{
+        while (n-- > 0)
+                cc->ops->ack(cc, 1, 0);
+}
+
+int frct_cc_test(int     argc,
+                 char ** argv)
+{
+        struct frcti     frcti;
+        struct frct_cc * cc = &frcti.cc;
+
+        (void) argc;
+        (void) argv;
+
+        memset(&frcti, 0, sizeof(frcti));
+
+        printf("Test: unknown algorithm...");
+
+        if (frct_cc_init(cc, CC_ALGOS) != -EINVAL)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: no congestion control keeps the window...");
+
+        if (frct_cc_init(cc, FRCTCCNONE) < 0)
+                goto error;
+
+        ack_n(cc, SSTHRESH);
+        cc->ops->cong(cc, false);
+        cc->ops->cong(cc, true);
+
+        if (cc->cwnd != CC_MAX_WND)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: slow start up to ssthresh...");
+
+        if (frct_cc_init(cc, FRCTCCRENO) < 0)
+                goto error;
+
+        if (cc->cwnd != CC_INIT_WND)
+                goto error;
+
+        cc->ssthresh = SSTHRESH;
+
+        ack_n(cc, SSTHRESH - CC_INIT_WND - 1);
+        if (cc->cwnd != SSTHRESH - 1)
+                goto error;
+
+        /* A stretch ACK does not overshoot ssthresh. */
+        cc->ops->ack(cc, 4, 0);
+        if (cc->cwnd != SSTHRESH)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: one PDU per window above ssthresh...");
+
+        ack_n(cc, SSTHRESH - 1);
+        if (cc->cwnd != SSTHRESH)
+                goto error;
+
+        ack_n(cc, 1);
+        if (cc->cwnd != SSTHRESH + 1)
+                goto error;
+
+        ack_n(cc, SSTHRESH + 1);
+        if (cc->cwnd != SSTHRESH + 2)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: loss halves the window...");
+
+        cc->ops->cong(cc, false);
+        if (cc->cwnd != SSTHRESH / 2 + 1 || cc->ssthresh != cc->cwnd)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: timeout restarts from one PDU...");
+
+        cc->ops->cong(cc, true);
+        if (cc->cwnd != 1 || cc->ssthresh != (SSTHRESH / 2 + 1) / 2)
+                goto error;
+
+        cc->ops->cong(cc, true);
+        cc->ops->cong(cc, true);
+        if (cc->ssthresh != CC_MIN_WND)
+                goto error;
+
+        ack_n(cc, 1);
+        if (cc->cwnd != CC_MIN_WND)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: one reaction per window...");
+
+        if (frct_cc_init(cc, FRCTCCRENO) < 0)
+                goto error;
+
+        cc->cwnd           = SSTHRESH;
+        frcti.snd_cr.seqno = 2 * SSTHRESH;
+        cc->recover        = SSTHRESH;
+
+        frcti_cong(&frcti, SSTHRESH, false);
+        if (cc->cwnd != SSTHRESH / 2 || cc->recover != 2 * SSTHRESH)
+                goto error;
+
+        /* Losses in the same window were sent before the reaction. */
+        frcti_cong(&frcti, SSTHRESH + 1, false);
+        frcti_cong(&frcti, 2 * SSTHRESH - 1, true);
+        if (cc->cwnd != SSTHRESH / 2)
+                goto error;
+
+        frcti.snd_cr.seqno = 3 * SSTHRESH;
+
+        frcti_cong(&frcti, 2 * SSTHRESH, false);
+        if (cc->cwnd != SSTHRESH / 4 || cc->recover != 3 * SSTHRESH)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: vegas leaves slow start on queueing...");
+
+        if (frct_cc_init(cc, FRCTCCVEGAS) < 0)
+                goto error;
+
+        cc->ops->ack(cc, 1, 0);
+        if (cc->cwnd != CC_INIT_WND || cc->rtt_min != 0)
+                goto error;
+
+        cc->ops->ack(cc, 1, RTT);
+        if (cc->cwnd != 2 * CC_INIT_WND || cc->rtt_min != RTT)
+                goto error;
+
+        /* 20 / 3, 6 PDUs queued. */
+        cc->ops->ack(cc, 1, RTT + RTT / 2);
+        if (cc->cwnd != 2 * CC_INIT_WND || cc->ssthresh != cc->cwnd)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: vegas grows below alpha...");
+
+        cc->ops->ack(cc, 1, RTT);
+        if (cc->cwnd != 2 * CC_INIT_WND + 1)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: vegas holds between alpha and beta...");
+
+        /* 21 / 5, 4 PDUs queued. */
+        cc->ops->ack(cc, 1, RTT + RTT / 4);
+        if (cc->cwnd != 2 * CC_INIT_WND + 1)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: vegas shrinks above beta...");
+
+        /* 21 / 2, 10 PDUs queued. */
+        cc->ops->ack(cc, 1, 2 * RTT);
+        if (cc->cwnd != 2 * CC_INIT_WND)
+                goto error;
+
+        if (cc->ssthresh > cc->cwnd)
+                goto error;
+
+        /* A lower rtt is the new base. */
+        cc->ops->ack(cc, 1, RTT / 2);
+        if (cc->rtt_min != RTT / 2 || cc->cwnd != 2 * CC_INIT_WND + 1)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: vegas reacts to loss like reno...");
+
+        cc->ops->cong(cc, false);
+        if (cc->cwnd != CC_INIT_WND || cc->ssthresh != CC_INIT_WND)
+                goto error;
+
+        printf("success.\n\n");
+
+        return 0;
+ error:
+        printf("failed.\n\n");
+        return -1;
+}
@@ -0,0 +1,324 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Test of the FRCT flow control and retransmission state
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "config.h"
+
+#include <ouroboros/endian.h>
+#include <ouroboros/errno.h>
+#include <ouroboros/fccntl.h>
+#include <ouroboros/list.h>
+#include <ouroboros/qos.h>
+#include <ouroboros/random.h>
+#include <ouroboros/shm_rbuff.h>
+#include <ouroboros/shm_rdrbuff.h>
+#include <ouroboros/time_utils.h>
+#include <ouroboros/utils.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WND      4  /* PDUs the receiver announces */
+#define PDUS     (SACK_DUPTHRESH + 1) /* a hole and the PDUs past it */
+#define STALL    10 /* ms the writer has to stay blocked */
+#define PATIENCE 10 /* s, the writer can be slow on a loaded box */
+
+/* Just what frct.c needs from dev.c. */
+struct flow {
+        struct shm_rbuff *    rx_rb;
+        struct shm_rbuff *    tx_rb;
+        qosspec_t             qs;
+        int                   flow_id;
+        struct shm_flow_set * set;
+};
+
+static struct {
+        struct shm_rdrbuff * rdrb;
+        struct flow          flows[2];
+} ai;
+
+#define flow_at(fd) (ai.flows[fd])
+
+static void ipcp_sdb_release(struct shm_du_buff * sdb)
+{
+        shm_rdrbuff_remove(ai.rdrb, shm_du_buff_get_idx(sdb));
+}
+
+#define shm_flow_set_notify(set, flow_id, event) ((void) 0)
+#define frct_tmr_due(frcti) ((void) 0)
+
+#include "frct.c"
+
+static struct frcti *       snd;
+static struct frcti *       rcv;
+static struct shm_du_buff * wsdb;
+static volatile int         sent;
+
+/* Adds the header to a new PDU and schedules it, like flow_tx. */
+static int snd_pdu(struct shm_du_buff ** sdb,
+                   uint32_t *            seqno)
+{
+        int ret;
+
+        if (shm_rdrbuff_alloc(ai.rdrb, 8, NULL, sdb) < 0)
+                return -ENOMEM;
+
+        ret = __frcti_snd_hdr(snd, *sdb, seqno);
+        if (ret < 0) {
+                ipcp_sdb_release(*sdb);
+                return ret;
+        }
+
+        __frcti_rxm(snd, *seqno, *sdb);
+
+        return 0;
+}
+
+/* Hands a PDU to the receiver, the application takes it at once. */
+static int rcv_pdu(struct shm_du_buff * sdb)
+{
+        int ret;
+
+        /* The wheel keeps a reference until the ACK. */
+        ret = __frcti_rcv(rcv, sdb, false);
+        if (ret == 0)
+                ipcp_sdb_release(sdb);
+
+        return ret;
+}
+
+/* Sends the receiver's ACK and window to the sender. */
+static int snd_ack(void)
+{
+        struct shm_du_buff * sdb;
+
+        if (shm_rdrbuff_alloc(ai.rdrb, 0, NULL, &sdb) < 0)
+                return -ENOMEM;
+
+        if (frcti_snd_ctrl(rcv, sdb) < 0) {
+                ipcp_sdb_release(sdb);
+                return -ENOMEM;
+        }
+
+        __frcti_rcv(snd, sdb, false);
+
+        return 0;
+}
+
+/* Waits for the window like flow_snd_hdr. */
+static void * writer(void * o)
+{
+        struct shm_du_buff * sdb;
+        struct timespec      abs;
+        struct timespec      now;
+        uint32_t             seqno;
+        int                  ret;
+
+        (void) o;
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+        abs.tv_sec += PATIENCE;
+
+        /* Without a wakeup, the writer waits until abs and fails. */
+        while ((ret = snd_pdu(&sdb, &seqno)) == -EAGAIN) {
+                frcti_wnd_wait(snd, &abs);
+                clock_gettime(PTHREAD_COND_CLOCK, &now);
+                if (ts_diff_ns(&abs, &now) >= 0)
+                        break;
+        }
+
+        if (ret == 0) {
+                wsdb = sdb;
+                sent = 1;
+        }
+
+        return (void *) 0;
+}
+
+int frct_test(int     argc,
+              char ** argv)
+{
+        struct shm_du_buff * sdb;
+        struct shm_du_buff * pdu[PDUS];
+        struct shm_rbuff *   rb[2];
+        pthread_t            thr;
+        uint32_t             seqno;
+        uint32_t             sn[PDUS];
+        int                  ret;
+        int                  i;
+
+        (void) argc;
+        (void) argv;
+
+        printf("Test: create FRCT instances...");
+
+        if (rxmwheel_init())
+                goto err;
+
+        ai.rdrb = shm_rdrbuff_create(SHM_BUFFER_SIZE, false);
+        if (ai.rdrb == NULL)
+                goto fail_rdrb;
+
+        rb[0] = shm_rbuff_create(getpid(), 1, 0);
+        if (rb[0] == NULL)
+                goto fail_rb0;
+
+        rb[1] = shm_rbuff_create(getpid(), 2, 0);
+        if (rb[1] == NULL)
+                goto fail_rb1;
+
+        flow_at(0).tx_rb = rb[0];
+        flow_at(0).rx_rb = rb[1];
+        flow_at(1).tx_rb = rb[1];
+        flow_at(1).rx_rb = rb[0];
+
+        snd = frcti_create(0);
+        if (snd == NULL)
+                goto fail_snd;
+
+        rcv = frcti_create(1);
+        if (rcv == NULL)
+                goto fail_rcv;
+
+        /* Only the receiver's window limits the sender. */
+        if (frcti_setcc(snd, FRCTCCNONE) < 0)
+                goto error;
+
+        snd->snd_cr.wnd = WND;
+
+        printf("success.\n\n");
+        printf("Test: the sender stops at the window edge...");
+
+        for (i = 0; i < WND; ++i) {
+                if (snd_pdu(&sdb, &seqno) < 0)
+                        goto error;
+                if (rcv_pdu(sdb) < 0)
+                        goto error;
+        }
+
+        if (__frcti_snd_open(snd))
+                goto error;
+
+        if (snd_pdu(&sdb, &seqno) != -EAGAIN)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: a blocked writer resumes on a window update...");
+
+        if (pthread_create(&thr, NULL, writer, NULL))
+                goto error;
+
+        usleep(STALL * 1000);
+
+        if (sent) {
+                pthread_join(thr, NULL);
+                goto error;
+        }
+
+        ret = snd_ack();
+
+        pthread_join(thr, NULL);
+
+        if (ret < 0 || !sent)
+                goto error;
+
+        if (snd->snd_cr.seqno - snd->snd_cr.lwe != 1)
+                goto error;
+
+        if (rcv_pdu(wsdb) < 0 || snd_ack() < 0)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: a SACK map with holes reaches the sender...");
+
+        if (frcti_setcc(snd, FRCTCCRENO) < 0)
+                goto error;
+
+        for (i = 0; i < PDUS; ++i)
+                if (snd_pdu(&pdu[i], &sn[i]) < 0)
+                        goto error;
+
+        /* The first and the last are lost for now. */
+        for (i = 1; i < PDUS - 1; ++i)
+                if (rcv_pdu(pdu[i]) != -EAGAIN)
+                        goto error;
+
+        if (snd_ack() < 0)
+                goto error;
+
+        if (frcti_sacked(snd, sn[0]) || frcti_sacked(snd, sn[PDUS - 1]))
+                goto error;
+
+        for (i = 1; i < PDUS - 1; ++i)
+                if (!frcti_sacked(snd, sn[i]))
+                        goto error;
+
+        printf("success.\n\n");
+        printf("Test: no loss below the dupthresh...");
+
+        /* Only PDUS - 2 are past the hole. */
+        if (snd->cc.cwnd != CC_INIT_WND || snd->cc.recover == sn[PDUS - 1] + 1)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: loss at the dupthresh...");
+
+        if (rcv_pdu(pdu[PDUS - 1]) != -EAGAIN || snd_ack() < 0)
+                goto error;
+
+        if (snd->cc.cwnd != CC_INIT_WND / 2)
+                goto error;
+
+        if (snd->cc.recover != sn[PDUS - 1] + 1)
+                goto error;
+
+        printf("success.\n\n");
+
+        frcti_destroy(rcv);
+        frcti_destroy(snd);
+        shm_rbuff_destroy(rb[1]);
+        shm_rbuff_destroy(rb[0]);
+        shm_rdrbuff_destroy(ai.rdrb);
+        rxmwheel_fini();
+
+        return 0;
+ error:
+        frcti_destroy(rcv);
+ fail_rcv:
+        frcti_destroy(snd);
+ fail_snd:
+        shm_rbuff_destroy(rb[1]);
+ fail_rb1:
+        shm_rbuff_destroy(rb[0]);
+ fail_rb0:
+        shm_rdrbuff_destroy(ai.rdrb);
+ fail_rdrb:
+        rxmwheel_fini();
+ err:
+        printf("failed.\n\n");
+        return -1;
+}
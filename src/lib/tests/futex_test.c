@@ -0,0 +1,115 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Test of the futex wait and wake
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "config.h"
+
+#include <ouroboros/futex.h>
+#include <ouroboros/time_utils.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define WAKES 1000
+
+static struct futex f;
+static volatile int count;
+
+static void * waker(void * o)
+{
+        int i;
+
+        (void) o;
+
+        for (i = 0; i < WAKES; ++i) {
+                __sync_fetch_and_add(&count, 1);
+                futex_wake(&f);
+        }
+
+        return (void *) 0;
+}
+
+int futex_test(int     argc,
+               char ** argv)
+{
+        struct timespec abs;
+        struct timespec intv = {0, 10 * MILLION};
+        pthread_t       thr;
+        uint32_t        seq;
+
+        (void) argc;
+        (void) argv;
+
+        futex_init(&f);
+
+        printf("Test: wake without waiters...");
+
+        futex_wake(&f);
+
+        if (f.seq != 0)
+                goto fail;
+
+        printf("success.\n\n");
+        printf("Test: wait on a changed value...");
+
+        seq = futex_prepare(&f);
+
+        futex_wake(&f);
+
+        if (futex_wait(&f, seq, NULL) != 0)
+                goto fail;
+
+        printf("success.\n\n");
+        printf("Test: wait times out...");
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+        ts_add(&abs, &intv, &abs);
+
+        if (futex_wait(&f, futex_prepare(&f), &abs) != -ETIMEDOUT)
+                goto fail;
+
+        printf("success.\n\n");
+        printf("Test: no lost wakeups...");
+
+        if (pthread_create(&thr, NULL, waker, NULL))
+                goto fail;
+
+        while (__sync_fetch_and_add(&count, 0) != WAKES) {
+                seq = futex_prepare(&f);
+                if (__sync_fetch_and_add(&count, 0) == WAKES)
+                        break;
+                futex_wait(&f, seq, NULL);
+        }
+
+        pthread_join(thr, NULL);
+
+        printf("success.\n\n");
+
+        return 0;
+
+ fail:
+        printf("failed.\n\n");
+        return -1;
+}
@@ -0,0 +1,320 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Test of the flow set events
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "config.h"
+
+#include <ouroboros/shm_flow_set.h>
+#include <ouroboros/time_utils.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FLOW_ID  3
+#define EVENTS   16
+#define THREADS  4
+#define BURST    256
+#define PATIENCE 10 /* s, the producers can be slow on a loaded box */
+#define FULL     (2 * SHM_BUFFER_SIZE) /* overflows a ring */
+#define MANY_ID  1024
+#define MANY     (SHM_BUFFER_SIZE + EVENTS) /* more flows than a ring */
+
+static struct shm_flow_set * set;
+static int                   flow_ids[THREADS];
+static int                   seen[MANY];
+
+static void * producer(void * o)
+{
+        int flow_id = *((int *) o);
+        int i;
+
+        for (i = 0; i < BURST; ++i)
+                shm_flow_set_notify(set, flow_id, FLOW_UP);
+
+        return (void *) 0;
+}
+
+static int readable(int fd)
+{
+        struct pollfd pfd;
+
+        pfd.fd     = fd;
+        pfd.events = POLLIN;
+
+        return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static ssize_t wait_events(int * fqueue)
+{
+        struct timespec abs;
+        struct timespec intv = {0, MILLION};
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+        ts_add(&abs, &intv, &abs);
+
+        return shm_flow_set_wait(set, 0, fqueue, &abs);
+}
+
+/* Reads events until there are none, returns the events seen. */
+static int drain_events(int * fqueue)
+{
+        ssize_t n;
+        int     seen = 0;
+
+        while ((n = wait_events(fqueue)) > 0)
+                while (n-- > 0)
+                        seen |= fqueue[2 * n + 1];
+
+        return seen;
+}
+
+int shm_flow_set_test(int     argc,
+                      char ** argv)
+{
+        pthread_t       threads[THREADS];
+        struct timespec abs;
+        int             fqueue[2 * SHM_BUFFER_SIZE];
+        int             count[THREADS];
+        ssize_t         n;
+        int             total;
+        int             fd;
+        int             i;
+
+        (void) argc;
+        (void) argv;
+
+        printf("Test: create flow set...");
+
+        set = shm_flow_set_create(getpid());
+        if (set == NULL)
+                goto err;
+
+        if (shm_flow_set_add(set, 0, FLOW_ID) < 0)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: packet events are coalesced...");
+
+        for (i = 0; i < EVENTS; ++i)
+                shm_flow_set_notify(set, FLOW_ID, FLOW_PKT);
+
+        if (wait_events(fqueue) != 1)
+                goto error;
+
+        if (fqueue[0] != FLOW_ID || fqueue[1] != FLOW_PKT)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: packet event is rearmed after wait...");
+
+        shm_flow_set_notify_n(set, FLOW_ID, FLOW_PKT, EVENTS);
+
+        if (wait_events(fqueue) != 1)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: other events are not coalesced...");
+
+        shm_flow_set_notify(set, FLOW_ID, FLOW_PKT);
+        shm_flow_set_notify(set, FLOW_ID, FLOW_UP);
+        shm_flow_set_notify(set, FLOW_ID, FLOW_PKT);
+        shm_flow_set_notify(set, FLOW_ID, FLOW_DOWN);
+
+        if (wait_events(fqueue) != 3)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: events are kept when the queue is full...");
+
+        for (i = 0; i < FULL; ++i)
+                shm_flow_set_notify(set, FLOW_ID, FLOW_UP);
+
+        shm_flow_set_notify(set, FLOW_ID, FLOW_PKT);
+        shm_flow_set_notify(set, FLOW_ID, FLOW_DOWN);
+
+        if (drain_events(fqueue) != (FLOW_UP | FLOW_PKT | FLOW_DOWN))
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: packets from more flows than the queue holds...");
+
+        for (i = 0; i < MANY; ++i)
+                if (shm_flow_set_add(set, 0, MANY_ID + i) < 0)
+                        goto error;
+
+        for (i = 0; i < MANY; ++i)
+                shm_flow_set_notify(set, MANY_ID + i, FLOW_PKT);
+
+        while ((n = wait_events(fqueue)) > 0) {
+                while (n-- > 0) {
+                        if (fqueue[2 * n] < MANY_ID ||
+                            fqueue[2 * n] >= MANY_ID + MANY ||
+                            fqueue[2 * n + 1] != FLOW_PKT)
+                                goto error;
+                        ++seen[fqueue[2 * n] - MANY_ID];
+                }
+        }
+
+        for (i = 0; i < MANY; ++i) {
+                if (seen[i] != 1)
+                        goto error;
+                if (i & 1)
+                        shm_flow_set_del(set, 0, MANY_ID + i);
+        }
+
+        printf("success.\n\n");
+        printf("Test: only members are rescanned after zero...");
+
+        shm_flow_set_zero(set, 0);
+
+        if (shm_flow_set_add(set, 0, FLOW_ID) < 0)
+                goto error;
+
+        for (i = 0; i < MANY; ++i)
+                shm_flow_set_notify(set, MANY_ID + i, FLOW_DOWN);
+
+        for (i = 0; i < FULL; ++i)
+                shm_flow_set_notify(set, FLOW_ID, FLOW_UP);
+
+        shm_flow_set_notify(set, FLOW_ID, FLOW_DOWN);
+
+        if (drain_events(fqueue) != (FLOW_UP | FLOW_DOWN))
+                goto error;
+
+        if (shm_flow_set_has(set, 0, MANY_ID))
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: no events after removing the flow...");
+
+        shm_flow_set_notify(set, FLOW_ID, FLOW_PKT);
+        shm_flow_set_del(set, 0, FLOW_ID);
+        shm_flow_set_add(set, 0, FLOW_ID);
+        shm_flow_set_zero(set, 0);
+        shm_flow_set_notify(set, FLOW_ID, FLOW_PKT);
+
+        if (wait_events(fqueue) != -ETIMEDOUT)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: flow rejoins after zero...");
+
+        if (shm_flow_set_has(set, 0, FLOW_ID))
+                goto error;
+
+        if (shm_flow_set_add(set, 1, FLOW_ID) < 0)
+                goto error;
+
+        shm_flow_set_zero(set, 1);
+
+        if (shm_flow_set_add(set, 0, FLOW_ID) < 0)
+                goto error;
+
+        if (shm_flow_set_add(set, 0, FLOW_ID) != -EPERM)
+                goto error;
+
+        shm_flow_set_notify(set, FLOW_ID, FLOW_PKT);
+
+        if (wait_events(fqueue) != 1)
+                goto error;
+
+        shm_flow_set_del(set, 0, FLOW_ID);
+
+        printf("success.\n\n");
+        printf("Test: concurrent producers...");
+
+        for (i = 0; i < THREADS; ++i) {
+                flow_ids[i] = FLOW_ID + 1 + i;
+                count[i]    = 0;
+                if (shm_flow_set_add(set, 0, flow_ids[i]) < 0)
+                        goto error;
+        }
+
+        for (i = 0; i < THREADS; ++i)
+                pthread_create(&threads[i], NULL, producer, &flow_ids[i]);
+
+        clock_gettime(PTHREAD_COND_CLOCK, &abs);
+        abs.tv_sec += PATIENCE;
+
+        total = 0;
+        while (total < THREADS * BURST) {
+                n = shm_flow_set_wait(set, 0, fqueue, &abs);
+                if (n < 0)
+                        break;
+                for (i = 0; i < n; ++i)
+                        ++count[fqueue[2 * i] - FLOW_ID - 1];
+                total += n;
+        }
+
+        for (i = 0; i < THREADS; ++i)
+                pthread_join(threads[i], NULL);
+
+        for (i = 0; i < THREADS; ++i)
+                if (count[i] != BURST)
+                        goto error;
+
+        printf("success.\n\n");
+        printf("Test: pollable fd...");
+
+        fd = shm_flow_set_get_fd(set, 0);
+        if (fd == -ENOENT) {
+                /* No socket directory without an IRMd. */
+                printf("skipped.\n\n");
+                shm_flow_set_destroy(set);
+                return 0;
+        }
+
+        if (fd < 0 || readable(fd))
+                goto error;
+
+        shm_flow_set_notify(set, FLOW_ID + 1, FLOW_PKT);
+        shm_flow_set_notify(set, FLOW_ID + 2, FLOW_PKT);
+
+        if (!readable(fd))
+                goto error;
+
+        if (wait_events(fqueue) != 2 || readable(fd))
+                goto error;
+
+        shm_flow_set_notify(set, FLOW_ID + 1, FLOW_PKT);
+
+        if (!readable(fd))
+                goto error;
+
+        shm_flow_set_close_fd(set, 0);
+
+        printf("success.\n\n");
+
+        shm_flow_set_destroy(set);
+
+        return 0;
+ error:
+        shm_flow_set_destroy(set);
+ err:
+        printf("failed.\n\n");
+        return -1;
+}
@@ -0,0 +1,176 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Benchmark of the shm_rbuff
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "config.h"
+
+#include <ouroboros/shm_rbuff.h>
+#include <ouroboros/time_utils.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BURST 32
+
+static struct shm_rbuff * rb;
+static size_t             count = 10 * MILLION;
+
+static void * single_writer(void * o)
+{
+        size_t i;
+
+        (void) o;
+
+        for (i = 0; i < count; ++i)
+                if (shm_rbuff_write_b(rb, i, NULL) < 0)
+                        return (void *) -1;
+
+        return (void *) 0;
+}
+
+static void * burst_writer(void * o)
+{
+        size_t  idx[BURST];
+        size_t  i = 0;
+        size_t  j;
+        ssize_t n;
+
+        (void) o;
+
+        while (i < count) {
+                for (j = 0; j < BURST; ++j)
+                        idx[j] = i + j;
+                n = shm_rbuff_write_n(rb, idx, BURST);
+                if (n == -EAGAIN)
+                        n = shm_rbuff_write_b(rb, i, NULL) < 0 ? -1 : 1;
+                if (n < 0)
+                        return (void *) -1;
+                i += n;
+        }
+
+        return (void *) 0;
+}
+
+static int single_reader(void)
+{
+        size_t i;
+
+        for (i = 0; i < count; ++i)
+                if (shm_rbuff_read_b(rb, NULL) != (ssize_t) i)
+                        return -1;
+
+        return 0;
+}
+
+static int burst_reader(void)
+{
+        ssize_t idx[BURST];
+        size_t  i = 0;
+        ssize_t j;
+        ssize_t n;
+
+        while (i < count) {
+                n = shm_rbuff_read_n(rb, idx, BURST);
+                if (n == -EAGAIN) {
+                        idx[0] = shm_rbuff_read_b(rb, NULL);
+                        n = idx[0] < 0 ? -1 : 1;
+                }
+                if (n < 0)
+                        return -1;
+                for (j = 0; j < n; ++j)
+                        if (idx[j] != (ssize_t) i++)
+                                return -1;
+        }
+
+        return 0;
+}
+
+static int run(const char * name,
+               void *    (* writer)(void *),
+               int       (* reader)(void))
+{
+        struct timespec t0;
+        struct timespec t1;
+        pthread_t       thr;
+        void *          ret;
+        long            us;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        if (pthread_create(&thr, NULL, writer, NULL))
+                return -1;
+
+        if (reader() < 0) {
+                pthread_cancel(thr);
+                pthread_join(thr, NULL);
+                return -1;
+        }
+
+        pthread_join(thr, &ret);
+        if (ret != (void *) 0)
+                return -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        us = ts_diff_us(&t0, &t1);
+
+        printf("%-8s %zu indices in %ld us, %.2f Mops/s.\n",
+               name, count, us, (double) count / (us ? us : 1));
+
+        return 0;
+}
+
+int main(int     argc,
+         char ** argv)
+{
+        if (argc > 1)
+                count = strtoul(argv[1], NULL, 10);
+
+#ifdef SHM_RBUFF_LOCKLESS
+        printf("Lockless rbuff, %d slots.\n", SHM_RBUFF_SIZE);
+#else
+        printf("Pthread rbuff, %d slots.\n", SHM_RBUFF_SIZE);
+#endif
+        rb = shm_rbuff_create(getpid(), 1, 0);
+        if (rb == NULL) {
+                printf("Failed to create rbuff.\n");
+                return -1;
+        }
+
+        if (run("single", single_writer, single_reader) < 0)
+                goto fail;
+
+        if (run("burst", burst_writer, burst_reader) < 0)
+                goto fail;
+
+        shm_rbuff_destroy(rb);
+
+        return 0;
+ fail:
+        printf("Benchmark failed.\n");
+        shm_rbuff_destroy(rb);
+        return -1;
+}
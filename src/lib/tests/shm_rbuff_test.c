@@ -30,18 +30,23 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#define BURST 32
+
 int shm_rbuff_test(int     argc,
                    char ** argv)
 {
         struct shm_rbuff * rb;
+        struct shm_rbuff * rb2;
         size_t             i;
+        size_t             in[BURST];
+        ssize_t            out[BURST];
 
         (void) argc;
         (void) argv;
 
         printf("Test: create rbuff...");
 
-        rb = shm_rbuff_create(getpid(), 1);
+        rb = shm_rbuff_create(getpid(), 1, 0);
         if (rb == NULL)
                 goto err;
 
@@ -93,12 +98,97 @@ int shm_rbuff_test(int     argc,
 
         printf("success [%zd entries].\n\n", shm_rbuff_queued(rb));
 
+        printf("Test: write a burst to a full queue...");
+
+        for (i = 0; i < BURST; ++i)
+                in[i] = i;
+
+        if (shm_rbuff_write_n(rb, in, BURST) != -EAGAIN)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: read a burst...");
+
+        if (shm_rbuff_read_n(rb, out, BURST) != BURST)
+                goto error;
+
+        if (shm_rbuff_queued(rb) != SHM_RBUFF_SIZE - 1 - BURST)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: write a burst...");
+
+        if (shm_rbuff_write_n(rb, in, BURST) != BURST)
+                goto error;
+
+        printf("success [%zd entries].\n\n", shm_rbuff_queued(rb));
+
+        while (shm_rbuff_read(rb) >= 0)
+                ;
+
+        printf("Test: burst keeps order...");
+
+        if (shm_rbuff_write_n(rb, in, BURST / 2) != BURST / 2)
+                goto error;
+
+        if (shm_rbuff_read_n(rb, out, BURST) != BURST / 2)
+                goto error;
+
+        for (i = 0; i < BURST / 2; ++i)
+                if (out[i] != (ssize_t) i)
+                        goto error;
+
+        if (shm_rbuff_read_n(rb, out, BURST) != -EAGAIN)
+                goto error;
+
+        printf("success.\n\n");
+
         /* empty the rbuff */
         while (shm_rbuff_read(rb) >= 0)
                 ;
 
         shm_rbuff_destroy(rb);
 
+        printf("Test: create a sized rbuff...");
+
+        rb = shm_rbuff_create(getpid(), 1, SHM_RBUFF_MIN + 1);
+        if (rb == NULL)
+                goto err;
+
+        if (shm_rbuff_size(rb) != SHM_RBUFF_MIN * 2)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: open finds the size...");
+
+        rb2 = shm_rbuff_open(getpid(), 1);
+        if (rb2 == NULL)
+                goto error;
+
+        if (shm_rbuff_size(rb2) != shm_rbuff_size(rb)) {
+                shm_rbuff_close(rb2);
+                goto error;
+        }
+
+        for (i = 0; i < SHM_RBUFF_MIN * 2 - 1; ++i)
+                if (shm_rbuff_write(rb2, i) < 0) {
+                        shm_rbuff_close(rb2);
+                        goto error;
+                }
+
+        shm_rbuff_close(rb2);
+
+        if (shm_rbuff_write(rb, 1) != -EAGAIN)
+                goto error;
+
+        for (i = 0; i < SHM_RBUFF_MIN * 2 - 1; ++i)
+                if (shm_rbuff_read(rb) != (ssize_t) i)
+                        goto error;
+
+        printf("success.\n\n");
+
+        shm_rbuff_destroy(rb);
+
         return 0;
 
  error:
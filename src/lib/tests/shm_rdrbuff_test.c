@@ -0,0 +1,434 @@
+/*
+ * Ouroboros - Copyright (C) 2016 - 2020
+ *
+ * Test of the random deletion ring buffer
+ *
+ *    Dimitri Staessens <dimitri.staessens@ugent.be>
+ *    Sander Vrijders   <sander.vrijders@ugent.be>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., http://www.fsf.org/about/contact/.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "config.h"
+
+#include <ouroboros/shm_rdrbuff.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define THREADS  8
+#define ROUNDS   (4 * SHM_BUFFER_SIZE)
+#define BURST    32
+#define BIG_LEN  (3 * 4096)
+#define PKT_LEN  64
+#define MAX_IDX  (SHM_BUFFER_SIZE * SHM_RDRB_SEGMENTS)
+
+static void * worker(void * o)
+{
+        struct shm_rdrbuff * rdrb = (struct shm_rdrbuff *) o;
+        struct shm_du_buff * sdb;
+        uint8_t *            buf;
+        ssize_t              idx;
+        size_t               i;
+
+        for (i = 0; i < ROUNDS; ++i) {
+                idx = shm_rdrbuff_alloc_b(rdrb, PKT_LEN, &buf, &sdb, NULL);
+                if (idx < 0)
+                        return (void *) -1;
+
+                memset(buf, (int) i, PKT_LEN);
+                shm_rdrbuff_remove(rdrb, idx);
+        }
+
+        return (void *) 0;
+}
+
+static int fill_and_drain(struct shm_rdrbuff * rdrb)
+{
+        static ssize_t       idx[MAX_IDX + 1];
+        struct shm_du_buff * sdb;
+        size_t               n = 0;
+        size_t               i;
+
+        while (n <= MAX_IDX) {
+                idx[n] = shm_rdrbuff_alloc(rdrb, PKT_LEN, NULL, &sdb);
+                if (idx[n] < 0)
+                        break;
+                ++n;
+        }
+
+        if (n == 0 || idx[n] != -EAGAIN) {
+                printf("Unexpected result after %zu allocations.\n", n);
+                return -1;
+        }
+
+        for (i = 0; i < n; ++i)
+                shm_rdrbuff_remove(rdrb, idx[i]);
+
+        return (int) n;
+}
+
+static int check_sizes(struct shm_rdrbuff * rdrb)
+{
+        static const size_t  len[] = { 64, 1500, 9000, 65536 };
+        static uint8_t       buf[65536];
+        ssize_t              idx[sizeof(len) / sizeof(len[0])];
+        struct shm_du_buff * sdb;
+        size_t               n = sizeof(len) / sizeof(len[0]);
+        size_t               i;
+        size_t               j;
+        int                  ret = 0;
+
+        for (i = 0; i < n; ++i) {
+                idx[i] = shm_rdrbuff_alloc(rdrb, len[i], NULL, &sdb);
+                if (idx[i] == -EMSGSIZE)
+                        break;
+                if (idx[i] < 0)
+                        return -1;
+                memset(buf, (int) i, len[i]);
+                shm_du_buff_scatter(sdb, 0, buf, len[i]);
+        }
+
+        n = i;
+
+        for (i = 0; i < n; ++i) {
+                sdb = shm_rdrbuff_get(rdrb, idx[i]);
+                if (shm_du_buff_len(sdb) != len[i])
+                        ret = -1;
+                memset(buf, 0xff, len[i]);
+                shm_du_buff_gather(sdb, 0, buf, len[i]);
+                for (j = 0; j < len[i]; ++j)
+                        if (buf[j] != (uint8_t) i)
+                                ret = -1;
+        }
+
+        for (i = n; i-- > 0;)
+                shm_rdrbuff_remove(rdrb, idx[i]);
+
+        return n < 2 ? -1 : ret;
+}
+
+/* Runs out of jumbo runs until a packet is chained. */
+static int check_chain(struct shm_rdrbuff * rdrb)
+{
+        static ssize_t       idx[MAX_IDX];
+        static uint8_t       buf[BIG_LEN];
+        static uint8_t       out[BIG_LEN];
+        struct shm_du_buff * sdb = NULL;
+        uint8_t *            tail;
+        size_t               n;
+        size_t               i;
+        int                  ret = -1;
+
+        for (n = 0; n < MAX_IDX; ++n) {
+                idx[n] = shm_rdrbuff_alloc(rdrb, BIG_LEN, NULL, &sdb);
+                if (idx[n] < 0)
+                        break;
+                if (shm_du_buff_next(sdb) != NULL)
+                        break;
+        }
+
+        if (n == MAX_IDX || idx[n] < 0)
+                goto fail;
+
+        for (i = 0; i < BIG_LEN; ++i)
+                buf[i] = (uint8_t) i;
+
+        if (shm_du_buff_len(sdb) != BIG_LEN)
+                goto fail_chain;
+
+        shm_du_buff_scatter(sdb, 0, buf, BIG_LEN);
+
+        tail = shm_du_buff_tail_alloc(sdb, sizeof(uint32_t));
+        if (tail == NULL)
+                goto fail_chain;
+
+        shm_du_buff_tail_release(sdb, sizeof(uint32_t));
+        shm_du_buff_head_release(sdb, BIG_LEN / 2);
+
+        if (shm_du_buff_len(sdb) != BIG_LEN - BIG_LEN / 2)
+                goto fail_chain;
+
+        shm_du_buff_gather(sdb, 0, out, BIG_LEN - BIG_LEN / 2);
+
+        if (memcmp(out, buf + BIG_LEN / 2, BIG_LEN - BIG_LEN / 2))
+                goto fail_chain;
+
+        ret = 0;
+ fail_chain:
+        ++n;
+ fail:
+        for (i = 0; i < n; ++i)
+                shm_rdrbuff_remove(rdrb, idx[i]);
+
+        return ret;
+}
+
+static int check_burst(struct shm_rdrbuff * rdrb)
+{
+        struct shm_du_buff * sdbs[BURST];
+        size_t               idx[BURST];
+        ssize_t              n;
+        ssize_t              i;
+        ssize_t              j;
+
+        n = shm_rdrbuff_alloc_n(rdrb, PKT_LEN, sdbs, BURST, NULL);
+        if (n < 1 || n > BURST)
+                return -1;
+
+        for (i = 0; i < n; ++i) {
+                idx[i] = shm_du_buff_get_idx(sdbs[i]);
+                if (shm_du_buff_tail(sdbs[i]) - shm_du_buff_head(sdbs[i])
+                    != PKT_LEN)
+                        return -1;
+                for (j = 0; j < i; ++j)
+                        if (idx[j] == idx[i])
+                                return -1;
+        }
+
+        return shm_rdrbuff_remove_n(rdrb, idx, n);
+}
+
+static int check_shrink(struct shm_rdrbuff * rdrb)
+{
+        char   name[64];
+        size_t s;
+        int    fd;
+        int    i;
+
+        /* The first extension segment follows the NUMA partitions. */
+        s = shm_rdrbuff_nodes(rdrb);
+        if (s == SHM_RDRB_SEGMENTS)
+                return 0;
+
+        sprintf(name, "%s.%zu", SHM_RDRB_NAME, s);
+
+        fd = shm_open(name, O_RDWR, 0666);
+        if (fd < 0)
+                return -1;
+
+        close(fd);
+
+        for (i = 0; i < 16; ++i)
+                shm_rdrbuff_shrink(rdrb);
+
+        fd = shm_open(name, O_RDWR, 0666);
+        if (fd >= 0) {
+                close(fd);
+                return -1;
+        }
+
+        return 0;
+}
+
+static size_t numa_allocs(struct shm_rdrbuff * rdrb)
+{
+        struct rdrb_numa_stats stats;
+        size_t                 n;
+        size_t                 sum = 0;
+
+        for (n = 0; n < shm_rdrbuff_nodes(rdrb); ++n) {
+                shm_rdrbuff_numa_stats(rdrb, n, &stats);
+                sum += stats.alloc_local + stats.alloc_remote;
+        }
+
+        return sum;
+}
+
+static int check_numa(struct shm_rdrbuff * rdrb)
+{
+        struct shm_du_buff * sdb;
+        size_t               before;
+        ssize_t              idx;
+        size_t               i;
+
+        if (shm_rdrbuff_nodes(rdrb) < 1)
+                return -1;
+
+        before = numa_allocs(rdrb);
+
+        for (i = 0; i < ROUNDS; ++i) {
+                idx = shm_rdrbuff_alloc(rdrb, PKT_LEN, NULL, &sdb);
+                if (idx < 0)
+                        return -1;
+                shm_rdrbuff_remove(rdrb, idx);
+        }
+
+        /* Only counted when there is more than one partition. */
+        if (shm_rdrbuff_nodes(rdrb) == 1)
+                return before == 0 && numa_allocs(rdrb) == 0 ? 0 : -1;
+
+        return numa_allocs(rdrb) - before == ROUNDS ? 0 : -1;
+}
+
+static int check_geometry(void)
+{
+        struct shm_rdrbuff * rdrb;
+        struct shm_rdrbuff * peer;
+        struct shm_du_buff * sdb;
+        uint8_t *            buf;
+        ssize_t              idx;
+        int                  ret = -1;
+
+        rdrb = shm_rdrbuff_create(SHM_BUFFER_SIZE >> 2, true);
+        if (rdrb == NULL)
+                return -1;
+
+        peer = shm_rdrbuff_open();
+        if (peer == NULL)
+                goto fail_peer;
+
+        if (fill_and_drain(rdrb) != (SHM_BUFFER_SIZE >> 2) * SHM_RDRB_SEGMENTS)
+                goto fail;
+
+        idx = shm_rdrbuff_alloc(rdrb, 1500, &buf, &sdb);
+        if (idx < 0)
+                goto fail;
+
+        memset(buf, 0x5a, 1500);
+
+        if (shm_rdrbuff_read(&buf, peer, idx) == 1500 && buf[1499] == 0x5a)
+                ret = 0;
+
+        shm_rdrbuff_remove(peer, idx);
+ fail:
+        shm_rdrbuff_close(peer);
+ fail_peer:
+        shm_rdrbuff_destroy(rdrb);
+        return ret;
+}
+
+int shm_rdrbuff_test(int     argc,
+                     char ** argv)
+{
+        struct shm_rdrbuff * rdrb;
+        struct shm_du_buff * sdb;
+        pthread_t            threads[THREADS];
+        void *               res;
+        ssize_t              idx;
+        size_t               i;
+        int                  n;
+
+        (void) argc;
+        (void) argv;
+
+        printf("Test: create rdrbuff...");
+
+        rdrb = shm_rdrbuff_create(SHM_BUFFER_SIZE, false);
+        if (rdrb == NULL)
+                goto err;
+
+        printf("success.\n\n");
+        printf("Test: allocate and release more than the buffer size...");
+
+        for (i = 0; i < ROUNDS; ++i) {
+                idx = shm_rdrbuff_alloc(rdrb, PKT_LEN, NULL, &sdb);
+                if (idx < 0)
+                        goto error;
+                if ((size_t) idx != shm_du_buff_get_idx(sdb))
+                        goto error;
+                shm_rdrbuff_remove(rdrb, idx);
+        }
+
+        printf("success.\n\n");
+        printf("Test: allocate from each size class...");
+
+        if (check_sizes(rdrb))
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: chain blocks for large packets...");
+
+        if (check_chain(rdrb))
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: allocate and release a burst...");
+
+        for (i = 0; i < ROUNDS / BURST; ++i)
+                if (check_burst(rdrb))
+                        goto error;
+
+        printf("success.\n\n");
+        printf("Test: fill and drain the buffer...");
+
+        n = fill_and_drain(rdrb);
+        if (n < 0)
+                goto error;
+
+        if (fill_and_drain(rdrb) != n)
+                goto error;
+
+        printf("success [%d blocks].\n\n", n);
+        printf("Test: release idle segments...");
+
+        if (check_shrink(rdrb))
+                goto error;
+
+        if (fill_and_drain(rdrb) != n)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: concurrent allocation from %d threads...", THREADS);
+
+        for (i = 0; i < THREADS; ++i)
+                if (pthread_create(&threads[i], NULL, worker, rdrb))
+                        goto error;
+
+        for (i = 0; i < THREADS; ++i) {
+                pthread_join(threads[i], &res);
+                if (res != (void *) 0)
+                        goto error;
+        }
+
+        printf("success.\n\n");
+        printf("Test: reclaim cached blocks...");
+
+        shm_rdrbuff_reclaim(rdrb, getpid());
+
+        if (fill_and_drain(rdrb) != n)
+                goto error;
+
+        printf("success.\n\n");
+        printf("Test: NUMA locality counters...");
+
+        if (check_numa(rdrb))
+                goto error;
+
+        printf("success [%zu nodes].\n\n", shm_rdrbuff_nodes(rdrb));
+
+        shm_rdrbuff_destroy(rdrb);
+
+        printf("Test: runtime size with huge pages...");
+
+        if (check_geometry())
+                goto err;
+
+        printf("success.\n\n");
+
+        return 0;
+
+ error:
+        shm_rdrbuff_destroy(rdrb);
+ err:
+        printf("failed.\n\n");
+        return -1;
+}
@@ -49,12 +49,14 @@
 #include <stdbool.h>
 
 #define BUF_SIZE 524288L
+#define MAX_BATCH 64
 
 #include "ocbr_client.c"
 
 struct s {
         long interval;
         long timeout;
+        int  batch;
 } server_settings;
 
 #include "ocbr_server.c"
@@ -68,6 +70,8 @@ static void usage(void)
                "Server options:\n"
                "  -i, --interval            Server report interval (s)\n"
                "  -t, --timeout             Server timeout interval (s)\n"
+               "  -b, --batch               Packets per read call"
+               " (default 1)\n"
                "\n"
                "Client options:\n"
                "  -n, --server_apn          Specify the name of the server.\n"
@@ -76,6 +80,8 @@ static void usage(void)
                "  -s, --size                packet size (B, max %ld B)\n"
                "  -r, --rate                Rate (b/s)\n"
                "      --sleep               Sleep in between sending packets\n"
+               "  -b, --batch               Packets per write call"
+               " (default 1)\n"
                "\n\n"
                "      --help                Display this help text and exit\n",
                BUF_SIZE);
@@ -88,6 +94,7 @@ int main(int argc, char ** argv)
         long   rate = 1000000; /* 1 Mb/s */
         bool   flood = false;
         bool   sleep = false;
+        int    batch = 1;
         int    ret = 0;
         char * rem = NULL;
         char * s_apn = NULL;
@@ -96,6 +103,7 @@ int main(int argc, char ** argv)
 
         server_settings.interval = 1; /* One second reporting interval */
         server_settings.timeout  = 1;
+        server_settings.batch    = 1;
 
         argc--;
         argv++;
@@ -138,6 +146,10 @@ int main(int argc, char ** argv)
                         flood = true;
                 } else if (strcmp(*argv, "--sleep") == 0) {
                         sleep = true;
+                } else if (strcmp(*argv, "-b") == 0 ||
+                           strcmp(*argv, "--batch") == 0) {
+                        batch = strtol(*(++argv), &rem, 10);
+                        --argc;
                 } else {
                         usage();
                         return 0;
@@ -146,7 +158,13 @@ int main(int argc, char ** argv)
                 argv++;
         }
 
+        if (batch < 1 || batch > MAX_BATCH) {
+                printf("Batch size must be between 1 and %d.\n", MAX_BATCH);
+                return 0;
+        }
+
         if (server) {
+                server_settings.batch = batch;
                 ret = server_main();
         } else {
                 if (s_apn == NULL) {
@@ -165,7 +183,8 @@ int main(int argc, char ** argv)
                         return 0;
                 }
 
-                ret = client_main(s_apn, duration, size, rate, flood, sleep);
+                ret = client_main(s_apn, duration, size, rate, flood, sleep,
+                                  batch);
         }
 
         return ret;
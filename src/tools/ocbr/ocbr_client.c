@@ -68,19 +68,44 @@ static void busy_wait_until(const struct timespec * deadline)
                 clock_gettime(CLOCK_REALTIME, &now);
 }
 
+/* Sends batch copies of buf, returns the number sent. */
+static ssize_t write_batch(int    fd,
+                           char * buf,
+                           int    size,
+                           int    batch)
+{
+        struct flow_msg msgs[MAX_BATCH];
+        ssize_t         ret;
+        int             i;
+
+        if (batch == 1) {
+                ret = flow_write(fd, buf, size);
+                return ret < 0 ? ret : 1;
+        }
+
+        for (i = 0; i < batch; ++i) {
+                msgs[i].buf = buf;
+                msgs[i].len = size;
+        }
+
+        return flow_write_batch(fd, msgs, batch);
+}
+
 int client_main(char * server,
                 int duration,
                 int size,
                 long rate,
                 bool flood,
-                bool sleep)
+                bool sleep,
+                int batch)
 {
         struct sigaction sig_act;
 
         int fd = 0;
         char buf[BUF_SIZE];
         long seqnr = 0;
-        long gap = size * 8.0 * (BILLION / (double) rate);
+        long gap = size * 8.0 * (BILLION / (double) rate) * batch;
+        ssize_t sent;
 
         struct timespec start;
         struct timespec end;
@@ -117,7 +142,8 @@ int client_main(char * server,
                         ts_add(&end, &intv, &end);
                         memcpy(buf, &seqnr, sizeof(seqnr));
 
-                        if (flow_write(fd, buf, size) < 0) {
+                        sent = write_batch(fd, buf, size, batch);
+                        if (sent < 0) {
                                 stop = true;
                                 continue;
                         }
@@ -127,7 +153,7 @@ int client_main(char * server,
                         else
                                 busy_wait_until(&end);
 
-                        ++seqnr;
+                        seqnr += sent;
 
                         if (ts_diff_us(&start, &end) / MILLION >= duration)
                                 stop = true;
@@ -135,12 +161,13 @@ int client_main(char * server,
         } else { /* flood */
                 while (!stop) {
                         clock_gettime(CLOCK_REALTIME, &end);
-                        if (flow_write(fd, buf, size) < 0) {
+                        sent = write_batch(fd, buf, size, batch);
+                        if (sent < 0) {
                                 stop = true;
                                 continue;
                         }
 
-                        ++seqnr;
+                        seqnr += sent;
 
                         if (ts_diff_us(&start, &end) / MILLION
                             >= (long) duration)
@@ -75,9 +75,40 @@ static void shutdown_server(int signo, siginfo_t * info, void * c)
         }
 }
 
+/* Returns the number of packets read, adds their bytes to count. */
+static ssize_t read_batch(int    fd,
+                          char * buf,
+                          long * count)
+{
+        struct flow_msg msgs[MAX_BATCH];
+        size_t          len = BUF_SIZE / server_settings.batch;
+        ssize_t         n;
+        ssize_t         i;
+
+        if (server_settings.batch == 1) {
+                n = flow_read(fd, buf, BUF_SIZE);
+                if (n < 0)
+                        return n;
+                *count += n;
+                return 1;
+        }
+
+        for (i = 0; i < server_settings.batch; ++i) {
+                msgs[i].buf = buf + i * len;
+                msgs[i].len = len;
+        }
+
+        n = flow_read_batch(fd, msgs, server_settings.batch);
+        for (i = 0; i < n; ++i)
+                *count += msgs[i].len;
+
+        return n;
+}
+
 static void handle_flow(int fd)
 {
-        int count = 0;
+        ssize_t n = 0;
+        long count = 0;
         char buf[BUF_SIZE];
 
         struct timespec now;
@@ -104,11 +135,12 @@ static void handle_flow(int fd)
         while (!stop) {
                 clock_gettime(CLOCK_REALTIME, &now);
 
-                count = flow_read(fd, buf, BUF_SIZE);
+                count = 0;
+                n = read_batch(fd, buf, &count);
 
-                if (count > 0) {
+                if (n > 0 && count > 0) {
                         clock_gettime(CLOCK_REALTIME, &alive);
-                        packets++;
+                        packets += n;
                         bytes_read += count;
                 }
 
@@ -62,6 +62,8 @@
 
 #define OPERF_MAX_FLOWS 256
 
+#define OPERF_MAX_BATCH 64
+
 #define TEST_TYPE_UNI 0
 #define TEST_TYPE_BI  1
 
@@ -80,6 +82,7 @@ struct c {
         bool   sleep;
         int    duration;
         int    size;
+        int    batch;
 
         unsigned long sent;
         unsigned long rcvd;
@@ -121,6 +124,8 @@ static void usage(void)
                "  -s, --size                Payload size (B, default 1500)\n"
                "  -f, --flood               Send packets as fast as possible\n"
                "      --sleep               Sleep in between sending packets\n"
+               "  -b, --batch               Packets per read and write call"
+               " (default 1)\n"
                "\n"
                "      --help                Display this help text and exit\n");
 }
@@ -175,6 +180,7 @@ int main(int argc, char ** argv)
         client.rate = 1000000;
         client.flood = false;
         client.sleep = false;
+        client.batch = 1;
 
         while (argc > 0) {
                 if (strcmp(*argv, "-n") == 0 ||
@@ -200,6 +206,10 @@ int main(int argc, char ** argv)
                         client.flood = true;
                 } else if (strcmp(*argv, "--sleep") == 0) {
                         client.sleep = true;
+                } else if (strcmp(*argv, "-b") == 0 ||
+                           strcmp(*argv, "--batch") == 0) {
+                        client.batch = strtol(*(++argv), &rem, 10);
+                        --argc;
                 } else if (strcmp(*argv, "-l") == 0 ||
                            strcmp(*argv, "--listen") == 0) {
                         serv = true;
@@ -243,6 +253,18 @@ int main(int argc, char ** argv)
                         client.size = 64;
                 }
 
+                if (client.batch < 1 || client.batch > OPERF_MAX_BATCH) {
+                        printf("Batch size must be between 1 and %d.\n",
+                               OPERF_MAX_BATCH);
+                        exit(EXIT_FAILURE);
+                }
+
+                if ((long) client.size * client.batch > OPERF_BUF_SIZE) {
+                        printf("Batch does not fit %d bytes.\n",
+                               OPERF_BUF_SIZE);
+                        exit(EXIT_FAILURE);
+                }
+
                 ret = client_main();
         }
 
@@ -64,6 +64,35 @@ void shutdown_client(int signo, siginfo_t * info, void * c)
         }
 }
 
+static void read_batch(int fd,
+                       char * buf)
+{
+        struct flow_msg msgs[OPERF_MAX_BATCH];
+        ssize_t         n;
+        ssize_t         i;
+
+        for (i = 0; i < client.batch; ++i) {
+                msgs[i].buf = buf + i * client.size;
+                msgs[i].len = client.size;
+        }
+
+        n = flow_read_batch(fd, msgs, client.batch);
+        if (n == -ETIMEDOUT) {
+                printf("Server timed out.\n");
+                stop = true;
+                return;
+        }
+
+        for (i = 0; i < n; ++i) {
+                if (msgs[i].len != (size_t) client.size) {
+                        printf("Invalid message on fd %d.\n", fd);
+                        continue;
+                }
+
+                ++client.rcvd;
+        }
+}
+
 void * reader(void * o)
 {
         struct timespec timeout = {2, 0};
@@ -75,6 +104,11 @@ void * reader(void * o)
         fccntl(fd, FLOWSRCVTIMEO, &timeout);
 
         while (!stop) {
+                if (client.batch > 1) {
+                        read_batch(fd, buf);
+                        continue;
+                }
+
                 msg_len = flow_read(fd, buf, OPERF_BUF_SIZE);
                 if (msg_len == -ETIMEDOUT) {
                         printf("Server timed out.\n");
@@ -93,10 +127,27 @@ void * reader(void * o)
         return (void *) 0;
 }
 
+/* Sends a batch of messages, returns the number sent. */
+static ssize_t write_batch(int    fd,
+                           char * buf)
+{
+        struct flow_msg msgs[OPERF_MAX_BATCH];
+        int             i;
+
+        for (i = 0; i < client.batch; ++i) {
+                msgs[i].buf = buf + i * client.size;
+                msgs[i].len = client.size;
+                ((struct msg *) msgs[i].buf)->id = client.sent + i;
+        }
+
+        return flow_write_batch(fd, msgs, client.batch);
+}
+
 void * writer(void * o)
 {
         int * fdp = (int *) o;
-        long gap = client.size * 8.0 * (BILLION / (double) client.rate);
+        long gap = client.size * 8.0 * (BILLION / (double) client.rate)
+                * client.batch;
 
         struct timespec now;
         struct timespec start;
@@ -105,8 +156,9 @@ void * writer(void * o)
 
         char *       buf;
         struct msg * msg;
+        ssize_t      sent;
 
-        buf = malloc(client.size);
+        buf = malloc(client.size * client.batch);
         if (buf == NULL)
                 return (void *) -ENOMEM;
 
@@ -115,7 +167,7 @@ void * writer(void * o)
                 return (void *) -EINVAL;
         }
 
-        memset(buf, 0, client.size);
+        memset(buf, 0, client.size * client.batch);
 
         msg = (struct msg *) buf;
 
@@ -139,16 +191,22 @@ void * writer(void * o)
                         ts_add(&now, &intv, &end);
                 }
 
-                msg->id = client.sent;
+                if (client.batch > 1) {
+                        sent = write_batch(*fdp, buf);
+                } else {
+                        msg->id = client.sent;
+                        sent = flow_write(*fdp, buf, client.size);
+                        sent = sent < 0 ? sent : 1;
+                }
 
-                if (flow_write(*fdp, buf, client.size) < 0) {
+                if (sent < 0) {
                         printf("Failed to send packet.\n");
                         flow_dealloc(*fdp);
                         free(buf);
                         return (void *) -1;
                 }
 
-                ++client.sent;
+                client.sent += sent;
 
                 if (!client.flood) {
                         if (client.sleep)
@@ -59,6 +59,7 @@
 #include <math.h>
 #include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 
 #define OPING_BUF_SIZE 1500
 
@@ -74,6 +75,7 @@ struct c {
         int       size;
         bool      timestamp;
         qosspec_t qs;
+        uint32_t  poll;
 
         /* stats */
         uint32_t sent;
@@ -95,6 +97,7 @@ struct s {
         fset_t *        flows;
         fqueue_t *      fq;
         pthread_mutex_t lock;
+        uint32_t        poll;
 
         pthread_t cleaner_pt;
         pthread_t accept_pt;
@@ -125,6 +128,8 @@ static void usage(void)
                "  -n, --server-name         Name of the oping server\n"
                "  -q, --qos                 QoS (raw, best, video, voice, data)"
                "\n"
+               "  -p, --poll                Busy-poll budget before sleeping"
+               " (us, default 0)\n"
                "  -s, --size                Payload size (B, default 64)\n"
                "  -Q, --quiet               Only print final statistics\n"
                "  -D, --timeofday           Print time of day before each line"
@@ -170,6 +175,8 @@ int main(int     argc,
         client.timestamp = false;
         client.qs        = qos_raw;
         client.quiet     = false;
+        client.poll      = 0;
+        server.poll      = 0;
 
         while (argc > 0) {
                 if (strcmp(*argv, "-i") == 0 ||
@@ -194,6 +201,11 @@ int main(int     argc,
                            strcmp(*argv, "--size") == 0) {
                         client.size = strtol(*(++argv), &rem, 10);
                         --argc;
+                } else if (strcmp(*argv, "-p") == 0 ||
+                           strcmp(*argv, "--poll") == 0) {
+                        client.poll = strtoul(*(++argv), &rem, 10);
+                        server.poll = client.poll;
+                        --argc;
                 } else if (strcmp(*argv, "-q") == 0 ||
                            strcmp(*argv, "--qos") == 0) {
                         qos = *(++argv);
@@ -214,6 +214,8 @@ static int client_main(void)
         struct timespec tic;
         struct timespec toc;
 
+        struct flow_poll_stat pstat;
+
         int fd;
 
         memset(&sig_act, 0, sizeof sig_act);
@@ -241,6 +243,7 @@ static int client_main(void)
         }
 
         fccntl(fd, FLOWSFLAGS, FLOWFRDWR | FLOWFRNOPART);
+        fccntl(fd, FLOWSPOLL, client.poll);
 
         clock_gettime(CLOCK_REALTIME, &tic);
 
@@ -273,6 +276,13 @@ static int client_main(void)
                         printf("NaN ms\n");
         }
 
+        if (client.poll > 0 && fccntl(fd, FLOWGPOLLSTAT, &pstat) == 0)
+                printf("poll spin/sleep = %.3f/%.3f ms, "
+                       "%" PRIu64 " hits, %" PRIu64 " sleeps\n",
+                       pstat.spin_ns / (double) MILLION,
+                       pstat.sleep_ns / (double) MILLION,
+                       pstat.hits, pstat.sleeps);
+
         flow_dealloc(fd);
 
         client_fini();
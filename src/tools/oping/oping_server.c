@@ -177,6 +177,8 @@ int server_main(void)
                 return -1;
         }
 
+        fqueue_set_poll(server.fq, server.poll);
+
         pthread_create(&server.cleaner_pt, NULL, cleaner_thread, NULL);
         pthread_create(&server.accept_pt, NULL, accept_thread, NULL);
         pthread_create(&server.server_pt, NULL, server_thread, NULL);